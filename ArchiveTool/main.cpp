@@ -0,0 +1,564 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Rainman2.h>
+#include <stdio.h>
+#include <memory>
+
+struct command_line_options_t
+{
+  command_line_options_t()
+    : ePrintLevel(PRINT_NORMAL)
+    , iThreadCount(0)
+    , iVersion(2)
+    , iCompressionLevel(9)
+  {
+  }
+
+  RainString sCommand;
+  RainString sInput;
+  RainString sOutput;
+  RainString sPath;
+  RainString sEntryPoint;
+  RainString sAlias;
+  RainString sArchiveName;
+
+  unsigned long iThreadCount;
+  unsigned short iVersion;
+  int iCompressionLevel;
+
+  enum
+  {
+    PRINT_VERBOSE,
+    PRINT_NORMAL,
+    PRINT_QUIET,
+  } ePrintLevel;
+} g_oCommandLine;
+
+int nullprintf(const wchar_t*, ...) {return 0;}
+#define VERBOSEwprintf(...) ((g_oCommandLine.ePrintLevel <= command_line_options_t::PRINT_VERBOSE ? wprintf : nullprintf)(__VA_ARGS__))
+#define NOTQUIETwprintf(...) ((g_oCommandLine.ePrintLevel < command_line_options_t::PRINT_QUIET ? wprintf : nullprintf)(__VA_ARGS__))
+
+//! Open an SGA or SPK archive, ready to be read from multiple threads
+IArchiveFileStore* OpenArchive(const RainString& sFile)
+{
+  std::auto_ptr<IFile> pFile(RainOpenFile(sFile, FM_Read));
+  if(SpkArchive::doesFileResemble(&*pFile))
+  {
+    std::auto_ptr<SpkArchive> pArchive(CHECK_ALLOCATION(new (std::nothrow) SpkArchive));
+    pArchive->init(pFile.release());
+    return pArchive.release();
+  }
+  else if(SgaArchive::doesFileResemble(&*pFile))
+  {
+    pFile.reset();
+    std::auto_ptr<SgaArchive> pArchive(CHECK_ALLOCATION(new (std::nothrow) SgaArchive));
+    pArchive->initMapped(sFile);
+    pArchive->enableConcurrentReads();
+    return pArchive.release();
+  }
+  THROW_SIMPLE_(L"\'%s\' is not an SGA or SPK archive", sFile.getCharacters());
+}
+
+class ConsoleExtractProgress : public IBulkExtractCallback
+{
+public:
+  ConsoleExtractProgress()
+    : m_iLastPrinted(0), m_iFilesDone(0), m_iBytesDone(0)
+  {
+  }
+
+  virtual bool onBulkExtractProgress(const bulk_extract_progress_t& oProgress) throw()
+  {
+    VERBOSEwprintf(L"  %s\n", oProgress.pCurrentFile->getCharacters());
+    if(oProgress.iMillisecondsElapsed - m_iLastPrinted >= 1000)
+    {
+      m_iLastPrinted = oProgress.iMillisecondsElapsed;
+      NOTQUIETwprintf(L"  %lu / %lu files, %.1f MB/s\n", static_cast<unsigned long>(oProgress.iFilesDone),
+        static_cast<unsigned long>(oProgress.iFilesTotal), oProgress.getBytesPerSecond() / 1048576.0);
+    }
+    m_iFilesDone = oProgress.iFilesDone;
+    m_iBytesDone = oProgress.iBytesDone;
+    return true;
+  }
+
+  unsigned long m_iLastPrinted;
+  size_t m_iFilesDone;
+  unsigned long long m_iBytesDone;
+};
+
+bool DoExtract()
+{
+  if(g_oCommandLine.sOutput.isEmpty())
+  {
+    fwprintf(stderr, L"Expected an output directory (-o) for extraction\n");
+    return false;
+  }
+  std::auto_ptr<IArchiveFileStore> pArchive(OpenArchive(g_oCommandLine.sInput));
+  NOTQUIETwprintf(L"Extracting %lu files from \'%s\'...\n", static_cast<unsigned long>(pArchive->getFileCount()), g_oCommandLine.sInput.getCharacters());
+
+  ConsoleExtractProgress oProgress;
+  size_t iFilesDone = 0;
+  unsigned long long iBytesDone = 0;
+  unsigned long iStartTime = RainGetTickCount();
+  BulkExtractor oExtractor;
+  oExtractor.setCallback(&oProgress);
+  oExtractor.setThreadCount(g_oCommandLine.iThreadCount);
+
+  RainString sOutput = g_oCommandLine.sOutput;
+  if(sOutput.suffix(1) != L"\\")
+    sOutput += L"\\";
+  if(!g_oCommandLine.sPath.isEmpty())
+  {
+    oExtractor.extract(&*pArchive, g_oCommandLine.sPath, RainGetFileSystemStore(), sOutput);
+    iFilesDone += oProgress.m_iFilesDone;
+    iBytesDone += oProgress.m_iBytesDone;
+  }
+  else
+  {
+    // Extract every entry point into a directory of the same name
+    for(size_t i = 0; i < pArchive->getEntryPointCount(); ++i)
+    {
+      const RainString& sEntryPoint = pArchive->getEntryPointName(i);
+      oProgress.m_iFilesDone = 0;
+      oProgress.m_iBytesDone = 0;
+      oExtractor.extract(&*pArchive, sEntryPoint, RainGetFileSystemStore(), sOutput + sEntryPoint);
+      iFilesDone += oProgress.m_iFilesDone;
+      iBytesDone += oProgress.m_iBytesDone;
+    }
+  }
+  NOTQUIETwprintf(L"Extracted %lu files (%.1f MB) in %.2f seconds\n", static_cast<unsigned long>(iFilesDone),
+    static_cast<double>(iBytesDone) / 1048576.0, static_cast<double>(RainGetTickCount() - iStartTime) / 1000.0);
+  return true;
+}
+
+bool DoCreate()
+{
+  if(g_oCommandLine.sOutput.isEmpty())
+  {
+    fwprintf(stderr, L"Expected an output archive (-o) for creation\n");
+    return false;
+  }
+  RainString sEntryPoint = g_oCommandLine.sEntryPoint.isEmpty() ? RainString(L"data") : g_oCommandLine.sEntryPoint;
+  RainString sAlias = g_oCommandLine.sAlias.isEmpty() ? sEntryPoint : g_oCommandLine.sAlias;
+  RainString sInput = g_oCommandLine.sInput;
+  if(sInput.suffix(1) != L"\\")
+    sInput += L"\\";
+
+  unsigned long iStartTime = RainGetTickCount();
+  SgaArchiveWriter oWriter;
+  oWriter.setVersion(g_oCommandLine.iVersion);
+  oWriter.setArchiveName(g_oCommandLine.sArchiveName.isEmpty() ? sEntryPoint : g_oCommandLine.sArchiveName);
+  oWriter.setCompressionLevel(g_oCommandLine.iCompressionLevel);
+  oWriter.setThreadCount(g_oCommandLine.iThreadCount);
+  oWriter.addEntryPoint(sEntryPoint, sAlias, RainGetFileSystemStore(), sInput);
+  NOTQUIETwprintf(L"Packing %lu files into version %u.0 archive \'%s\'...\n", static_cast<unsigned long>(oWriter.getFileCount()),
+    static_cast<unsigned int>(g_oCommandLine.iVersion), g_oCommandLine.sOutput.getCharacters());
+
+  std::auto_ptr<IFile> pFile(RainOpenFile(g_oCommandLine.sOutput, FM_Write));
+  oWriter.writeToFile(&*pFile);
+  NOTQUIETwprintf(L"Packed %.1f MB into %.1f MB (%lu duplicate files) in %.2f seconds\n",
+    static_cast<double>(oWriter.getBytesIn()) / 1048576.0, static_cast<double>(oWriter.getBytesOut()) / 1048576.0,
+    static_cast<unsigned long>(oWriter.getDuplicateCount()), static_cast<double>(RainGetTickCount() - iStartTime) / 1000.0);
+  return true;
+}
+
+bool DoCreateSpk()
+{
+  if(g_oCommandLine.sOutput.isEmpty())
+  {
+    fwprintf(stderr, L"Expected an output archive (-o) for creation\n");
+    return false;
+  }
+  RainString sInput = g_oCommandLine.sInput;
+  if(sInput.suffix(1) != L"\\")
+    sInput += L"\\";
+
+  unsigned long iStartTime = RainGetTickCount();
+  SpkArchiveWriter oWriter;
+  oWriter.setCompressionLevel(g_oCommandLine.iCompressionLevel);
+  oWriter.setThreadCount(g_oCommandLine.iThreadCount);
+  oWriter.addDirectory(RainGetFileSystemStore(), sInput);
+  NOTQUIETwprintf(L"Packing %lu files into SPK archive '%s'...\n", static_cast<unsigned long>(oWriter.getFileCount()),
+    g_oCommandLine.sOutput.getCharacters());
+
+  std::auto_ptr<IFile> pFile(RainOpenFile(g_oCommandLine.sOutput, FM_Write));
+  oWriter.writeToFile(&*pFile);
+  NOTQUIETwprintf(L"Packed %.1f MB into %.1f MB in %.2f seconds\n", static_cast<double>(oWriter.getBytesIn()) / 1048576.0,
+    static_cast<double>(oWriter.getBytesOut()) / 1048576.0, static_cast<double>(RainGetTickCount() - iStartTime) / 1000.0);
+  return true;
+}
+
+bool DoRepack()
+{
+  if(g_oCommandLine.sOutput.isEmpty())
+  {
+    fwprintf(stderr, L"Expected an output archive (-o) for repacking\n");
+    return false;
+  }
+  std::auto_ptr<IArchiveFileStore> pArchive(OpenArchive(g_oCommandLine.sInput));
+
+  unsigned long iStartTime = RainGetTickCount();
+  SgaArchiveWriter oWriter;
+  oWriter.setVersion(g_oCommandLine.iVersion);
+  if(!g_oCommandLine.sArchiveName.isEmpty())
+    oWriter.setArchiveName(g_oCommandLine.sArchiveName);
+  else if(pArchive->getEntryPointCount() != 0)
+    oWriter.setArchiveName(pArchive->getEntryPointName(0));
+  oWriter.setCompressionLevel(g_oCommandLine.iCompressionLevel);
+  oWriter.setThreadCount(g_oCommandLine.iThreadCount);
+  for(size_t i = 0; i < pArchive->getEntryPointCount(); ++i)
+  {
+    const RainString& sEntryPoint = pArchive->getEntryPointName(i);
+    oWriter.addEntryPoint(sEntryPoint, sEntryPoint, &*pArchive, sEntryPoint);
+  }
+  NOTQUIETwprintf(L"Repacking %lu files into version %u.0 archive '%s'...\n", static_cast<unsigned long>(oWriter.getFileCount()),
+    static_cast<unsigned int>(g_oCommandLine.iVersion), g_oCommandLine.sOutput.getCharacters());
+
+  std::auto_ptr<IFile> pFile(RainOpenFile(g_oCommandLine.sOutput, FM_Write));
+  oWriter.writeToFile(&*pFile);
+  NOTQUIETwprintf(L"Repacked %.1f MB into %.1f MB (%lu duplicate files) in %.2f seconds\n",
+    static_cast<double>(oWriter.getBytesIn()) / 1048576.0, static_cast<double>(oWriter.getBytesOut()) / 1048576.0,
+    static_cast<unsigned long>(oWriter.getDuplicateCount()), static_cast<double>(RainGetTickCount() - iStartTime) / 1000.0);
+  return true;
+}
+
+bool DoUpdate()
+{
+  if(g_oCommandLine.sOutput.isEmpty())
+  {
+    fwprintf(stderr, L"Expected an archive (-o) to update\n");
+    return false;
+  }
+  RainString sEntryPoint = g_oCommandLine.sEntryPoint.isEmpty() ? RainString(L"data") : g_oCommandLine.sEntryPoint;
+  RainString sAlias = g_oCommandLine.sAlias.isEmpty() ? sEntryPoint : g_oCommandLine.sAlias;
+  RainString sInput = g_oCommandLine.sInput;
+  if(sInput.suffix(1) != L"\\")
+    sInput += L"\\";
+
+  unsigned long iStartTime = RainGetTickCount();
+  SgaArchiveWriter oWriter;
+  if(!g_oCommandLine.sArchiveName.isEmpty())
+    oWriter.setArchiveName(g_oCommandLine.sArchiveName);
+  oWriter.setCompressionLevel(g_oCommandLine.iCompressionLevel);
+  oWriter.setThreadCount(g_oCommandLine.iThreadCount);
+  oWriter.addEntryPoint(sEntryPoint, sAlias, RainGetFileSystemStore(), sInput);
+  NOTQUIETwprintf(L"Updating archive '%s' with %lu files...\n", g_oCommandLine.sOutput.getCharacters(), static_cast<unsigned long>(oWriter.getFileCount()));
+
+  std::auto_ptr<IFile> pFile(RainOpenFile(g_oCommandLine.sOutput, FM_Update));
+  oWriter.updateFile(&*pFile);
+  NOTQUIETwprintf(L"Kept %lu unchanged files, and appended %.1f MB in %.2f seconds\n", static_cast<unsigned long>(oWriter.getReusedCount()),
+    static_cast<double>(oWriter.getBytesOut()) / 1048576.0, static_cast<double>(RainGetTickCount() - iStartTime) / 1000.0);
+  return true;
+}
+
+bool DoCompact()
+{
+  if(g_oCommandLine.sOutput.isEmpty())
+  {
+    fwprintf(stderr, L"Expected an output archive (-o) for compaction\n");
+    return false;
+  }
+
+  unsigned long iStartTime = RainGetTickCount();
+  std::auto_ptr<IFile> pInput(RainOpenFile(g_oCommandLine.sInput, FM_Read));
+  pInput->seek(0, SR_End);
+  seek_offset_t iInputSize = pInput->tell();
+  NOTQUIETwprintf(L"Compacting '%s' into '%s'...\n", g_oCommandLine.sInput.getCharacters(), g_oCommandLine.sOutput.getCharacters());
+
+  SgaArchiveWriter oWriter;
+  std::auto_ptr<IFile> pOutput(RainOpenFile(g_oCommandLine.sOutput, FM_Write));
+  oWriter.compact(&*pInput, &*pOutput);
+  NOTQUIETwprintf(L"Compacted %.1f MB into %.1f MB in %.2f seconds\n", static_cast<double>(iInputSize) / 1048576.0,
+    static_cast<double>(pOutput->tell()) / 1048576.0, static_cast<double>(RainGetTickCount() - iStartTime) / 1000.0);
+  return true;
+}
+
+const wchar_t* HashStatusName(archive_verify_report_t::eHashStatus eStatus)
+{
+  switch(eStatus)
+  {
+  case archive_verify_report_t::HS_Valid:
+    return L"valid";
+  case archive_verify_report_t::HS_Invalid:
+    return L"INVALID";
+  default:
+    return L"not present";
+  }
+}
+
+bool DoVerify()
+{
+  std::auto_ptr<IArchiveFileStore> pArchive(OpenArchive(g_oCommandLine.sInput));
+  NOTQUIETwprintf(L"Verifying '%s'...\n", g_oCommandLine.sInput.getCharacters());
+
+  archive_verify_report_t oReport;
+  pArchive->verify(oReport, g_oCommandLine.iThreadCount);
+  NOTQUIETwprintf(L"  Header hash: %s\n", HashStatusName(oReport.eHeaderHash));
+  NOTQUIETwprintf(L"  Contents hash: %s\n", HashStatusName(oReport.eContentsHash));
+  NOTQUIETwprintf(L"  Files checked individually: %lu\n", static_cast<unsigned long>(oReport.iFilesChecked));
+  for(std::vector<archive_verify_report_t::corrupt_file_t>::const_iterator itr = oReport.vCorruptFiles.begin(); itr != oReport.vCorruptFiles.end(); ++itr)
+    wprintf(L"  CORRUPT: %s (%s)\n", itr->sPath.getCharacters(), itr->sReason.getCharacters());
+  double fSeconds = static_cast<double>(oReport.iMillisecondsElapsed) / 1000.0;
+  NOTQUIETwprintf(L"Read %.1f MB in %.2f seconds (%.1f MB/s)\n", static_cast<double>(oReport.iBytesRead) / 1048576.0, fSeconds,
+    fSeconds > 0.0 ? static_cast<double>(oReport.iBytesRead) / 1048576.0 / fSeconds : 0.0);
+  if(!oReport.isValid())
+  {
+    fwprintf(stderr, L"'%s' is corrupt\n", g_oCommandLine.sInput.getCharacters());
+    return false;
+  }
+  NOTQUIETwprintf(L"No problems found\n");
+  return true;
+}
+
+bool DoDiff()
+{
+  if(g_oCommandLine.sOutput.isEmpty())
+  {
+    fwprintf(stderr, L"Expected a second archive (-o) to compare against\n");
+    return false;
+  }
+  std::auto_ptr<IArchiveFileStore> pOld(OpenArchive(g_oCommandLine.sInput));
+  std::auto_ptr<IArchiveFileStore> pNew(OpenArchive(g_oCommandLine.sOutput));
+  NOTQUIETwprintf(L"Comparing '%s' with '%s'...\n", g_oCommandLine.sInput.getCharacters(), g_oCommandLine.sOutput.getCharacters());
+
+  archive_diff_report_t oReport;
+  IArchiveFileStore::diff(&*pOld, &*pNew, oReport);
+  for(std::vector<RainString>::const_iterator itr = oReport.vRemoved.begin(); itr != oReport.vRemoved.end(); ++itr)
+    wprintf(L"  - %s\n", itr->getCharacters());
+  for(std::vector<RainString>::const_iterator itr = oReport.vAdded.begin(); itr != oReport.vAdded.end(); ++itr)
+    wprintf(L"  + %s\n", itr->getCharacters());
+  for(std::vector<RainString>::const_iterator itr = oReport.vModified.begin(); itr != oReport.vModified.end(); ++itr)
+    wprintf(L"  * %s\n", itr->getCharacters());
+  NOTQUIETwprintf(L"%lu removed, %lu added, %lu modified\n", static_cast<unsigned long>(oReport.vRemoved.size()),
+    static_cast<unsigned long>(oReport.vAdded.size()), static_cast<unsigned long>(oReport.vModified.size()));
+  NOTQUIETwprintf(L"Compared %lu files (%lu decompressed), reading %.1f MB and decompressing %.1f MB in %.2f seconds\n",
+    static_cast<unsigned long>(oReport.iFilesCompared), static_cast<unsigned long>(oReport.iFilesInflated),
+    static_cast<double>(oReport.iBytesRead) / 1048576.0, static_cast<double>(oReport.iBytesInflated) / 1048576.0,
+    static_cast<double>(oReport.iMillisecondsElapsed) / 1000.0);
+  return true;
+}
+
+void PrintUsage(const wchar_t* sExecutable)
+{
+  fwprintf(stderr, L"Command format is:\n");
+  fwprintf(stderr, L"%s extract -i archive -o directory [-p path] [-t threads] [-q | -v]\n", sExecutable);
+  fwprintf(stderr, L"  extract; extracts files from an SGA or SPK archive\n");
+  fwprintf(stderr, L"  -i; archive to read from\n");
+  fwprintf(stderr, L"  -o; directory to extract to\n");
+  fwprintf(stderr, L"  -p; directory within the archive to extract (defaults to everything)\n");
+  fwprintf(stderr, L"  -t; number of threads to decompress with (defaults to one per processor)\n");
+  fwprintf(stderr, L"%s create -i directory -o archive [-V version] [-e entrypoint] [-a alias] [-n name] [-l level] [-t threads] [-q | -v]\n", sExecutable);
+  fwprintf(stderr, L"  create; creates an SGA archive from the contents of a directory\n");
+  fwprintf(stderr, L"  -i; directory to read from\n");
+  fwprintf(stderr, L"  -o; archive to write to\n");
+  fwprintf(stderr, L"  -V; archive version; 2 (DoW), 4 (CoH) or 5 (DoW2) (defaults to 2)\n");
+  fwprintf(stderr, L"  -e; name of the entry point (defaults to \"data\")\n");
+  fwprintf(stderr, L"  -a; alias of the entry point (defaults to the entry point name)\n");
+  fwprintf(stderr, L"  -n; name of the archive (defaults to the entry point name)\n");
+  fwprintf(stderr, L"  -l; compression level, 1 (fastest) to 9 (smallest) (defaults to 9)\n");
+  fwprintf(stderr, L"  -t; number of threads to compress with (defaults to one per processor)\n");
+  fwprintf(stderr, L"%s createspk -i directory -o archive [-l level] [-t threads] [-q | -v]\n", sExecutable);
+  fwprintf(stderr, L"  createspk; creates an SPK archive from the contents of a directory\n");
+  fwprintf(stderr, L"  -i; directory to read from\n");
+  fwprintf(stderr, L"  -o; archive to write to\n");
+  fwprintf(stderr, L"  -l; compression level, 1 (fastest) to 9 (smallest) (defaults to 9)\n");
+  fwprintf(stderr, L"  -t; number of threads to compress with (defaults to one per processor)\n");
+  fwprintf(stderr, L"%s repack -i archive -o archive [-V version] [-n name] [-l level] [-t threads] [-q | -v]\n", sExecutable);
+  fwprintf(stderr, L"  repack; copies the contents of an SGA or SPK archive into a new SGA archive\n");
+  fwprintf(stderr, L"  -i; archive to read from; files compressed within it are copied without recompression\n");
+  fwprintf(stderr, L"  -o; archive to write to\n");
+  fwprintf(stderr, L"  -V; archive version; 2 (DoW), 4 (CoH) or 5 (DoW2) (defaults to 2)\n");
+  fwprintf(stderr, L"  -n; name of the archive (defaults to the name of the first entry point)\n");
+  fwprintf(stderr, L"  -l; compression level for files which are not already compressed (defaults to 9)\n");
+  fwprintf(stderr, L"  -t; number of threads to compress with (defaults to one per processor)\n");
+  fwprintf(stderr, L"%s update -i directory -o archive [-e entrypoint] [-a alias] [-n name] [-l level] [-t threads] [-q | -v]\n", sExecutable);
+  fwprintf(stderr, L"  update; brings an existing SGA archive up to date with the contents of a directory\n");
+  fwprintf(stderr, L"  -i; directory to read from\n");
+  fwprintf(stderr, L"  -o; archive to update; only new and changed files are written, and are appended to it\n");
+  fwprintf(stderr, L"  -e; name of the entry point (defaults to \"data\")\n");
+  fwprintf(stderr, L"  -a; alias of the entry point (defaults to the entry point name)\n");
+  fwprintf(stderr, L"  -n; name of the archive (defaults to the existing name)\n");
+  fwprintf(stderr, L"  -l; compression level, 1 (fastest) to 9 (smallest) (defaults to 9)\n");
+  fwprintf(stderr, L"  -t; number of threads to compress with (defaults to one per processor)\n");
+  fwprintf(stderr, L"%s compact -i archive -o archive [-q | -v]\n", sExecutable);
+  fwprintf(stderr, L"  compact; copies an SGA archive, leaving out the dead space left behind by update\n");
+  fwprintf(stderr, L"  -i; archive to read from\n");
+  fwprintf(stderr, L"  -o; archive to write to\n");
+  fwprintf(stderr, L"%s verify -i archive [-t threads] [-q | -v]\n", sExecutable);
+  fwprintf(stderr, L"  verify; checks the hashes and checksums of an SGA or SPK archive\n");
+  fwprintf(stderr, L"  -i; archive to check\n");
+  fwprintf(stderr, L"  -t; number of threads to check files with (defaults to one per processor)\n");
+  fwprintf(stderr, L"%s diff -i archive -o archive [-q | -v]\n", sExecutable);
+  fwprintf(stderr, L"  diff; lists the files which differ between two SGA or SPK archives\n");
+  fwprintf(stderr, L"  -i; the older archive\n");
+  fwprintf(stderr, L"  -o; the newer archive\n");
+  fwprintf(stderr, L"Common options:\n");
+  fwprintf(stderr, L"  -q; quiet output to console\n");
+  fwprintf(stderr, L"  -v; verbose output to console\n");
+}
+
+int wmain(int argc, wchar_t** argv)
+{
+#define REQUIRE_NEXT_ARG(noun) if((i + 1) >= argc) { \
+    fwprintf(stderr, L"Expected " L ## noun L" to follow \"%s\"\n", arg); \
+    return -2; \
+  }
+
+  const wchar_t* sExecutable = wcsrchr(*argv, '\\') ? (wcsrchr(*argv, '\\') + 1) : (*argv);
+  if(argc < 2 || argv[1][0] == '-')
+  {
+    PrintUsage(sExecutable);
+    return -4;
+  }
+  g_oCommandLine.sCommand = argv[1];
+
+  for(int i = 2; i < argc; ++i)
+  {
+    wchar_t *arg = argv[i];
+    if(arg[0] == '-')
+    {
+      bool bValid = false;
+      if(arg[1] != 0 && arg[2] == 0)
+      {
+        bValid = true;
+        switch(arg[1])
+        {
+        case 'i':
+          REQUIRE_NEXT_ARG("filename");
+          g_oCommandLine.sInput = argv[++i];
+          break;
+        case 'o':
+          REQUIRE_NEXT_ARG("filename");
+          g_oCommandLine.sOutput = argv[++i];
+          break;
+        case 'p':
+          REQUIRE_NEXT_ARG("path");
+          g_oCommandLine.sPath = argv[++i];
+          break;
+        case 'V':
+          REQUIRE_NEXT_ARG("number");
+          g_oCommandLine.iVersion = static_cast<unsigned short>(_wtoi(argv[++i]));
+          break;
+        case 'e':
+          REQUIRE_NEXT_ARG("name");
+          g_oCommandLine.sEntryPoint = argv[++i];
+          break;
+        case 'a':
+          REQUIRE_NEXT_ARG("name");
+          g_oCommandLine.sAlias = argv[++i];
+          break;
+        case 'n':
+          REQUIRE_NEXT_ARG("name");
+          g_oCommandLine.sArchiveName = argv[++i];
+          break;
+        case 'l':
+          REQUIRE_NEXT_ARG("number");
+          g_oCommandLine.iCompressionLevel = _wtoi(argv[++i]);
+          break;
+        case 't':
+          REQUIRE_NEXT_ARG("number");
+          g_oCommandLine.iThreadCount = static_cast<unsigned long>(_wtoi(argv[++i]));
+          break;
+        case 'v':
+          g_oCommandLine.ePrintLevel = command_line_options_t::PRINT_VERBOSE;
+          break;
+        case 'q':
+          g_oCommandLine.ePrintLevel = command_line_options_t::PRINT_QUIET;
+          break;
+        default:
+          bValid = false;
+          break;
+        }
+      }
+      if(!bValid)
+      {
+        fwprintf(stderr, L"Unrecognised command line switch \"%s\"\n", arg);
+        return -1;
+      }
+    }
+    else
+    {
+      fwprintf(stderr, L"Expected command line switch rather than \"%s\"\n", arg);
+      return -3;
+    }
+  }
+
+#undef REQUIRE_NEXT_ARG
+
+  NOTQUIETwprintf(L"** Corsix\'s Archive Tool **\n");
+  if(g_oCommandLine.sInput.isEmpty())
+  {
+    fwprintf(stderr, L"Expected an input (-i)\n");
+    PrintUsage(sExecutable);
+    return -4;
+  }
+
+  bool bAllGood = false;
+
+  try
+  {
+    if(g_oCommandLine.sCommand.compareCaseless("extract") == 0)
+      bAllGood = DoExtract();
+    else if(g_oCommandLine.sCommand.compareCaseless("create") == 0)
+      bAllGood = DoCreate();
+    else if(g_oCommandLine.sCommand.compareCaseless("createspk") == 0)
+      bAllGood = DoCreateSpk();
+    else if(g_oCommandLine.sCommand.compareCaseless("repack") == 0)
+      bAllGood = DoRepack();
+    else if(g_oCommandLine.sCommand.compareCaseless("update") == 0)
+      bAllGood = DoUpdate();
+    else if(g_oCommandLine.sCommand.compareCaseless("compact") == 0)
+      bAllGood = DoCompact();
+    else if(g_oCommandLine.sCommand.compareCaseless("diff") == 0)
+      bAllGood = DoDiff();
+    else if(g_oCommandLine.sCommand.compareCaseless("verify") == 0)
+      bAllGood = DoVerify();
+    else
+    {
+      fwprintf(stderr, L"Unrecognised command \"%s\"\n", g_oCommandLine.sCommand.getCharacters());
+      PrintUsage(sExecutable);
+      return -4;
+    }
+  }
+  catch(RainException *pE)
+  {
+    bAllGood = false;
+    fwprintf(stderr, L"Fatal exception:\n");
+    for(RainException *p = pE; p; p = p->getPrevious())
+    {
+      fwprintf(stderr, L"%s:%li - %s\n", p->getFile().getCharacters(), p->getLine(), p->getMessage().getCharacters());
+      if(g_oCommandLine.ePrintLevel >= command_line_options_t::PRINT_QUIET)
+        break;
+    }
+    delete pE;
+  }
+
+  if(bAllGood)
+  {
+    NOTQUIETwprintf(L"Done\n");
+    return 0;
+  }
+  return -10;
+}
@@ -27,6 +27,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "hash.h"
 #include "zlib.h"
 #include "memfile.h"
+#include "inflatefile.h"
 #include <memory.h>
 #include <string.h>
 #ifdef RAINMAN2_USE_CRYPTO_WIN32
@@ -35,40 +36,203 @@ OTHER DEALINGS IN THE SOFTWARE.
 #define min std::min
 #endif
 
-struct _entry_point_raw_t
+archive_verify_report_t::archive_verify_report_t() throw()
 {
-  char sDirectoryName[64];
-  char sAlias[64];
-  unsigned short int iFirstDirectory;
-  unsigned short int iLastDirectory;
-  unsigned short int iFirstFile;
-  unsigned short int iLastFile;
-  unsigned long iFolderOffset;
-};
+  clear();
+}
 
-struct _directory_raw_t
+void archive_verify_report_t::clear() throw()
 {
-  unsigned long iNameOffset;
-  unsigned short int iFirstDirectory;
-  unsigned short int iLastDirectory;
-  unsigned short int iFirstFile;
-  unsigned short int iLastFile;
-};
+  eHeaderHash = HS_NotPresent;
+  eContentsHash = HS_NotPresent;
+  iFilesChecked = 0;
+  iBytesRead = 0;
+  iMillisecondsElapsed = 0;
+  vCorruptFiles.clear();
+}
+
+bool archive_verify_report_t::isValid() const throw()
+{
+  return eHeaderHash != HS_Invalid && eContentsHash != HS_Invalid && vCorruptFiles.empty();
+}
+
+archive_diff_report_t::archive_diff_report_t() throw()
+{
+  clear();
+}
+
+void archive_diff_report_t::clear() throw()
+{
+  vAdded.clear();
+  vRemoved.clear();
+  vModified.clear();
+  iFilesCompared = 0;
+  iFilesInflated = 0;
+  iBytesRead = 0;
+  iBytesInflated = 0;
+  iMillisecondsElapsed = 0;
+}
+
+bool archive_diff_report_t::isIdentical() const throw()
+{
+  return vAdded.empty() && vRemoved.empty() && vModified.empty();
+}
 
-struct _file_raw_t
+static void DeleteRawSource(const char* pBuffer, size_t iSize)
 {
-  unsigned long iNameOffset;
-  unsigned long iDataOffset;
-	unsigned long iDataLengthCompressed;
-	unsigned long iDataLength;
-	unsigned long iModificationTime;
-  union
+  archive_raw_source_t* pSource = reinterpret_cast<archive_raw_source_t*>(const_cast<char*>(pBuffer));
+  if(pSource->bDeleteFile)
+    delete pSource->pFile;
+  delete pSource;
+}
+
+memory_buffer_owner_t* archive_raw_source_t::create(IFile* pFile, bool bDeleteFile) throw(...)
+{
+  archive_raw_source_t* pSource = 0;
+  memory_buffer_owner_t* pOwner;
+  try
+  {
+    pSource = CHECK_ALLOCATION(new (std::nothrow) archive_raw_source_t);
+    pOwner = CHECK_ALLOCATION(new (std::nothrow) memory_buffer_owner_t);
+  }
+  CATCH_THROW_SIMPLE({delete pSource; if(bDeleteFile) delete pFile;}, L"Cannot share archive file");
+  pSource->pFile = pFile;
+  pSource->bDeleteFile = bDeleteFile;
+  pOwner->iReferenceCount = 1;
+  pOwner->pBuffer = reinterpret_cast<const char*>(pSource);
+  pOwner->iSize = 0;
+  pOwner->fnFree = DeleteRawSource;
+  return pOwner;
+}
+
+archive_raw_source_t* archive_raw_source_t::get(memory_buffer_owner_t* pOwner) throw()
+{
+  return reinterpret_cast<archive_raw_source_t*>(const_cast<char*>(pOwner->pBuffer));
+}
+
+memory_buffer_owner_t* archive_raw_source_t::addReference(memory_buffer_owner_t* pOwner) throw()
+{
+  RainAtomicIncrement(&pOwner->iReferenceCount);
+  return pOwner;
+}
+
+//! Checks files on a background thread for IArchiveFileStore::_verifyFiles()
+class ArchiveVerifyWorker : public RainThread
+{
+public:
+  ArchiveVerifyWorker(IArchiveFileStore* pArchive, const std::vector<IArchiveFileStore::_verify_item_t>& vItems, const std::vector<size_t>& vOrder,
+                      std::vector<RainString>& vReasons, std::vector<char>& vCorrupt, volatile long* pNextIndex) throw()
+    : m_pArchive(pArchive), m_vItems(vItems), m_vOrder(vOrder), m_vReasons(vReasons), m_vCorrupt(vCorrupt), m_pNextIndex(pNextIndex)
   {
-	  unsigned long iFlags32;
-    unsigned short iFlags16;
+  }
+
+  virtual void run() throw()
+  {
+    while(true)
+    {
+      // Files are claimed in storage order, and each result slot is only ever written by the thread which claimed it
+      size_t iNext = static_cast<size_t>(RainAtomicIncrement(m_pNextIndex) - 1);
+      if(iNext >= m_vOrder.size())
+        break;
+      size_t iIndex = m_vOrder[iNext];
+      m_vCorrupt[iIndex] = m_pArchive->_verifyFile(m_vItems[iIndex].pFile, m_vReasons[iIndex]) ? 0 : 1;
+    }
+  }
+
+  //! Orders indices into the items by the position of the files' data
+  struct OrderLess
+  {
+    OrderLess(const std::vector<IArchiveFileStore::_verify_item_t>& vItems) : m_vItems(vItems) {}
+    bool operator()(size_t a, size_t b) const {return m_vItems[a].iOrder < m_vItems[b].iOrder;}
+    const std::vector<IArchiveFileStore::_verify_item_t>& m_vItems;
   };
+
+protected:
+  IArchiveFileStore* m_pArchive;
+  const std::vector<IArchiveFileStore::_verify_item_t>& m_vItems;
+  const std::vector<size_t>& m_vOrder;
+  std::vector<RainString>& m_vReasons;
+  std::vector<char>& m_vCorrupt;
+  volatile long* m_pNextIndex;
 };
 
+void IArchiveFileStore::_verifyFiles(const std::vector<_verify_item_t>& vItems, archive_verify_report_t& oReport, unsigned long iThreadCount) throw(...)
+{
+  std::vector<RainString> vReasons(vItems.size());
+  std::vector<char> vCorrupt(vItems.size(), 0);
+  std::vector<size_t> vOrder(vItems.size());
+  for(size_t i = 0; i < vOrder.size(); ++i)
+    vOrder[i] = i;
+  std::stable_sort(vOrder.begin(), vOrder.end(), ArchiveVerifyWorker::OrderLess(vItems));
+  volatile long iNextIndex = 0;
+
+  if(iThreadCount == 0)
+    iThreadCount = RainGetProcessorCount();
+  if(iThreadCount > vItems.size())
+    iThreadCount = static_cast<unsigned long>(vItems.size());
+
+  std::vector<ArchiveVerifyWorker*> vWorkers;
+  try
+  {
+    for(unsigned long i = 1; i < iThreadCount; ++i)
+    {
+      ArchiveVerifyWorker *pWorker = CHECK_ALLOCATION(new (std::nothrow) ArchiveVerifyWorker(this, vItems, vOrder, vReasons, vCorrupt, &iNextIndex));
+      try
+      {
+        pWorker->start();
+      }
+      CATCH_THROW_SIMPLE(delete pWorker, L"Cannot start worker thread");
+      vWorkers.push_back(pWorker);
+    }
+  }
+  catch(RainException *pE)
+  {
+    // Carry on with however many threads did start, as the calling thread does a share of the work anyway
+    delete pE;
+  }
+
+  // The calling thread checks files too, which also covers the single threaded case
+  ArchiveVerifyWorker oSelf(this, vItems, vOrder, vReasons, vCorrupt, &iNextIndex);
+  oSelf.run();
+  for(std::vector<ArchiveVerifyWorker*>::iterator itr = vWorkers.begin(); itr != vWorkers.end(); ++itr)
+  {
+    (**itr).join();
+    delete *itr;
+  }
+
+  oReport.iFilesChecked += vItems.size();
+  for(size_t i = 0; i < vItems.size(); ++i)
+  {
+    if(vCorrupt[i])
+    {
+      archive_verify_report_t::corrupt_file_t oCorrupt;
+      oCorrupt.sPath = vItems[i].sPath;
+      oCorrupt.sReason = vReasons[i];
+      oReport.vCorruptFiles.push_back(oCorrupt);
+    }
+  }
+}
+
+RainString IArchiveFileStore::_describeVerifyException(RainException* pE) throw()
+{
+  RainString sReason;
+  try
+  {
+    for(RainException* p = pE; p; p = p->getPrevious())
+    {
+      if(!sReason.isEmpty())
+        sReason += L"; ";
+      sReason += p->getMessage();
+    }
+  }
+  catch(RainException *pAllocationError)
+  {
+    delete pAllocationError;
+  }
+  delete pE;
+  return sReason;
+}
+
 bool IArchiveFileStore::initNoThrow(IFile* pFile, bool bTakePointerOwnership) throw()
 {
   try
@@ -93,6 +257,316 @@ void IArchiveFileStore::getCaps(file_store_caps_t& oCaps) const throw()
   oCaps.bCanOpenDirectories = true;
 }
 
+bool IArchiveFileStore::_batchItemLess(const _batch_item_t& a, const _batch_item_t& b) throw()
+{
+  if(a.iPosition != b.iPosition)
+    return a.iPosition < b.iPosition;
+  return a.iRequest < b.iRequest;
+}
+
+void IArchiveFileStore::pumpFiles(const std::vector<std::pair<RainString, IFile*> >& vFiles) throw(...)
+{
+  // A single read covers a run of files as long as it stays within the buffer, and the gaps between
+  // the files are small enough that reading through them is cheaper than seeking over them
+  static const size_t BATCH_BUFFER_SIZE = 1 << 20;
+  static const size_t BATCH_MAXIMUM_GAP = 64 << 10;
+
+  // Every path is resolved before any data is read, so that a bad path is reported before anything is written
+  std::vector<_batch_item_t> vItems(vFiles.size());
+  for(size_t i = 0; i < vFiles.size(); ++i)
+  {
+    try
+    {
+      vItems[i].iRequest = i;
+      _getBatchItem(vFiles[i].first, vItems[i]);
+    }
+    CATCH_THROW_SIMPLE_({}, L"Cannot pump file \'%s\'", vFiles[i].first.getCharacters());
+  }
+  std::sort(vItems.begin(), vItems.end(), _batchItemLess);
+
+  char* pBuffer = 0;
+  try
+  {
+    for(size_t iFirst = 0; iFirst < vItems.size();)
+    {
+      const _batch_item_t& oFirst = vItems[iFirst];
+      if(!oFirst.bNeedsRead || oFirst.iLength > BATCH_BUFFER_SIZE)
+      {
+        // Large files are pumped on their own, which reads them sequentially anyway
+        try
+        {
+          _pumpBatchItem(oFirst, vFiles[oFirst.iRequest].second, 0);
+        }
+        CATCH_THROW_SIMPLE_({}, L"Cannot pump file \'%s\'", vFiles[oFirst.iRequest].first.getCharacters());
+        ++iFirst;
+        continue;
+      }
+
+      // Extend the run for as long as the next file fits in the buffer and is close enough
+      seek_offset_t iStart = oFirst.iPosition;
+      seek_offset_t iEnd = iStart + static_cast<seek_offset_t>(oFirst.iLength);
+      size_t iLast = iFirst + 1;
+      for(; iLast < vItems.size(); ++iLast)
+      {
+        const _batch_item_t& oNext = vItems[iLast];
+        if(!oNext.bNeedsRead || oNext.iPosition > iEnd + static_cast<seek_offset_t>(BATCH_MAXIMUM_GAP))
+          break;
+        seek_offset_t iNextEnd = std::max(iEnd, oNext.iPosition + static_cast<seek_offset_t>(oNext.iLength));
+        if(static_cast<size_t>(iNextEnd - iStart) > BATCH_BUFFER_SIZE)
+          break;
+        iEnd = iNextEnd;
+      }
+
+      if(pBuffer == 0)
+        pBuffer = CHECK_ALLOCATION(new (std::nothrow) char[BATCH_BUFFER_SIZE]);
+      size_t iLength = static_cast<size_t>(iEnd - iStart);
+      if(_readBatchData(iStart, pBuffer, iLength) != iLength)
+        THROW_SIMPLE(L"Unexpected end of archive");
+
+      for(; iFirst < iLast; ++iFirst)
+      {
+        const _batch_item_t& oItem = vItems[iFirst];
+        try
+        {
+          _pumpBatchItem(oItem, vFiles[oItem.iRequest].second, pBuffer + (oItem.iPosition - iStart));
+        }
+        CATCH_THROW_SIMPLE_({}, L"Cannot pump file \'%s\'", vFiles[oItem.iRequest].first.getCharacters());
+      }
+    }
+  }
+  CATCH_THROW_SIMPLE(delete[] pBuffer, L"Cannot pump batch of files");
+  delete[] pBuffer;
+}
+
+IFile* IArchiveFileStore::openRaw(const RainString& sPath, archive_raw_details_t& oDetails) throw(...)
+{
+  char* pData = 0;
+  size_t iLength = 0;
+  try
+  {
+    _batch_item_t oItem;
+    oItem.iRequest = 0;
+    _getBatchItem(sPath, oItem);
+    _getRawDetails(oItem, oDetails);
+    iLength = oItem.iLength;
+    CHECK_ALLOCATION(pData = new (std::nothrow) char[iLength ? iLength : 1]);
+    if(_readBatchData(oItem.iPosition, pData, iLength) != iLength)
+      THROW_SIMPLE(L"Unexpected end of archive");
+  }
+  CATCH_THROW_SIMPLE_(delete[] pData, L"Cannot open raw data of '%s'", sPath.getCharacters());
+
+  MemoryReadFile* pFile = new (std::nothrow) MemoryReadFile(pData, iLength, true);
+  if(pFile == 0)
+  {
+    delete[] pData;
+    CHECK_ALLOCATION(pFile);
+  }
+  return pFile;
+}
+
+void IArchiveFileStore::pumpRaw(const RainString& sPath, IFile* pSink, archive_raw_details_t& oDetails) throw(...)
+{
+  static const size_t BUFFER_SIZE = 64 << 10;
+  char* pBuffer = 0;
+  try
+  {
+    _batch_item_t oItem;
+    oItem.iRequest = 0;
+    _getBatchItem(sPath, oItem);
+    _getRawDetails(oItem, oDetails);
+    CHECK_ALLOCATION(pBuffer = new (std::nothrow) char[BUFFER_SIZE]);
+    seek_offset_t iPosition = oItem.iPosition;
+    for(size_t iRemaining = oItem.iLength; iRemaining != 0;)
+    {
+      size_t iAmount = iRemaining < BUFFER_SIZE ? iRemaining : BUFFER_SIZE;
+      if(_readBatchData(iPosition, pBuffer, iAmount) != iAmount)
+        THROW_SIMPLE(L"Unexpected end of archive");
+      pSink->write(pBuffer, 1, iAmount);
+      iPosition += static_cast<seek_offset_t>(iAmount);
+      iRemaining -= iAmount;
+    }
+  }
+  CATCH_THROW_SIMPLE_(delete[] pBuffer, L"Cannot pump raw data of '%s'", sPath.getCharacters());
+  delete[] pBuffer;
+}
+
+//! A file found by ListArchiveFiles()
+struct ArchiveDiffFile
+{
+  RainString sPath;
+  unsigned long iLength;
+};
+
+static bool ArchiveDiffFileOrder(const ArchiveDiffFile& a, const ArchiveDiffFile& b)
+{
+  return a.sPath.compareCaseless(b.sPath) < 0;
+}
+
+static bool CaselessOrder(const RainString& a, const RainString& b)
+{
+  return a.compareCaseless(b) < 0;
+}
+
+//! Get the full path and length of every file within every entry point of an archive
+static void ListArchiveFiles(IArchiveFileStore* pArchive, std::vector<ArchiveDiffFile>& vFiles) throw(...)
+{
+  std::vector<IDirectory*> vTodo;
+  try
+  {
+    for(size_t i = 0; i < pArchive->getEntryPointCount(); ++i)
+    {
+      vTodo.push_back(pArchive->openDirectory(pArchive->getEntryPointName(i)));
+      while(!vTodo.empty())
+      {
+        IDirectory* pDirectory = vTodo.back();
+        vTodo.pop_back();
+        try
+        {
+          for(IDirectory::iterator itr = pDirectory->begin(), itrEnd = pDirectory->end(); itr != itrEnd; ++itr)
+          {
+            if(itr->isDirectory())
+            {
+              vTodo.push_back(itr->open());
+              continue;
+            }
+            ArchiveDiffFile oFile;
+            oFile.sPath = pDirectory->getPath() + itr->name();
+            oFile.iLength = itr->size().iLower;
+            vFiles.push_back(oFile);
+          }
+        }
+        CATCH_THROW_SIMPLE(delete pDirectory, L"Cannot list directory");
+        delete pDirectory;
+      }
+    }
+  }
+  catch(RainException *pE)
+  {
+    for(std::vector<IDirectory*>::iterator itr = vTodo.begin(); itr != vTodo.end(); ++itr)
+      delete *itr;
+    throw;
+  }
+  std::sort(vFiles.begin(), vFiles.end(), ArchiveDiffFileOrder);
+}
+
+void IArchiveFileStore::diff(IArchiveFileStore* pOld, IArchiveFileStore* pNew, archive_diff_report_t& oReport) throw(...)
+{
+  oReport.clear();
+  unsigned long iStartTime = RainGetTickCount();
+
+  std::vector<ArchiveDiffFile> vOld, vNew;
+  try
+  {
+    ListArchiveFiles(pOld, vOld);
+  }
+  CATCH_THROW_SIMPLE({}, L"Cannot list the files of the old archive");
+  try
+  {
+    ListArchiveFiles(pNew, vNew);
+  }
+  CATCH_THROW_SIMPLE({}, L"Cannot list the files of the new archive");
+
+  // Both lists are sorted, so a single merge pass matches up the paths. Files whose lengths differ
+  // are modified without any of their data needing to be read.
+  std::vector<std::pair<size_t, size_t> > vMatched;
+  for(size_t iOld = 0, iNew = 0; iOld < vOld.size() || iNew < vNew.size();)
+  {
+    int iOrder;
+    if(iOld == vOld.size())
+      iOrder = 1;
+    else if(iNew == vNew.size())
+      iOrder = -1;
+    else
+      iOrder = vOld[iOld].sPath.compareCaseless(vNew[iNew].sPath);
+
+    if(iOrder < 0)
+      oReport.vRemoved.push_back(vOld[iOld++].sPath);
+    else if(iOrder > 0)
+      oReport.vAdded.push_back(vNew[iNew++].sPath);
+    else
+    {
+      if(vOld[iOld].iLength != vNew[iNew].iLength)
+        oReport.vModified.push_back(vNew[iNew].sPath);
+      else
+        vMatched.push_back(std::make_pair(iOld, iNew));
+      ++iOld, ++iNew;
+    }
+  }
+
+  std::vector<_batch_item_t> vOldItems(vMatched.size());
+  std::vector<_batch_item_t> vNewItems(vMatched.size());
+  for(size_t i = 0; i < vMatched.size(); ++i)
+  {
+    vOldItems[i].iRequest = i;
+    vNewItems[i].iRequest = i;
+    try
+    {
+      pOld->_getBatchItem(vOld[vMatched[i].first].sPath, vOldItems[i]);
+      pNew->_getBatchItem(vNew[vMatched[i].second].sPath, vNewItems[i]);
+    }
+    CATCH_THROW_SIMPLE_({}, L"Cannot locate the data of '%s'", vNew[vMatched[i].second].sPath.getCharacters());
+  }
+  std::sort(vNewItems.begin(), vNewItems.end(), _batchItemLess);
+
+  std::vector<char> vOldData, vNewData;
+  for(std::vector<_batch_item_t>::const_iterator itr = vNewItems.begin(); itr != vNewItems.end(); ++itr)
+  {
+    const _batch_item_t& oNewItem = *itr;
+    const _batch_item_t& oOldItem = vOldItems[oNewItem.iRequest];
+    const RainString& sOldPath = vOld[vMatched[oNewItem.iRequest].first].sPath;
+    const RainString& sNewPath = vNew[vMatched[oNewItem.iRequest].second].sPath;
+    bool bSame = false;
+    try
+    {
+      ++oReport.iFilesCompared;
+      if(oOldItem.iLength == oNewItem.iLength)
+      {
+        if(vOldData.size() < oOldItem.iLength)
+        {
+          vOldData.resize(oOldItem.iLength);
+          vNewData.resize(oOldItem.iLength);
+        }
+        if(oOldItem.iLength == 0)
+          bSame = true;
+        else
+        {
+          if(pOld->_readBatchData(oOldItem.iPosition, &vOldData[0], oOldItem.iLength) != oOldItem.iLength
+          || pNew->_readBatchData(oNewItem.iPosition, &vNewData[0], oNewItem.iLength) != oNewItem.iLength)
+            THROW_SIMPLE(L"Unexpected end of archive");
+          oReport.iBytesRead += oOldItem.iLength + oNewItem.iLength;
+          bSame = memcmp(&vOldData[0], &vNewData[0], oOldItem.iLength) == 0;
+        }
+      }
+      if(!bSame)
+      {
+        // The same contents can be compressed in different ways, so the contents themselves are compared
+        size_t iLength = vNew[vMatched[oNewItem.iRequest].second].iLength;
+        ++oReport.iFilesInflated;
+        if(vOldData.size() < iLength)
+        {
+          vOldData.resize(iLength);
+          vNewData.resize(iLength);
+        }
+        if(iLength != 0)
+        {
+          pOld->readFileInto(sOldPath, &vOldData[0], iLength);
+          pNew->readFileInto(sNewPath, &vNewData[0], iLength);
+        }
+        // The raw data is read again to be decompressed, but it is the decompressed contents which are delivered
+        oReport.iBytesRead += oOldItem.iLength + oNewItem.iLength;
+        oReport.iBytesInflated += static_cast<unsigned long long>(iLength) * 2;
+        bSame = iLength == 0 || memcmp(&vOldData[0], &vNewData[0], iLength) == 0;
+      }
+    }
+    CATCH_THROW_SIMPLE_({}, L"Cannot compare '%s'", sNewPath.getCharacters());
+    if(!bSame)
+      oReport.vModified.push_back(sNewPath);
+  }
+
+  std::sort(oReport.vModified.begin(), oReport.vModified.end(), CaselessOrder);
+  oReport.iMillisecondsElapsed = RainGetTickCount() - iStartTime;
+}
+
 void IArchiveFileStore::deleteFile(const RainString& sPath) throw(...)
 {
   THROW_SIMPLE_(L"Files cannot be deleted from archive files (attempt to delete \'%s\')", sPath.getCharacters());
@@ -136,7 +610,14 @@ SgaArchive::~SgaArchive()
 void SgaArchive::_zeroSelf() throw()
 {
   m_pRawFile = 0;
-  m_bDeleteRawFileLater = false;
+  m_pRawSource = 0;
+  m_pRawFileMutex = 0;
+  m_pMappedData = 0;
+  m_iMappedLength = 0;
+  m_bRawReadAtThreadSafe = false;
+  m_bConcurrentReads = false;
+  m_bPathIndexBuilt = false;
+  m_iUnindexedResolves = 0;
   memset(&m_oFileHeader, 0, sizeof m_oFileHeader);
   m_pEntryPoints = 0;
   m_pDirectories = 0;
@@ -146,16 +627,19 @@ void SgaArchive::_zeroSelf() throw()
   m_iNumDirectoriesLoaded = 0;
   m_iNumFilesLoaded = 0;
   m_sStringBlob = 0;
+  m_iStringBlobLength = 0;
 }
 
 void SgaArchive::_cleanSelf() throw()
 {
-  if(m_bDeleteRawFileLater)
-    delete m_pRawFile;
+  // Files opened from the archive may still hold references to the raw file
+  if(m_pRawSource)
+    m_pRawSource->release();
   delete[] m_pEntryPoints;
   delete[] m_pDirectories;
   delete[] m_pFiles;
   delete[] m_sStringBlob;
+  m_oPathIndex.clear();
 
   _zeroSelf();
 }
@@ -169,10 +653,19 @@ bool SgaArchive::doesFileResemble(IFile* pFile) throw()
 }
 
 void SgaArchive::init(IFile* pSgaFile, bool bTakePointerOwnership) throw(...)
+{
+  _init(pSgaFile, bTakePointerOwnership, 0, 0);
+}
+
+void SgaArchive::_init(IFile* pSgaFile, bool bTakePointerOwnership, const char* pMappedData, size_t iMappedLength) throw(...)
 {
   _cleanSelf();
+  m_pRawSource = archive_raw_source_t::create(pSgaFile, bTakePointerOwnership);
+  m_pRawFileMutex = &archive_raw_source_t::get(m_pRawSource)->oMutex;
   m_pRawFile = pSgaFile;
-  m_bDeleteRawFileLater = bTakePointerOwnership;
+  m_pMappedData = pMappedData;
+  m_iMappedLength = iMappedLength;
+  m_bRawReadAtThreadSafe = pSgaFile->isReadAtThreadSafe();
   
   try
   {
@@ -263,13 +756,13 @@ void SgaArchive::init(IFile* pSgaFile, bool bTakePointerOwnership) throw(...)
       pSgaFile->readOne(iStringsLength);
       CHECK_ALLOCATION(m_sStringBlob = new (std::nothrow) char[iStringsLength]);
       pSgaFile->readArray(m_sStringBlob, iStringsLength);
-
       if(CryptAcquireContext(&hCryptoProvider, NULL, L"Microsoft Enhanced Cryptographic Provider v1.0", PROV_RSA_FULL, CRYPT_VERIFYCONTEXT) == FALSE)
         THROW_SIMPLE(L"Cannot acquire cryptographic context from Windows");
       if(CryptImportKey(hCryptoProvider, pKeyData, iKeyLength, NULL, 0, &hCryptoKey) == FALSE)
         THROW_SIMPLE(L"Cannot import cryptographic key from archive");
       if(CryptDecrypt(hCryptoKey, NULL, TRUE, 0, reinterpret_cast<BYTE*>(m_sStringBlob), &iStringsLength) == FALSE)
         THROW_SIMPLE(L"Could not decrypt archive\'s string table");
+      m_iStringBlobLength = iStringsLength;
     }
     CATCH_THROW_SIMPLE({
       if(hCryptoKey)
@@ -293,11 +786,208 @@ void SgaArchive::init(IFile* pSgaFile, bool bTakePointerOwnership) throw(...)
       size_t iStringsLength = m_oFileHeader.iDataHeaderSize - m_oFileHeader.iStringOffset;
       CHECK_ALLOCATION(m_sStringBlob = new (std::nothrow) char[iStringsLength]);
       pSgaFile->readArray(m_sStringBlob, iStringsLength);
+      m_iStringBlobLength = iStringsLength;
     }
     CATCH_THROW_SIMPLE(_cleanSelf(), L"Cannot load file and directory names");
   }
 }
 
+//! The number of paths which SgaArchive::_resolvePath() resolves by searching before it builds the path index
+static const unsigned long PATH_INDEX_THRESHOLD = 32;
+
+void SgaArchive::_loadEverything() throw(...)
+{
+  if(m_oFileHeader.iEntryPointCount != 0)
+    _loadEntryPointsUpTo(m_oFileHeader.iEntryPointCount - 1);
+  if(m_oFileHeader.iDirectoryCount != 0)
+    _loadDirectoriesUpTo(m_oFileHeader.iDirectoryCount - 1);
+  if(m_oFileHeader.iFileCount != 0)
+    _loadFilesUpTo(m_oFileHeader.iFileCount - 1);
+}
+
+bool SgaArchive::_buildPathIndex() throw(...)
+{
+  _loadEverything();
+
+  // If memory is short, then paths are resolved by searching each directory instead
+  if(!m_oPathIndex.reserve(static_cast<size_t>(m_oFileHeader.iDirectoryCount) + m_oFileHeader.iFileCount))
+    return false;
+
+  // Files are inserted before directories, so that (as with searching) a file is found in preference
+  // to a directory with the same name
+  _path_index_entry_t oEntry;
+  oEntry.bIsFile = true;
+  for(unsigned short int iDirectory = 0; iDirectory < m_oFileHeader.iDirectoryCount; ++iDirectory)
+  {
+    const _directory_info_t& oDirectory = m_pDirectories[iDirectory];
+    RainString sPath = _getDirectoryPath(&oDirectory);
+    unsigned long iDirectoryHash = CRCCaselessHashSimpleAsciiFromUnicode(sPath.getCharacters(), sPath.length());
+    oEntry.iDirectory = iDirectory;
+    for(oEntry.iIndex = oDirectory.iFirstFile; oEntry.iIndex < oDirectory.iLastFile; ++oEntry.iIndex)
+    {
+      const char* sName = m_sStringBlob + m_pFiles[oEntry.iIndex].iName;
+      m_oPathIndex.insert(CRCCaselessHashSimple(sName, strlen(sName), iDirectoryHash), oEntry);
+    }
+  }
+  oEntry.bIsFile = false;
+  for(oEntry.iIndex = 0; oEntry.iIndex < m_oFileHeader.iDirectoryCount; ++oEntry.iIndex)
+  {
+    // Directory paths end with a backslash, which is not part of the key
+    RainString sPath = _getDirectoryPath(m_pDirectories + oEntry.iIndex);
+    oEntry.iDirectory = oEntry.iIndex;
+    m_oPathIndex.insert(CRCCaselessHashSimpleAsciiFromUnicode(sPath.getCharacters(), sPath.length() - 1), oEntry);
+  }
+  m_bPathIndexBuilt = true;
+  return true;
+}
+
+void SgaArchive::initMapped(const RainString& sPath) throw(...)
+{
+  _cleanSelf();
+  MemoryMappedFile *pMapped = CHECK_ALLOCATION(new (std::nothrow) MemoryMappedFile);
+  try
+  {
+    pMapped->map(sPath);
+  }
+  CATCH_THROW_SIMPLE_(delete pMapped, L"Cannot memory map SGA archive \'%s\'", sPath.getCharacters());
+
+  // _init() takes ownership of pMapped, and will clean it up upon failure
+  _init(pMapped, true, pMapped->getBuffer(), pMapped->getSize());
+}
+
+bool SgaArchive::initMappedNoThrow(const RainString& sPath) throw()
+{
+  try
+  {
+    initMapped(sPath);
+  }
+  catch(RainException *pE)
+  {
+    delete pE;
+    return false;
+  }
+  return true;
+}
+
+void SgaArchive::enableConcurrentReads() throw(...)
+{
+  try
+  {
+    // Loading the entire table of contents (and building the path index up front) means that
+    // neither the lazy loaders nor _resolvePath() ever modify anything again. Should there not be
+    // enough memory for the index, then paths are resolved by searching, which only reads the
+    // (fully loaded) table of contents, and so is equally safe.
+    if(!m_bPathIndexBuilt && !_buildPathIndex())
+      m_oPathIndex.clear();
+    _loadEverything();
+  }
+  CATCH_THROW_SIMPLE(m_oPathIndex.clear(), L"Cannot load archive table of contents");
+  m_bConcurrentReads = true;
+}
+
+void SgaArchive::getCaps(file_store_caps_t& oCaps) const throw()
+{
+  IArchiveFileStore::getCaps(oCaps);
+  oCaps.bCanReadConcurrently = m_bConcurrentReads;
+}
+
+size_t SgaArchive::_readRawNoThrow(seek_offset_t iPosition, void* pDestination, size_t iLength) throw()
+{
+  if(m_bRawReadAtThreadSafe)
+    return m_pRawFile->readAtNoThrow(iPosition, pDestination, 1, iLength);
+  RainMutexLock oLock(*m_pRawFileMutex);
+  return m_pRawFile->readAtNoThrow(iPosition, pDestination, 1, iLength);
+}
+
+const unsigned char* SgaArchive::_readTableOfContents(unsigned long iSectionOffset, size_t iFirstRecord, size_t iRecordCount, size_t iRecordSize, std::vector<unsigned char>& vBuffer) throw(...)
+{
+  size_t iPosition = static_cast<size_t>(m_iDataHeaderOffset) + iSectionOffset + iFirstRecord * iRecordSize;
+  size_t iLength = iRecordCount * iRecordSize;
+  if(m_pMappedData != 0)
+  {
+    if(iPosition > m_iMappedLength || iLength > m_iMappedLength - iPosition)
+      THROW_SIMPLE(L"Table of contents extends beyond the end of the archive");
+    return reinterpret_cast<const unsigned char*>(m_pMappedData + iPosition);
+  }
+  vBuffer.resize(iLength ? iLength : 1);
+  if(_readRawNoThrow(static_cast<seek_offset_t>(iPosition), &vBuffer[0], iLength) != iLength)
+    THROW_SIMPLE(L"Table of contents extends beyond the end of the archive");
+  return &vBuffer[0];
+}
+
+const char* SgaArchive::_getMappedData(_file_info_t* pInfo) throw()
+{
+  if(m_pMappedData == 0)
+    return 0;
+  // Careful ordering of the comparisons to avoid overflow on corrupt offsets / lengths
+  size_t iOffset = static_cast<size_t>(m_oFileHeader.iDataOffset);
+  if(iOffset > m_iMappedLength || static_cast<size_t>(pInfo->iDataOffset) > m_iMappedLength - iOffset)
+    return 0;
+  iOffset += static_cast<size_t>(pInfo->iDataOffset);
+  if(static_cast<size_t>(pInfo->iDataLengthCompressed) > m_iMappedLength - iOffset)
+    return 0;
+  return m_pMappedData + iOffset;
+}
+
+IFile* SgaArchive::_openFile(_file_info_t* pInfo) throw(...)
+{
+  if(pInfo->iDataLength == pInfo->iDataLengthCompressed)
+  {
+    const char* pMapped = _getMappedData(pInfo);
+    if(pMapped)
+    {
+      // Zero-copy view onto the mapping, which the file (and any views of it) keep alive
+      MemoryReadFile* pFile = new (std::nothrow) MemoryReadFile(pMapped, pInfo->iDataLength, archive_raw_source_t::addReference(m_pRawSource));
+      if(pFile == 0)
+        m_pRawSource->release();
+      return CHECK_ALLOCATION(pFile);
+    }
+  }
+  else if(pInfo->iDataLength >= InflateReadFile::STREAMING_THRESHOLD)
+  {
+    // Large compressed files are inflated as they are read, so that callers which only look at the start of
+    // the file (e.g. to identify its type) do not pay for decompressing all of it. The file holds a reference
+    // to the raw source, so that it can outlive the archive.
+    InflateReadFile* pFile;
+    const char* pMapped = _getMappedData(pInfo);
+    memory_buffer_owner_t* pRawSource = archive_raw_source_t::addReference(m_pRawSource);
+    if(pMapped)
+      pFile = new (std::nothrow) InflateReadFile(pMapped, pInfo->iDataLengthCompressed, pInfo->iDataLength, pRawSource);
+    else
+    {
+      pFile = new (std::nothrow) InflateReadFile(m_pRawFile, static_cast<seek_offset_t>(m_oFileHeader.iDataOffset + pInfo->iDataOffset),
+        pInfo->iDataLengthCompressed, pInfo->iDataLength, m_bRawReadAtThreadSafe ? 0 : m_pRawFileMutex, false, pRawSource);
+    }
+    if(pFile == 0)
+      pRawSource->release();
+    CHECK_ALLOCATION(pFile);
+    pFile->setTolerateBadChecksum(_hasTruncatedChecksum(pInfo, Z_DATA_ERROR, "incorrect data check"));
+    return pFile;
+  }
+  IFile* pFile = CHECK_ALLOCATION(new (std::nothrow) MemoryWriteFile(pInfo->iDataLength));
+  try
+  {
+    _pumpFile(pInfo, pFile);
+    pFile->seek(0, SR_Start);
+  }
+  CATCH_THROW_SIMPLE(delete pFile, L"Cannot decompress file data");
+  return pFile;
+}
+
+bool SgaArchive::_hasTruncatedChecksum(_file_info_t* pInfo, int iZLibError, const char* sZLibMessage) throw()
+{
+  if(iZLibError != Z_DATA_ERROR || sZLibMessage == 0 || strcmp(sZLibMessage, "incorrect data check") != 0)
+    return false;
+  if(m_oFileHeader.iVersionMajor != 5 || m_oFileHeader.iVersionMinor != 0 || m_oFileHeader.iDataOffset != 198
+    || pInfo != (m_pFiles + m_oFileHeader.iFileCount - 1))
+    return false;
+  // There is a bug in SGA archives produced by early versions of sga4to5.exe, in which the last two bytes of
+  // the last file's data are truncated. If this is the case, then the actual data is still intact, but the
+  // end of the zLib metadata is missing.
+  char aSignature[4];
+  return _readRawNoThrow(192, aSignature, 4) == 4 && memcmp(aSignature, "COR6", 4) == 0;
+}
+
 IFile* SgaArchive::openFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
 {
   if(eMode != FM_Read)
@@ -307,28 +997,39 @@ IFile* SgaArchive::openFile(const RainString& sPath, eFileOpenMode eMode) throw(
   _resolvePath(sPath, &pDirInfo, &pFileInfo, true);
   if(pFileInfo == 0)
     THROW_SIMPLE_(L"Cannot open file \'%s\' as it is a directory", sPath.getCharacters());
-  IFile* pFile = CHECK_ALLOCATION(new (std::nothrow) MemoryWriteFile(pFileInfo->iDataLength));
   try
   {
-    _pumpFile(pFileInfo, pFile);
-    pFile->seek(0, SR_Start);
+    return _openFile(pFileInfo);
   }
-  CATCH_THROW_SIMPLE_(delete pFile, L"Error opening \'%s\' for reading", sPath.getCharacters());
-  return pFile;
+  CATCH_THROW_SIMPLE_({}, L"Error opening \'%s\' for reading", sPath.getCharacters());
 }
 
 void SgaArchive::_pumpFile(_file_info_t* pInfo, IFile* pSink) throw(...)
 {
-  m_pRawFile->seek(m_oFileHeader.iDataOffset + pInfo->iDataOffset, SR_Start);
+  _pumpFile(pInfo, pSink, _getMappedData(pInfo));
+}
+
+void SgaArchive::_pumpFile(_file_info_t* pInfo, IFile* pSink, const char* pMapped) throw(...)
+{
+  // Positional reads are used rather than seek() + read() so that multiple threads can pump at once
+  seek_offset_t iPosition = static_cast<seek_offset_t>(m_oFileHeader.iDataOffset + pInfo->iDataOffset);
 
   if(pInfo->iDataLength == pInfo->iDataLengthCompressed)
   {
+    if(pMapped)
+    {
+      pSink->writeArray(pMapped, pInfo->iDataLength);
+      return;
+    }
     static const size_t BUFFER_SIZE = 8192;
     unsigned char aBuffer[BUFFER_SIZE];
     for(size_t iRemaining = static_cast<size_t>(pInfo->iDataLength); iRemaining != 0;)
     {
-      size_t iNumBytes = m_pRawFile->readArrayNoThrow(aBuffer, min(BUFFER_SIZE, iRemaining));
+      size_t iNumBytes = _readRawNoThrow(iPosition, aBuffer, min(BUFFER_SIZE, iRemaining));
+      if(iNumBytes == 0)
+        THROW_SIMPLE(L"Unexpected end of archive");
       pSink->writeArray(aBuffer, iNumBytes);
+      iPosition += static_cast<seek_offset_t>(iNumBytes);
       iRemaining -= iNumBytes;
     }
   }
@@ -351,11 +1052,21 @@ void SgaArchive::_pumpFile(_file_info_t* pInfo, IFile* pSink) throw(...)
     z_stream stream;
     int err;
 
-    iNumBytes = m_pRawFile->readArrayNoThrow(aBufferComp, min(BUFFER_SIZE, iRemaining));
-    iRemaining -= iNumBytes;
-
-    stream.next_in = (Bytef*)aBufferComp;
-    stream.avail_in = (uInt)iNumBytes;
+    if(pMapped)
+    {
+      // The entire compressed stream is available in memory, so it can be given to zLib in one go
+      stream.next_in = (Bytef*)pMapped;
+      stream.avail_in = (uInt)iRemaining;
+      iRemaining = 0;
+    }
+    else
+    {
+      iNumBytes = _readRawNoThrow(iPosition, aBufferComp, min(BUFFER_SIZE, iRemaining));
+      iPosition += static_cast<seek_offset_t>(iNumBytes);
+      iRemaining -= iNumBytes;
+      stream.next_in = (Bytef*)aBufferComp;
+      stream.avail_in = (uInt)iNumBytes;
+    }
     stream.next_out = (Bytef*)aBufferInft;
     stream.avail_out = (uInt)BUFFER_SIZE;
     stream.zalloc = (alloc_func)0;
@@ -381,9 +1092,10 @@ void SgaArchive::_pumpFile(_file_info_t* pInfo, IFile* pSink) throw(...)
             break;
 
           case Z_OK:
-            if(stream.avail_in == 0)
+            if(stream.avail_in == 0 && iRemaining != 0)
             {
-              iNumBytes = m_pRawFile->readArrayNoThrow(aBufferComp, min(BUFFER_SIZE, iRemaining));
+              iNumBytes = _readRawNoThrow(iPosition, aBufferComp, min(BUFFER_SIZE, iRemaining));
+              iPosition += static_cast<seek_offset_t>(iNumBytes);
               iRemaining -= iNumBytes;
               stream.next_in = (Bytef*)aBufferComp;
               stream.avail_in = (uInt)iNumBytes;
@@ -397,20 +1109,8 @@ void SgaArchive::_pumpFile(_file_info_t* pInfo, IFile* pSink) throw(...)
             break;
 
           default:
-            if(stream.total_out == pInfo->iDataLength && stream.msg && strcmp(stream.msg, "incorrect data check") == 0
-              && m_oFileHeader.iVersionMajor == 5 && m_oFileHeader.iVersionMinor == 0 && m_oFileHeader.iDataOffset == 198
-              && pInfo == (m_pFiles + m_oFileHeader.iFileCount - 1))
-            {
-              // There is a bug in SGA archives produced by early versions of sga4to5.exe, in which the last two bytes of
-              // the last file's data are truncated. If this is the case, then the actual data is still intact, but the
-              // end of the zLib metadata is missing.
-              m_pRawFile->seek(192, SR_Start);
-              m_pRawFile->readArrayNoThrow(aBufferComp, 4);
-              if(memcmp(aBufferComp, "COR6", 4) == 0)
-              {
-                break;
-              }
-            }
+            if(stream.total_out == pInfo->iDataLength && _hasTruncatedChecksum(pInfo, err, stream.msg))
+              break;
             THROW_SIMPLE_(L"Cannot decompress file; %s (%S)", Z_ERR[-err-1], stream.msg ? stream.msg : "?");
             break;
           }
@@ -448,29 +1148,295 @@ void SgaArchive::pumpFile(const RainString& sPath, IFile* pSink) throw(...)
   CATCH_THROW_SIMPLE_({}, L"Cannot pump file \'%s\'", sPath.getCharacters());
 }
 
+//! Reads a file sequentially on a background thread, so that reading the next buffer overlaps with processing the current one
+class ArchiveReadAheadThread : public RainThread
+{
+public:
+  ArchiveReadAheadThread(IFile* pFile, RainMutex* pMutex, seek_offset_t iPosition, char* pBuffers, size_t iBufferSize) throw(...)
+    : m_oEmpty(2), m_oFilled(2), m_pFile(pFile), m_pMutex(pMutex), m_iPosition(iPosition), m_pBuffers(pBuffers), m_iBufferSize(iBufferSize)
+  {
+    m_oEmpty.push(0);
+    m_oEmpty.push(1);
+  }
+
+  virtual void run() throw()
+  {
+    while(true)
+    {
+      size_t iIndex = m_oEmpty.pop();
+      size_t iLength;
+      if(m_pMutex)
+      {
+        RainMutexLock oLock(*m_pMutex);
+        iLength = m_pFile->readAtNoThrow(m_iPosition, m_pBuffers + iIndex * m_iBufferSize, 1, m_iBufferSize);
+      }
+      else
+        iLength = m_pFile->readAtNoThrow(m_iPosition, m_pBuffers + iIndex * m_iBufferSize, 1, m_iBufferSize);
+      m_iPosition += static_cast<seek_offset_t>(iLength);
+      m_aLengths[iIndex] = iLength;
+      m_oFilled.push(iIndex);
+      if(iLength < m_iBufferSize)
+        break;
+    }
+  }
+
+  //! Wait for the next buffer of data; a length less than the buffer size means that the end of the file was reached
+  size_t next(const char*& pData) throw()
+  {
+    m_iCurrent = m_oFilled.pop();
+    pData = m_pBuffers + m_iCurrent * m_iBufferSize;
+    return m_aLengths[m_iCurrent];
+  }
+
+  //! Hand the buffer from next() back to the reading thread
+  void release() throw()
+  {
+    m_oEmpty.push(m_iCurrent);
+  }
+
+protected:
+  RainBoundedQueue<size_t> m_oEmpty;
+  RainBoundedQueue<size_t> m_oFilled;
+  IFile* m_pFile;
+  RainMutex* m_pMutex;
+  seek_offset_t m_iPosition;
+  char* m_pBuffers;
+  size_t m_iBufferSize;
+  size_t m_aLengths[2];
+  size_t m_iCurrent;
+};
+
+void SgaArchive::_hashContents(unsigned char* pHash, unsigned long long& iBytesRead) throw(...)
+{
+  // The contents hash covers everything after the file header, which is 180 bytes long, plus the
+  // platform field from version 4, plus the offset of the table of contents in version 5
+  size_t iStart = 180;
+  if(m_oFileHeader.iVersionMajor >= 4)
+    iStart += 4;
+  if(m_oFileHeader.iVersionMajor >= 5)
+    iStart += 4;
+
+  MD5Hash oHash;
+  oHash.updateFromString("E01519D6-2DB7-4640-AF54-0A23319C56C3");
+  if(m_pMappedData)
+  {
+    if(iStart < m_iMappedLength)
+    {
+      oHash.update(m_pMappedData + iStart, m_iMappedLength - iStart);
+      iBytesRead += m_iMappedLength - iStart;
+    }
+  }
+  else
+  {
+    static const size_t BUFFER_SIZE = 1 << 20;
+    char* pBuffers = CHECK_ALLOCATION(new (std::nothrow) char[BUFFER_SIZE * 2]);
+    try
+    {
+      ArchiveReadAheadThread oReader(m_pRawFile, m_bRawReadAtThreadSafe ? 0 : m_pRawFileMutex, static_cast<seek_offset_t>(iStart), pBuffers, BUFFER_SIZE);
+      oReader.start();
+      while(true)
+      {
+        const char* pData;
+        size_t iLength = oReader.next(pData);
+        oHash.update(pData, iLength);
+        iBytesRead += iLength;
+        oReader.release();
+        if(iLength < BUFFER_SIZE)
+          break;
+      }
+      oReader.join();
+    }
+    CATCH_THROW_SIMPLE(delete[] pBuffers, L"Cannot read archive contents");
+    delete[] pBuffers;
+  }
+  oHash.finalise(pHash);
+}
+
+void SgaArchive::verify(archive_verify_report_t& oReport, unsigned long iThreadCount) throw(...)
+{
+  unsigned long iStartTime = RainGetTickCount();
+  oReport.clear();
+
+  // The table of contents is small, so it is hashed separately from the pass over the rest of the archive
+  {
+    std::vector<unsigned char> vBuffer;
+    const unsigned char* pDataHeader = _readTableOfContents(0, 0, m_oFileHeader.iDataHeaderSize, 1, vBuffer);
+    unsigned char aHash[16];
+    MD5Hash oHash;
+    oHash.updateFromString("DFC9AF62-FC1B-4180-BC27-11CCE87D3EFF");
+    oHash.update(reinterpret_cast<const char*>(pDataHeader), m_oFileHeader.iDataHeaderSize);
+    oHash.finalise(aHash);
+    oReport.eHeaderHash = memcmp(aHash, m_oFileHeader.iHeaderMD5, 16) == 0 ? archive_verify_report_t::HS_Valid : archive_verify_report_t::HS_Invalid;
+    oReport.iBytesRead += m_oFileHeader.iDataHeaderSize;
+  }
+
+  // Some tools leave the contents hash as zero rather than computing it
+  static const long aZeroHash[4] = {0};
+  if(memcmp(m_oFileHeader.iContentsMD5, aZeroHash, 16) != 0)
+  {
+    unsigned char aHash[16];
+    _hashContents(aHash, oReport.iBytesRead);
+    oReport.eContentsHash = memcmp(aHash, m_oFileHeader.iContentsMD5, 16) == 0 ? archive_verify_report_t::HS_Valid : archive_verify_report_t::HS_Invalid;
+  }
+
+  if(oReport.eContentsHash != archive_verify_report_t::HS_Valid)
+  {
+    _loadEverything();
+    std::vector<_verify_item_t> vItems;
+    for(unsigned short int iDirectory = 0; iDirectory < m_oFileHeader.iDirectoryCount; ++iDirectory)
+    {
+      const _directory_info_t* pDirectory = m_pDirectories + iDirectory;
+      RainString sDirectoryPath;
+      for(unsigned short int iFile = pDirectory->iFirstFile; iFile < pDirectory->iLastFile; ++iFile)
+      {
+        _file_info_t* pFile = m_pFiles + iFile;
+        if(pFile->iDataLength == pFile->iDataLengthCompressed)
+          continue;
+        if(sDirectoryPath.isEmpty())
+          sDirectoryPath = _getDirectoryPath(pDirectory);
+        _verify_item_t oItem;
+        oItem.pFile = pFile;
+        oItem.sPath = sDirectoryPath + RainString(_getName(*pFile));
+        oItem.iOrder = pFile->iDataOffset;
+        vItems.push_back(oItem);
+      }
+    }
+    _verifyFiles(vItems, oReport, iThreadCount);
+  }
+
+  oReport.iMillisecondsElapsed = RainGetTickCount() - iStartTime;
+}
+
+bool SgaArchive::_verifyFile(void* pFile, RainString& sReason) throw()
+{
+  _file_info_t* pInfo = reinterpret_cast<_file_info_t*>(pFile);
+  char* pBuffer = 0;
+  try
+  {
+    // Inflating the whole file checks the adler32 checksum at the end of its zLib stream
+    CHECK_ALLOCATION(pBuffer = new (std::nothrow) char[pInfo->iDataLength ? pInfo->iDataLength : 1]);
+    _readFileInto(pInfo, pBuffer);
+  }
+  catch(RainException *pE)
+  {
+    delete[] pBuffer;
+    sReason = _describeVerifyException(pE);
+    return false;
+  }
+  delete[] pBuffer;
+  return true;
+}
+
+void SgaArchive::_getBatchItem(const RainString& sPath, _batch_item_t& oItem) throw(...)
+{
+  _directory_info_t* pDirInfo = 0;
+  _file_info_t* pFileInfo = 0;
+  _resolvePath(sPath, &pDirInfo, &pFileInfo, true);
+  if(pFileInfo == 0)
+    THROW_SIMPLE(L"Cannot pump a directory");
+  oItem.iPosition = static_cast<seek_offset_t>(m_oFileHeader.iDataOffset + pFileInfo->iDataOffset);
+  oItem.iLength = static_cast<size_t>(pFileInfo->iDataLengthCompressed);
+  oItem.pFile = pFileInfo;
+  // Files in a mapped archive are already in memory, so there is nothing to gain from reading them
+  oItem.bNeedsRead = _getMappedData(pFileInfo) == 0;
+}
+
+void SgaArchive::_pumpBatchItem(const _batch_item_t& oItem, IFile* pSink, const char* pRawData) throw(...)
+{
+  _file_info_t* pFileInfo = reinterpret_cast<_file_info_t*>(oItem.pFile);
+  _pumpFile(pFileInfo, pSink, pRawData ? pRawData : _getMappedData(pFileInfo));
+}
+
+size_t SgaArchive::_readBatchData(seek_offset_t iPosition, void* pDestination, size_t iLength) throw()
+{
+  return _readRawNoThrow(iPosition, pDestination, iLength);
+}
+
+void SgaArchive::_getRawDetails(const _batch_item_t& oItem, archive_raw_details_t& oDetails) throw()
+{
+  const _file_info_t* pFileInfo = reinterpret_cast<const _file_info_t*>(oItem.pFile);
+  oDetails.iLength = pFileInfo->iDataLength;
+  oDetails.iLengthCompressed = pFileInfo->iDataLengthCompressed;
+  oDetails.iModificationTime = pFileInfo->iModificationTime;
+  oDetails.bCompressed = pFileInfo->iDataLength != pFileInfo->iDataLengthCompressed;
+}
+
+size_t SgaArchive::readFileInto(const RainString& sPath, void* pBuffer, size_t iBufferSize) throw(...)
+{
+  _directory_info_t* pDirInfo = 0;
+  _file_info_t* pFileInfo = 0;
+  try
+  {
+    _resolvePath(sPath, &pDirInfo, &pFileInfo, true);
+    if(pFileInfo == 0)
+      THROW_SIMPLE(L"Cannot read a directory");
+    if(pFileInfo->iDataLength > iBufferSize)
+      THROW_SIMPLE_(L"File is %lu bytes, but the buffer is only %lu bytes", pFileInfo->iDataLength, static_cast<unsigned long>(iBufferSize));
+
+    _readFileInto(pFileInfo, pBuffer);
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot read file \'%s\'", sPath.getCharacters());
+  return pFileInfo->iDataLength;
+}
+
+void SgaArchive::_readFileInto(_file_info_t* pInfo, void* pBuffer) throw(...)
+{
+  const char* pMapped = _getMappedData(pInfo);
+  seek_offset_t iPosition = static_cast<seek_offset_t>(m_oFileHeader.iDataOffset + pInfo->iDataOffset);
+  size_t iLength = static_cast<size_t>(pInfo->iDataLength);
+  size_t iLengthCompressed = static_cast<size_t>(pInfo->iDataLengthCompressed);
+
+  if(iLength == iLengthCompressed)
+  {
+    if(pMapped)
+      memcpy(pBuffer, pMapped, iLength);
+    else if(_readRawNoThrow(iPosition, pBuffer, iLength) != iLength)
+      THROW_SIMPLE(L"Unexpected end of archive");
+    return;
+  }
+
+  if(_hasTruncatedChecksum(pInfo, Z_DATA_ERROR, "incorrect data check"))
+  {
+    // A one-shot inflate would reject the damaged stream, so inflate it in chunks (still straight into the buffer)
+    InflateReadFile oFile(m_pRawFile, iPosition, iLengthCompressed, iLength, m_bRawReadAtThreadSafe ? 0 : m_pRawFileMutex);
+    oFile.setTolerateBadChecksum(true);
+    oFile.read(pBuffer, 1, iLength);
+    return;
+  }
+
+  if(pMapped)
+  {
+    RainInflateInto(pMapped, iLengthCompressed, pBuffer, iLength);
+    return;
+  }
+  char* pCompressed = CHECK_ALLOCATION(new (std::nothrow) char[iLengthCompressed ? iLengthCompressed : 1]);
+  try
+  {
+    if(_readRawNoThrow(iPosition, pCompressed, iLengthCompressed) != iLengthCompressed)
+      THROW_SIMPLE(L"Unexpected end of archive");
+    RainInflateInto(pCompressed, iLengthCompressed, pBuffer, iLength);
+  }
+  CATCH_THROW_SIMPLE(delete[] pCompressed, L"Cannot decompress file data");
+  delete[] pCompressed;
+}
+
 IFile* SgaArchive::openFileNoThrow(const RainString& sPath, eFileOpenMode eMode) throw()
 {
   if(eMode != FM_Read)
     return 0;
   _directory_info_t* pDirInfo = 0;
   _file_info_t* pFileInfo = 0;
-  if(!_resolvePath(sPath, &pDirInfo, &pFileInfo, false))
-    return 0;
-  IFile* pFile = new (std::nothrow) MemoryWriteFile(pFileInfo->iDataLength);
-  if(!pFile)
+  if(!_resolvePath(sPath, &pDirInfo, &pFileInfo, false) || pFileInfo == 0)
     return 0;
   try
   {
-    _pumpFile(pFileInfo, pFile);
-    pFile->seek(0, SR_Start);
+    return _openFile(pFileInfo);
   }
   catch(RainException *pE)
   {
     delete pE;
-    delete pFile;
     return 0;
   }
-  return pFile;
 }
 
 bool SgaArchive::doesFileExist(const RainString& sPath) throw()
@@ -481,11 +1447,40 @@ bool SgaArchive::doesFileExist(const RainString& sPath) throw()
   return pFileInfo != 0;
 }
 
+bool SgaArchive::getFileStorageOrder(const RainString& sPath, unsigned long& iOrder) throw()
+{
+  _directory_info_t* pDirInfo = 0;
+  _file_info_t* pFileInfo = 0;
+  if(!_resolvePath(sPath, &pDirInfo, &pFileInfo, false) || pFileInfo == 0)
+    return false;
+  iOrder = pFileInfo->iDataOffset;
+  return true;
+}
+
 size_t SgaArchive::getEntryPointCount() throw()
 {
   return m_oFileHeader.iEntryPointCount;
 }
 
+size_t SgaArchive::getMemoryUsage() const throw()
+{
+  size_t iUsage = sizeof(SgaArchive);
+  if(m_pEntryPoints)
+  {
+    iUsage += sizeof(_entry_point_info_t) * m_oFileHeader.iEntryPointCount;
+    for(unsigned short int i = 0; i < m_oFileHeader.iEntryPointCount; ++i)
+      iUsage += m_pEntryPoints[i].sName.getMemoryUsage() + m_pEntryPoints[i].sPath.getMemoryUsage();
+  }
+  if(m_pDirectories)
+    iUsage += sizeof(_directory_info_t) * m_oFileHeader.iDirectoryCount;
+  if(m_pFiles)
+    iUsage += sizeof(_file_info_t) * m_oFileHeader.iFileCount;
+  if(m_sStringBlob)
+    iUsage += m_iStringBlobLength;
+  iUsage += m_oPathIndex.getMemoryUsage();
+  return iUsage;
+}
+
 const RainString& SgaArchive::getEntryPointName(size_t iIndex) throw(...)
 {
   CHECK_RANGE(0, iIndex, getEntryPointCount() - 1);
@@ -496,8 +1491,8 @@ const RainString& SgaArchive::getEntryPointName(size_t iIndex) throw(...)
 class ArchiveDirectoryAdapter : public IDirectory
 {
 public:
-  ArchiveDirectoryAdapter(SgaArchive* pArchive, SgaArchive::_directory_info_t* pDirectory) throw()
-    : m_pArchive(pArchive), m_pDirectory(pDirectory)
+  ArchiveDirectoryAdapter(SgaArchive* pArchive, SgaArchive::_directory_info_t* pDirectory) throw(...)
+    : m_pArchive(pArchive), m_pDirectory(pDirectory), m_sPath(pArchive->_getDirectoryPath(pDirectory))
   {
     m_iCountSubDir = pDirectory->iLastDirectory - pDirectory->iFirstDirectory;
     m_iCountFiles = pDirectory->iLastFile - pDirectory->iFirstFile;
@@ -505,7 +1500,7 @@ public:
 
   virtual const RainString& getPath() throw()
   {
-    return m_pDirectory->sPath;
+    return m_sPath;
   }
 
   virtual IFileStore* getStore() throw()
@@ -527,7 +1522,7 @@ public:
       m_pArchive->_loadDirectoriesUpTo((unsigned short)iItemIndex);
       SgaArchive::_directory_info_t* pInfo = m_pArchive->m_pDirectories + iItemIndex;
       if(oDetails.oFields.name)
-        oDetails.sName = pInfo->sName;
+        oDetails.sName = RainString(m_pArchive->_getName(*pInfo));
       if(oDetails.oFields.dir)
         oDetails.bIsDirectory = true;
       if(oDetails.oFields.size)
@@ -577,18 +1572,19 @@ public:
     try
     {
       m_pArchive->_loadDirectoriesUpTo((unsigned short)iIndex);
+      return new (std::nothrow) ArchiveDirectoryAdapter(m_pArchive, m_pArchive->m_pDirectories + iIndex);
     }
     catch(RainException *pE)
     {
       delete pE;
       return 0;
     }
-    return new (std::nothrow) ArchiveDirectoryAdapter(m_pArchive, m_pArchive->m_pDirectories + iIndex);
   }
 
 protected:
   SgaArchive *m_pArchive;
   SgaArchive::_directory_info_t *m_pDirectory;
+  RainString m_sPath;
   size_t m_iCountSubDir;
   size_t m_iCountFiles;
 };
@@ -609,7 +1605,15 @@ IDirectory* SgaArchive::openDirectoryNoThrow(const RainString& sPath) throw()
   _file_info_t* pFileInfo;
   if(!_resolvePath(sPath, &pDirectoryInfo, &pFileInfo, false) || pDirectoryInfo == 0)
     return 0;
-  return new (std::nothrow) ArchiveDirectoryAdapter(this, pDirectoryInfo);
+  try
+  {
+    return new (std::nothrow) ArchiveDirectoryAdapter(this, pDirectoryInfo);
+  }
+  catch(RainException *pE)
+  {
+    delete pE;
+    return 0;
+  }
 }
 
 bool SgaArchive::doesDirectoryExist(const RainString& sPath) throw()
@@ -620,13 +1624,26 @@ bool SgaArchive::doesDirectoryExist(const RainString& sPath) throw()
   return pDirInfo != 0;
 }
 
+//! Decode a little endian 16 bit integer from a table of contents record
+static inline unsigned short int DecodeU16(const unsigned char* p) throw()
+{
+  return static_cast<unsigned short int>(p[0] | (p[1] << 8));
+}
+
+//! Decode a little endian 32 bit integer from a table of contents record
+static inline unsigned long DecodeU32(const unsigned char* p) throw()
+{
+  return static_cast<unsigned long>(p[0]) | (static_cast<unsigned long>(p[1]) << 8)
+    | (static_cast<unsigned long>(p[2]) << 16) | (static_cast<unsigned long>(p[3]) << 24);
+}
+
 void SgaArchive::_loadEntryPointsUpTo(unsigned short int iEnsureLoaded) throw(...)
 {
   unsigned short int iFirstToLoad = m_iNumEntryPointsLoaded + 1;
   if(m_pEntryPoints == 0)
   {
     iFirstToLoad = 0;
-    CHECK_ALLOCATION(m_pEntryPoints = new _directory_info_t[getEntryPointCount()]);
+    CHECK_ALLOCATION(m_pEntryPoints = new _entry_point_info_t[getEntryPointCount()]);
   }
   if(iFirstToLoad <= iEnsureLoaded)
   {
@@ -637,57 +1654,60 @@ void SgaArchive::_loadEntryPointsUpTo(unsigned short int iEnsureLoaded) throw(..
       if((m_oFileHeader.iVersionMajor == 4 && m_oFileHeader.iVersionMinor == 1)
       || (m_oFileHeader.iVersionMajor == 5))
       {
+        // The folder offset at the end of the record is 16 bits rather than 32 bits
         iEntryPointSize = 138;
       }
-      m_pRawFile->seek(m_iDataHeaderOffset + m_oFileHeader.iEntryPointOffset + static_cast<unsigned long>(iFirstToLoad) * iEntryPointSize, SR_Start);
-      for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; m_iNumEntryPointsLoaded = iToLoad++)
+      std::vector<unsigned char> vBuffer;
+      const unsigned char* pRaw = _readTableOfContents(m_oFileHeader.iEntryPointOffset, iFirstToLoad, iEnsureLoaded - iFirstToLoad + 1, iEntryPointSize, vBuffer);
+      // name[64], alias[64], first directory, last directory, first file, last file, folder offset
+      for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; ++iToLoad, pRaw += iEntryPointSize)
       {
-        _entry_point_raw_t oRaw;
-        m_pRawFile->readArray(oRaw.sDirectoryName, 64);
-        m_pRawFile->readArray(oRaw.sAlias, 64);
-        m_pRawFile->readOne(oRaw.iFirstDirectory);
-        m_pRawFile->readOne(oRaw.iLastDirectory);
-        m_pRawFile->readOne(oRaw.iFirstFile);
-        m_pRawFile->readOne(oRaw.iLastFile);
-        if((m_oFileHeader.iVersionMajor == 4 && m_oFileHeader.iVersionMinor == 1)
-        || (m_oFileHeader.iVersionMajor == 5) )
-        {
-          unsigned short iFolderOffset;
-          m_pRawFile->readOne(iFolderOffset);
-          oRaw.iFolderOffset = iFolderOffset;
-        }
-        else
-        {
-          m_pRawFile->readOne(oRaw.iFolderOffset);
-        }
-
-        m_pEntryPoints[iToLoad].sName = oRaw.sDirectoryName;
+        // Names are padded with zeros to 64 characters, but are not terminated if they use all 64
+        const char* sName = reinterpret_cast<const char*>(pRaw);
+        const char* sNameEnd = reinterpret_cast<const char*>(memchr(sName, 0, 64));
+        m_pEntryPoints[iToLoad].sName = RainString(sName, sNameEnd ? sNameEnd - sName : 64);
         m_pEntryPoints[iToLoad].sPath = m_pEntryPoints[iToLoad].sName + L"\\";
-        m_pEntryPoints[iToLoad].iFirstDirectory = oRaw.iFirstDirectory;
-        m_pEntryPoints[iToLoad].iLastDirectory = oRaw.iLastDirectory;
-        m_pEntryPoints[iToLoad].iFirstFile = oRaw.iFirstFile;
-        m_pEntryPoints[iToLoad].iLastFile = oRaw.iLastFile;
-
-        _loadDirectoriesUpTo(oRaw.iFirstDirectory);
+        m_pEntryPoints[iToLoad].iFirstDirectory = DecodeU16(pRaw + 128);
+        m_pEntryPoints[iToLoad].iLastDirectory = DecodeU16(pRaw + 130);
+        m_pEntryPoints[iToLoad].iFirstFile = DecodeU16(pRaw + 132);
+        m_pEntryPoints[iToLoad].iLastFile = DecodeU16(pRaw + 134);
       }
+      m_iNumEntryPointsLoaded = iEnsureLoaded;
+
+      // Loading directories requires entry points, so is done after all of the above entry points are loaded
+      for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; ++iToLoad)
+        _loadDirectoriesUpTo(m_pEntryPoints[iToLoad].iFirstDirectory);
     }
     CATCH_THROW_SIMPLE({}, L"Unable to load entry point details")
   }
 }
 
-const RainString& SgaArchive::_getDirectoryEntryPoint(_directory_info_t* pDirectory) throw()
+unsigned short int SgaArchive::_getDirectoryEntryPoint(unsigned short int iDirectory) throw(...)
 {
+  if(m_oFileHeader.iEntryPointCount == 0)
+    THROW_SIMPLE_(L"Directory #%u does not belong to any entry point", static_cast<unsigned int>(iDirectory));
   _loadEntryPointsUpTo(m_oFileHeader.iEntryPointCount - 1);
   if(m_oFileHeader.iEntryPointCount != 1)
   {
-    unsigned short int iIndex = (unsigned short)(pDirectory - m_pDirectories);
     for(unsigned short int iEntryPoint = 0; iEntryPoint < m_oFileHeader.iEntryPointCount; ++iEntryPoint)
     {
-      if(m_pEntryPoints[iEntryPoint].iFirstDirectory <= iIndex && iIndex < m_pEntryPoints[iEntryPoint].iLastDirectory)
-        return m_pEntryPoints[iEntryPoint].sPath;
+      if(m_pEntryPoints[iEntryPoint].iFirstDirectory <= iDirectory && iDirectory < m_pEntryPoints[iEntryPoint].iLastDirectory)
+        return iEntryPoint;
     }
   }
-  return m_pEntryPoints->sPath;
+  return 0;
+}
+
+RainString SgaArchive::_getDirectoryPath(const _directory_info_t* pDirectory) throw(...)
+{
+  const char* sRelativePath = m_sStringBlob + pDirectory->iPath;
+  RainString sPath = m_pEntryPoints[pDirectory->iEntryPoint].sPath;
+  if(*sRelativePath != 0)
+  {
+    sPath += sRelativePath;
+    sPath += L"\\";
+  }
+  return sPath;
 }
 
 void SgaArchive::_loadDirectoriesUpTo(unsigned short int iEnsureLoaded) throw(...)
@@ -703,32 +1723,22 @@ void SgaArchive::_loadDirectoriesUpTo(unsigned short int iEnsureLoaded) throw(..
     CHECK_RANGE_LTMAX(0, iEnsureLoaded, m_oFileHeader.iDirectoryCount);
     try
     {
-      m_pRawFile->seek(m_iDataHeaderOffset + m_oFileHeader.iDirectoryOffset + iFirstToLoad * 12, SR_Start);
-      for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; m_iNumDirectoriesLoaded = iToLoad++)
+      std::vector<unsigned char> vBuffer;
+      const unsigned char* pRaw = _readTableOfContents(m_oFileHeader.iDirectoryOffset, iFirstToLoad, iEnsureLoaded - iFirstToLoad + 1, 12, vBuffer);
+      // name offset, first directory, last directory, first file, last file
+      for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; m_iNumDirectoriesLoaded = iToLoad++, pRaw += 12)
       {
-        _directory_raw_t oRaw;
-        m_pRawFile->readOne(oRaw.iNameOffset);
-        m_pRawFile->readOne(oRaw.iFirstDirectory);
-        m_pRawFile->readOne(oRaw.iLastDirectory);
-        m_pRawFile->readOne(oRaw.iFirstFile);
-        m_pRawFile->readOne(oRaw.iLastFile);
-
-        m_pDirectories[iToLoad].sPath = RainString(m_sStringBlob + oRaw.iNameOffset);
-        if(m_pDirectories[iToLoad].sPath.isEmpty())
-        {
-          m_pDirectories[iToLoad].sPath = _getDirectoryEntryPoint(m_pDirectories + iToLoad);
-          m_pDirectories[iToLoad].sName = m_pDirectories[iToLoad].sPath.beforeLast('\\');
-        }
-        else
-        {
-          m_pDirectories[iToLoad].sPath = _getDirectoryEntryPoint(m_pDirectories + iToLoad) + m_pDirectories[iToLoad].sPath;
-          m_pDirectories[iToLoad].sName = m_pDirectories[iToLoad].sPath.afterLast('\\');
-          m_pDirectories[iToLoad].sPath += L"\\";
-        }
-        m_pDirectories[iToLoad].iFirstDirectory = oRaw.iFirstDirectory;
-        m_pDirectories[iToLoad].iLastDirectory = oRaw.iLastDirectory;
-        m_pDirectories[iToLoad].iFirstFile = oRaw.iFirstFile;
-        m_pDirectories[iToLoad].iLastFile = oRaw.iLastFile;
+        _directory_info_t& oDirectory = m_pDirectories[iToLoad];
+        oDirectory.iPath = DecodeU32(pRaw);
+        if(oDirectory.iPath >= m_iStringBlobLength)
+          THROW_SIMPLE_(L"Name of directory #%u lies outside of the string block", static_cast<unsigned int>(iToLoad));
+        const char* sName = strrchr(m_sStringBlob + oDirectory.iPath, '\\');
+        oDirectory.iName = sName ? static_cast<unsigned long>(sName + 1 - m_sStringBlob) : oDirectory.iPath;
+        oDirectory.iEntryPoint = _getDirectoryEntryPoint(iToLoad);
+        oDirectory.iFirstDirectory = DecodeU16(pRaw + 4);
+        oDirectory.iLastDirectory = DecodeU16(pRaw + 6);
+        oDirectory.iFirstFile = DecodeU16(pRaw + 8);
+        oDirectory.iLastFile = DecodeU16(pRaw + 10);
       }
     }
     CATCH_THROW_SIMPLE({}, L"Unable to load directory details")
@@ -739,20 +1749,15 @@ void SgaArchive::_loadFilesUpTo_v2(unsigned short int iFirstToLoad, unsigned sho
 {
   try
   {
-    m_pRawFile->seek(m_iDataHeaderOffset + m_oFileHeader.iFileOffset + iFirstToLoad * 20, SR_Start);
-    for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; m_iNumFilesLoaded = iToLoad++)
+    // name offset, flags, data offset, compressed length, length
+    std::vector<unsigned char> vBuffer;
+    const unsigned char* pRaw = _readTableOfContents(m_oFileHeader.iFileOffset, iFirstToLoad, iEnsureLoaded - iFirstToLoad + 1, 20, vBuffer);
+    for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; m_iNumFilesLoaded = iToLoad++, pRaw += 20)
     {
-      _file_raw_t oRaw;
-      m_pRawFile->readOne(oRaw.iNameOffset);
-      m_pRawFile->readOne(oRaw.iFlags32);
-      m_pRawFile->readOne(oRaw.iDataOffset);
-      m_pRawFile->readOne(oRaw.iDataLengthCompressed);
-      m_pRawFile->readOne(oRaw.iDataLength);
-
-      m_pFiles[iToLoad].iName = oRaw.iNameOffset; //RainString(m_sStringBlob + oRaw.iNameOffset);
-      m_pFiles[iToLoad].iDataOffset = oRaw.iDataOffset;
-      m_pFiles[iToLoad].iDataLength = oRaw.iDataLength;
-      m_pFiles[iToLoad].iDataLengthCompressed = oRaw.iDataLengthCompressed;
+      m_pFiles[iToLoad].iName = DecodeU32(pRaw);
+      m_pFiles[iToLoad].iDataOffset = DecodeU32(pRaw + 8);
+      m_pFiles[iToLoad].iDataLengthCompressed = DecodeU32(pRaw + 12);
+      m_pFiles[iToLoad].iDataLength = DecodeU32(pRaw + 16);
       m_pFiles[iToLoad].iModificationTime = 0;
     }
   }
@@ -763,22 +1768,16 @@ void SgaArchive::_loadFilesUpTo_v4(unsigned short int iFirstToLoad, unsigned sho
 {
   try
   {
-    m_pRawFile->seek(m_iDataHeaderOffset + m_oFileHeader.iFileOffset + iFirstToLoad * 22, SR_Start);
-    for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; m_iNumFilesLoaded = iToLoad++)
+    // name offset, data offset, compressed length, length, modification time, flags
+    std::vector<unsigned char> vBuffer;
+    const unsigned char* pRaw = _readTableOfContents(m_oFileHeader.iFileOffset, iFirstToLoad, iEnsureLoaded - iFirstToLoad + 1, 22, vBuffer);
+    for(unsigned short int iToLoad = iFirstToLoad; iToLoad <= iEnsureLoaded; m_iNumFilesLoaded = iToLoad++, pRaw += 22)
     {
-      _file_raw_t oRaw;
-      m_pRawFile->readOne(oRaw.iNameOffset);
-      m_pRawFile->readOne(oRaw.iDataOffset);
-      m_pRawFile->readOne(oRaw.iDataLengthCompressed);
-      m_pRawFile->readOne(oRaw.iDataLength);
-      m_pRawFile->readOne(oRaw.iModificationTime);
-      m_pRawFile->readOne(oRaw.iFlags16);
-
-      m_pFiles[iToLoad].iName = oRaw.iNameOffset; //RainString(m_sStringBlob + oRaw.iNameOffset);
-      m_pFiles[iToLoad].iDataOffset = oRaw.iDataOffset;
-      m_pFiles[iToLoad].iDataLength = oRaw.iDataLength;
-      m_pFiles[iToLoad].iDataLengthCompressed = oRaw.iDataLengthCompressed;
-      m_pFiles[iToLoad].iModificationTime = oRaw.iModificationTime;
+      m_pFiles[iToLoad].iName = DecodeU32(pRaw);
+      m_pFiles[iToLoad].iDataOffset = DecodeU32(pRaw + 4);
+      m_pFiles[iToLoad].iDataLengthCompressed = DecodeU32(pRaw + 8);
+      m_pFiles[iToLoad].iDataLength = DecodeU32(pRaw + 12);
+      m_pFiles[iToLoad].iModificationTime = DecodeU32(pRaw + 16);
     }
   }
   CATCH_THROW_SIMPLE({}, L"Unable to load file details")
@@ -812,12 +1811,110 @@ void SgaArchive::_loadChildren(_directory_info_t* pInfo, bool bJustDirectories)
     _loadFilesUpTo(pInfo->iLastFile - 1);
 }
 
+//! If a path begins with the given part (compared caselessly), then advance past the part and return true
+template <class T>
+static bool ConsumeCaseless(const RainChar*& pPath, size_t& iPathLength, const T* pPart, size_t iPartLength) throw()
+{
+  if(iPartLength > iPathLength || !RainEqualsCaseless(pPath, pPart, iPartLength))
+    return false;
+  pPath += iPartLength;
+  iPathLength -= iPartLength;
+  return true;
+}
+
+struct SgaArchive::_path_index_matcher_t
+{
+  _path_index_matcher_t(SgaArchive* pArchive, const RainChar* pPath, size_t iLength) throw()
+    : m_pArchive(pArchive), m_pPath(pPath), m_iLength(iLength)
+  {
+  }
+
+  bool operator() (const _path_index_entry_t& oEntry) const throw()
+  {
+    // The path of a directory is [entry point]\[relative path], or just [entry point] for the root of
+    // an entry point, and the path of a file is [path of its directory]\[file name]
+    const _directory_info_t& oDirectory = m_pArchive->m_pDirectories[oEntry.iDirectory];
+    const RainString& sEntryPoint = m_pArchive->m_pEntryPoints[oDirectory.iEntryPoint].sName;
+    const char* sRelativePath = m_pArchive->m_sStringBlob + oDirectory.iPath;
+    const RainChar* pPath = m_pPath;
+    size_t iLength = m_iLength;
+    const char cSeparator = '\\';
+
+    if(!ConsumeCaseless(pPath, iLength, sEntryPoint.getCharacters(), sEntryPoint.length()))
+      return false;
+    if(*sRelativePath != 0)
+    {
+      if(!ConsumeCaseless(pPath, iLength, &cSeparator, 1) || !ConsumeCaseless(pPath, iLength, sRelativePath, strlen(sRelativePath)))
+        return false;
+    }
+    if(oEntry.bIsFile)
+    {
+      const char* sName = m_pArchive->m_sStringBlob + m_pArchive->m_pFiles[oEntry.iIndex].iName;
+      if(!ConsumeCaseless(pPath, iLength, &cSeparator, 1) || !ConsumeCaseless(pPath, iLength, sName, strlen(sName)))
+        return false;
+    }
+    return iLength == 0;
+  }
+
+  SgaArchive* m_pArchive;
+  const RainChar* m_pPath;
+  size_t m_iLength;
+};
+
+bool SgaArchive::_resolvePathIndexed(const RainString& sPath, _directory_info_t** ppDirectory, _file_info_t **ppFile, bool bThrow) throw(...)
+{
+  // A trailing backslash makes no difference to what a path refers to
+  size_t iLength = sPath.length();
+  if(iLength != 0 && sPath.getCharacters()[iLength - 1] == '\\')
+    --iLength;
+
+  const _path_index_entry_t* pEntry = m_oPathIndex.find(CRCCaselessHashSimpleAsciiFromUnicode(sPath.getCharacters(), iLength),
+    _path_index_matcher_t(this, sPath.getCharacters(), iLength));
+  if(pEntry == 0)
+  {
+    if(bThrow)
+      THROW_SIMPLE_(L"Unable to find \'%s\'", sPath.getCharacters());
+    return false;
+  }
+  if(pEntry->bIsFile)
+    *ppFile = m_pFiles + pEntry->iIndex;
+  else
+    *ppDirectory = m_pDirectories + pEntry->iIndex;
+  return true;
+}
+
 bool SgaArchive::_resolvePath(const RainString& sPath, _directory_info_t** ppDirectory, _file_info_t **ppFile, bool bThrow) throw(...)
 {
   // Clear return values
   *ppDirectory = 0;
   *ppFile = 0;
 
+  // Once concurrent reads are enabled, nothing may be modified, so whatever enableConcurrentReads()
+  // decided is final
+  if(!m_bPathIndexBuilt && !m_bConcurrentReads && ++m_iUnindexedResolves == PATH_INDEX_THRESHOLD)
+  {
+    // Enough paths have been resolved to repay loading the whole table of contents and indexing it.
+    // If that fails, then paths carry on being resolved by searching.
+    try
+    {
+      _buildPathIndex();
+    }
+    catch(RainException *pE)
+    {
+      delete pE;
+      m_oPathIndex.clear();
+    }
+  }
+  if(m_bPathIndexBuilt)
+    return _resolvePathIndexed(sPath, ppDirectory, ppFile, bThrow);
+
+  if(m_oFileHeader.iEntryPointCount == 0)
+  {
+    if(bThrow)
+      THROW_SIMPLE_(L"Unable to find \'%s\'", sPath.getCharacters());
+    return false;
+  }
+
   // Load all the entry points
   try { _loadEntryPointsUpTo(m_oFileHeader.iEntryPointCount - 1); }
   CATCH_THROW_SIMPLE({ if(!bThrow){delete e; return false;} }, L"Unable to load entry point details");
@@ -825,10 +1922,10 @@ bool SgaArchive::_resolvePath(const RainString& sPath, _directory_info_t** ppDir
   // Find entry point
   RainString sPart = sPath.beforeFirst('\\');
   RainString sPathRemain = sPath.afterFirst('\\');
-  _directory_info_t* pDirectory = _resolveArray(m_pEntryPoints, 0, m_oFileHeader.iEntryPointCount, sPart, sPath, bThrow);
-  if(!pDirectory)
+  _entry_point_info_t* pEntryPoint = _resolveArray(m_pEntryPoints, 0, m_oFileHeader.iEntryPointCount, sPart, sPath, bThrow);
+  if(!pEntryPoint)
     return false;
-  pDirectory = m_pDirectories + pDirectory->iFirstDirectory;
+  _directory_info_t* pDirectory = m_pDirectories + pEntryPoint->iFirstDirectory;
   if(sPathRemain.isEmpty())
   {
     *ppDirectory = pDirectory;
@@ -23,8 +23,102 @@ FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
 OTHER DEALINGS IN THE SOFTWARE.
 */
 #pragma once
+#include "containers.h"
 #include "file.h"
+#include "threading.h"
 #include "exception.h"
+#include <vector>
+
+struct memory_buffer_owner_t;
+
+//! Result of checking an archive for corruption (see IArchiveFileStore::verify())
+struct RAINMAN2_API archive_verify_report_t
+{
+  archive_verify_report_t() throw();
+
+  //! Outcome of checking one of the archive-wide hashes
+  enum eHashStatus
+  {
+    HS_NotPresent, //!< The archive format does not have this hash
+    HS_Valid,      //!< The stored hash matches the archive
+    HS_Invalid,    //!< The stored hash does not match the archive
+  };
+
+  //! A file within the archive which failed its check
+  struct corrupt_file_t
+  {
+    RainString sPath;   //!< Full path of the file
+    RainString sReason; //!< Description of what is wrong with it
+  };
+
+  eHashStatus eHeaderHash;             //!< Hash of the table of contents
+  eHashStatus eContentsHash;           //!< Hash of everything after the file header
+  size_t iFilesChecked;                //!< Number of files which were checked individually
+  unsigned long long iBytesRead;       //!< Number of bytes of the archive which were read
+  unsigned long iMillisecondsElapsed;  //!< Time taken to verify the archive
+  std::vector<corrupt_file_t> vCorruptFiles;
+
+  //! Returns true if none of the checks found a problem
+  bool isValid() const throw();
+
+  //! Reset to the state of a newly constructed report
+  void clear() throw();
+};
+
+//! Result of comparing the files of two archives (see IArchiveFileStore::diff())
+struct RAINMAN2_API archive_diff_report_t
+{
+  archive_diff_report_t() throw();
+
+  std::vector<RainString> vAdded;      //!< Paths of files which are only in the new archive
+  std::vector<RainString> vRemoved;    //!< Paths of files which are only in the old archive
+  std::vector<RainString> vModified;   //!< Paths of files which are in both archives, with different contents
+  size_t iFilesCompared;               //!< Number of files in both archives whose raw data was compared
+  size_t iFilesInflated;               //!< Number of those files which also had to be decompressed and compared
+  unsigned long long iBytesRead;       //!< Number of bytes of raw (possibly compressed) data read from the two archives
+  unsigned long long iBytesInflated;   //!< Number of bytes of file contents which were decompressed (or copied) for comparing
+  unsigned long iMillisecondsElapsed;  //!< Time taken to compare the archives
+
+  //! Returns true if the two archives contain the same files with the same contents
+  bool isIdentical() const throw();
+
+  //! Reset to the state of a newly constructed report
+  void clear() throw();
+};
+
+//! How the data of a file is stored within an archive (see IArchiveFileStore::openRaw())
+struct archive_raw_details_t
+{
+  unsigned long iLength;           //!< Length of the contents of the file
+  unsigned long iLengthCompressed; //!< Length of the raw data of the file
+  unsigned long iModificationTime; //!< Unix timestamp of the file, or 0 if the archive does not store one
+  bool bCompressed;                //!< true if the raw data is a zLib stream, false if it is the contents as-is
+};
+
+//! The raw file behind an archive, shared with the files opened from the archive
+/*!
+  Files which read the raw file after being opened (streaming inflaters, and zero-copy views
+  of a memory mapped archive) hold a reference to this, so that they remain valid after the
+  archive itself has been destroyed. The references are counted by a memory_buffer_owner_t
+  whose buffer is the raw source, which allows them to be handed to MemoryReadFile and
+  InflateReadFile.
+*/
+struct RAINMAN2_API archive_raw_source_t
+{
+  IFile* pFile;
+  RainMutex oMutex; //!< Guards reads from pFile, unless pFile->isReadAtThreadSafe()
+  bool bDeleteFile;
+
+  //! Share a raw file; the returned owner holds a single reference
+  /*!
+    If bDeleteFile is true, then pFile is deleted once the last reference is released, or
+    straight away if an exception is thrown.
+  */
+  static memory_buffer_owner_t* create(IFile* pFile, bool bDeleteFile) throw(...);
+  static archive_raw_source_t* get(memory_buffer_owner_t* pOwner) throw();
+  //! Add a reference, and return pOwner
+  static memory_buffer_owner_t* addReference(memory_buffer_owner_t* pOwner) throw();
+};
 
 class RAINMAN2_API IArchiveFileStore : public IFileStore
 {
@@ -35,14 +129,118 @@ public:
   virtual size_t getFileCount() const throw() = 0;
   virtual size_t getDirectoryCount() const throw() = 0;
 
+  //! Get the approximate number of bytes of memory used by the archive's table of contents and indices
+  /*!
+    Excludes the archive file itself (and hence any memory mapping of it), and any files or
+    directories which are currently open.
+  */
+  virtual size_t getMemoryUsage() const throw() = 0;
+
+  //! Check the archive for corruption
+  /*!
+    Checks whatever hashes and checksums the archive format provides, reading the archive
+    with large sequential reads. Individual files are checked on a pool of threads. A
+    corrupt archive does not cause an exception; instead the problems are described in the
+    report. Exceptions are only thrown if the archive cannot be read at all.
+    \param oReport Report to fill in (any previous contents are cleared)
+    \param iThreadCount Number of threads to check files with, or 0 for one per processor
+  */
+  virtual void verify(archive_verify_report_t& oReport, unsigned long iThreadCount = 0) throw(...) = 0;
+
+  //! Find the files which have been added, removed or modified between two archives
+  /*!
+    Files are matched by path (compared caselessly). A file in both archives is unchanged if
+    its length, the length of its raw (possibly compressed) data, and that raw data itself are
+    the same in both archives. Only when the raw data differs, but the length does not, are
+    both copies decompressed and compared, as the same contents could have been compressed
+    differently. The raw data is read in the order that it is stored in the new archive.
+    The two archives can be of different formats.
+    \param pOld The older of the two archives
+    \param pNew The newer of the two archives
+    \param oReport Report to fill in (any previous contents are cleared); paths are sorted caselessly
+  */
+  static void diff(IArchiveFileStore* pOld, IArchiveFileStore* pNew, archive_diff_report_t& oReport) throw(...);
+
   virtual void getCaps(file_store_caps_t& oCaps) const throw();
 
+  //! Pump a batch of files in the order that their data is stored in the archive
+  /*!
+    Requests are sorted by the position of their data, and runs of nearby files are read
+    with a single large read, from which each of them is then pumped.
+  */
+  virtual void pumpFiles(const std::vector<std::pair<RainString, IFile*> >& vFiles) throw(...);
+
+  //! Open the raw data of a file, exactly as it is stored within the archive
+  /*!
+    The raw data is not decompressed, so it can be given to another archive (see
+    SgaArchiveWriter) without being decompressed and then compressed again.
+    \param sPath Full path of the file
+    \param oDetails Filled in with the lengths, timestamp and compression of the file
+    \return A read-only file of the raw data, which the caller must delete
+  */
+  virtual IFile* openRaw(const RainString& sPath, archive_raw_details_t& oDetails) throw(...);
+
+  //! Write the raw data of a file, exactly as it is stored within the archive, to another file
+  /*!
+    As for openRaw(), but the raw data is written to pSink rather than being held in memory.
+  */
+  virtual void pumpRaw(const RainString& sPath, IFile* pSink, archive_raw_details_t& oDetails) throw(...);
+
   virtual void   deleteFile            (const RainString& sPath) throw(...);
   virtual bool   deleteFileNoThrow     (const RainString& sPath) throw();
   virtual void   createDirectory       (const RainString& sPath) throw(...);
   virtual bool   createDirectoryNoThrow(const RainString& sPath) throw();
   virtual void   deleteDirectory       (const RainString& sPath) throw(...);
   virtual bool   deleteDirectoryNoThrow(const RainString& sPath) throw();
+
+protected:
+  friend class ArchiveVerifyWorker;
+
+  //! A file to be checked by _verifyFiles()
+  struct _verify_item_t
+  {
+    void* pFile;          //!< Archive-specific information on the file
+    RainString sPath;     //!< Full path of the file, for the report
+    unsigned long iOrder; //!< Position of the file's data, so that files are checked in storage order
+  };
+
+  //! Check files with _verifyFile() on a pool of threads, adding those which fail to the report
+  void _verifyFiles(const std::vector<_verify_item_t>& vItems, archive_verify_report_t& oReport, unsigned long iThreadCount) throw(...);
+
+  //! Check a single file for _verifyFiles(), which may call this from several threads at once
+  /*!
+    \param sReason Set to a description of the problem if the file is corrupt
+    \return true if the file is intact, false if it is corrupt
+  */
+  virtual bool _verifyFile(void* pFile, RainString& sReason) throw() = 0;
+
+  //! Turn an exception (and those which caused it) into a single line for a report, and delete it
+  static RainString _describeVerifyException(RainException* pE) throw();
+
+  //! One request of a pumpFiles() batch
+  struct _batch_item_t
+  {
+    seek_offset_t iPosition; //!< Position of the file's raw data within the archive file
+    size_t iLength;          //!< Length, in bytes, of the file's raw (possibly compressed) data
+    size_t iRequest;         //!< Index of the request within the batch
+    void* pFile;             //!< Archive-specific information on the file
+    bool bNeedsRead;         //!< false if the archive can pump the file without pumpFiles() reading it (e.g. when mapped)
+  };
+
+  //! Orders pumpFiles() requests by the position of their data, and then by request order
+  static bool _batchItemLess(const _batch_item_t& a, const _batch_item_t& b) throw();
+
+  //! Fill in the details of a pumpFiles() request, throwing an exception if the file does not exist
+  virtual void _getBatchItem(const RainString& sPath, _batch_item_t& oItem) throw(...) = 0;
+
+  //! Pump a file from its raw data, or from the archive itself if pRawData is NULL
+  virtual void _pumpBatchItem(const _batch_item_t& oItem, IFile* pSink, const char* pRawData) throw(...) = 0;
+
+  //! Read part of the archive file, returning the number of bytes read
+  virtual size_t _readBatchData(seek_offset_t iPosition, void* pDestination, size_t iLength) throw() = 0;
+
+  //! Describe how the file of a batch item (see _getBatchItem()) is stored, for openRaw() and pumpRaw()
+  virtual void _getRawDetails(const _batch_item_t& oItem, archive_raw_details_t& oDetails) throw() = 0;
 };
 
 /*
@@ -56,6 +254,21 @@ public:
     * Company of Heroes Online (uses 4.1, also uses SPK archives)
     * Warhammer 40,000: Dawn of War II (uses 5.0)
   It is currently assumed that Company of Heroes: Tales of Valor will use version 4.x archives.
+
+  An archive on disk can be loaded with initMapped() rather than init(), in which case the whole
+  archive is memory mapped. Stored (uncompressed) files are then opened as views straight into the
+  mapping without any copying, and compressed files are inflated directly from the mapping.
+
+  Files opened from the archive which still refer to the archive file (views of the mapping,
+  and large compressed files which are inflated as they are read) share ownership of it, so
+  they remain valid after the archive is destroyed. If init() is not given ownership of the
+  archive file, then the caller must keep it alive until such files have been closed.
+
+  The table of contents is loaded lazily, so opening an archive and touching only a few of
+  its directories reads only the records which are needed. Once enough paths have been
+  resolved (or concurrent reads are enabled), the whole table of contents is loaded and an
+  index of the full path of every file and directory is built, so that resolving a path is
+  then a single hash table lookup, rather than a search of each directory along the path.
 */
 class RAINMAN2_API SgaArchive : public IArchiveFileStore
 {
@@ -67,13 +280,49 @@ public:
 
   virtual void init(IFile* pSgaFile, bool bTakePointerOwnership = true) throw(...);
 
+  //! Load an archive from disk by memory mapping it
+  /*!
+    Behaves like init(), except that the archive is mapped into memory rather than read through
+    a file handle, allowing stored files to be opened without copying their data.
+  */
+  void initMapped(const RainString& sPath) throw(...);
+  bool initMappedNoThrow(const RainString& sPath) throw();
+
+  //! Allow files to be opened and pumped from multiple threads at the same time
+  /*!
+    Loads the entire table of contents, after which it is never modified, and so can be
+    read by multiple threads without locking. File data is then read with positional
+    reads (see IFile::readAt()), so the shared file pointer is never used. Archives loaded
+    with initMapped() read concurrently without any locking, as do archive files whose
+    positional reads are thread-safe; otherwise reads of the archive file are serialised.
+    Paths are resolved through an index of the table of contents, or by searching it if
+    there is not enough memory for the index.
+    Must be called after init() and before any other threads use the archive.
+  */
+  void enableConcurrentReads() throw(...);
+
+  virtual void getCaps(file_store_caps_t& oCaps) const throw();
+
   virtual size_t getFileCount() const throw() {return m_oFileHeader.iFileCount;}
   virtual size_t getDirectoryCount() const throw() {return m_oFileHeader.iDirectoryCount;}
+  virtual size_t getMemoryUsage() const throw();
+
+  //! Check the header and contents hashes of the archive
+  /*!
+    The table of contents is checked against the header hash, and everything after the file
+    header is read in a single sequential pass (straight from the mapping, if the archive is
+    mapped) and checked against the contents hash. Only if the contents hash does not match
+    is each compressed file then inflated to locate the damage, as the zLib stream of each
+    file carries a checksum of its own. Stored files cannot be checked individually.
+  */
+  virtual void verify(archive_verify_report_t& oReport, unsigned long iThreadCount = 0) throw(...);
 
   virtual IFile* openFile         (const RainString& sPath, eFileOpenMode eMode) throw(...);
   virtual void   pumpFile         (const RainString& sPath, IFile* pSink) throw(...);
+  virtual size_t readFileInto     (const RainString& sPath, void* pBuffer, size_t iBufferSize) throw(...);
   virtual IFile* openFileNoThrow  (const RainString& sPath, eFileOpenMode eMode) throw();
   virtual bool   doesFileExist    (const RainString& sPath) throw();
+  virtual bool   getFileStorageOrder(const RainString& sPath, unsigned long& iOrder) throw();
 
   virtual size_t            getEntryPointCount() throw();
   virtual const RainString& getEntryPointName(size_t iIndex) throw(...);
@@ -84,6 +333,8 @@ public:
 
 protected:
   friend class ArchiveDirectoryAdapter;
+  //! Reads the table of contents and file data directly, in order to update and compact archives
+  friend class SgaArchiveWriter;
 
   struct _file_header_raw_t
   {
@@ -113,10 +364,26 @@ protected:
     unsigned short int iStringCount;
   };
 
-  struct _directory_info_t
+  struct _entry_point_info_t
   {
     RainString sName;
-    RainString sPath;
+    RainString sPath; // sName followed by a backslash
+    // The directories and files within the entry point are those in the ranges [first, last)
+    unsigned short int iFirstDirectory;
+    unsigned short int iLastDirectory;
+    unsigned short int iFirstFile;
+    unsigned short int iLastFile;
+  };
+
+  struct _directory_info_t
+  {
+    // Like files, directories refer to the archive's string block rather than having RainStrings of their own, as
+    // archives can contain thousands of directories. The string block holds the path of the directory relative to
+    // its entry point (e.g. "art\\ebps"), and iName is the offset of the final part of that path (e.g. "ebps").
+    // The full path (e.g. "data\\art\\ebps\\") is built when required by _getDirectoryPath().
+    unsigned long iPath;
+    unsigned long iName;
+    unsigned short int iEntryPoint;
     // The subdirectories of this directory are those in the range [first, last)
     unsigned short int iFirstDirectory;
     unsigned short int iLastDirectory;
@@ -145,16 +412,63 @@ protected:
 		unsigned long iModificationTime;
   };
 
+  //! An entry in the path index, which maps full paths to files and directories
+  struct _path_index_entry_t
+  {
+    unsigned short int iIndex;     //!< Index of the file or directory
+    unsigned short int iDirectory; //!< For files, the index of the directory containing the file
+    bool bIsFile;
+  };
+
+  //! Predicate for RainHashIndex::find() which checks that a path index entry matches a path
+  struct _path_index_matcher_t;
+  friend struct _path_index_matcher_t;
+
+  virtual bool _verifyFile(void* pFile, RainString& sReason) throw();
+  virtual void _getBatchItem(const RainString& sPath, _batch_item_t& oItem) throw(...);
+  virtual void _pumpBatchItem(const _batch_item_t& oItem, IFile* pSink, const char* pRawData) throw(...);
+  virtual size_t _readBatchData(seek_offset_t iPosition, void* pDestination, size_t iLength) throw();
+  virtual void _getRawDetails(const _batch_item_t& oItem, archive_raw_details_t& oDetails) throw();
+
   void _zeroSelf() throw();
   void _cleanSelf() throw();
-  const RainString& _getDirectoryEntryPoint(_directory_info_t* pDirectory) throw();
+  void _init(IFile* pSgaFile, bool bTakePointerOwnership, const char* pMappedData, size_t iMappedLength) throw(...);
+  void _loadEverything() throw(...);
+  //! Load the whole table of contents and index it by path; returns false if there is not enough memory for the index
+  bool _buildPathIndex() throw(...);
+  unsigned short int _getDirectoryEntryPoint(unsigned short int iDirectory) throw(...);
+  RainString _getDirectoryPath(const _directory_info_t* pDirectory) throw(...);
   void _loadEntryPointsUpTo(unsigned short int iEnsureLoaded) throw(...);
   void _loadDirectoriesUpTo(unsigned short int iEnsureLoaded) throw(...);
   void _loadFilesUpTo(unsigned short int iEnsureLoaded) throw(...);
   void _loadFilesUpTo_v2(unsigned short int iFirstToLoad, unsigned short int iEnsureLoaded) throw(...);
   void _loadFilesUpTo_v4(unsigned short int iFirstToLoad, unsigned short int iEnsureLoaded) throw(...);
   void _loadChildren(_directory_info_t* pInfo, bool bJustDirectories) throw(...);
+  //! Compute the contents hash, with a single sequential pass over everything after the file header
+  void _hashContents(unsigned char* pHash, unsigned long long& iBytesRead) throw(...);
   void _pumpFile(_file_info_t* pInfo, IFile* pSink) throw(...);
+  //! Pump a file whose raw data is already in memory (in the mapping, or read by pumpFiles()), or read it if pMapped is NULL
+  void _pumpFile(_file_info_t* pInfo, IFile* pSink, const char* pMapped) throw(...);
+  void _readFileInto(_file_info_t* pInfo, void* pBuffer) throw(...);
+  IFile* _openFile(_file_info_t* pInfo) throw(...);
+  //! Detect the truncated zLib trailer left on the last file by early versions of sga4to5.exe
+  bool _hasTruncatedChecksum(_file_info_t* pInfo, int iZLibError, const char* sZLibMessage) throw();
+  size_t _readRawNoThrow(seek_offset_t iPosition, void* pDestination, size_t iLength) throw();
+
+  //! Get a range of fixed size records from a section of the table of contents
+  /*!
+    The records are read with a single read, or not read at all when the archive is memory mapped.
+    \param iSectionOffset Offset of the section, relative to the start of the data header
+    \param vBuffer Storage for the records, if they need to be read
+    \return Pointer to the first of the (undecoded) records, valid until vBuffer is modified
+  */
+  const unsigned char* _readTableOfContents(unsigned long iSectionOffset, size_t iFirstRecord, size_t iRecordCount, size_t iRecordSize, std::vector<unsigned char>& vBuffer) throw(...);
+
+  //! Get a pointer to the raw (possibly compressed) data of a file in the memory mapped archive
+  /*!
+    Returns NULL if the archive is not memory mapped, or if the file's data lies outside of the mapping.
+  */
+  const char* _getMappedData(_file_info_t* pInfo) throw();
 
   /*!
     Attempts to locate a directory/file within the archive from a given file name / path.
@@ -166,10 +480,13 @@ protected:
     \param bThrow If true, then an exception is thrown if nothing is found. If false, then false is returned instead.
   */
   bool _resolvePath(const RainString& sPath, _directory_info_t** ppDirectory, _file_info_t **ppFile, bool bThrow) throw(...);
+  //! Implementation of _resolvePath() as a single lookup in the path index, used once the index has been built
+  bool _resolvePathIndexed(const RainString& sPath, _directory_info_t** ppDirectory, _file_info_t **ppFile, bool bThrow) throw(...);
 
   template <class T>
   inline const RainString& _getName(const T& o) {return o.sName;}
 
+  inline const char* _getName(const _directory_info_t& o) {return m_sStringBlob + o.iName;}
   inline const char* _getName(const _file_info_t& o) {return m_sStringBlob + o.iName;}
 
   template <class T>
@@ -204,14 +521,23 @@ protected:
   }
 
   _file_header_raw_t m_oFileHeader;
-  _directory_info_t *m_pEntryPoints;
+  _entry_point_info_t *m_pEntryPoints;
   _directory_info_t *m_pDirectories;
   _file_info_t      *m_pFiles;
   char              *m_sStringBlob;
+  size_t             m_iStringBlobLength;
   IFile             *m_pRawFile;
+  memory_buffer_owner_t *m_pRawSource; //!< Shares m_pRawFile with the files opened from the archive
+  const char        *m_pMappedData;
+  size_t             m_iMappedLength;
   seek_offset_t      m_iDataHeaderOffset;
   unsigned short int m_iNumEntryPointsLoaded;
   unsigned short int m_iNumDirectoriesLoaded;
   unsigned short int m_iNumFilesLoaded;
-  bool               m_bDeleteRawFileLater;
+  RainMutex         *m_pRawFileMutex; //!< Guards m_pRawFile; belongs to m_pRawSource
+  RainHashIndex<_path_index_entry_t> m_oPathIndex;
+  bool               m_bPathIndexBuilt;
+  unsigned long      m_iUnindexedResolves; //!< Number of paths resolved before the path index was built
+  bool               m_bRawReadAtThreadSafe;
+  bool               m_bConcurrentReads;
 };
@@ -0,0 +1,344 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "bulk_extract.h"
+#include "exception.h"
+#include "memfile.h"
+#include "threading.h"
+#include <algorithm>
+#include <memory>
+#include <queue>
+
+double bulk_extract_progress_t::getBytesPerSecond() const throw()
+{
+  if(iMillisecondsElapsed == 0)
+    return 0.0;
+  return static_cast<double>(iBytesDone) * 1000.0 / static_cast<double>(iMillisecondsElapsed);
+}
+
+IBulkExtractCallback::~IBulkExtractCallback() throw() {}
+
+BulkExtractor::BulkExtractor() throw()
+  : m_pCallback(0), m_iThreadCount(0), m_iQueueLength(64), m_iStartTime(0)
+{
+}
+
+BulkExtractor::~BulkExtractor() throw()
+{
+}
+
+void BulkExtractor::setThreadCount(unsigned long iThreadCount) throw()
+{
+  m_iThreadCount = iThreadCount;
+}
+
+void BulkExtractor::setQueueLength(unsigned long iQueueLength) throw()
+{
+  m_iQueueLength = iQueueLength ? iQueueLength : 1;
+}
+
+void BulkExtractor::setCallback(IBulkExtractCallback* pCallback) throw()
+{
+  m_pCallback = pCallback;
+}
+
+static bool BulkExtractEntryOrder(const BulkExtractor::_entry_t& a, const BulkExtractor::_entry_t& b)
+{
+  return a.iOrder < b.iOrder;
+}
+
+bool BulkExtractor::extract(IFileStore* pSource, const RainString& sSourcePath, IFileStore* pDestination, RainString sDestinationPath) throw(...)
+{
+  if(sDestinationPath.suffix(1) != L"\\")
+    sDestinationPath += L"\\";
+  m_vEntries.clear();
+  m_iStartTime = RainGetTickCount();
+  m_oProgress.iFilesDone = 0;
+  m_oProgress.iFilesTotal = 0;
+  m_oProgress.iBytesDone = 0;
+  m_oProgress.iMillisecondsElapsed = 0;
+  m_oProgress.pCurrentFile = 0;
+
+  bool bCompleted;
+  try
+  {
+    _enumerate(pSource, sSourcePath, pDestination, sDestinationPath);
+
+    // Reading in storage order turns what would be random access of the source into sequential access
+    std::stable_sort(m_vEntries.begin(), m_vEntries.end(), BulkExtractEntryOrder);
+    m_oProgress.iFilesTotal = m_vEntries.size();
+
+    file_store_caps_t oCaps;
+    pSource->getCaps(oCaps);
+    unsigned long iThreadCount = m_iThreadCount ? m_iThreadCount : RainGetProcessorCount();
+    if(!oCaps.bCanReadConcurrently || iThreadCount <= 1 || m_vEntries.size() <= 1)
+      bCompleted = _extractSequential(pSource, pDestination);
+    else
+      bCompleted = _extractParallel(pSource, pDestination, iThreadCount);
+  }
+  CATCH_THROW_SIMPLE_(m_vEntries.clear(), L"Cannot extract \'%s\' to \'%s\'", sSourcePath.getCharacters(), sDestinationPath.getCharacters());
+
+  m_vEntries.clear();
+  return bCompleted;
+}
+
+void BulkExtractor::_enumerate(IFileStore* pSource, const RainString& sSourcePath, IFileStore* pDestination, const RainString& sDestinationPath) throw(...)
+{
+  std::queue<IDirectory*> qTodo;
+  try
+  {
+    qTodo.push(pSource->openDirectory(sSourcePath));
+    size_t iSkipLength = qTodo.front()->getPath().length();
+    while(!qTodo.empty())
+    {
+      IDirectory *pDirectory = qTodo.front();
+      const RainString& sDirectoryPath = pDirectory->getPath();
+      RainString sDirectoryBase = sDestinationPath + sDirectoryPath.mid(iSkipLength, sDirectoryPath.length() - iSkipLength);
+      if(!pDestination->doesDirectoryExist(sDirectoryBase))
+        pDestination->createDirectory(sDirectoryBase);
+
+      for(IDirectory::iterator itr = pDirectory->begin(), itrEnd = pDirectory->end(); itr != itrEnd; ++itr)
+      {
+        if(itr->isDirectory())
+          qTodo.push(itr->open());
+        else
+        {
+          _entry_t oEntry;
+          oEntry.sSource = sDirectoryPath + itr->name();
+          oEntry.sDestination = sDirectoryBase + itr->name();
+          oEntry.iSize = itr->size().iLower;
+          if(!pSource->getFileStorageOrder(oEntry.sSource, oEntry.iOrder))
+            oEntry.iOrder = 0;
+          m_vEntries.push_back(oEntry);
+        }
+      }
+
+      delete pDirectory;
+      qTodo.pop();
+    }
+  }
+  catch(RainException *pE)
+  {
+    while(!qTodo.empty())
+    {
+      delete qTodo.front();
+      qTodo.pop();
+    }
+    RETHROW_SIMPLE(pE, L"Cannot enumerate files to extract");
+  }
+}
+
+bool BulkExtractor::_fileDone(const RainString& sPath, unsigned long iSize) throw()
+{
+  ++m_oProgress.iFilesDone;
+  m_oProgress.iBytesDone += iSize;
+  m_oProgress.iMillisecondsElapsed = RainGetTickCount() - m_iStartTime;
+  m_oProgress.pCurrentFile = &sPath;
+  if(m_pCallback)
+    return m_pCallback->onBulkExtractProgress(m_oProgress);
+  return true;
+}
+
+bool BulkExtractor::_extractSequential(IFileStore* pSource, IFileStore* pDestination) throw(...)
+{
+  // Files are handed to the source in groups, so that archives can serve runs of small files from a single read
+  static const size_t BATCH_SIZE = 64;
+  std::vector<std::pair<RainString, IFile*> > vBatch;
+  vBatch.reserve(BATCH_SIZE);
+  for(size_t iFirst = 0; iFirst < m_vEntries.size(); iFirst += BATCH_SIZE)
+  {
+    size_t iLast = std::min(iFirst + BATCH_SIZE, m_vEntries.size());
+    try
+    {
+      for(size_t i = iFirst; i < iLast; ++i)
+      {
+        try
+        {
+          vBatch.push_back(std::make_pair(m_vEntries[i].sSource, static_cast<IFile*>(0)));
+          vBatch.back().second = pDestination->openFile(m_vEntries[i].sDestination, FM_Write);
+        }
+        CATCH_THROW_SIMPLE_({}, L"Cannot extract \'%s\'", m_vEntries[i].sSource.getCharacters());
+      }
+      pSource->pumpFiles(vBatch);
+    }
+    catch(RainException*)
+    {
+      for(std::vector<std::pair<RainString, IFile*> >::iterator itr = vBatch.begin(); itr != vBatch.end(); ++itr)
+        delete itr->second;
+      throw;
+    }
+    for(std::vector<std::pair<RainString, IFile*> >::iterator itr = vBatch.begin(); itr != vBatch.end(); ++itr)
+      delete itr->second;
+    vBatch.clear();
+
+    for(size_t i = iFirst; i < iLast; ++i)
+    {
+      if(!_fileDone(m_vEntries[i].sSource, m_vEntries[i].iSize))
+        return false;
+    }
+  }
+  return true;
+}
+
+//! An item passed from a BulkExtractWorker to the writing thread
+struct BulkExtractItem
+{
+  size_t iIndex;           //!< Index into the entries, or -1 to signal that the worker has finished
+  MemoryReadFile* pData;   //!< The decompressed file, or NULL if pError is set
+  RainException* pError;   //!< Exception thrown whilst decompressing the file
+};
+
+//! Reads and decompresses files on a background thread for BulkExtractor
+class BulkExtractWorker : public RainThread
+{
+public:
+  BulkExtractWorker(IFileStore* pSource, const std::vector<BulkExtractor::_entry_t>& vEntries,
+                    volatile long* pNextIndex, volatile long* pCancelled, RainBoundedQueue<BulkExtractItem>* pQueue) throw()
+    : m_pSource(pSource), m_vEntries(vEntries), m_pNextIndex(pNextIndex), m_pCancelled(pCancelled), m_pQueue(pQueue)
+  {
+  }
+
+  virtual void run() throw()
+  {
+    BulkExtractItem oItem;
+    while(*m_pCancelled == 0)
+    {
+      // Each worker claims the next unclaimed entry, so entries are read in (roughly) storage order
+      oItem.iIndex = static_cast<size_t>(RainAtomicIncrement(m_pNextIndex) - 1);
+      if(oItem.iIndex >= m_vEntries.size())
+        break;
+      const BulkExtractor::_entry_t& oEntry = m_vEntries[oItem.iIndex];
+      oItem.pError = 0;
+      oItem.pData = 0;
+      // The size is known from the listing, so the file is read (or decompressed) straight into its buffer
+      char* pBuffer = new (std::nothrow) char[oEntry.iSize ? oEntry.iSize : 1];
+      try
+      {
+        CHECK_ALLOCATION(pBuffer);
+        size_t iLength = m_pSource->readFileInto(oEntry.sSource, pBuffer, oEntry.iSize);
+        oItem.pData = CHECK_ALLOCATION(new (std::nothrow) MemoryReadFile(pBuffer, iLength, true));
+      }
+      catch(RainException *pE)
+      {
+        delete[] pBuffer;
+        oItem.pError = new (std::nothrow) RainException(__WFILE__, __LINE__, pE, L"Cannot extract \'%s\'", oEntry.sSource.getCharacters());
+        if(oItem.pError == 0)
+          oItem.pError = pE;
+      }
+      m_pQueue->push(oItem);
+    }
+    oItem.iIndex = static_cast<size_t>(-1);
+    oItem.pData = 0;
+    oItem.pError = 0;
+    m_pQueue->push(oItem);
+  }
+
+protected:
+  IFileStore* m_pSource;
+  const std::vector<BulkExtractor::_entry_t>& m_vEntries;
+  volatile long* m_pNextIndex;
+  volatile long* m_pCancelled;
+  RainBoundedQueue<BulkExtractItem>* m_pQueue;
+};
+
+bool BulkExtractor::_extractParallel(IFileStore* pSource, IFileStore* pDestination, unsigned long iThreadCount) throw(...)
+{
+  volatile long iNextIndex = 0;
+  volatile long iCancelled = 0;
+  RainBoundedQueue<BulkExtractItem> oQueue(static_cast<long>(m_iQueueLength));
+  std::vector<BulkExtractWorker*> vWorkers;
+  RainException *pError = 0;
+  bool bCompleted = true;
+
+  try
+  {
+    for(unsigned long i = 0; i < iThreadCount; ++i)
+    {
+      BulkExtractWorker *pWorker = CHECK_ALLOCATION(new (std::nothrow) BulkExtractWorker(pSource, m_vEntries, &iNextIndex, &iCancelled, &oQueue));
+      try
+      {
+        pWorker->start();
+      }
+      CATCH_THROW_SIMPLE(delete pWorker, L"Cannot start worker thread");
+      vWorkers.push_back(pWorker);
+    }
+  }
+  catch(RainException *pE)
+  {
+    // Workers which did start will still run to completion, and are drained below
+    pError = pE;
+    iCancelled = 1;
+  }
+
+  // Write out the files as the workers finish decompressing them. After an error or a cancellation,
+  // keep draining the queue until every worker has finished, so that no worker blocks forever.
+  for(size_t iWorkersRemaining = vWorkers.size(); iWorkersRemaining != 0;)
+  {
+    BulkExtractItem oItem = oQueue.pop();
+    if(oItem.iIndex == static_cast<size_t>(-1))
+    {
+      --iWorkersRemaining;
+      continue;
+    }
+    if(oItem.pError)
+    {
+      iCancelled = 1;
+      if(pError)
+        delete oItem.pError;
+      else
+        pError = oItem.pError;
+    }
+    else if(iCancelled == 0)
+    {
+      const _entry_t& oEntry = m_vEntries[oItem.iIndex];
+      IFile *pFile = 0;
+      try
+      {
+        pFile = pDestination->openFile(oEntry.sDestination, FM_Write);
+        pFile->write(oItem.pData->getBuffer(), 1, oItem.pData->getSize());
+        delete pFile;
+      }
+      catch(RainException *pE)
+      {
+        delete pFile;
+        iCancelled = 1;
+        pError = new (std::nothrow) RainException(__WFILE__, __LINE__, pE, L"Cannot write \'%s\'", oEntry.sDestination.getCharacters());
+        if(pError == 0)
+          pError = pE;
+      }
+      if(iCancelled == 0 && !_fileDone(oEntry.sSource, static_cast<unsigned long>(oItem.pData->getSize())))
+      {
+        iCancelled = 1;
+        bCompleted = false;
+      }
+    }
+    delete oItem.pData;
+  }
+
+  for(std::vector<BulkExtractWorker*>::iterator itr = vWorkers.begin(); itr != vWorkers.end(); ++itr)
+    delete *itr;
+  if(pError)
+    throw pError;
+  return bCompleted;
+}
@@ -0,0 +1,121 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#pragma once
+#include "file.h"
+#include <vector>
+
+//! Progress of a bulk extraction, as reported to an IBulkExtractCallback
+struct RAINMAN2_API bulk_extract_progress_t
+{
+  size_t iFilesDone;                  //!< Number of files written to the destination so far
+  size_t iFilesTotal;                 //!< Total number of files being extracted
+  unsigned long long iBytesDone;      //!< Number of (uncompressed) bytes written so far
+  unsigned long iMillisecondsElapsed; //!< Time elapsed since the extraction began
+  const RainString* pCurrentFile;     //!< Source path of the file most recently written
+
+  //! Get the average throughput so far, in bytes per second
+  double getBytesPerSecond() const throw();
+};
+
+//! Interface for receiving progress notifications from a BulkExtractor
+class RAINMAN2_API IBulkExtractCallback
+{
+public:
+  virtual ~IBulkExtractCallback() throw();
+
+  //! Called after each file has been written to the destination
+  /*!
+    Always called on the thread which called BulkExtractor::extract(), so it is safe to
+    update user interface elements from here.
+    \return true to continue extracting, false to cancel the extraction
+  */
+  virtual bool onBulkExtractProgress(const bulk_extract_progress_t& oProgress) throw() = 0;
+};
+
+//! Extracts an entire directory tree from one file store into another
+/*!
+  Files are read from the source in the order in which their data is stored (see
+  IFileStore::getFileStorageOrder()), decompressed by a pool of worker threads, and
+  then passed through a bounded queue to the calling thread, which writes them to the
+  destination. The queue length limits the number of decompressed files held in memory
+  at once. If the source does not support concurrent reads (see file_store_caps_t), then
+  files are extracted one at a time, straight into the destination.
+
+  Example usage:
+    BulkExtractor oExtractor;
+    oExtractor.setCallback(&oMyProgressCallback);
+    oExtractor.extract(pArchive, L"data\\", RainGetFileSystemStore(), L"C:\\extracted\\");
+*/
+class RAINMAN2_API BulkExtractor
+{
+public:
+  BulkExtractor() throw();
+  ~BulkExtractor() throw();
+
+  //! Set the number of threads used to read and decompress files
+  /*!
+    \param iThreadCount Number of threads, or 0 for one thread per processor (the default)
+  */
+  void setThreadCount(unsigned long iThreadCount) throw();
+
+  //! Set the maximum number of decompressed files which can be waiting to be written (default 64)
+  void setQueueLength(unsigned long iQueueLength) throw();
+
+  //! Set the object to notify of progress (or NULL for no notifications)
+  void setCallback(IBulkExtractCallback* pCallback) throw();
+
+  //! Extract a directory and everything beneath it
+  /*!
+    \param pSource The file store to extract from
+    \param sSourcePath The directory to extract
+    \param pDestination The file store to extract to
+    \param sDestinationPath The directory to extract into, which is created if required.
+      The contents of sSourcePath end up directly within this directory.
+    \return true if every file was extracted, false if the extraction was cancelled
+  */
+  bool extract(IFileStore* pSource, const RainString& sSourcePath, IFileStore* pDestination, RainString sDestinationPath) throw(...);
+
+  //! A file to be extracted; for internal use only
+  struct _entry_t
+  {
+    RainString sSource;
+    RainString sDestination;
+    unsigned long iOrder;
+    unsigned long iSize;
+  };
+
+protected:
+  void _enumerate(IFileStore* pSource, const RainString& sSourcePath, IFileStore* pDestination, const RainString& sDestinationPath) throw(...);
+  bool _extractSequential(IFileStore* pSource, IFileStore* pDestination) throw(...);
+  bool _extractParallel(IFileStore* pSource, IFileStore* pDestination, unsigned long iThreadCount) throw(...);
+  bool _fileDone(const RainString& sPath, unsigned long iSize) throw();
+
+  std::vector<_entry_t> m_vEntries;
+  bulk_extract_progress_t m_oProgress;
+  IBulkExtractCallback* m_pCallback;
+  unsigned long m_iThreadCount;
+  unsigned long m_iQueueLength;
+  unsigned long m_iStartTime;
+};
@@ -0,0 +1,202 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "compress_pipeline.h"
+#include "exception.h"
+#include "threading.h"
+#include <map>
+#include <vector>
+
+ICompressedFileSink::~ICompressedFileSink() throw() {}
+
+//! Reads and compresses files on a background thread for RainCompressAndWrite()
+class RainCompressWorker : public RainThread
+{
+public:
+  RainCompressWorker(ICompressedFileSink* pSink, size_t iFileCount, volatile long* pNextIndex, volatile long* pCancelled,
+                     RainSemaphore* pWindow, RainBoundedQueue<RainCompressedFile>* pQueue) throw()
+    : m_pSink(pSink), m_iFileCount(iFileCount), m_pNextIndex(pNextIndex), m_pCancelled(pCancelled), m_pWindow(pWindow), m_pQueue(pQueue)
+  {
+  }
+
+  virtual void run() throw()
+  {
+    RainCompressedFile oItem;
+    for(;;)
+    {
+      // The window limits how far ahead of the writing thread the workers can get, and hence how
+      // many compressed files are held in memory at once
+      m_pWindow->wait();
+      if(*m_pCancelled != 0)
+        break;
+      size_t iIndex = static_cast<size_t>(RainAtomicIncrement(m_pNextIndex) - 1);
+      if(iIndex >= m_iFileCount)
+        break;
+      try
+      {
+        m_pSink->compressFile(iIndex, oItem);
+        oItem.iIndex = iIndex;
+        oItem.pError = 0;
+      }
+      catch(RainException *pE)
+      {
+        oItem.iIndex = iIndex;
+        oItem.pData = 0;
+        oItem.pError = pE;
+      }
+      m_pQueue->push(oItem);
+    }
+    oItem.iIndex = static_cast<size_t>(-1);
+    oItem.pData = 0;
+    oItem.pError = 0;
+    m_pQueue->push(oItem);
+  }
+
+protected:
+  ICompressedFileSink* m_pSink;
+  size_t m_iFileCount;
+  volatile long* m_pNextIndex;
+  volatile long* m_pCancelled;
+  RainSemaphore* m_pWindow;
+  RainBoundedQueue<RainCompressedFile>* m_pQueue;
+};
+
+//! Compress and write files one after another on the calling thread
+static void RainCompressAndWriteSequential(ICompressedFileSink* pSink, IFile* pOutput, size_t iFileCount) throw(...)
+{
+  for(size_t i = 0; i < iFileCount; ++i)
+  {
+    RainCompressedFile oItem;
+    pSink->compressFile(i, oItem);
+    oItem.iIndex = i;
+    oItem.pError = 0;
+    try
+    {
+      pSink->writeFile(pOutput, oItem);
+    }
+    CATCH_THROW_SIMPLE(delete[] oItem.pData, L"Cannot write file data");
+    delete[] oItem.pData;
+  }
+}
+
+void RainCompressAndWrite(ICompressedFileSink* pSink, IFile* pOutput, size_t iFileCount, unsigned long iThreadCount) throw(...)
+{
+  if(iThreadCount <= 1 || iFileCount <= 1)
+  {
+    RainCompressAndWriteSequential(pSink, pOutput, iFileCount);
+    return;
+  }
+
+  // Each worker can claim one slot of the window which it never gives back (when it finds that
+  // there is no work left), so the window must be larger than the number of workers
+  long iWindowSize = static_cast<long>(iThreadCount) * 4;
+  volatile long iNextIndex = 0;
+  volatile long iCancelled = 0;
+  RainSemaphore oWindow(iWindowSize);
+  RainBoundedQueue<RainCompressedFile> oQueue(iWindowSize);
+  std::vector<RainCompressWorker*> vWorkers;
+  std::map<size_t, RainCompressedFile> mapPending;
+  size_t iNextToWrite = 0;
+  RainException *pError = 0;
+
+#define CANCEL_WORKERS() \
+  if(iCancelled == 0) { \
+    iCancelled = 1; \
+    for(unsigned long i = 0; i < iThreadCount; ++i) \
+      oWindow.post(); \
+  }
+
+  try
+  {
+    for(unsigned long i = 0; i < iThreadCount; ++i)
+    {
+      RainCompressWorker *pWorker = CHECK_ALLOCATION(new (std::nothrow) RainCompressWorker(pSink, iFileCount, &iNextIndex, &iCancelled, &oWindow, &oQueue));
+      try
+      {
+        pWorker->start();
+      }
+      CATCH_THROW_SIMPLE(delete pWorker, L"Cannot start worker thread");
+      vWorkers.push_back(pWorker);
+    }
+  }
+  catch(RainException *pE)
+  {
+    pError = pE;
+    CANCEL_WORKERS();
+  }
+
+  // Files are compressed out of order, but must be written in order, so hold on to files until
+  // every file before them has been written. After an error, keep draining the queue until every
+  // worker has finished, so that no worker blocks forever.
+  for(size_t iWorkersRemaining = vWorkers.size(); iWorkersRemaining != 0;)
+  {
+    RainCompressedFile oItem = oQueue.pop();
+    if(oItem.iIndex == static_cast<size_t>(-1))
+    {
+      --iWorkersRemaining;
+      continue;
+    }
+    if(oItem.pError)
+    {
+      if(pError)
+        delete oItem.pError;
+      else
+        pError = oItem.pError;
+      CANCEL_WORKERS();
+      continue;
+    }
+    if(iCancelled != 0)
+    {
+      delete[] oItem.pData;
+      continue;
+    }
+    mapPending[oItem.iIndex] = oItem;
+    for(std::map<size_t, RainCompressedFile>::iterator itr = mapPending.find(iNextToWrite); itr != mapPending.end(); itr = mapPending.find(++iNextToWrite))
+    {
+      try
+      {
+        pSink->writeFile(pOutput, itr->second);
+      }
+      catch(RainException *pE)
+      {
+        pError = pE;
+        CANCEL_WORKERS();
+      }
+      delete[] itr->second.pData;
+      mapPending.erase(itr);
+      oWindow.post();
+      if(iCancelled != 0)
+        break;
+    }
+  }
+
+#undef CANCEL_WORKERS
+
+  for(std::map<size_t, RainCompressedFile>::iterator itr = mapPending.begin(); itr != mapPending.end(); ++itr)
+    delete[] itr->second.pData;
+  for(std::vector<RainCompressWorker*>::iterator itr = vWorkers.begin(); itr != vWorkers.end(); ++itr)
+    delete *itr;
+  if(pError)
+    throw pError;
+}
@@ -0,0 +1,74 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#pragma once
+#include "file.h"
+#include "exception.h"
+
+//! A file which has been read and compressed, as passed from a worker thread to the writing thread by RainCompressAndWrite()
+struct RainCompressedFile
+{
+  size_t iIndex;              //!< Index of the file, or -1 to signal that a worker has finished
+  unsigned char aMD5[16];     //!< Hash of the uncompressed data
+  unsigned long iLength;      //!< Length of the uncompressed data
+  unsigned long iDataLength;  //!< Length of the data to store (pData)
+  char* pData;                //!< The data to store, allocated with new[], which is either compressed, or stored as-is when iDataLength == iLength
+  RainException* pError;      //!< Exception thrown whilst reading or compressing the file
+};
+
+//! The archive format specific half of RainCompressAndWrite(), which produces and stores the data of each file
+class RAINMAN2_API ICompressedFileSink
+{
+public:
+  virtual ~ICompressedFileSink() throw();
+
+  //! Read and compress a file
+  /*!
+    Called on worker threads, possibly for several files at once.
+    \param iIndex Index of the file, from 0 up to the file count given to RainCompressAndWrite()
+    \param oResult Set to the compressed file (with iIndex and pError left for the caller to set)
+  */
+  virtual void compressFile(size_t iIndex, RainCompressedFile& oResult) throw(...) = 0;
+
+  //! Store a compressed file
+  /*!
+    Called on the thread which called RainCompressAndWrite(), for each file in order of index. The
+    data of the file is freed by the caller afterwards.
+  */
+  virtual void writeFile(IFile* pOutput, RainCompressedFile& oItem) throw(...) = 0;
+};
+
+//! Compress a number of files, on a pool of threads, and write them out in order
+/*!
+  Files are compressed out of order by the worker threads, but are passed to the sink in order, so
+  that the output is written sequentially. How far ahead of the writing the workers can get is
+  limited, which also limits how many compressed files are held in memory at once. If anything
+  fails, then the remaining work is cancelled, and the first exception is rethrown.
+  \param pSink Compresses and stores each file
+  \param pOutput The file passed to pSink->writeFile()
+  \param iFileCount The number of files
+  \param iThreadCount The number of worker threads; if 1 or less, the files are compressed and
+    written one after another on the calling thread
+*/
+RAINMAN2_API void RainCompressAndWrite(ICompressedFileSink* pSink, IFile* pOutput, size_t iFileCount, unsigned long iThreadCount) throw(...);
@@ -162,3 +162,170 @@ protected:
   TSize m_iSize;
   TSize m_iNumAllocated;
 };
+
+//! An open addressing hash table of small (plain old data) values, keyed by 32 bit hashes
+/*!
+  Only the hashes of keys are stored, not the keys themselves, so more than one value may be
+  found for a given hash. Hence find() and erase() take a predicate which checks whether a
+  candidate value is the one being looked for (typically by comparing names).
+*/
+template <class T>
+class RainHashIndex
+{
+public:
+  RainHashIndex()
+    : m_pSlots(0)
+    , m_iNumSlots(0)
+    , m_iSize(0)
+  {
+  }
+
+  ~RainHashIndex()
+  {
+    free(m_pSlots);
+  }
+
+  size_t size() const
+  {
+    return m_iSize;
+  }
+
+  bool empty() const
+  {
+    return m_iSize == 0;
+  }
+
+  void clear()
+  {
+    free(m_pSlots);
+    m_pSlots = 0;
+    m_iNumSlots = 0;
+    m_iSize = 0;
+  }
+
+  //! Get the number of bytes of memory used by the table
+  size_t getMemoryUsage() const
+  {
+    return sizeof(slot_t) * m_iNumSlots;
+  }
+
+  //! Ensure that iCount values can be held without the table growing
+  /*!
+    \return false if memory could not be allocated, in which case the table is unchanged
+  */
+  bool reserve(size_t iCount)
+  {
+    // Keep the table at most half full, so that probe sequences stay short
+    size_t iNumSlots = 16;
+    while(iNumSlots < iCount * 2)
+      iNumSlots <<= 1;
+    if(iNumSlots <= m_iNumSlots)
+      return true;
+
+    slot_t *pOldSlots = m_pSlots;
+    size_t iOldNumSlots = m_iNumSlots;
+    m_pSlots = reinterpret_cast<slot_t*>(calloc(iNumSlots, sizeof(slot_t)));
+    if(m_pSlots == 0)
+    {
+      m_pSlots = pOldSlots;
+      return false;
+    }
+    m_iNumSlots = iNumSlots;
+    for(size_t i = 0; i < iOldNumSlots; ++i)
+    {
+      if(pOldSlots[i].bUsed)
+        *_findFreeSlot(pOldSlots[i].iHash) = pOldSlots[i];
+    }
+    free(pOldSlots);
+    return true;
+  }
+
+  //! Add a value to the table (values with the same hash are kept in insertion order)
+  /*!
+    \return false if memory could not be allocated
+  */
+  bool insert(unsigned long iHash, const T& oValue)
+  {
+    if(!reserve(m_iSize + 1))
+      return false;
+    slot_t *pSlot = _findFreeSlot(iHash);
+    pSlot->iHash = iHash;
+    pSlot->bUsed = true;
+    pSlot->oValue = oValue;
+    ++m_iSize;
+    return true;
+  }
+
+  //! Find the first value with the given hash for which fnMatches(value) returns true
+  /*!
+    \return A pointer to the value, or NULL if there is no such value
+  */
+  template <class TPredicate>
+  const T* find(unsigned long iHash, TPredicate fnMatches) const
+  {
+    if(m_iNumSlots == 0)
+      return 0;
+    for(size_t i = iHash & (m_iNumSlots - 1); m_pSlots[i].bUsed; i = (i + 1) & (m_iNumSlots - 1))
+    {
+      if(m_pSlots[i].iHash == iHash && fnMatches(m_pSlots[i].oValue))
+        return &m_pSlots[i].oValue;
+    }
+    return 0;
+  }
+
+  //! Remove the first value with the given hash for which fnMatches(value) returns true
+  /*!
+    \return true if a value was removed, false if there was no such value
+  */
+  template <class TPredicate>
+  bool erase(unsigned long iHash, TPredicate fnMatches)
+  {
+    if(m_iNumSlots == 0)
+      return false;
+    size_t iMask = m_iNumSlots - 1;
+    size_t i = iHash & iMask;
+    while(m_pSlots[i].bUsed && !(m_pSlots[i].iHash == iHash && fnMatches(m_pSlots[i].oValue)))
+      i = (i + 1) & iMask;
+    if(!m_pSlots[i].bUsed)
+      return false;
+
+    // Values further along the probe sequence are moved back into the hole where they can be,
+    // as find() stops at the first unused slot
+    for(size_t j = (i + 1) & iMask; m_pSlots[j].bUsed; j = (j + 1) & iMask)
+    {
+      size_t iHome = m_pSlots[j].iHash & iMask;
+      if(((j - iHome) & iMask) >= ((j - i) & iMask))
+      {
+        m_pSlots[i] = m_pSlots[j];
+        i = j;
+      }
+    }
+    m_pSlots[i].bUsed = false;
+    --m_iSize;
+    return true;
+  }
+
+protected:
+  struct slot_t
+  {
+    unsigned long iHash;
+    bool bUsed;
+    T oValue;
+  };
+
+  slot_t* _findFreeSlot(unsigned long iHash)
+  {
+    size_t i = iHash & (m_iNumSlots - 1);
+    while(m_pSlots[i].bUsed)
+      i = (i + 1) & (m_iNumSlots - 1);
+    return m_pSlots + i;
+  }
+
+  slot_t* m_pSlots;
+  size_t m_iNumSlots;
+  size_t m_iSize;
+
+private:
+  RainHashIndex(const RainHashIndex&);
+  RainHashIndex& operator= (const RainHashIndex&);
+};
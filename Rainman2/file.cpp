@@ -25,11 +25,28 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "file.h"
 #include "exception.h"
 #include "new_trace.h"
-#include <direct.h>
+#include "threading.h"
 #include <stdio.h>
-#include <windows.h>
 #include <time.h>
 #include <errno.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <io.h>
+#include <windows.h>
+#else
+#include "memfile.h"
+#include <stdlib.h>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
 #ifdef RAINMAN2_USE_LUA
 extern "C" {
 #include <lua.h>
@@ -41,6 +58,70 @@ FileSystemStore g_oRainFSO;
 
 IFile::~IFile() {}
 
+void IFile::readAt(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw(...)
+{
+  if(readAtNoThrow(iPosition, pDestination, iItemSize, iItemCount) != iItemCount)
+    THROW_SIMPLE_(L"Unable to read %lu items from position %li", static_cast<unsigned long>(iItemCount), static_cast<long>(iPosition));
+}
+
+size_t IFile::readAtNoThrow(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+{
+  seek_offset_t iOldPosition = tell();
+  if(!seekNoThrow(iPosition, SR_Start))
+    return 0;
+  size_t iCount = readNoThrow(pDestination, iItemSize, iItemCount);
+  seekNoThrow(iOldPosition, SR_Start);
+  return iCount;
+}
+
+bool IFile::isReadAtThreadSafe() const throw()
+{
+  return false;
+}
+
+IFileView::~IFileView() {}
+
+//! View holding its own copy of the data, for files which are not held in memory
+class RainCopiedFileView : public IFileView
+{
+public:
+  RainCopiedFileView(char* pData, size_t iLength) throw()
+    : m_pData(pData), m_iLength(iLength) {}
+  virtual ~RainCopiedFileView() throw()
+  {
+    delete[] m_pData;
+  }
+
+  virtual const char* getData() const throw() {return m_pData;}
+  virtual size_t getLength() const throw() {return m_iLength;}
+  virtual bool isDirect() const throw() {return false;}
+
+protected:
+  char* m_pData;
+  size_t m_iLength;
+};
+
+IFileView* IFile::mapView(seek_offset_t iPosition, size_t iLength) throw(...)
+{
+  // At least one byte is allocated, so that even an empty view has a valid data pointer
+  char* pData = CHECK_ALLOCATION(new NOTHROW char[iLength ? iLength : 1]);
+  try
+  {
+    readAt(iPosition, pData, 1, iLength);
+  }
+  CATCH_THROW_SIMPLE_(delete[] pData, L"Cannot view %lu bytes at position %li", static_cast<unsigned long>(iLength), static_cast<long>(iPosition));
+  IFileView* pView = new NOTHROW RainCopiedFileView(pData, iLength);
+  if(pView == 0)
+    delete[] pData;
+  return CHECK_ALLOCATION(pView);
+}
+
+void IFile::writeGather(const file_buffer_t* pBuffers, size_t iCount) throw(...)
+{
+  for(size_t i = 0; i < iCount; ++i)
+    write(pBuffers[i].pData, 1, pBuffers[i].iLength);
+}
+
 #ifdef RAINMAN2_USE_LUA
 struct IFile_load_load_t
 {
@@ -308,7 +389,7 @@ IFile* IDirectory::openFileNoThrow(size_t iIndex, eFileOpenMode eMode) throw()
   catch(RainException *e)
   {
     delete e;
-    return false;
+    return 0;
   }
 }
 
@@ -334,7 +415,7 @@ IDirectory* IDirectory::openDirectoryNoThrow(size_t iIndex) throw()
   catch(RainException *e)
   {
     delete e;
-    return false;
+    return 0;
   }
 }
 
@@ -346,6 +427,7 @@ file_store_caps_t::file_store_caps_t() throw()
 file_store_caps_t& file_store_caps_t::operator= (bool bValue) throw()
 {
   bCanReadFiles = bCanWriteFiles = bCanDeleteFiles = bCanOpenDirectories = bValue;
+  bCanCreateDirectories = bCanDeleteDirectories = bCanReadConcurrently = bValue;
   return *this;
 }
 
@@ -371,6 +453,28 @@ void IFileStore::pumpFile(const RainString& sPath, IFile* pSink) throw(...)
   CATCH_THROW_SIMPLE_(delete pFile, L"Cannot pump file \'%s\'", sPath.getCharacters());
 }
 
+void IFileStore::pumpFiles(const std::vector<std::pair<RainString, IFile*> >& vFiles) throw(...)
+{
+  for(std::vector<std::pair<RainString, IFile*> >::const_iterator itr = vFiles.begin(); itr != vFiles.end(); ++itr)
+    pumpFile(itr->first, itr->second);
+}
+
+size_t IFileStore::readFileInto(const RainString& sPath, void* pBuffer, size_t iBufferSize) throw(...)
+{
+  IFile *pFile = 0;
+  try
+  {
+    pFile = openFile(sPath, FM_Read);
+    size_t iNumBytes = pFile->readArrayNoThrow(reinterpret_cast<char*>(pBuffer), iBufferSize);
+    char cExtra;
+    if(pFile->readOneNoThrow(cExtra) != 0)
+      THROW_SIMPLE_(L"File is larger than the %lu byte buffer", static_cast<unsigned long>(iBufferSize));
+    delete pFile;
+    return iNumBytes;
+  }
+  CATCH_THROW_SIMPLE_(delete pFile, L"Cannot read file \'%s\'", sPath.getCharacters());
+}
+
 FileSystemStore::FileSystemStore() throw()
 {
   m_bKnowEntryPoints = false;
@@ -380,6 +484,11 @@ FileSystemStore::~FileSystemStore() throw()
 {
 }
 
+bool IFileStore::getFileStorageOrder(const RainString& sPath, unsigned long& iOrder) throw()
+{
+  return false;
+}
+
 void FileSystemStore::getCaps(file_store_caps_t& oCaps) const throw()
 {
   oCaps = false;
@@ -389,6 +498,7 @@ void FileSystemStore::getCaps(file_store_caps_t& oCaps) const throw()
   oCaps.bCanOpenDirectories = true;
   oCaps.bCanCreateDirectories = true;
   oCaps.bCanDeleteDirectories = true;
+  oCaps.bCanReadConcurrently = true;
 }
 
 IFile* FileSystemStore::openFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
@@ -469,6 +579,7 @@ void FileSystemStore::_ensureGotEntryPoints() throw()
   if(!m_bKnowEntryPoints)
   {
     m_bKnowEntryPoints = true;
+#ifdef _WIN32
     unsigned long iDrives = _getdrives();
     for(char c = 'A'; iDrives; ++c, iDrives >>= 1)
     {
@@ -479,6 +590,10 @@ void FileSystemStore::_ensureGotEntryPoints() throw()
         m_vEntryPoints.push_back(sPath);
       }
     }
+#else
+    // POSIX has a single tree; paths below it are written as \usr\share etc.
+    m_vEntryPoints.push_back(L"/");
+#endif
   }
 }
 
@@ -541,6 +656,7 @@ RAINMAN2_API IFile* RainOpenFilePtr(FILE* pFile, bool bCloseWhenDone) throw(...)
   return CHECK_ALLOCATION(new NOTHROW RainFileAdapter(pFile, bCloseWhenDone));
 }
 
+#ifdef _WIN32
 IFile* RainOpenFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
 {
   const wchar_t* sMode;
@@ -550,8 +666,13 @@ IFile* RainOpenFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
     sMode = L"rb";
     break;
   case FM_Write:
-    sMode = L"wb";
+    sMode = L"w+b";
+    break;
+  case FM_Update:
+    sMode = L"r+b";
     break;
+  case FM_WriteAtomic:
+    return RainOpenFileAtomic(sPath);
   default:
     THROW_SIMPLE_(L"Unsupported file mode for opening \'%s\'", sPath.getCharacters());
   }
@@ -570,8 +691,21 @@ IFile* RainOpenFileNoThrow(const RainString& sPath, eFileOpenMode eMode) throw()
     sMode = L"rb";
     break;
   case FM_Write:
-    sMode = L"wb";
+    sMode = L"w+b";
+    break;
+  case FM_Update:
+    sMode = L"r+b";
     break;
+  case FM_WriteAtomic:
+    try
+    {
+      return RainOpenFileAtomic(sPath);
+    }
+    catch(RainException *e)
+    {
+      delete e;
+      return 0;
+    }
   default:
     return 0;
   }
@@ -581,10 +715,406 @@ IFile* RainOpenFileNoThrow(const RainString& sPath, eFileOpenMode eMode) throw()
   return new NOTHROW RainFileAdapter(pRawFile);
 }
 
+#else
+bool RainNativePath(const RainString& sPath, std::vector<char>& vNative) throw()
+{
+  RainString sSlashed(sPath);
+  sSlashed.replaceAll('\\', '/');
+  size_t iLength = wcstombs(0, sSlashed.getCharacters(), 0);
+  if(iLength == static_cast<size_t>(-1))
+    return false;
+  vNative.resize(iLength + 1);
+  wcstombs(&vNative[0], sSlashed.getCharacters(), iLength + 1);
+  return true;
+}
+
+static bool NativeStat(const RainString& sPath, struct stat& oStat) throw()
+{
+  std::vector<char> vNative;
+  return RainNativePath(sPath, vNative) && stat(&vNative[0], &oStat) == 0;
+}
+
+//! Reads up to iBytes from iPosition, retrying short and interrupted reads; returns the number of bytes read
+static size_t PositionalRead(int iDescriptor, void* pDestination, size_t iBytes, seek_offset_t iPosition) throw()
+{
+  size_t iDone = 0;
+  while(iDone < iBytes)
+  {
+    ssize_t iCount = pread(iDescriptor, reinterpret_cast<char*>(pDestination) + iDone, iBytes - iDone, iPosition + iDone);
+    if(iCount == -1 && errno == EINTR)
+      continue;
+    if(iCount <= 0)
+      break;
+    iDone += static_cast<size_t>(iCount);
+  }
+  return iDone;
+}
+
+//! Writes iBytes at iPosition, retrying short and interrupted writes; returns the number of bytes written
+static size_t PositionalWrite(int iDescriptor, const void* pSource, size_t iBytes, seek_offset_t iPosition) throw()
+{
+  size_t iDone = 0;
+  while(iDone < iBytes)
+  {
+    ssize_t iCount = pwrite(iDescriptor, reinterpret_cast<const char*>(pSource) + iDone, iBytes - iDone, iPosition + iDone);
+    if(iCount == -1 && errno == EINTR)
+      continue;
+    if(iCount <= 0)
+      break;
+    iDone += static_cast<size_t>(iCount);
+  }
+  return iDone;
+}
+
+//! IFile implementation on top of a POSIX file descriptor
+/*!
+  All I/O is positional (pread / pwrite) relative to a position kept in the object, so the
+  descriptor's own offset is never used and readAt() of a read-only file needs no locking.
+  Small reads and writes go through a single internal buffer, which holds either read-ahead
+  data or pending writes (never both), while requests at least as large as the buffer go
+  straight to the descriptor.
+  Reading a whole small file in one call therefore costs a single pread().
+*/
+class RainDescriptorFileAdapter : public IFile
+{
+public:
+  RainDescriptorFileAdapter(int iDescriptor, bool bWritable) throw()
+    : m_iDescriptor(iDescriptor), m_iPosition(0), m_iBufferStart(0), m_iBufferLength(0), m_bBufferDirty(false)
+    , m_bWriteFailed(false), m_bWritable(bWritable) {}
+  virtual ~RainDescriptorFileAdapter() throw()
+  {
+    if(m_iDescriptor != -1)
+    {
+      _flushNoThrow();
+      close(m_iDescriptor);
+    }
+  }
+
+  virtual void read(void* pDestination, size_t iItemSize, size_t iItemCount) throw(...)
+  {
+    if(readNoThrow(pDestination, iItemSize, iItemCount) != iItemCount)
+      THROW_SIMPLE(L"Unable to read all items from file");
+  }
+
+  virtual size_t readNoThrow(void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+  {
+    if(iItemSize == 0 || !_flushNoThrow())
+      return 0;
+    char* pDestinationBytes = reinterpret_cast<char*>(pDestination);
+    size_t iBytes = iItemSize * iItemCount, iDone = 0;
+    while(iDone < iBytes)
+    {
+      if(m_iPosition >= m_iBufferStart && m_iPosition < m_iBufferStart + static_cast<seek_offset_t>(m_iBufferLength))
+      {
+        size_t iOffset = static_cast<size_t>(m_iPosition - m_iBufferStart);
+        size_t iCount = std::min(m_iBufferLength - iOffset, iBytes - iDone);
+        memcpy(pDestinationBytes + iDone, m_aBuffer + iOffset, iCount);
+        iDone += iCount;
+        m_iPosition += static_cast<seek_offset_t>(iCount);
+      }
+      else if(iBytes - iDone >= BUFFER_SIZE)
+      {
+        size_t iCount = PositionalRead(m_iDescriptor, pDestinationBytes + iDone, iBytes - iDone, m_iPosition);
+        iDone += iCount;
+        m_iPosition += static_cast<seek_offset_t>(iCount);
+        break;
+      }
+      else
+      {
+        m_iBufferStart = m_iPosition;
+        m_iBufferLength = PositionalRead(m_iDescriptor, m_aBuffer, BUFFER_SIZE, m_iPosition);
+        if(m_iBufferLength == 0)
+          break;
+      }
+    }
+    return iDone / iItemSize;
+  }
+
+  virtual void write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...)
+  {
+    if(writeNoThrow(pSource, iItemSize, iItemCount) != iItemCount)
+      THROW_SIMPLE(L"Unable to write all items to file");
+  }
+
+  virtual size_t writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw()
+  {
+    if(iItemSize == 0)
+      return 0;
+    size_t iBytes = iItemSize * iItemCount;
+    if(!m_bBufferDirty)
+      m_iBufferLength = 0; // Discard read-ahead, as the write may overlap it
+    else if(m_iBufferStart + static_cast<seek_offset_t>(m_iBufferLength) != m_iPosition || m_iBufferLength + iBytes > BUFFER_SIZE)
+    {
+      if(!_flushNoThrow())
+        return 0;
+    }
+    if(iBytes >= BUFFER_SIZE)
+    {
+      size_t iCount = PositionalWrite(m_iDescriptor, pSource, iBytes, m_iPosition);
+      m_iPosition += static_cast<seek_offset_t>(iCount);
+      if(iCount != iBytes)
+        m_bWriteFailed = true;
+      return iCount / iItemSize;
+    }
+    if(m_iBufferLength == 0)
+    {
+      m_iBufferStart = m_iPosition;
+      m_bBufferDirty = true;
+    }
+    memcpy(m_aBuffer + m_iBufferLength, pSource, iBytes);
+    m_iBufferLength += iBytes;
+    m_iPosition += static_cast<seek_offset_t>(iBytes);
+    return iItemCount;
+  }
+
+  virtual void seek(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw(...)
+  {
+    if(!seekNoThrow(iOffset, eRelativeTo))
+      THROW_SIMPLE(L"Unable to seek to position in file");
+  }
+
+  virtual bool seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw()
+  {
+    seek_offset_t iBase;
+    switch(eRelativeTo)
+    {
+    case SR_Start:
+      iBase = 0;
+      break;
+    case SR_Current:
+      iBase = m_iPosition;
+      break;
+    case SR_End:
+      {
+        struct stat oStat;
+        if(fstat(m_iDescriptor, &oStat) != 0)
+          return false;
+        iBase = static_cast<seek_offset_t>(oStat.st_size);
+        // Pending writes may extend the file beyond what the filesystem knows about
+        if(m_bBufferDirty && m_iBufferStart + static_cast<seek_offset_t>(m_iBufferLength) > iBase)
+          iBase = m_iBufferStart + static_cast<seek_offset_t>(m_iBufferLength);
+      }
+      break;
+    default:
+      return false;
+    }
+    if(iBase + iOffset < 0)
+      return false;
+    m_iPosition = iBase + iOffset;
+    return true;
+  }
+
+  virtual seek_offset_t tell() throw()
+  {
+    return m_iPosition;
+  }
+
+  virtual size_t readAtNoThrow(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+  {
+    // Pending writes have to reach the file first, which modifies the buffer; otherwise neither
+    // the buffer nor the position are touched.
+    if(iItemSize == 0 || (m_bBufferDirty && !_flushNoThrow()))
+      return 0;
+    return PositionalRead(m_iDescriptor, pDestination, iItemSize * iItemCount, iPosition) / iItemSize;
+  }
+
+  //! Only read-only files, as positional reads of writable files may flush pending writes
+  virtual bool isReadAtThreadSafe() const throw()
+  {
+    return !m_bWritable;
+  }
+
+  virtual void writeGather(const file_buffer_t* pBuffers, size_t iCount) throw(...)
+  {
+    if(!_writeGatherNoThrow(pBuffers, iCount))
+      THROW_SIMPLE(L"Unable to write all buffers to file");
+  }
+
+protected:
+  //! Writes the buffers with as few pwritev() calls as possible, retrying short and interrupted writes
+  bool _writeGatherNoThrow(const file_buffer_t* pBuffers, size_t iCount) throw()
+  {
+    // Small amounts of data are better off gathered in the internal buffer
+    size_t iTotal = 0;
+    for(size_t i = 0; i < iCount; ++i)
+      iTotal += pBuffers[i].iLength;
+    if(iTotal < BUFFER_SIZE)
+    {
+      for(size_t i = 0; i < iCount; ++i)
+      {
+        if(writeNoThrow(pBuffers[i].pData, 1, pBuffers[i].iLength) != pBuffers[i].iLength)
+          return false;
+      }
+      return true;
+    }
+
+    if(!_flushNoThrow())
+      return false;
+    m_iBufferLength = 0; // Discard read-ahead, as the write may overlap it
+    struct iovec aVectors[GATHER_COUNT];
+    size_t iBuffer = 0, iSkip = 0; // iSkip bytes of pBuffers[iBuffer] have already been written
+    for(;;)
+    {
+      while(iBuffer < iCount && iSkip == pBuffers[iBuffer].iLength)
+      {
+        ++iBuffer;
+        iSkip = 0;
+      }
+      if(iBuffer == iCount)
+        return true;
+
+      int iVectorCount = 0;
+      for(size_t i = iBuffer; i < iCount && iVectorCount < GATHER_COUNT; ++i, ++iVectorCount)
+      {
+        size_t iOffset = (i == iBuffer) ? iSkip : 0;
+        aVectors[iVectorCount].iov_base = const_cast<char*>(reinterpret_cast<const char*>(pBuffers[i].pData)) + iOffset;
+        aVectors[iVectorCount].iov_len = pBuffers[i].iLength - iOffset;
+      }
+      ssize_t iWritten = pwritev(m_iDescriptor, aVectors, iVectorCount, m_iPosition);
+      if(iWritten == -1 && errno == EINTR)
+        continue;
+      if(iWritten <= 0)
+      {
+        m_bWriteFailed = true;
+        return false;
+      }
+      m_iPosition += static_cast<seek_offset_t>(iWritten);
+      for(size_t iRemaining = static_cast<size_t>(iWritten); iRemaining != 0;)
+      {
+        size_t iConsumed = std::min(iRemaining, pBuffers[iBuffer].iLength - iSkip);
+        iRemaining -= iConsumed;
+        iSkip += iConsumed;
+        if(iSkip == pBuffers[iBuffer].iLength)
+        {
+          ++iBuffer;
+          iSkip = 0;
+        }
+      }
+    }
+  }
+
+  bool _flushNoThrow() throw()
+  {
+    if(!m_bBufferDirty)
+      return true;
+    bool bWritten = PositionalWrite(m_iDescriptor, m_aBuffer, m_iBufferLength, m_iBufferStart) == m_iBufferLength;
+    m_bBufferDirty = false;
+    m_iBufferLength = 0;
+    if(!bWritten)
+      m_bWriteFailed = true;
+    return bWritten;
+  }
+
+  static const size_t BUFFER_SIZE = 0x10000;
+  static const int GATHER_COUNT = 64; //!< Maximum number of buffers passed to one pwritev() call
+
+  int m_iDescriptor;
+  seek_offset_t m_iPosition;
+  seek_offset_t m_iBufferStart;
+  size_t m_iBufferLength;
+  bool m_bBufferDirty;
+  bool m_bWriteFailed; //!< Set once any data has failed to reach the file
+  bool m_bWritable;
+  char m_aBuffer[BUFFER_SIZE];
+};
+
+//! Read-only files at least this large are memory mapped rather than read through a buffer
+static const off_t MAP_THRESHOLD = 0x40000;
+
+static int OpenDescriptor(const RainString& sPath, eFileOpenMode eMode) throw()
+{
+  int iFlags;
+  switch(eMode)
+  {
+  case FM_Read:
+    iFlags = O_RDONLY;
+    break;
+  case FM_Write:
+    iFlags = O_RDWR | O_CREAT | O_TRUNC;
+    break;
+  case FM_Update:
+    iFlags = O_RDWR;
+    break;
+  default:
+    return -1;
+  }
+  std::vector<char> vNative;
+  if(!RainNativePath(sPath, vNative))
+    return -1;
+  int iDescriptor;
+  do
+  {
+    iDescriptor = open(&vNative[0], iFlags | O_CLOEXEC, 0666);
+  } while(iDescriptor == -1 && errno == EINTR);
+  return iDescriptor;
+}
+
+//! Wraps an open descriptor in the most suitable IFile, taking ownership of it; returns 0 on failure
+static IFile* AdaptDescriptor(int iDescriptor, eFileOpenMode eMode) throw()
+{
+  if(eMode == FM_Read)
+  {
+    struct stat oStat;
+    if(fstat(iDescriptor, &oStat) == 0 && S_ISREG(oStat.st_mode) && oStat.st_size >= MAP_THRESHOLD)
+    {
+      MemoryMappedFile *pMapped = new NOTHROW MemoryMappedFile;
+      if(pMapped && pMapped->mapDescriptorNoThrow(iDescriptor))
+      {
+        // The mapping keeps the file alive, so the descriptor is no longer needed
+        close(iDescriptor);
+        return pMapped;
+      }
+      delete pMapped;
+    }
+  }
+  IFile *pFile = new NOTHROW RainDescriptorFileAdapter(iDescriptor, eMode != FM_Read);
+  if(pFile == 0)
+    close(iDescriptor);
+  return pFile;
+}
+
+IFile* RainOpenFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
+{
+  if(eMode == FM_WriteAtomic)
+    return RainOpenFileAtomic(sPath);
+  if(eMode != FM_Read && eMode != FM_Write && eMode != FM_Update)
+    THROW_SIMPLE_(L"Unsupported file mode for opening \'%s\'", sPath.getCharacters());
+  int iDescriptor = OpenDescriptor(sPath, eMode);
+  if(iDescriptor == -1)
+    THROW_SIMPLE_(L"Unable to open \'%s\'", sPath.getCharacters());
+  return CHECK_ALLOCATION(AdaptDescriptor(iDescriptor, eMode));
+}
+
+IFile* RainOpenFileNoThrow(const RainString& sPath, eFileOpenMode eMode) throw()
+{
+  if(eMode == FM_WriteAtomic)
+  {
+    try
+    {
+      return RainOpenFileAtomic(sPath);
+    }
+    catch(RainException *e)
+    {
+      delete e;
+      return 0;
+    }
+  }
+  int iDescriptor = OpenDescriptor(sPath, eMode);
+  if(iDescriptor == -1)
+    return 0;
+  return AdaptDescriptor(iDescriptor, eMode);
+}
+#endif
+
 bool RainDoesFileExist(const RainString& sPath) throw()
 {
+#ifdef _WIN32
   DWORD dwAttributes = GetFileAttributes(sPath.getCharacters());
   return dwAttributes != INVALID_FILE_ATTRIBUTES && (dwAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0;
+#else
+  struct stat oStat;
+  return NativeStat(sPath, oStat) && !S_ISDIR(oStat.st_mode);
+#endif
 }
 
 void RainDeleteFile(const RainString& sPath) throw(...)
@@ -595,9 +1125,445 @@ void RainDeleteFile(const RainString& sPath) throw(...)
 
 bool RainDeleteFileNoThrow(const RainString& sPath) throw()
 {
+#ifdef _WIN32
   return DeleteFile(sPath.getCharacters()) == TRUE;
+#else
+  std::vector<char> vNative;
+  return RainNativePath(sPath, vNative) && unlink(&vNative[0]) == 0;
+#endif
+}
+
+//! Generate a path next to sPath for writing its replacement to
+/*!
+  The final rename is only atomic within a single volume, so the temporary file goes in the
+  directory of the target rather than in a system temporary directory.
+*/
+static RainString TemporaryPathFor(const RainString& sPath) throw(...)
+{
+  static volatile long s_iCounter = 0;
+#ifdef _WIN32
+  unsigned long iProcess = static_cast<unsigned long>(GetCurrentProcessId());
+#else
+  unsigned long iProcess = static_cast<unsigned long>(getpid());
+#endif
+  RainString sSuffix;
+  sSuffix.printf(L".%lu-%li.tmp", iProcess, RainAtomicIncrement(&s_iCounter));
+  return sPath + sSuffix;
+}
+
+#ifndef _WIN32
+//! Get the directory containing sPath, with a trailing separator, or an empty string for a bare name
+static RainString DirectoryOf(const RainString& sPath) throw(...)
+{
+  RainString sDirectory(sPath);
+  sDirectory.replaceAll('/', '\\');
+  return sDirectory.prefix(sDirectory.length() - sDirectory.afterLast('\\').length());
+}
+#endif
+
+//! Move a completed temporary file over its target, replacing any existing file
+static bool ReplaceWithTemporary(const RainString& sTemporaryPath, const RainString& sPath) throw()
+{
+#ifdef _WIN32
+  return MoveFileExW(sTemporaryPath.getCharacters(), sPath.getCharacters(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+#else
+  std::vector<char> vFrom, vTo;
+  return RainNativePath(sTemporaryPath, vFrom) && RainNativePath(sPath, vTo) && rename(&vFrom[0], &vTo[0]) == 0;
+#endif
+}
+
+//! Called once the temporary file of an atomic write has been closed
+/*!
+  This is the only function which can add files to a batch, and is not for use outside of this file.
+  \param iDescriptor For files of a batch, the still open temporary file (or -1), which the batch takes over
+*/
+void RainFinishAtomicWrite(const RainString& sTemporaryPath, const RainString& sPath, RainWriteBatch* pBatch, bool bWritten, int iDescriptor) throw()
+{
+  if(pBatch)
+    pBatch->_addPending(sTemporaryPath, sPath, bWritten, iDescriptor);
+  else if(!bWritten || !ReplaceWithTemporary(sTemporaryPath, sPath))
+    RainDeleteFileNoThrow(sTemporaryPath);
+}
+
+#ifdef _WIN32
+class RainAtomicFileAdapter : public RainFileAdapter
+{
+public:
+  RainAtomicFileAdapter(FILE* pRawFile, const RainString& sTemporaryPath, const RainString& sPath, RainWriteBatch* pBatch, seek_offset_t iReservedSize) throw()
+    : RainFileAdapter(pRawFile, false), m_sTemporaryPath(sTemporaryPath), m_sPath(sPath), m_pBatch(pBatch)
+    , m_iReservedSize(iReservedSize), m_iEnd(0), m_bWriteFailed(false) {}
+  virtual ~RainAtomicFileAdapter() throw()
+  {
+    bool bWritten = !m_bWriteFailed && fflush(m_pFile) == 0;
+    // Space reserved but never written must not become part of the file
+    if(bWritten && m_iReservedSize > m_iEnd)
+      bWritten = _chsize_s(_fileno(m_pFile), m_iEnd) == 0;
+    // Files of a batch are flushed to disk together when the batch is committed
+    if(bWritten && m_pBatch == 0)
+      bWritten = _commit(_fileno(m_pFile)) == 0;
+    if(fclose(m_pFile) != 0)
+      bWritten = false;
+    RainFinishAtomicWrite(m_sTemporaryPath, m_sPath, m_pBatch, bWritten, -1);
+  }
+
+  virtual size_t writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw()
+  {
+    size_t iCount = RainFileAdapter::writeNoThrow(pSource, iItemSize, iItemCount);
+    if(iCount != iItemCount)
+      m_bWriteFailed = true;
+    seek_offset_t iPosition = tell();
+    if(iPosition > m_iEnd)
+      m_iEnd = iPosition;
+    return iCount;
+  }
+
+  virtual bool seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw()
+  {
+    // The file size includes any reserved space, but where the file really ends is already known
+    if(eRelativeTo == SR_End)
+      return RainFileAdapter::seekNoThrow(m_iEnd + iOffset, SR_Start);
+    return RainFileAdapter::seekNoThrow(iOffset, eRelativeTo);
+  }
+
+protected:
+  RainString m_sTemporaryPath;
+  RainString m_sPath;
+  RainWriteBatch* m_pBatch;
+  seek_offset_t m_iReservedSize;
+  seek_offset_t m_iEnd;
+  bool m_bWriteFailed;
+};
+
+IFile* RainOpenFileAtomic(const RainString& sPath, unsigned long long iExpectedSize, RainWriteBatch* pBatch) throw(...)
+{
+  RainString sTemporaryPath = TemporaryPathFor(sPath);
+  FILE* pRawFile = _wfopen(sTemporaryPath.getCharacters(), L"w+b");
+  if(pRawFile == 0)
+    THROW_SIMPLE_(L"Unable to create a temporary file for \'%s\'", sPath.getCharacters());
+  if(iExpectedSize != 0)
+  {
+    // As on other platforms, the space is reserved up front, so that a full disk is reported now
+    // rather than part way through writing. The file is cut back to what was written when closed.
+    errno_t iError = iExpectedSize > 0x7FFFFFFFULL ? EFBIG : _chsize_s(_fileno(pRawFile), static_cast<__int64>(iExpectedSize));
+    if(iError == ENOSPC || iError == EFBIG)
+    {
+      fclose(pRawFile);
+      RainDeleteFileNoThrow(sTemporaryPath);
+      THROW_SIMPLE_(L"Not enough space to write %llu bytes to \'%s\'", iExpectedSize, sPath.getCharacters());
+    }
+  }
+  RainAtomicFileAdapter* pFile = new NOTHROW RainAtomicFileAdapter(pRawFile, sTemporaryPath, sPath, pBatch, static_cast<seek_offset_t>(iExpectedSize));
+  if(pFile == 0)
+  {
+    fclose(pRawFile);
+    RainDeleteFileNoThrow(sTemporaryPath);
+  }
+  return CHECK_ALLOCATION(pFile);
+}
+#else
+class RainAtomicFileAdapter : public RainDescriptorFileAdapter
+{
+public:
+  RainAtomicFileAdapter(int iDescriptor, const RainString& sTemporaryPath, const RainString& sPath, RainWriteBatch* pBatch, seek_offset_t iReservedSize) throw()
+    : RainDescriptorFileAdapter(iDescriptor, true), m_sTemporaryPath(sTemporaryPath), m_sPath(sPath), m_pBatch(pBatch)
+    , m_iReservedSize(iReservedSize), m_iEnd(0) {}
+  virtual ~RainAtomicFileAdapter() throw()
+  {
+    bool bWritten = _flushNoThrow() && !m_bWriteFailed;
+    // Space reserved but never written must not become part of the file
+    if(bWritten && m_iReservedSize > m_iEnd)
+      bWritten = ftruncate(m_iDescriptor, m_iEnd) == 0;
+    if(m_pBatch)
+    {
+      // Files of a batch are flushed to disk together when the batch is committed, which is
+      // given the descriptor so that it need not reopen the file to flush it
+      int iDescriptor = m_iDescriptor;
+      m_iDescriptor = -1;
+      RainFinishAtomicWrite(m_sTemporaryPath, m_sPath, m_pBatch, bWritten, iDescriptor);
+      return;
+    }
+    if(bWritten)
+      bWritten = fsync(m_iDescriptor) == 0;
+    if(close(m_iDescriptor) != 0)
+      bWritten = false;
+    m_iDescriptor = -1;
+    RainFinishAtomicWrite(m_sTemporaryPath, m_sPath, m_pBatch, bWritten, -1);
+  }
+
+  virtual size_t writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw()
+  {
+    size_t iCount = RainDescriptorFileAdapter::writeNoThrow(pSource, iItemSize, iItemCount);
+    if(m_iPosition > m_iEnd)
+      m_iEnd = m_iPosition;
+    return iCount;
+  }
+
+  virtual void writeGather(const file_buffer_t* pBuffers, size_t iCount) throw(...)
+  {
+    bool bWritten = _writeGatherNoThrow(pBuffers, iCount);
+    if(m_iPosition > m_iEnd)
+      m_iEnd = m_iPosition;
+    if(!bWritten)
+      THROW_SIMPLE(L"Unable to write all buffers to file");
+  }
+
+  virtual bool seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw()
+  {
+    // The filesystem's idea of the file size includes any reserved space, but as nobody else
+    // can be writing to the file, where it really ends is already known
+    if(eRelativeTo == SR_End)
+      return RainDescriptorFileAdapter::seekNoThrow(m_iEnd + iOffset, SR_Start);
+    return RainDescriptorFileAdapter::seekNoThrow(iOffset, eRelativeTo);
+  }
+
+protected:
+  RainString m_sTemporaryPath;
+  RainString m_sPath;
+  RainWriteBatch* m_pBatch;
+  seek_offset_t m_iReservedSize;
+  seek_offset_t m_iEnd;
+};
+
+IFile* RainOpenFileAtomic(const RainString& sPath, unsigned long long iExpectedSize, RainWriteBatch* pBatch) throw(...)
+{
+  RainString sTemporaryPath = TemporaryPathFor(sPath);
+  std::vector<char> vNative;
+  if(!RainNativePath(sTemporaryPath, vNative))
+    THROW_SIMPLE_(L"Cannot convert \'%s\' to a native path", sTemporaryPath.getCharacters());
+  int iDescriptor = open(&vNative[0], O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if(iDescriptor == -1)
+    THROW_SIMPLE_(L"Unable to create a temporary file for \'%s\'", sPath.getCharacters());
+  {
+    // A replacement keeps the permissions of the file which it replaces
+    std::vector<char> vTarget;
+    struct stat oStat;
+    if(RainNativePath(sPath, vTarget) && stat(&vTarget[0], &oStat) == 0 && fchmod(iDescriptor, oStat.st_mode & 07777) != 0)
+    {
+      close(iDescriptor);
+      unlink(&vNative[0]);
+      THROW_SIMPLE_(L"Unable to give the temporary file for \'%s\' the same permissions", sPath.getCharacters());
+    }
+  }
+  if(iExpectedSize != 0)
+  {
+    // Reserving the space up front stops the file growing one small extent at a time, and
+    // reports a full disk now rather than part way through writing
+    int iError = posix_fallocate(iDescriptor, 0, static_cast<off_t>(iExpectedSize));
+    if(iError == ENOSPC || iError == EFBIG)
+    {
+      close(iDescriptor);
+      unlink(&vNative[0]);
+      THROW_SIMPLE_(L"Not enough space to write %llu bytes to \'%s\'", iExpectedSize, sPath.getCharacters());
+    }
+  }
+  RainAtomicFileAdapter* pFile = new NOTHROW RainAtomicFileAdapter(iDescriptor, sTemporaryPath, sPath, pBatch, static_cast<seek_offset_t>(iExpectedSize));
+  if(pFile == 0)
+  {
+    close(iDescriptor);
+    unlink(&vNative[0]);
+  }
+  return CHECK_ALLOCATION(pFile);
+}
+#endif
+
+#ifndef _WIN32
+//! The most temporary files which a RainWriteBatch keeps open; any more are reopened by commit()
+static const size_t BATCH_MAXIMUM_DESCRIPTORS = 256;
+#endif
+
+RainWriteBatch::RainWriteBatch() throw()
+  : m_iDescriptorCount(0)
+{
+}
+
+RainWriteBatch::~RainWriteBatch() throw()
+{
+  discard();
 }
 
+IFile* RainWriteBatch::openFile(const RainString& sPath, unsigned long long iExpectedSize) throw(...)
+{
+  return RainOpenFileAtomic(sPath, iExpectedSize, this);
+}
+
+void RainWriteBatch::_addPending(const RainString& sTemporaryPath, const RainString& sPath, bool bWritten, int iDescriptor) throw()
+{
+  if(!bWritten)
+  {
+#ifndef _WIN32
+    if(iDescriptor != -1)
+      close(iDescriptor);
+#endif
+    RainDeleteFileNoThrow(sTemporaryPath);
+    return;
+  }
+  pending_t oPending;
+  oPending.sTemporaryPath = sTemporaryPath;
+  oPending.sPath = sPath;
+  oPending.iDescriptor = iDescriptor;
+  RainMutexLock oLock(m_oMutex);
+#ifndef _WIN32
+  if(iDescriptor != -1)
+  {
+    if(m_iDescriptorCount < BATCH_MAXIMUM_DESCRIPTORS)
+      ++m_iDescriptorCount;
+    else
+    {
+      // Too many open files would exhaust the process's descriptors, so this one is reopened later
+      close(iDescriptor);
+      oPending.iDescriptor = -1;
+    }
+  }
+#endif
+  m_vPending.push_back(oPending);
+}
+
+void RainWriteBatch::_closeDescriptors(std::vector<pending_t>& vPending) throw()
+{
+#ifndef _WIN32
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); itr != vPending.end(); ++itr)
+  {
+    if(itr->iDescriptor != -1)
+    {
+      close(itr->iDescriptor);
+      itr->iDescriptor = -1;
+    }
+  }
+#endif
+}
+
+size_t RainWriteBatch::getPendingCount() throw()
+{
+  RainMutexLock oLock(m_oMutex);
+  return m_vPending.size();
+}
+
+void RainWriteBatch::discard() throw()
+{
+  std::vector<pending_t> vPending;
+  {
+    RainMutexLock oLock(m_oMutex);
+    vPending.swap(m_vPending);
+    m_iDescriptorCount = 0;
+  }
+  _closeDescriptors(vPending);
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); itr != vPending.end(); ++itr)
+    RainDeleteFileNoThrow(itr->sTemporaryPath);
+}
+
+void RainWriteBatch::commit() throw(...)
+{
+  std::vector<pending_t> vPending;
+  {
+    RainMutexLock oLock(m_oMutex);
+    vPending.swap(m_vPending);
+    m_iDescriptorCount = 0;
+  }
+  if(vPending.empty())
+    return;
+
+  // Nothing may be renamed into place before its contents are safely on disk
+  bool bSynced = true;
+#ifdef _WIN32
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); itr != vPending.end(); ++itr)
+  {
+    HANDLE hFile = CreateFileW(itr->sTemporaryPath.getCharacters(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(hFile == INVALID_HANDLE_VALUE || FlushFileBuffers(hFile) == FALSE)
+      bSynced = false;
+    if(hFile != INVALID_HANDLE_VALUE)
+      CloseHandle(hFile);
+  }
+#else
+  // The directories are kept open so that the renames can be made durable afterwards
+  std::vector<RainString> vDirectoryPaths;
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); itr != vPending.end(); ++itr)
+    vDirectoryPaths.push_back(DirectoryOf(itr->sPath));
+  std::sort(vDirectoryPaths.begin(), vDirectoryPaths.end());
+  vDirectoryPaths.erase(std::unique(vDirectoryPaths.begin(), vDirectoryPaths.end()), vDirectoryPaths.end());
+  std::vector<int> vDirectories;
+  for(std::vector<RainString>::iterator itr = vDirectoryPaths.begin(); itr != vDirectoryPaths.end(); ++itr)
+  {
+    std::vector<char> vNative;
+    int iDescriptor = -1;
+    if(itr->isEmpty())
+      iDescriptor = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    else if(RainNativePath(*itr, vNative))
+      iDescriptor = open(&vNative[0], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(iDescriptor == -1)
+      bSynced = false;
+    else
+      vDirectories.push_back(iDescriptor);
+  }
+  // Files of the batch which were not kept open are reopened, as only a descriptor can be flushed
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); bSynced && itr != vPending.end(); ++itr)
+  {
+    if(itr->iDescriptor != -1)
+      continue;
+    std::vector<char> vNative;
+    if(RainNativePath(itr->sTemporaryPath, vNative))
+      itr->iDescriptor = open(&vNative[0], O_RDONLY | O_CLOEXEC);
+    if(itr->iDescriptor == -1)
+      bSynced = false;
+  }
+#ifdef __linux__
+  // Starting write-back of every file before waiting on any of them lets the disk take the whole
+  // batch at once, rather than one file per round trip
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); bSynced && itr != vPending.end(); ++itr)
+    sync_file_range(itr->iDescriptor, 0, 0, SYNC_FILE_RANGE_WRITE);
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); bSynced && itr != vPending.end(); ++itr)
+  {
+    if(fdatasync(itr->iDescriptor) != 0)
+      bSynced = false;
+  }
+#else
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); bSynced && itr != vPending.end(); ++itr)
+  {
+    if(fsync(itr->iDescriptor) != 0)
+      bSynced = false;
+  }
+#endif
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); itr != vPending.end(); ++itr)
+  {
+    if(itr->iDescriptor != -1 && close(itr->iDescriptor) != 0)
+      bSynced = false;
+    itr->iDescriptor = -1;
+  }
+#endif
+  if(!bSynced)
+  {
+#ifndef _WIN32
+    for(std::vector<int>::iterator itr = vDirectories.begin(); itr != vDirectories.end(); ++itr)
+      close(*itr);
+#endif
+    // Leave the batch as it was, so that the caller can choose to retry or discard it
+    RainMutexLock oLock(m_oMutex);
+    m_vPending.insert(m_vPending.end(), vPending.begin(), vPending.end());
+    THROW_SIMPLE_(L"Cannot flush %lu files to disk", static_cast<unsigned long>(vPending.size()));
+  }
+
+  size_t iFailed = 0;
+  RainString sFirstFailure;
+  for(std::vector<pending_t>::iterator itr = vPending.begin(); itr != vPending.end(); ++itr)
+  {
+    if(!ReplaceWithTemporary(itr->sTemporaryPath, itr->sPath))
+    {
+      if(iFailed++ == 0)
+        sFirstFailure = itr->sPath;
+      RainDeleteFileNoThrow(itr->sTemporaryPath);
+    }
+  }
+#ifndef _WIN32
+  for(std::vector<int>::iterator itr = vDirectories.begin(); itr != vDirectories.end(); ++itr)
+  {
+    fsync(*itr);
+    close(*itr);
+  }
+#endif
+  if(iFailed != 0)
+    THROW_SIMPLE_(L"Cannot move %lu of %lu files into place, including \'%s\'", static_cast<unsigned long>(iFailed), static_cast<unsigned long>(vPending.size()), sFirstFailure.getCharacters());
+}
+
+#ifdef _WIN32
 class RainDirectoryAdapter : public IDirectory
 {
 public:
@@ -674,6 +1640,213 @@ protected:
   std::vector<WIN32_FIND_DATAW*> m_vItems;
 };
 
+#else
+//! IDirectory implementation for POSIX filesystems
+/*!
+  Names and (usually) types come from the directory listing itself. Sizes and timestamps are
+  only fetched when first asked for, one system call per item covering every field requested,
+  and are then cached for the lifetime of the object. Hence the separate calls which
+  auto_directory_item makes for each field cost at most one stat between them.
+*/
+class RainDirectoryAdapter : public IDirectory
+{
+public:
+  RainDirectoryAdapter(IFileStore* pStore) throw() : m_pStore(pStore), m_iDescriptor(-1) {}
+  virtual ~RainDirectoryAdapter() throw()
+  {
+    if(m_iDescriptor != -1)
+      close(m_iDescriptor);
+  }
+
+  void init(RainString sPath) throw(...)
+  {
+    m_sPath = sPath;
+    m_sPath.replaceAll('/', '\\');
+    if(m_sPath.suffix(1).compareCaseless(L"\\") != 0)
+      m_sPath += L"\\";
+
+    std::vector<char> vNative;
+    if(!RainNativePath(m_sPath, vNative))
+      THROW_SIMPLE_(L"Cannot convert \'%s\' to a native path", m_sPath.getCharacters());
+    // The descriptor is kept so that item details can later be fetched with fstatat()
+    m_iDescriptor = open(&vNative[0], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(m_iDescriptor == -1)
+      THROW_SIMPLE_(L"Cannot iterate contents of \'%s\'", m_sPath.getCharacters());
+
+#ifdef __linux__
+    // getdents64 fills a large buffer with many entries per system call
+    std::vector<char> vBuffer(0x8000);
+    while(true)
+    {
+      long iCount = syscall(SYS_getdents64, m_iDescriptor, &vBuffer[0], vBuffer.size());
+      if(iCount == -1 && errno == EINTR)
+        continue;
+      if(iCount < 0)
+        THROW_SIMPLE_(L"Cannot iterate contents of \'%s\'", m_sPath.getCharacters());
+      if(iCount == 0)
+        break;
+      for(long iOffset = 0; iOffset < iCount;)
+      {
+        const linux_dirent64_t* pEntry = reinterpret_cast<const linux_dirent64_t*>(&vBuffer[iOffset]);
+        _addItem(pEntry->d_name, pEntry->d_type);
+        iOffset += pEntry->d_reclen;
+      }
+    }
+#else
+    // fdopendir() takes ownership of the descriptor it is given, so give it a copy
+    int iCopy = dup(m_iDescriptor);
+    DIR* pDirectory = iCopy == -1 ? 0 : fdopendir(iCopy);
+    if(pDirectory == 0)
+    {
+      if(iCopy != -1)
+        close(iCopy);
+      THROW_SIMPLE_(L"Cannot iterate contents of \'%s\'", m_sPath.getCharacters());
+    }
+    for(dirent* pEntry; (pEntry = readdir(pDirectory)) != 0;)
+      _addItem(pEntry->d_name, pEntry->d_type);
+    closedir(pDirectory);
+#endif
+  }
+
+  virtual size_t getItemCount() throw() {return m_vItems.size();}
+  virtual void getItemDetails(size_t iIndex, directory_item_t& oDetails) throw(...)
+  {
+    CHECK_RANGE_LTMAX(0, iIndex, m_vItems.size());
+    item_t& oItem = m_vItems[iIndex];
+    if((oDetails.oFields.dir && !oItem.oFieldsKnown.dir) || (oDetails.oFields.size && !oItem.oFieldsKnown.size)
+      || (oDetails.oFields.time && !oItem.oFieldsKnown.time))
+    {
+      _fetchDetails(oItem, oDetails.oFields);
+    }
+
+    if(oDetails.oFields.name)
+      oDetails.sName = oItem.sName;
+    if(oDetails.oFields.dir)
+      oDetails.bIsDirectory = oItem.bIsDirectory;
+    if(oDetails.oFields.size)
+    {
+      oDetails.iSize.iUpper = static_cast<unsigned long>(oItem.iSize >> 32);
+      oDetails.iSize.iLower = static_cast<unsigned long>(oItem.iSize & 0xFFFFFFFF);
+    }
+    if(oDetails.oFields.time)
+      oDetails.iTimestamp = oItem.iTimestamp;
+  }
+
+  virtual const RainString& getPath() throw() {return m_sPath;}
+  virtual IFileStore* getStore() throw() {return m_pStore;}
+
+protected:
+  //! Layout of the records returned by the getdents64 system call
+  struct linux_dirent64_t
+  {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+  };
+
+  //! Cached details of one entry; the fields in oFieldsKnown have been filled in
+  struct item_t
+  {
+    RainString sName;
+    std::string sNativeName;
+    directory_item_t::field_list_t oFieldsKnown;
+    bool bIsDirectory;
+    unsigned long long iSize;
+    filetime_t iTimestamp;
+  };
+
+  //! Fill in the fields of oWanted which are not yet known for an item, with a single system call
+  /*!
+    Where statx() is available, only the requested fields are asked for, though anything extra
+    that the kernel returns is cached as well. Should the item have vanished since the directory
+    was listed, the requested fields are given default values rather than an exception thrown,
+    as documented for IDirectory::getItemDetails().
+  */
+  void _fetchDetails(item_t& oItem, const directory_item_t::field_list_t& oWanted) throw()
+  {
+#if defined(__linux__) && defined(STATX_SIZE)
+    unsigned int iMask = 0;
+    if(oWanted.dir && !oItem.oFieldsKnown.dir)
+      iMask |= STATX_TYPE;
+    if(oWanted.size && !oItem.oFieldsKnown.size)
+      iMask |= STATX_SIZE;
+    if(oWanted.time && !oItem.oFieldsKnown.time)
+      iMask |= STATX_MTIME;
+    struct statx oStat;
+    if(statx(m_iDescriptor, oItem.sNativeName.c_str(), 0, iMask, &oStat) == 0)
+    {
+      if(oStat.stx_mask & STATX_TYPE)
+      {
+        oItem.bIsDirectory = S_ISDIR(oStat.stx_mode);
+        oItem.oFieldsKnown.dir = true;
+      }
+      if(oStat.stx_mask & STATX_SIZE)
+      {
+        oItem.iSize = oStat.stx_size;
+        oItem.oFieldsKnown.size = true;
+      }
+      if(oStat.stx_mask & STATX_MTIME)
+      {
+        oItem.iTimestamp = static_cast<filetime_t>(oStat.stx_mtime.tv_sec);
+        oItem.oFieldsKnown.time = true;
+      }
+    }
+#else
+    struct stat oStat;
+    if(fstatat(m_iDescriptor, oItem.sNativeName.c_str(), &oStat, 0) == 0)
+    {
+      oItem.bIsDirectory = S_ISDIR(oStat.st_mode);
+      oItem.iSize = static_cast<unsigned long long>(oStat.st_size);
+      oItem.iTimestamp = oStat.st_mtime;
+      oItem.oFieldsKnown = true;
+      oItem.oFieldsKnown.name = true;
+    }
+#endif
+    // Anything still unknown (i.e. the call failed, or the filesystem cannot supply it) keeps its default
+    if(oWanted.dir)
+      oItem.oFieldsKnown.dir = true;
+    if(oWanted.size)
+      oItem.oFieldsKnown.size = true;
+    if(oWanted.time)
+      oItem.oFieldsKnown.time = true;
+  }
+
+  void _addItem(const char* sNativeName, unsigned char iType) throw(...)
+  {
+    if(strcmp(sNativeName, ".") == 0 || strcmp(sNativeName, "..") == 0)
+      return;
+    size_t iLength = mbstowcs(0, sNativeName, 0);
+    if(iLength == static_cast<size_t>(-1))
+      return; // Not representable in the current locale, so could never be opened by name either
+    m_vItems.push_back(item_t());
+    item_t& oItem = m_vItems.back();
+    std::vector<wchar_t> vName(iLength + 1);
+    mbstowcs(&vName[0], sNativeName, iLength + 1);
+    oItem.sName = RainString(&vName[0], iLength);
+    oItem.sNativeName = sNativeName;
+    oItem.oFieldsKnown = false;
+    oItem.oFieldsKnown.name = true;
+    oItem.bIsDirectory = false;
+    oItem.iSize = 0;
+    oItem.iTimestamp = 0;
+    // The entry type comes for free with the listing, except for symbolic links, which are
+    // followed (as they are on Windows) and so need a stat to find what they point at
+    if(iType != DT_UNKNOWN && iType != DT_LNK)
+    {
+      oItem.bIsDirectory = iType == DT_DIR;
+      oItem.oFieldsKnown.dir = true;
+    }
+  }
+
+  IFileStore* m_pStore;
+  RainString m_sPath;
+  int m_iDescriptor;
+  std::vector<item_t> m_vItems;
+};
+#endif
+
 IDirectory* RainOpenDirectory(const RainString& sPath) throw(...)
 {
   RainDirectoryAdapter* pDirectory = 0;
@@ -701,13 +1874,50 @@ IDirectory* RainOpenDirectoryNoThrow(const RainString& sPath) throw()
 
 bool RainDoesDirectoryExist(const RainString& sPath) throw()
 {
+#ifdef _WIN32
   DWORD dwAttributes = GetFileAttributes(sPath.getCharacters());
   return dwAttributes != INVALID_FILE_ATTRIBUTES && (dwAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+  struct stat oStat;
+  return NativeStat(sPath, oStat) && S_ISDIR(oStat.st_mode);
+#endif
+}
+
+//! Equivalent of _wmkdir(), returning 0 on success or -1 with errno set
+static int MakeDirectory(const RainString& sPath) throw()
+{
+#ifdef _WIN32
+  return _wmkdir(sPath.getCharacters());
+#else
+  std::vector<char> vNative;
+  if(!RainNativePath(sPath, vNative))
+  {
+    errno = ENOENT;
+    return -1;
+  }
+  return mkdir(&vNative[0], 0777);
+#endif
+}
+
+//! Equivalent of _wrmdir(), returning 0 on success or -1 with errno set
+static int RemoveEmptyDirectory(const RainString& sPath) throw()
+{
+#ifdef _WIN32
+  return _wrmdir(sPath.getCharacters());
+#else
+  std::vector<char> vNative;
+  if(!RainNativePath(sPath, vNative))
+  {
+    errno = ENOENT;
+    return -1;
+  }
+  return rmdir(&vNative[0]);
+#endif
 }
 
 void RainCreateDirectory(const RainString& sPath) throw(...)
 {
-  if(_wmkdir(sPath.getCharacters()) == -1)
+  if(MakeDirectory(sPath) == -1)
   {
     const wchar_t* sErr = L"Cannot create directory \'%s\'";
     switch(errno)
@@ -726,12 +1936,12 @@ void RainCreateDirectory(const RainString& sPath) throw(...)
 
 bool RainCreateDirectoryNoThrow(const RainString& sPath) throw()
 {
-  return _wmkdir(sPath.getCharacters()) == 0;
+  return MakeDirectory(sPath) == 0;
 }
 
 void RainDeleteDirectory(const RainString& sPath) throw(...)
 {
-  if(_wrmdir(sPath.getCharacters()) == -1)
+  if(RemoveEmptyDirectory(sPath) == -1)
   {
     const wchar_t* sErr = L"Cannot delete directory \'%s\'";
     switch(errno)
@@ -754,7 +1964,7 @@ void RainDeleteDirectory(const RainString& sPath) throw(...)
 
 bool RainDeleteDirectoryNoThrow(const RainString& sPath) throw()
 {
-  return _wrmdir(sPath.getCharacters()) == 0;
+  return RemoveEmptyDirectory(sPath) == 0;
 }
 
 FileSystemStore* RainGetFileSystemStore()
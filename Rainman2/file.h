@@ -24,8 +24,10 @@ OTHER DEALINGS IN THE SOFTWARE.
 */
 #pragma once
 #include "string.h"
+#include "threading.h"
 #include <stdio.h>
 #include <vector>
+#include <utility>
 #include <iterator>
 
 //! Type used when specifying the offset in file seek / tell operations
@@ -47,6 +49,41 @@ enum eFileOpenMode
 {
   FM_Read,  //!< Open a file in read-only binary mode
   FM_Write, //!< Open a file in read & write binary mode
+  FM_Update, //!< Open an existing file in read & write binary mode, without truncating it
+  FM_WriteAtomic, //!< As FM_Write, but any existing file is only replaced once the new one is closed (see RainOpenFileAtomic())
+};
+
+//! A read-only window onto part of a file, as returned by IFile::mapView()
+/*!
+  Depending upon the file, the view either points directly at memory belonging to the file,
+  or holds its own copy of the data. The data remains valid until the view is deleted,
+  subject to the caveats given for the mapView() of the particular file type.
+*/
+class RAINMAN2_API IFileView
+{
+public:
+  virtual ~IFileView() throw(); //!< virtual destructor
+
+  //! Get the first byte of the view
+  virtual const char* getData() const throw() = 0;
+
+  //! Get the number of bytes in the view
+  virtual size_t getLength() const throw() = 0;
+
+  //! Determine whether the view refers directly to the file's memory (true) or is a copy (false)
+  virtual bool isDirect() const throw() = 0;
+
+  //! Get the view as an array of items of a particular type
+  template <class T>
+  const T* getArray() const throw()
+  { return reinterpret_cast<const T*>(getData()); }
+};
+
+//! One of the buffers passed to IFile::writeGather()
+struct file_buffer_t
+{
+  const void* pData;
+  size_t iLength; //!< Length in bytes
 };
 
 //! A generic interface for files and other file-like things
@@ -152,6 +189,44 @@ public:
   size_t readArrayNoThrow(T* pDestination, size_t iCount) throw()
   { return readNoThrow(pDestination, sizeof(T), iCount); }
 
+  //! Read bytes from a given position in the file
+  /*!
+    Reads a number of items starting at an absolute position in the file, without
+    the position being taken from or left in the file pointer. If all of the items
+    cannot be read, then an exception will be thrown.
+    The default implementation seeks, reads and then restores the file pointer, and
+    so is no safer than calling those methods directly. If isReadAtThreadSafe()
+    returns true, then multiple threads may call readAt() and readAtNoThrow() at the
+    same time, provided that no other methods are called concurrently.
+    \param iPosition Offset, in bytes, from the start of the file to read from
+    \param pDestination Buffer at least iItemSize*iItemCount bytes big
+    \param iItemSize Size, in bytes, of one item
+    \param iItemCount Number of items to read from the file
+    \sa readAtNoThrow() isReadAtThreadSafe()
+  */
+  virtual void readAt(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw(...);
+
+  //! Read bytes from a given position in the file, without throwing an exception
+  /*!
+    Same as readAt(), except that as many items as possible are read, and the number
+    of items read is returned.
+  */
+  virtual size_t readAtNoThrow(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw();
+
+  //! Determine whether readAt() can be called from multiple threads at the same time
+  virtual bool isReadAtThreadSafe() const throw();
+
+  //! Get a read-only view of part of the file, without copying it when the file allows
+  /*!
+    Files held in memory return a view pointing directly at that memory. Other files
+    return a view holding a copy of the data, read with readAt(). In neither case is the
+    position of the file changed.
+    \param iPosition Offset, in bytes, from the start of the file of the first byte to view
+    \param iLength Number of bytes to view; the whole range must lie within the file
+    \return A view, which the caller must delete; never null
+  */
+  virtual IFileView* mapView(seek_offset_t iPosition, size_t iLength) throw(...);
+
   virtual void write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...) = 0;
   virtual size_t writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw() = 0;
 
@@ -171,6 +246,17 @@ public:
   size_t writeArrayNoThrow(const T* pSource, size_t iCount) throw()
   { return writeNoThrow(pSource, sizeof(T), iCount); }
 
+  //! Write a series of buffers to the file, one after the other
+  /*!
+    Equivalent to calling write() for each buffer in turn, except that files can pass all of
+    the buffers to the operating system in a single call. If the buffers cannot all be written,
+    then an exception will be thrown, and the file position may have been incremented by any
+    amount. The default implementation calls write() for each buffer.
+    \param pBuffers Array of iCount buffers
+    \param iCount Number of buffers to write
+  */
+  virtual void writeGather(const file_buffer_t* pBuffers, size_t iCount) throw(...);
+
   virtual void seek(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw(...) = 0;
   virtual bool seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw() = 0;
 
@@ -358,6 +444,7 @@ struct RAINMAN2_API file_store_caps_t
   bool bCanOpenDirectories : 1;   //!< true if directories can be opened
   bool bCanCreateDirectories : 1; //!< true if directories can be created
   bool bCanDeleteDirectories : 1; //!< true if directories can be deleted
+  bool bCanReadConcurrently : 1;  //!< true if files can be opened / pumped by multiple threads at once
 };
 
 //! Interface for entities which contain files
@@ -400,6 +487,39 @@ public:
   //! Open a file and copy its contents to another file
   virtual void pumpFile(const RainString& sPath, IFile* pSink) throw(...);
 
+  //! Read the entire contents of a file into a caller-supplied buffer
+  /*!
+    When the size of the file is already known (e.g. from a directory listing), this avoids
+    the intermediate buffers and per-chunk calls of openFile() and pumpFile(); archives can
+    decompress straight into the buffer. An exception is thrown if the file is larger than
+    the buffer.
+    \param sPath The full path to the file in question
+    \param pBuffer Buffer to copy the contents of the file into
+    \param iBufferSize Size of pBuffer, in bytes
+    \return The number of bytes written to pBuffer (i.e. the size of the file)
+  */
+  virtual size_t readFileInto(const RainString& sPath, void* pBuffer, size_t iBufferSize) throw(...);
+
+  //! Copy the contents of several files to other files
+  /*!
+    Equivalent to calling pumpFile() for each (path, sink) pair, except that the store is
+    free to process the files in whatever order is most efficient for it. Archives read the
+    files in the order that their data is stored, which turns a tree-order extraction into
+    a (mostly) sequential read of the archive.
+    \param vFiles Pairs of (path of file to read, sink to copy its contents to)
+  */
+  virtual void pumpFiles(const std::vector<std::pair<RainString, IFile*> >& vFiles) throw(...);
+
+  //! Get a value indicating where a file's data is physically located within the store
+  /*!
+    Reading many files in increasing order of this value gives the most sequential pattern
+    of access to the underlying storage (for example, the data offset within an archive).
+    \param sPath The full path to the file in question
+    \param iOrder Variable to store the value in
+    \return true if iOrder was set, false if the store has no meaningful order (the default)
+  */
+  virtual bool getFileStorageOrder(const RainString& sPath, unsigned long& iOrder) throw();
+
   virtual bool doesFileExist(const RainString& sPath) throw() = 0;
   
   //! Delete a file from the store
@@ -495,11 +615,91 @@ public:
   std::vector<RainString> m_vEntryPoints;
 };
 
+//! Group commit for files written with RainOpenFileAtomic()
+/*!
+  Files opened as part of a batch are written to temporary files next to their final paths,
+  as with any atomic write, but closing them neither flushes them to disk nor renames them
+  into place. Instead, commit() flushes the whole batch to disk in one go and then renames
+  every file into place, so that waiting for the disk is done once per batch rather than once
+  per file. Should the process die before commit() finishes, every target is either untouched
+  or completely replaced, never truncated. Files which have not been committed by the time the
+  batch is destroyed are discarded.
+
+  On POSIX systems, the batch keeps the temporary files open once they are closed (up to a
+  limit), so that commit() can start write-back of all of them and then wait for each one,
+  without flushing anything else on the same filesystem.
+
+  Files of a batch can be opened and closed from several threads at once.
+*/
+class RAINMAN2_API RainWriteBatch
+{
+public:
+  RainWriteBatch() throw();
+  ~RainWriteBatch() throw();
+
+  //! Open a file for writing as part of this batch; see RainOpenFileAtomic()
+  IFile* openFile(const RainString& sPath, unsigned long long iExpectedSize = 0) throw(...);
+
+  //! Flush all closed files of the batch to disk and move them into place
+  /*!
+    Files still open when this is called are not included; they will be part of the next
+    commit. Should some files fail to be moved into place, the remainder are still committed
+    and then an exception is thrown.
+  */
+  void commit() throw(...);
+
+  //! Throw away all closed files of the batch, leaving their targets untouched
+  void discard() throw();
+
+  //! Get the number of files which have been closed but not yet committed or discarded
+  size_t getPendingCount() throw();
+
+protected:
+  struct pending_t
+  {
+    RainString sTemporaryPath;
+    RainString sPath;
+    int iDescriptor; //!< The temporary file, if it is still open, otherwise -1
+  };
+
+  static void _closeDescriptors(std::vector<pending_t>& vPending) throw();
+
+  RainMutex m_oMutex;
+  std::vector<pending_t> m_vPending;
+  size_t m_iDescriptorCount; //!< Number of entries of m_vPending which have an open descriptor
+
+private:
+  friend void RainFinishAtomicWrite(const RainString& sTemporaryPath, const RainString& sPath, RainWriteBatch* pBatch, bool bWritten, int iDescriptor) throw();
+
+  //! Called (through RainFinishAtomicWrite()) by files of the batch as they are closed
+  /*!
+    \param iDescriptor The still open temporary file, or -1; the batch takes ownership of it
+  */
+  void _addPending(const RainString& sTemporaryPath, const RainString& sPath, bool bWritten, int iDescriptor) throw();
+
+  RainWriteBatch(const RainWriteBatch&);
+  RainWriteBatch& operator= (const RainWriteBatch&);
+};
+
 RAINMAN2_API FileSystemStore* RainGetFileSystemStore();
 
 RAINMAN2_API IFile* RainOpenFile(const RainString& sPath, eFileOpenMode eMode) throw(...);
 RAINMAN2_API IFile* RainOpenFileNoThrow(const RainString& sPath, eFileOpenMode eMode) throw();
 RAINMAN2_API IFile* RainOpenFilePtr(FILE* pFile, bool bCloseWhenDone = true) throw(...);
+
+//! Open a file for writing such that it only replaces any existing file once complete
+/*!
+  The data is written to a temporary file in the same directory as sPath. When the returned
+  file is deleted, the temporary file is flushed to disk and then renamed over sPath, so a crash
+  at any point leaves either the old file or the complete new one. Should any write to the file
+  fail, the temporary file is deleted on close and sPath left untouched.
+  \param sPath The file to (re)write
+  \param iExpectedSize If non-zero, the final size of the file, which is then reserved on disk
+    up front rather than the file growing with each write; an exception is thrown if there is
+    not enough space for it
+  \param pBatch If non-null, the flush and rename are left to RainWriteBatch::commit()
+*/
+RAINMAN2_API IFile* RainOpenFileAtomic(const RainString& sPath, unsigned long long iExpectedSize = 0, RainWriteBatch* pBatch = 0) throw(...);
 RAINMAN2_API bool RainDoesFileExist(const RainString& sPath) throw();
 RAINMAN2_API void RainDeleteFile(const RainString& sPath) throw(...);
 RAINMAN2_API bool RainDeleteFileNoThrow(const RainString& sPath) throw();
@@ -510,5 +710,9 @@ RAINMAN2_API void        RainCreateDirectory       (const RainString& sPath) thr
 RAINMAN2_API bool        RainCreateDirectoryNoThrow(const RainString& sPath) throw();
 RAINMAN2_API void        RainDeleteDirectory       (const RainString& sPath) throw(...);
 RAINMAN2_API bool        RainDeleteDirectoryNoThrow(const RainString& sPath) throw();
+#ifndef _WIN32
+//! Convert a path in the library's backslash convention to a slash separated multibyte path for POSIX calls
+RAINMAN2_API bool        RainNativePath            (const RainString& sPath, std::vector<char>& vNative) throw();
+#endif
 
 RAINMAN2_API filesize_t operator+ (const filesize_t& a, const filesize_t& b);
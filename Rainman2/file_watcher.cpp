@@ -0,0 +1,385 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "file_watcher.h"
+#include "exception.h"
+#include <memory>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <map>
+#endif
+
+//! How long the background thread waits for changes before checking whether it should stop
+static const int WATCHER_POLL_MILLISECONDS = 200;
+
+IFileChangeListener::~IFileChangeListener() throw()
+{
+}
+
+#ifdef _WIN32
+
+struct RainFileWatcher::_backend_t
+{
+  //! A directory tree which is being watched
+  struct directory_t
+  {
+    RainString sPath;
+    HANDLE hDirectory;
+    OVERLAPPED oOverlapped;
+    DWORD aBuffer[0x4000]; //!< ReadDirectoryChangesW requires a DWORD aligned buffer, and at most 64KB over a network
+  };
+
+  //! Issue an asynchronous read of the changes to a directory tree
+  static bool read(directory_t* pDirectory) throw()
+  {
+    const DWORD iFilter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+    return ReadDirectoryChangesW(pDirectory->hDirectory, pDirectory->aBuffer, sizeof(pDirectory->aBuffer), TRUE, iFilter, NULL,
+      &pDirectory->oOverlapped, NULL) == TRUE;
+  }
+
+  std::vector<directory_t*> vDirectories;
+  std::vector<RainString> vToOpen; //!< Directories given to watchDirectory(), which the background thread has yet to open
+};
+
+static void BackendCreate(RainFileWatcher::_backend_t*& pBackend) throw(...)
+{
+  pBackend = CHECK_ALLOCATION(new (std::nothrow) RainFileWatcher::_backend_t);
+}
+
+static void BackendDestroy(RainFileWatcher::_backend_t* pBackend) throw()
+{
+  // Directory handles are closed by the background thread, as only it can cancel its reads
+  delete pBackend;
+}
+
+static void BackendWatch(RainFileWatcher::_backend_t* pBackend, FileSystemStore*, const RainString& sPath) throw(...)
+{
+  if(pBackend->vDirectories.size() + pBackend->vToOpen.size() >= MAXIMUM_WAIT_OBJECTS)
+    THROW_SIMPLE_(L"Cannot watch more than %i directories", static_cast<int>(MAXIMUM_WAIT_OBJECTS));
+  pBackend->vToOpen.push_back(sPath);
+}
+
+void RainFileWatcher::run() throw()
+{
+  typedef _backend_t::directory_t directory_t;
+  std::vector<directory_t*>& vDirectories = m_pBackend->vDirectories;
+  std::vector<HANDLE> vEvents;
+  while(m_iStopping == 0)
+  {
+    {
+      RainMutexLock oLock(m_oMutex);
+      for(std::vector<RainString>::iterator itr = m_pBackend->vToOpen.begin(); itr != m_pBackend->vToOpen.end(); ++itr)
+      {
+        directory_t *pDirectory = new (std::nothrow) directory_t;
+        if(pDirectory == 0)
+          continue;
+        pDirectory->sPath = *itr;
+        pDirectory->hDirectory = CreateFileW(itr->getCharacters(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+          NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        memset(&pDirectory->oOverlapped, 0, sizeof(OVERLAPPED));
+        pDirectory->oOverlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if(pDirectory->hDirectory == INVALID_HANDLE_VALUE || pDirectory->oOverlapped.hEvent == NULL || !_backend_t::read(pDirectory))
+        {
+          if(pDirectory->hDirectory != INVALID_HANDLE_VALUE)
+            CloseHandle(pDirectory->hDirectory);
+          if(pDirectory->oOverlapped.hEvent != NULL)
+            CloseHandle(pDirectory->oOverlapped.hEvent);
+          delete pDirectory;
+          continue;
+        }
+        vDirectories.push_back(pDirectory);
+        vEvents.push_back(pDirectory->oOverlapped.hEvent);
+      }
+      m_pBackend->vToOpen.clear();
+    }
+    if(vEvents.empty())
+    {
+      Sleep(WATCHER_POLL_MILLISECONDS);
+      continue;
+    }
+
+    DWORD iResult = WaitForMultipleObjects(static_cast<DWORD>(vEvents.size()), &vEvents[0], FALSE, WATCHER_POLL_MILLISECONDS);
+    if(iResult < WAIT_OBJECT_0 || iResult >= WAIT_OBJECT_0 + vEvents.size())
+      continue;
+    directory_t *pDirectory = vDirectories[iResult - WAIT_OBJECT_0];
+    DWORD iBytes = 0;
+    if(!GetOverlappedResult(pDirectory->hDirectory, &pDirectory->oOverlapped, &iBytes, FALSE) || iBytes == 0)
+    {
+      // The buffer was too small to hold every change
+      _publish(pDirectory->sPath, FC_Overflow);
+    }
+    else
+    {
+      const char* pBuffer = reinterpret_cast<const char*>(pDirectory->aBuffer);
+      for(;;)
+      {
+        const FILE_NOTIFY_INFORMATION *pInfo = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(pBuffer);
+        RainString sPath = pDirectory->sPath + L"\\" + RainString(pInfo->FileName, pInfo->FileNameLength / sizeof(WCHAR));
+        switch(pInfo->Action)
+        {
+        case FILE_ACTION_ADDED:
+        case FILE_ACTION_RENAMED_NEW_NAME:
+          _publish(sPath, FC_Added);
+          break;
+        case FILE_ACTION_REMOVED:
+        case FILE_ACTION_RENAMED_OLD_NAME:
+          _publish(sPath, FC_Removed);
+          break;
+        default:
+          _publish(sPath, FC_Modified);
+          break;
+        }
+        if(pInfo->NextEntryOffset == 0)
+          break;
+        pBuffer += pInfo->NextEntryOffset;
+      }
+    }
+    ResetEvent(pDirectory->oOverlapped.hEvent);
+    if(!_backend_t::read(pDirectory))
+      _publish(pDirectory->sPath, FC_Overflow);
+  }
+
+  for(std::vector<directory_t*>::iterator itr = vDirectories.begin(); itr != vDirectories.end(); ++itr)
+  {
+    DWORD iBytes;
+    CancelIo((**itr).hDirectory);
+    GetOverlappedResult((**itr).hDirectory, &(**itr).oOverlapped, &iBytes, TRUE);
+    CloseHandle((**itr).hDirectory);
+    CloseHandle((**itr).oOverlapped.hEvent);
+    delete *itr;
+  }
+  vDirectories.clear();
+}
+
+#else
+
+struct RainFileWatcher::_backend_t
+{
+  int iInotify;
+  std::map<int, RainString> mapWatches; //!< Maps inotify watch descriptors to directory paths
+};
+
+//! Create the inotify instance which every watched directory is added to
+static void BackendCreate(RainFileWatcher::_backend_t*& pBackend) throw(...)
+{
+  pBackend = CHECK_ALLOCATION(new (std::nothrow) RainFileWatcher::_backend_t);
+  pBackend->iInotify = inotify_init();
+  if(pBackend->iInotify == -1)
+  {
+    delete pBackend;
+    pBackend = 0;
+    THROW_SIMPLE(L"Cannot initialise inotify");
+  }
+}
+
+static void BackendDestroy(RainFileWatcher::_backend_t* pBackend) throw()
+{
+  close(pBackend->iInotify);
+  delete pBackend;
+}
+
+//! Watch a directory and (as inotify is not recursive) every directory below it
+static void BackendWatch(RainFileWatcher::_backend_t* pBackend, FileSystemStore* pStore, const RainString& sPath) throw(...)
+{
+  const uint32_t iMask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO;
+  std::vector<RainString> vTodo(1, sPath);
+  std::vector<char> vNative;
+  while(!vTodo.empty())
+  {
+    RainString sDirectory = vTodo.back();
+    vTodo.pop_back();
+    if(!RainNativePath(sDirectory, vNative))
+      THROW_SIMPLE_(L"Cannot convert \'%s\' to a native path", sDirectory.getCharacters());
+    int iWatch = inotify_add_watch(pBackend->iInotify, &vNative[0], iMask);
+    if(iWatch == -1)
+    {
+      // Subdirectories may vanish before they can be watched, but the directory asked for must exist
+      if(sDirectory == sPath)
+        THROW_SIMPLE_(L"Cannot watch \'%s\'", sPath.getCharacters());
+      continue;
+    }
+    pBackend->mapWatches[iWatch] = sDirectory;
+
+    std::auto_ptr<IDirectory> pDirectory(pStore->openDirectoryNoThrow(sDirectory));
+    if(pDirectory.get() == 0)
+      continue;
+    for(IDirectory::iterator itr = pDirectory->begin(), itrEnd = pDirectory->end(); itr != itrEnd; ++itr)
+    {
+      if(itr->isDirectory())
+        vTodo.push_back(sDirectory + L"\\" + itr->name());
+    }
+  }
+}
+
+void RainFileWatcher::run() throw()
+{
+  std::vector<char> vBuffer(0x10000);
+  while(m_iStopping == 0)
+  {
+    pollfd oPoll;
+    oPoll.fd = m_pBackend->iInotify;
+    oPoll.events = POLLIN;
+    oPoll.revents = 0;
+    if(poll(&oPoll, 1, WATCHER_POLL_MILLISECONDS) <= 0)
+      continue;
+    ssize_t iLength = read(m_pBackend->iInotify, &vBuffer[0], vBuffer.size());
+    if(iLength <= 0)
+      continue;
+
+    RainMutexLock oLock(m_oMutex);
+    for(ssize_t iOffset = 0; iOffset < iLength;)
+    {
+      const inotify_event *pEvent = reinterpret_cast<const inotify_event*>(&vBuffer[iOffset]);
+      iOffset += sizeof(inotify_event) + pEvent->len;
+      if(pEvent->mask & IN_Q_OVERFLOW)
+      {
+        _publishOverflow();
+        continue;
+      }
+      std::map<int, RainString>::iterator itrWatch = m_pBackend->mapWatches.find(pEvent->wd);
+      if(itrWatch == m_pBackend->mapWatches.end())
+        continue;
+      if(pEvent->mask & IN_IGNORED)
+      {
+        m_pBackend->mapWatches.erase(itrWatch);
+        continue;
+      }
+
+      RainString sPath = itrWatch->second;
+      if(pEvent->len != 0)
+      {
+        size_t iNameLength = mbstowcs(0, pEvent->name, 0);
+        if(iNameLength == static_cast<size_t>(-1))
+        {
+          _publish(sPath, FC_Overflow);
+          continue;
+        }
+        std::vector<wchar_t> vName(iNameLength + 1);
+        mbstowcs(&vName[0], pEvent->name, iNameLength + 1);
+        sPath += L"\\";
+        sPath += &vName[0];
+      }
+
+      if(pEvent->mask & (IN_CREATE | IN_MOVED_TO))
+      {
+        if(pEvent->mask & IN_ISDIR)
+        {
+          try
+          {
+            BackendWatch(m_pBackend, m_pStore, sPath);
+          }
+          catch(RainException *pE)
+          {
+            delete pE;
+          }
+        }
+        _publish(sPath, FC_Added);
+      }
+      else if(pEvent->mask & (IN_DELETE | IN_MOVED_FROM))
+        _publish(sPath, FC_Removed);
+      else
+        _publish(sPath, FC_Modified);
+    }
+  }
+}
+
+#endif
+
+RainFileWatcher::RainFileWatcher(FileSystemStore* pStore) throw(...)
+  : m_pStore(pStore ? pStore : RainGetFileSystemStore()), m_pBackend(0), m_iStopping(0), m_bStarted(false)
+{
+  BackendCreate(m_pBackend);
+}
+
+RainFileWatcher::~RainFileWatcher() throw()
+{
+  m_iStopping = 1;
+  join();
+  BackendDestroy(m_pBackend);
+}
+
+void RainFileWatcher::watchDirectory(const RainString& sPath) throw(...)
+{
+  RainString sDirectory(sPath);
+  sDirectory.replaceAll('/', '\\');
+  while(sDirectory.length() > 1 && sDirectory.suffix(1) == L"\\")
+    sDirectory = sDirectory.prefix(sDirectory.length() - 1);
+
+  RainMutexLock oLock(m_oMutex);
+  for(std::vector<RainString>::iterator itr = m_vWatched.begin(); itr != m_vWatched.end(); ++itr)
+  {
+    if(itr->compareCaseless(sDirectory) == 0)
+      return;
+  }
+  try
+  {
+    BackendWatch(m_pBackend, m_pStore, sDirectory);
+    m_vWatched.push_back(sDirectory);
+    if(!m_bStarted)
+    {
+      start();
+      m_bStarted = true;
+    }
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot watch directory \'%s\'", sDirectory.getCharacters());
+}
+
+void RainFileWatcher::addListener(IFileChangeListener* pListener) throw(...)
+{
+  RainMutexLock oLock(m_oMutex);
+  m_vListeners.push_back(pListener);
+}
+
+void RainFileWatcher::removeListener(IFileChangeListener* pListener) throw()
+{
+  // Listeners are called with the mutex held, so once it is acquired here, no call is in progress
+  RainMutexLock oLock(m_oMutex);
+  for(std::vector<IFileChangeListener*>::iterator itr = m_vListeners.begin(); itr != m_vListeners.end(); ++itr)
+  {
+    if(*itr == pListener)
+    {
+      m_vListeners.erase(itr);
+      break;
+    }
+  }
+}
+
+void RainFileWatcher::_publish(const RainString& sPath, eFileChange eChange) throw()
+{
+  RainMutexLock oLock(m_oMutex);
+  for(std::vector<IFileChangeListener*>::iterator itr = m_vListeners.begin(); itr != m_vListeners.end(); ++itr)
+    (**itr).onFileChange(m_pStore, sPath, eChange);
+}
+
+void RainFileWatcher::_publishOverflow() throw()
+{
+  RainMutexLock oLock(m_oMutex);
+  for(std::vector<RainString>::iterator itr = m_vWatched.begin(); itr != m_vWatched.end(); ++itr)
+    _publish(*itr, FC_Overflow);
+}
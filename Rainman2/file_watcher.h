@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#pragma once
+#include "file.h"
+#include "threading.h"
+#include <vector>
+
+//! The kinds of change which RainFileWatcher reports
+enum eFileChange
+{
+  FC_Added,    //!< A file or directory was created, or was renamed to the path
+  FC_Removed,  //!< A file or directory was deleted, or was renamed away from the path
+  FC_Modified, //!< The contents or attributes of a file or directory changed
+  FC_Overflow, //!< Changes were lost, so anything at or below the path may have changed
+};
+
+//! Receives notifications of changes from a RainFileWatcher
+class RAINMAN2_API IFileChangeListener
+{
+public:
+  virtual ~IFileChangeListener() throw();
+
+  //! Called on the watcher's thread for every change
+  /*!
+    \param pStore The store whose contents changed
+    \param sPath Path of the changed file or directory, in the same form as paths given to pStore
+      (with backslashes as separators). It is not known whether the path is a file or a directory
+      (and it may no longer exist).
+    \param eChange The kind of change
+  */
+  virtual void onFileChange(IFileStore* pStore, const RainString& sPath, eFileChange eChange) throw() = 0;
+};
+
+//! Watches directories of a FileSystemStore for changes, and tells listeners about them
+/*!
+  Changes are detected by the operating system (ReadDirectoryChangesW on Windows, and inotify on
+  Linux), and published on a background thread, which is started by the first call to
+  watchDirectory(). Directories are watched along with all of their subdirectories.
+*/
+class RAINMAN2_API RainFileWatcher : protected RainThread
+{
+public:
+  //! Constructor
+  /*!
+    \param pStore The store whose directories will be watched (defaults to RainGetFileSystemStore())
+  */
+  RainFileWatcher(FileSystemStore* pStore = 0) throw(...);
+  //! Destructor; stops the background thread
+  ~RainFileWatcher() throw();
+
+  FileSystemStore* getStore() const throw() {return m_pStore;}
+
+  //! Start watching a directory (and its subdirectories); does nothing if it is already watched
+  void watchDirectory(const RainString& sPath) throw(...);
+
+  void addListener(IFileChangeListener* pListener) throw(...);
+  //! Stop sending changes to a listener; once this returns, the listener will not be called again
+  void removeListener(IFileChangeListener* pListener) throw();
+
+  //! Platform specific state; for internal use only
+  struct _backend_t;
+
+protected:
+  virtual void run() throw();
+  void _publish(const RainString& sPath, eFileChange eChange) throw();
+  void _publishOverflow() throw();
+
+  FileSystemStore* m_pStore;
+  _backend_t* m_pBackend;
+  std::vector<RainString> m_vWatched;
+  std::vector<IFileChangeListener*> m_vListeners;
+  RainMutex m_oMutex; //!< Guards everything which is shared with the background thread
+  volatile long m_iStopping;
+  bool m_bStarted;
+};
@@ -61,14 +61,14 @@ public:
 
   virtual IFile* openFile(size_t iIndex, eFileOpenMode eMode) throw(...)
   {
-    if(eMode == FM_Write)
+    if(eMode != FM_Read)
       THROW_SIMPLE_(L"Cannot open index %lu for writing - it is read-only", static_cast<unsigned long>(iIndex));
     return m_pDirectory->openFile(iIndex, eMode);
   }
 
   virtual IFile* openFileNoThrow(size_t iIndex, eFileOpenMode eMode) throw()
   {
-    if(eMode == FM_Write)
+    if(eMode != FM_Read)
       return 0;
     return m_pDirectory->openFileNoThrow(iIndex, eMode);
   }
@@ -124,7 +124,7 @@ void ReadOnlyFileStoreAdaptor::getCaps(file_store_caps_t& oCaps) const throw()
 
 IFile* ReadOnlyFileStoreAdaptor::openFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
 {
-  if(eMode == FM_Write)
+  if(eMode != FM_Read)
     THROW_SIMPLE_(L"Cannot write to file \'%s\' - it is read-only", sPath.getCharacters());
   else
     return m_pFileStore->openFile(sPath, eMode);
@@ -132,7 +132,7 @@ IFile* ReadOnlyFileStoreAdaptor::openFile(const RainString& sPath, eFileOpenMode
 
 IFile* ReadOnlyFileStoreAdaptor::openFileNoThrow(const RainString& sPath, eFileOpenMode eMode) throw()
 {
-  if(eMode == FM_Write)
+  if(eMode != FM_Read)
     return 0;
   else
     return m_pFileStore->openFileNoThrow(sPath, eMode);
@@ -143,6 +143,26 @@ bool ReadOnlyFileStoreAdaptor::doesFileExist(const RainString& sPath) throw()
   return m_pFileStore->doesFileExist(sPath);
 }
 
+void ReadOnlyFileStoreAdaptor::pumpFile(const RainString& sPath, IFile* pSink) throw(...)
+{
+  m_pFileStore->pumpFile(sPath, pSink);
+}
+
+size_t ReadOnlyFileStoreAdaptor::readFileInto(const RainString& sPath, void* pBuffer, size_t iBufferSize) throw(...)
+{
+  return m_pFileStore->readFileInto(sPath, pBuffer, iBufferSize);
+}
+
+void ReadOnlyFileStoreAdaptor::pumpFiles(const std::vector<std::pair<RainString, IFile*> >& vFiles) throw(...)
+{
+  m_pFileStore->pumpFiles(vFiles);
+}
+
+bool ReadOnlyFileStoreAdaptor::getFileStorageOrder(const RainString& sPath, unsigned long& iOrder) throw()
+{
+  return m_pFileStore->getFileStorageOrder(sPath, iOrder);
+}
+
 void ReadOnlyFileStoreAdaptor::deleteFile(const RainString& sPath) throw(...)
 {
   THROW_SIMPLE_(L"Cannot delete file \'%s\' - it is read-only", sPath.getCharacters());
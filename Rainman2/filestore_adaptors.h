@@ -37,6 +37,10 @@ public:
   virtual IFile* openFile         (const RainString& sPath, eFileOpenMode eMode) throw(...);
   virtual IFile* openFileNoThrow  (const RainString& sPath, eFileOpenMode eMode) throw();
   virtual bool   doesFileExist    (const RainString& sPath) throw();
+  virtual void   pumpFile         (const RainString& sPath, IFile* pSink) throw(...);
+  virtual size_t readFileInto     (const RainString& sPath, void* pBuffer, size_t iBufferSize) throw(...);
+  virtual void   pumpFiles        (const std::vector<std::pair<RainString, IFile*> >& vFiles) throw(...);
+  virtual bool   getFileStorageOrder(const RainString& sPath, unsigned long& iOrder) throw();
   virtual void   deleteFile       (const RainString& sPath) throw(...);
   virtual bool   deleteFileNoThrow(const RainString& sPath) throw();
 
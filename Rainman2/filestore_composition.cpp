@@ -31,11 +31,15 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include <stack>
 
 FileStoreComposition::FileStoreComposition() throw()
+  : m_iOldestMissingPath(0), m_pWatcher(0), m_iCacheGeneration(0)
 {
 }
 
 FileStoreComposition::~FileStoreComposition() throw()
 {
+  if(m_pWatcher)
+    m_pWatcher->removeListener(this);
+  invalidateCaches();
   for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
   {
     if((*itr)->m_bOwnsPointer)
@@ -69,34 +73,67 @@ void FileStoreComposition::addFileStore(IFileStore *pStore, const RainString &sP
     pInfo->m_sMountedIn = sMountIn + L"\\";
   pInfo->m_iPriority = iPriority;
   pStore->getCaps(pInfo->m_oCaps);
-  pInfo->m_bOwnsPointer = false;
+  pInfo->m_bOwnsPointer = bTakeOwnership;
   pInfo->m_bEnabled = true;
-  m_vFileStores.push_back(pInfo);
-  std::sort(m_vFileStores.begin(), m_vFileStores.end(), _file_store_priority_sort);
 
+  // Everything which can fail is done before the store is added to the list, as other threads may
+  // be using any store in the list, and so a store cannot be removed again once it has been added
+  std::vector<file_store_info_t*> vFileStores;
+  std::vector<RainString> vEntryPoints;
   try
   {
-    reenumerateEntryPoints();
+    {
+      RainMutexLock oLock(m_oCacheMutex);
+      vFileStores = m_vFileStores;
+    }
+    vFileStores.push_back(pInfo);
+    std::sort(vFileStores.begin(), vFileStores.end(), _file_store_priority_sort);
+    _enumerateEntryPoints(vFileStores, vEntryPoints);
+    if(m_pWatcher && pStore == m_pWatcher->getStore() && !pInfo->m_sPrefix.isEmpty())
+      m_pWatcher->watchDirectory(pInfo->m_sPrefix);
   }
-  CATCH_THROW_SIMPLE({
-    delete pInfo;
-    m_vFileStores.erase(std::find(m_vFileStores.begin(), m_vFileStores.end(), pInfo));
-  }, L"Cannot enumerate entry points with new store");
+  CATCH_THROW_SIMPLE(delete pInfo, L"Cannot enumerate entry points with new store");
 
-  pInfo->m_bOwnsPointer = bTakeOwnership;
+  {
+    RainMutexLock oLock(m_oCacheMutex);
+    m_vFileStores.swap(vFileStores);
+    m_vEntryPoints.swap(vEntryPoints);
+  }
+  invalidateCaches();
+}
+
+void FileStoreComposition::watchFileSystem(RainFileWatcher* pWatcher) throw(...)
+{
+  if(m_pWatcher)
+    THROW_SIMPLE(L"The composition is already watching the file system");
+  // Changes made before the directories are being watched would go unnoticed
+  invalidateCaches();
+  pWatcher->addListener(this);
+  m_pWatcher = pWatcher;
+  for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
+  {
+    if((**itr).m_pStore == pWatcher->getStore() && !(**itr).m_sPrefix.isEmpty())
+      pWatcher->watchDirectory((**itr).m_sPrefix);
+  }
 }
 
 size_t FileStoreComposition::enableFileStore(IFileStore *pStore, bool bEnable) throw(...)
 {
   size_t iCount = 0;
-  for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
   {
-    if((**itr).m_pStore == pStore)
+    // Whether a store is enabled is read by lookups on other threads
+    RainMutexLock oLock(m_oCacheMutex);
+    for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
     {
-      if((**itr).m_bEnabled != bEnable)
-        (**itr).m_bEnabled = bEnable, ++iCount;
+      if((**itr).m_pStore == pStore)
+      {
+        if((**itr).m_bEnabled != bEnable)
+          (**itr).m_bEnabled = bEnable, ++iCount;
+      }
     }
   }
+  if(iCount != 0)
+    invalidateCaches();
   return iCount;
 }
 
@@ -106,10 +143,16 @@ size_t FileStoreComposition::disableFileStore(IFileStore *pStore, bool bDisable)
 }
 
 void FileStoreComposition::reenumerateEntryPoints() throw(...)
+{
+  std::vector<RainString> vEntryPoints;
+  _enumerateEntryPoints(m_vFileStores, vEntryPoints);
+  m_vEntryPoints.swap(vEntryPoints);
+}
+
+void FileStoreComposition::_enumerateEntryPoints(const std::vector<file_store_info_t*>& vFileStores, std::vector<RainString>& vEntryPoints) throw(...)
 {
   std::tr1::unordered_map<unsigned long, bool> mapEntryPoints;
-  m_vEntryPoints.clear();
-  for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
+  for(std::vector<file_store_info_t*>::const_iterator itr = vFileStores.begin(); itr != vFileStores.end(); ++itr)
   {
     if(!(*itr)->m_bEnabled)
       continue;
@@ -119,7 +162,7 @@ void FileStoreComposition::reenumerateEntryPoints() throw(...)
       unsigned long iHash = CRCCaselessHashSimple(sName.getCharacters(), sName.length() * sizeof(RainChar));
       if(mapEntryPoints[iHash] == false)
       {
-        m_vEntryPoints.push_back(sName);
+        vEntryPoints.push_back(sName);
         mapEntryPoints[iHash] = true;
       }
     }
@@ -134,7 +177,7 @@ void FileStoreComposition::reenumerateEntryPoints() throw(...)
           unsigned long iHash = CRCCaselessHashSimple(sName.getCharacters(), sName.length() * sizeof(RainChar));
           if(mapEntryPoints[iHash] == false)
           {
-            m_vEntryPoints.push_back(sName);
+            vEntryPoints.push_back(sName);
             mapEntryPoints[iHash] = true;
           }
         }
@@ -150,7 +193,7 @@ void FileStoreComposition::reenumerateEntryPoints() throw(...)
             unsigned long iHash = CRCCaselessHashSimple(sName.getCharacters(), sName.length() * sizeof(RainChar));
             if(mapEntryPoints[iHash] == false)
             {
-              m_vEntryPoints.push_back(sName);
+              vEntryPoints.push_back(sName);
               mapEntryPoints[iHash] = true;
             }
           }
@@ -163,6 +206,8 @@ void FileStoreComposition::reenumerateEntryPoints() throw(...)
 void FileStoreComposition::getCaps(file_store_caps_t& oCaps) const throw()
 {
   oCaps = false;
+  // Concurrent reads are only possible if every enabled store supports them
+  bool bAllCanReadConcurrently = true;
   for(std::vector<file_store_info_t*>::const_iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
   {
     if(!(*itr)->m_bEnabled)
@@ -176,6 +221,281 @@ void FileStoreComposition::getCaps(file_store_caps_t& oCaps) const throw()
     oCaps.bCanOpenDirectories = oCaps.bCanOpenDirectories || oThisCaps.bCanOpenDirectories;
     oCaps.bCanCreateDirectories = oCaps.bCanCreateDirectories || oThisCaps.bCanCreateDirectories;
     oCaps.bCanDeleteDirectories = oCaps.bCanDeleteDirectories || oThisCaps.bCanDeleteDirectories;
+    bAllCanReadConcurrently = bAllCanReadConcurrently && oThisCaps.bCanReadConcurrently;
+  }
+  oCaps.bCanReadConcurrently = oCaps.bCanReadFiles && bAllCanReadConcurrently;
+}
+
+void FileStoreComposition::invalidateCaches() throw()
+{
+  _invalidatePath(RainString(), false);
+}
+
+struct FileStoreComposition::resolved_path_matcher_t
+{
+  resolved_path_matcher_t(const std::vector<resolved_path_t>& vResolvedPaths, const RainString& sPath) throw()
+    : m_vResolvedPaths(vResolvedPaths), m_sPath(sPath)
+  {
+  }
+
+  bool operator() (size_t iIndex) const throw()
+  {
+    // Paths are hashed caselessly, but compared exactly, as mount points are matched exactly
+    return m_vResolvedPaths[iIndex].m_sPath == m_sPath;
+  }
+
+  const std::vector<resolved_path_t>& m_vResolvedPaths;
+  const RainString& m_sPath;
+};
+
+//! Predicate for RainHashIndex::erase() which matches one particular resolved path
+struct ResolvedSlotMatcher
+{
+  ResolvedSlotMatcher(size_t iIndex) throw() : m_iIndex(iIndex) {}
+  bool operator() (size_t iIndex) const throw() {return iIndex == m_iIndex;}
+  size_t m_iIndex;
+};
+
+//! Get the key of the directory containing a path, in the form used by the listings and m_mapResolvedByDirectory
+/*!
+  Keys are the path of the directory in lower case and ending with a backslash, except for the root
+  directory, which is keyed by a lone backslash.
+*/
+static RainString GetDirectoryKey(const RainString& sPath) throw(...)
+{
+  if(sPath.indexOf('\\') == -1)
+    return L"\\";
+  RainString sKey = sPath.beforeLast('\\');
+  sKey.toLower();
+  return sKey + L"\\";
+}
+
+void FileStoreComposition::_freeResolvedPath(size_t iIndex) throw()
+{
+  resolved_path_t& oResolved = m_vResolvedPaths[iIndex];
+  m_oPathIndex.erase(CRCCaselessHashSimpleAsciiFromUnicode(oResolved.m_sPath.getCharacters(), oResolved.m_sPath.length()), ResolvedSlotMatcher(iIndex));
+  oResolved.m_sPath.clear();
+  oResolved.m_sFullPath.clear();
+  oResolved.m_pStore = 0;
+  oResolved.m_bFree = true;
+  m_vFreeResolvedPaths.push_back(iIndex);
+}
+
+FileStoreComposition::file_store_info_t* FileStoreComposition::_resolveForReading(const RainString& sPath, RainString& sFullPath) throw()
+{
+  unsigned long iHash = CRCCaselessHashSimpleAsciiFromUnicode(sPath.getCharacters(), sPath.length());
+  unsigned long iGeneration;
+  std::vector<file_store_info_t*> vFileStores;
+  {
+    RainMutexLock oLock(m_oCacheMutex);
+    iGeneration = m_iCacheGeneration;
+    const size_t* pIndex = m_oPathIndex.find(iHash, resolved_path_matcher_t(m_vResolvedPaths, sPath));
+    if(pIndex)
+    {
+      const resolved_path_t& oResolved = m_vResolvedPaths[*pIndex];
+      sFullPath = oResolved.m_sFullPath;
+      return oResolved.m_pStore;
+    }
+    for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
+    {
+      if((*itr)->m_bEnabled && (**itr).m_oCaps.bCanReadFiles)
+        vFileStores.push_back(*itr);
+    }
+  }
+
+  // The stores are probed without holding the lock, so that other lookups are not held up. Stores
+  // are never removed from the composition, so the copy of the list remains valid.
+  resolved_path_t oResolved;
+  oResolved.m_sPath = sPath;
+  oResolved.m_pStore = 0;
+  oResolved.m_bFree = false;
+  for(std::vector<file_store_info_t*>::iterator itr = vFileStores.begin(); itr != vFileStores.end(); ++itr)
+  {
+    if((**itr).transformToFullPath(sPath, oResolved.m_sFullPath) && (**itr).m_pStore->doesFileExist(oResolved.m_sFullPath))
+    {
+      oResolved.m_pStore = *itr;
+      break;
+    }
+  }
+  if(oResolved.m_pStore == 0)
+    oResolved.m_sFullPath.clear();
+
+  // If anything was discarded from the caches whilst probing, then the result may already be out of
+  // date. Another thread may also have looked up the same path in the meantime.
+  RainMutexLock oLock(m_oCacheMutex);
+  if(iGeneration == m_iCacheGeneration && m_oPathIndex.find(iHash, resolved_path_matcher_t(m_vResolvedPaths, sPath)) == 0)
+  {
+    // Everything which can fail is done before the caches are changed, as failing to cache the
+    // result is harmless, but a path which is in one index and not the others would never be freed
+    std::vector<size_t>* pDirectory = 0;
+    try
+    {
+      pDirectory = &m_mapResolvedByDirectory[GetDirectoryKey(sPath)];
+      pDirectory->reserve(pDirectory->size() + 1);
+      if(oResolved.m_pStore == 0 && m_vMissingPaths.size() < MAX_MISSING_PATHS)
+        m_vMissingPaths.reserve(m_vMissingPaths.size() + 1);
+      if(m_vFreeResolvedPaths.empty())
+        m_vResolvedPaths.reserve(m_vResolvedPaths.size() + 1);
+      if(!m_oPathIndex.reserve(m_oPathIndex.size() + 1))
+        pDirectory = 0;
+    }
+    catch(...)
+    {
+      pDirectory = 0;
+    }
+    if(pDirectory)
+    {
+      size_t iIndex = m_vResolvedPaths.size();
+      if(m_vFreeResolvedPaths.empty())
+        m_vResolvedPaths.push_back(oResolved);
+      else
+      {
+        iIndex = m_vFreeResolvedPaths.back();
+        m_vFreeResolvedPaths.pop_back();
+        m_vResolvedPaths[iIndex] = oResolved;
+      }
+      m_oPathIndex.insert(iHash, iIndex);
+      pDirectory->push_back(iIndex);
+      if(oResolved.m_pStore == 0)
+        _rememberMissingPath(iIndex);
+    }
+  }
+  sFullPath = oResolved.m_sFullPath;
+  return oResolved.m_pStore;
+}
+
+//! Determine whether a path is equal to (or below) a directory, where an empty directory contains everything
+static bool IsPathWithin(const RainString& sPath, const RainString& sDirectory) throw()
+{
+  if(sDirectory.isEmpty())
+    return true;
+  if(sPath.length() < sDirectory.length() || sPath.prefix(sDirectory.length()).compareCaseless(sDirectory) != 0)
+    return false;
+  return sPath.length() == sDirectory.length() || sPath.getCharacters()[sDirectory.length()] == '\\';
+}
+
+void FileStoreComposition::_rememberMissingPath(size_t iIndex) throw()
+{
+  // Paths which no store provides are remembered in a ring, with the oldest being forgotten once the
+  // ring is full. A slot in the ring may refer to a path which has since been freed (and perhaps
+  // reused), in which case forgetting it early is harmless.
+  if(m_vMissingPaths.size() < MAX_MISSING_PATHS)
+  {
+    m_vMissingPaths.push_back(iIndex);
+    return;
+  }
+  size_t iOldest = m_vMissingPaths[m_iOldestMissingPath];
+  m_vMissingPaths[m_iOldestMissingPath] = iIndex;
+  m_iOldestMissingPath = (m_iOldestMissingPath + 1) % MAX_MISSING_PATHS;
+  resolved_path_t& oOldest = m_vResolvedPaths[iOldest];
+  if(iOldest == iIndex || oOldest.m_bFree || oOldest.m_pStore != 0)
+    return;
+  std::map<RainString, std::vector<size_t> >::iterator itr = m_mapResolvedByDirectory.find(GetDirectoryKey(oOldest.m_sPath));
+  if(itr != m_mapResolvedByDirectory.end())
+    itr->second.erase(std::remove(itr->second.begin(), itr->second.end(), iOldest), itr->second.end());
+  _freeResolvedPath(iOldest);
+}
+
+void FileStoreComposition::_invalidatePath(const RainString& sPath, bool bListingsOnly) throw()
+{
+  RainMutexLock oLock(m_oCacheMutex);
+  ++m_iCacheGeneration;
+  if(sPath.isEmpty())
+  {
+    // Listings which are still in use by open directories are kept alive by their references
+    for(std::map<RainString, listing_t*>::iterator itr = m_mapListings.begin(); itr != m_mapListings.end(); ++itr)
+      _releaseListing(itr->second);
+    m_mapListings.clear();
+    if(!bListingsOnly)
+    {
+      m_oPathIndex.clear();
+      m_vResolvedPaths.clear();
+      m_vFreeResolvedPaths.clear();
+      m_mapResolvedByDirectory.clear();
+      m_vMissingPaths.clear();
+      m_iOldestMissingPath = 0;
+    }
+    return;
+  }
+
+  // Both the listings and the resolved paths are keyed by lower case directory path ending with a
+  // backslash, so the entries for everything below the path are a contiguous range of each map, and
+  // the path itself is in the entry for its parent
+  RainString sKey(sPath);
+  sKey.toLower();
+  sKey += L"\\";
+  RainString sParentKey = GetDirectoryKey(sPath);
+
+  if(!bListingsOnly)
+  {
+    // Affected paths are removed from the index, and their slots are reused by later lookups
+    std::map<RainString, std::vector<size_t> >::iterator itr = m_mapResolvedByDirectory.lower_bound(sKey);
+    while(itr != m_mapResolvedByDirectory.end() && itr->first.length() >= sKey.length() && itr->first.prefix(sKey.length()) == sKey)
+    {
+      for(std::vector<size_t>::iterator itrIndex = itr->second.begin(); itrIndex != itr->second.end(); ++itrIndex)
+        _freeResolvedPath(*itrIndex);
+      m_mapResolvedByDirectory.erase(itr++);
+    }
+    itr = m_mapResolvedByDirectory.find(sParentKey);
+    if(itr != m_mapResolvedByDirectory.end())
+    {
+      std::vector<size_t>& vDirectory = itr->second;
+      for(size_t i = 0; i < vDirectory.size(); )
+      {
+        if(m_vResolvedPaths[vDirectory[i]].m_sPath.compareCaseless(sPath) == 0)
+        {
+          _freeResolvedPath(vDirectory[i]);
+          vDirectory[i] = vDirectory.back();
+          vDirectory.pop_back();
+        }
+        else
+          ++i;
+      }
+      if(vDirectory.empty())
+        m_mapResolvedByDirectory.erase(itr);
+    }
+  }
+
+  std::map<RainString, listing_t*>::iterator itr = m_mapListings.lower_bound(sKey);
+  while(itr != m_mapListings.end() && itr->first.length() >= sKey.length() && itr->first.prefix(sKey.length()) == sKey)
+  {
+    _releaseListing(itr->second);
+    m_mapListings.erase(itr++);
+  }
+  itr = m_mapListings.find(sParentKey);
+  if(itr != m_mapListings.end())
+  {
+    _releaseListing(itr->second);
+    m_mapListings.erase(itr);
+  }
+}
+
+void FileStoreComposition::onFileChange(IFileStore* pStore, const RainString& sPath, eFileChange eChange) throw()
+{
+  // A change to the contents of a file only affects the listing of its directory (which includes
+  // its size and time stamp), whereas any other change may affect which store provides each path
+  RainMutexLock oLock(m_oCacheMutex);
+  for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
+  {
+    if((**itr).m_pStore != pStore || (**itr).m_sPrefix.isEmpty())
+      continue;
+    // Prefixes end with a backslash, which the path of the root of the store does not have
+    const RainString& sPrefix = (**itr).m_sPrefix;
+    RainString sPrefixDirectory = sPrefix.prefix(sPrefix.length() - 1);
+    if(!IsPathWithin(sPath, sPrefixDirectory))
+      continue;
+    RainString sMountedIn = (**itr).m_sMountedIn;
+    if(!sMountedIn.isEmpty())
+      sMountedIn = sMountedIn.prefix(sMountedIn.length() - 1);
+    if(sPath.length() <= sPrefix.length())
+    {
+      // The root of the store itself has changed, so everything provided by it may have changed
+      _invalidatePath(sMountedIn, false);
+      continue;
+    }
+    RainString sRelative = sPath.mid(sPrefix.length(), sPath.length() - sPrefix.length());
+    RainString sCompositionPath = sMountedIn.isEmpty() ? sRelative : sMountedIn + L"\\" + sRelative;
+    _invalidatePath(sCompositionPath, eChange == FC_Modified);
   }
 }
 
@@ -199,32 +519,139 @@ bool FileStoreComposition::file_store_info_t::transformToFullPath(const RainStri
   return true;
 }
 
+//! A file opened for writing through the composition, which discards the cached details of its path once closed
+/*!
+  The caches are also discarded when the file is opened, but other threads may look up the path
+  whilst it is being written, and an atomic write only creates the file when it is closed.
+*/
+class FileStoreCompositionWriteFile : public IFile
+{
+public:
+  FileStoreCompositionWriteFile(IFile* pFile, const RainString& sPath, FileStoreComposition* pStore) throw()
+    : m_pFile(pFile), m_sPath(sPath), m_pStore(pStore)
+  {
+  }
+
+  virtual ~FileStoreCompositionWriteFile() throw()
+  {
+    delete m_pFile;
+    m_pStore->_invalidatePath(m_sPath, false);
+  }
+
+  virtual void read(void* pDestination, size_t iItemSize, size_t iItemCount) throw(...)
+  {
+    m_pFile->read(pDestination, iItemSize, iItemCount);
+  }
+
+  virtual size_t readNoThrow(void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+  {
+    return m_pFile->readNoThrow(pDestination, iItemSize, iItemCount);
+  }
+
+  virtual void readAt(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw(...)
+  {
+    m_pFile->readAt(iPosition, pDestination, iItemSize, iItemCount);
+  }
+
+  virtual size_t readAtNoThrow(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+  {
+    return m_pFile->readAtNoThrow(iPosition, pDestination, iItemSize, iItemCount);
+  }
+
+  virtual bool isReadAtThreadSafe() const throw()
+  {
+    return m_pFile->isReadAtThreadSafe();
+  }
+
+  virtual IFileView* mapView(seek_offset_t iPosition, size_t iLength) throw(...)
+  {
+    return m_pFile->mapView(iPosition, iLength);
+  }
+
+  virtual void write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...)
+  {
+    m_pFile->write(pSource, iItemSize, iItemCount);
+  }
+
+  virtual size_t writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw()
+  {
+    return m_pFile->writeNoThrow(pSource, iItemSize, iItemCount);
+  }
+
+  virtual void writeGather(const file_buffer_t* pBuffers, size_t iCount) throw(...)
+  {
+    m_pFile->writeGather(pBuffers, iCount);
+  }
+
+  virtual void seek(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw(...)
+  {
+    m_pFile->seek(iOffset, eRelativeTo);
+  }
+
+  virtual bool seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw()
+  {
+    return m_pFile->seekNoThrow(iOffset, eRelativeTo);
+  }
+
+  virtual seek_offset_t tell() throw()
+  {
+    return m_pFile->tell();
+  }
+
+protected:
+  IFile* m_pFile;
+  RainString m_sPath;
+  FileStoreComposition* m_pStore;
+};
+
+//! Get a path without any trailing backslash, as directory paths may be given with or without one
+static RainString WithoutTrailingBackslash(const RainString& sPath) throw(...)
+{
+  if(!sPath.isEmpty() && sPath.getCharacters()[sPath.length() - 1] == '\\')
+    return sPath.prefix(sPath.length() - 1);
+  return sPath;
+}
+
+RainString FileStoreComposition::_getCreatedPath(const RainString& sPath) throw(...)
+{
+  RainString sCreated = WithoutTrailingBackslash(sPath);
+  for(RainString sParent = sCreated.beforeLast('\\'); !sParent.isEmpty() && !doesDirectoryExist(sParent); sParent = sCreated.beforeLast('\\'))
+    sCreated = sParent;
+  return sCreated;
+}
+
+IFile* FileStoreComposition::_wrapWrittenFile(IFile* pFile, const RainString& sPath) throw()
+{
+  if(pFile == 0)
+    return 0;
+  FileStoreCompositionWriteFile* pWrapped = new (std::nothrow) FileStoreCompositionWriteFile(pFile, sPath, this);
+  if(pWrapped == 0)
+  {
+    delete pFile;
+    _invalidatePath(sPath, false);
+  }
+  return pWrapped;
+}
+
 IFile* FileStoreComposition::openFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
 {
   if(eMode == FM_Read)
   {
     try
     {
-      for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
-      {
-        if(!(*itr)->m_bEnabled)
-          continue;
-
-        if((**itr).m_oCaps.bCanReadFiles)
-        {
-          RainString sFullPath;
-          if(!(**itr).transformToFullPath(sPath, sFullPath))
-            continue;
-          if((**itr).m_pStore->doesFileExist(sFullPath))
-            return (**itr).m_pStore->openFile(sFullPath, eMode);
-        }
-      }
+      RainString sFullPath;
+      file_store_info_t *pStore = _resolveForReading(sPath, sFullPath);
+      if(pStore)
+        return pStore->m_pStore->openFile(sFullPath, eMode);
       THROW_SIMPLE_(L"\'%s\' does not exist in any file stores", sPath.getCharacters());
     }
     CATCH_THROW_SIMPLE_({}, L"Error opening file \'%s\' for reading", sPath.getCharacters());
   }
   else
   {
+    // Opening a file for writing can create it, along with its directory
+    RainString sCreated = _getCreatedPath(sPath);
+    _invalidatePath(sCreated, false);
     try
     {
       for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
@@ -237,7 +664,7 @@ IFile* FileStoreComposition::openFile(const RainString& sPath, eFileOpenMode eMo
             continue;
         if((**itr).m_pStore->doesFileExist(sFullPath))
         {
-          return (**itr).m_pStore->openFile(sFullPath, eMode);
+          return CHECK_ALLOCATION(_wrapWrittenFile((**itr).m_pStore->openFile(sFullPath, eMode), sCreated));
         }
         else if((**itr).m_oCaps.bCanWriteFiles)
         {
@@ -245,7 +672,7 @@ IFile* FileStoreComposition::openFile(const RainString& sPath, eFileOpenMode eMo
           RainString sFullParent;
           (**itr).transformToFullPath(sParent, sFullParent);
           (**itr).ensureDirectory(sFullParent, true);
-          return (**itr).m_pStore->openFile(sFullPath, eMode);
+          return CHECK_ALLOCATION(_wrapWrittenFile((**itr).m_pStore->openFile(sFullPath, eMode), sCreated));
         }
       }
       THROW_SIMPLE(L"No file stores with write capability to create the file in");
@@ -258,27 +685,15 @@ IFile* FileStoreComposition::openFileNoThrow(const RainString& sPath, eFileOpenM
 {
   if(eMode == FM_Read)
   {
-    for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
-    {
-      if(!(*itr)->m_bEnabled)
-        continue;
-
-      if((**itr).m_oCaps.bCanReadFiles)
-      {
-        RainString sFullPath;
-        if(!(**itr).transformToFullPath(sPath, sFullPath))
-          continue;
-        if((**itr).m_pStore->doesFileExist(sFullPath))
-        {
-          IFile* pFile = (**itr).m_pStore->openFileNoThrow(sFullPath, eMode);
-          if(pFile)
-            return pFile;
-        }
-      }
-    }
+    RainString sFullPath;
+    file_store_info_t *pStore = _resolveForReading(sPath, sFullPath);
+    if(pStore)
+      return pStore->m_pStore->openFileNoThrow(sFullPath, eMode);
   }
   else
   {
+    RainString sCreated = _getCreatedPath(sPath);
+    _invalidatePath(sCreated, false);
     for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
     {
       if(!(*itr)->m_bEnabled)
@@ -290,7 +705,7 @@ IFile* FileStoreComposition::openFileNoThrow(const RainString& sPath, eFileOpenM
 
       if((**itr).m_pStore->doesFileExist(sFullPath))
       {
-        return (**itr).m_pStore->openFileNoThrow(sPath, eMode);
+        return _wrapWrittenFile((**itr).m_pStore->openFileNoThrow(sFullPath, eMode), sCreated);
       }
       else if((**itr).m_oCaps.bCanWriteFiles)
       {
@@ -298,7 +713,7 @@ IFile* FileStoreComposition::openFileNoThrow(const RainString& sPath, eFileOpenM
         RainString sFullParent;
         (**itr).transformToFullPath(sParent, sFullParent);
         if((**itr).ensureDirectory(sFullParent, false))
-          return (**itr).m_pStore->openFile(sFullPath, eMode);
+          return _wrapWrittenFile((**itr).m_pStore->openFileNoThrow(sFullPath, eMode), sCreated);
         return 0; // while we could continue through the list, to ensure consistent behaviour
                   // with openFile(), we abort after the first writable file store
       }
@@ -326,17 +741,13 @@ bool FileStoreComposition::file_store_info_t::ensureDirectory(RainString sFullPa
 
 bool FileStoreComposition::doesFileExist(const RainString& sPath) throw()
 {
-  for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
-  {
-    RainString sFullPath;
-    if((*itr)->m_bEnabled && (**itr).transformToFullPath(sPath, sFullPath) && (**itr).m_pStore->doesFileExist(sFullPath))
-      return true;
-  }
-  return false;
+  RainString sFullPath;
+  return _resolveForReading(sPath, sFullPath) != 0;
 }
 
 void FileStoreComposition::deleteFile(const RainString& sPath) throw(...)
 {
+  _invalidatePath(sPath, false);
   try
   {
     // Optimisations for simple cases
@@ -409,140 +820,226 @@ const RainString& FileStoreComposition::getEntryPointName(size_t iIndex) throw(.
   return m_vEntryPoints[iIndex];
 }
 
-static bool directories_first_alphabetical_predicate(const auto_directory_item& a, const auto_directory_item& b)
+bool FileStoreComposition::_listing_item_sort(const listing_item_t& a, const listing_item_t& b)
 {
-  if(a.isDirectory() != b.isDirectory())
-    return a.isDirectory();
-  return a.name().compareCaseless(b.name()) < 0;
+  int iStatus = a.m_sSortKey.compare(b.m_sSortKey);
+  if(iStatus != 0)
+    return iStatus < 0;
+  return a.m_iStore < b.m_iStore;
 }
 
-class FileStoreCompositionFakePlaceholderDirectory : public IDirectory
+bool FileStoreComposition::_listing_item_is_directory(const listing_item_t& oItem)
 {
-public:
-  FileStoreCompositionFakePlaceholderDirectory(const RainString &sPath, FileStoreComposition* pStore, const RainString& sItem) throw()
-    : m_sPath(sPath), m_pStore(pStore), m_sItem(sItem)
+  return oItem.m_bIsDirectory;
+}
+
+void FileStoreComposition::_buildListing(const RainString& sPath, listing_t* pListing) throw(...)
+{
+  // Gather the contents of the directory from each store, with each store's contents sorted by name
+  std::vector<std::vector<listing_item_t> > vStoreItems;
+  listing_item_t oItem;
+  directory_item_t oDetails;
+  oDetails.oFields = true;
+  std::vector<file_store_info_t*> vFileStores;
   {
+    // As with _resolveForReading(), the stores are read from a copy of the list taken under the lock
+    RainMutexLock oLock(m_oCacheMutex);
+    for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
+    {
+      if((*itr)->m_bEnabled)
+        vFileStores.push_back(*itr);
+    }
   }
-
-  virtual size_t getItemCount() throw()
+  for(size_t iStore = 0; iStore < vFileStores.size(); ++iStore)
   {
-    return 1;
+    file_store_info_t *pInfo = vFileStores[iStore];
+    oItem.m_iStore = iStore;
+
+    RainString sFullPath;
+    if(!pInfo->transformToFullPath(sPath, sFullPath))
+    {
+      // The directory may be an ancestor of the directory which the store is mounted in, in which
+      // case the next directory along the mount path appears within it
+      if(sPath.length() < pInfo->m_sMountedIn.length() && memcmp(sPath.getCharacters(), pInfo->m_sMountedIn.getCharacters(), sPath.length() * sizeof(RainChar)) == 0)
+      {
+        oItem.m_sName = pInfo->m_sMountedIn.mid(sPath.length(), pInfo->m_sMountedIn.indexOf('\\', sPath.length() + 1) - sPath.length());
+        oItem.m_sSortKey = oItem.m_sName;
+        oItem.m_sSortKey.toLower();
+        oItem.m_iSize.iLower = oItem.m_iSize.iUpper = 0;
+        oItem.m_iTimestamp = 0;
+        oItem.m_bIsDirectory = true;
+        vStoreItems.push_back(std::vector<listing_item_t>(1, oItem));
+      }
+      continue;
+    }
+    if(!pInfo->m_pStore->doesDirectoryExist(sFullPath))
+      continue;
+
+    std::auto_ptr<IDirectory> pDirectory(pInfo->m_pStore->openDirectory(sFullPath));
+    size_t iCount = pDirectory->getItemCount();
+    vStoreItems.push_back(std::vector<listing_item_t>());
+    std::vector<listing_item_t>& vItems = vStoreItems.back();
+    vItems.reserve(iCount);
+    size_t iSecondRun = 0;
+    bool bSorted = true;
+    for(size_t i = 0; i < iCount; ++i)
+    {
+      pDirectory->getItemDetails(i, oDetails);
+      oItem.m_sName = oDetails.sName;
+      oItem.m_sSortKey = oDetails.sName;
+      oItem.m_sSortKey.toLower();
+      oItem.m_iSize = oDetails.iSize;
+      oItem.m_iTimestamp = oDetails.iTimestamp;
+      oItem.m_bIsDirectory = oDetails.bIsDirectory;
+      if(bSorted && !vItems.empty() && _listing_item_sort(oItem, vItems.back()))
+      {
+        // One break in the order is allowed, which starts a second sorted run
+        if(iSecondRun == 0)
+          iSecondRun = vItems.size();
+        else
+          bSorted = false;
+      }
+      vItems.push_back(oItem);
+    }
+    // Most stores list items in name order already, or list directories and then files, each in name
+    // order (as SgaArchive does). In the latter case, the two runs are merged, so a full sort is only
+    // needed for stores which do neither.
+    if(!bSorted)
+      std::sort(vItems.begin(), vItems.end(), _listing_item_sort);
+    else if(iSecondRun != 0)
+      std::inplace_merge(vItems.begin(), vItems.begin() + iSecondRun, vItems.end(), _listing_item_sort);
   }
 
-  virtual void getItemDetails(size_t iIndex, directory_item_t& oDetails) throw(...)
+  // Merge the sorted lists, taking each name only once, from the highest priority store which has it
+  size_t iTotal = 0;
+  for(size_t i = 0; i < vStoreItems.size(); ++i)
+    iTotal += vStoreItems[i].size();
+  std::vector<listing_item_t>& vMerged = pListing->m_vItems;
+  vMerged.reserve(iTotal);
+  std::vector<size_t> vPositions(vStoreItems.size(), 0);
+  for(;;)
   {
-    CHECK_RANGE_LTMAX(0, iIndex, static_cast<size_t>(1));
-    if(oDetails.oFields.dir)
-      oDetails.bIsDirectory = true;
-    if(oDetails.oFields.name)
-      oDetails.sName = m_sItem;
+    const listing_item_t* pNext = 0;
+    size_t iNextList = 0;
+    for(size_t i = 0; i < vStoreItems.size(); ++i)
+    {
+      if(vPositions[i] < vStoreItems[i].size() && (pNext == 0 || _listing_item_sort(vStoreItems[i][vPositions[i]], *pNext)))
+      {
+        pNext = &vStoreItems[i][vPositions[i]];
+        iNextList = i;
+      }
+    }
+    if(pNext == 0)
+      break;
+    if(vMerged.empty() || vMerged.back().m_sSortKey != pNext->m_sSortKey)
+      vMerged.push_back(*pNext);
+    ++vPositions[iNextList];
   }
 
-  virtual const RainString& getPath() throw()
+  // Directories come before files, and a stable partition keeps both sorted by name
+  std::stable_partition(vMerged.begin(), vMerged.end(), _listing_item_is_directory);
+}
+
+FileStoreComposition::listing_t* FileStoreComposition::_getListing(const RainString& sPath) throw(...)
+{
+  RainString sKey(sPath);
+  sKey.toLower();
   {
-    return m_sPath;
+    RainMutexLock oLock(m_oCacheMutex);
+    std::map<RainString, listing_t*>::iterator itr = m_mapListings.find(sKey);
+    if(itr != m_mapListings.end())
+    {
+      RainAtomicIncrement(&itr->second->m_iReferenceCount);
+      return itr->second;
+    }
   }
 
-  virtual IFileStore* getStore() throw()
+  // As with the path index, the stores are read without holding the lock
+  unsigned long iGeneration;
   {
-    return m_pStore;
+    RainMutexLock oLock(m_oCacheMutex);
+    iGeneration = m_iCacheGeneration;
   }
+  listing_t *pListing = CHECK_ALLOCATION(new (std::nothrow) listing_t);
+  pListing->m_iReferenceCount = 1;
+  try
+  {
+    _buildListing(sPath, pListing);
+  }
+  CATCH_THROW_SIMPLE(delete pListing, L"Cannot merge directory contents");
 
-  virtual IFile* openFile(size_t iIndex, eFileOpenMode eMode) throw(...)
+  RainMutexLock oLock(m_oCacheMutex);
+  std::map<RainString, listing_t*>::iterator itr = m_mapListings.find(sKey);
+  if(itr == m_mapListings.end() && iGeneration == m_iCacheGeneration && _canCacheListings())
   {
-    THROW_SIMPLE(L"Cannot open file - no files exist in this directory");
-    return 0;
+    RainAtomicIncrement(&pListing->m_iReferenceCount);
+    m_mapListings[sKey] = pListing;
   }
+  return pListing;
+}
 
-  virtual IFile* openFileNoThrow(size_t iIndex, eFileOpenMode eMode) throw()
+bool FileStoreComposition::_canCacheListings() const throw()
+{
+  // Nothing is told about changes made to a store other than through the composition, unless it is
+  // the file system store being watched, or it cannot be changed at all (like an archive)
+  for(std::vector<file_store_info_t*>::const_iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
   {
-    return 0;
+    const file_store_info_t& oInfo = **itr;
+    if(!oInfo.m_bEnabled || !oInfo.m_oCaps.bCanOpenDirectories)
+      continue;
+    if(m_pWatcher && oInfo.m_pStore == m_pWatcher->getStore())
+      continue;
+    if(oInfo.m_oCaps.bCanWriteFiles || oInfo.m_oCaps.bCanDeleteFiles || oInfo.m_oCaps.bCanCreateDirectories || oInfo.m_oCaps.bCanDeleteDirectories)
+      return false;
   }
+  return true;
+}
 
-protected:
-  RainString m_sPath,
-             m_sItem;
-  FileStoreComposition* m_pStore;
-};
+void FileStoreComposition::_releaseListing(listing_t* pListing) throw()
+{
+  if(RainAtomicDecrement(&pListing->m_iReferenceCount) == 0)
+    delete pListing;
+}
 
 class FileStoreCompositionDirectory : public IDirectory
 {
 public:
   FileStoreCompositionDirectory(const RainString &sPath, FileStoreComposition* pStore) throw()
-    : m_sPath(sPath), m_pStore(pStore)
+    : m_sPath(sPath), m_pStore(pStore), m_pListing(0)
   {
   }
 
   virtual ~FileStoreCompositionDirectory()
   {
-    for(std::vector<IDirectory*>::iterator itr = m_vDirectories.begin(); itr != m_vDirectories.end(); ++itr)
-      delete *itr;
+    if(m_pListing)
+      FileStoreComposition::_releaseListing(m_pListing);
   }
 
   void init() throw(...)
   {
     if(m_sPath.suffix(1) != L"\\")
       m_sPath += '\\';
-
-    std::tr1::unordered_map<unsigned long, bool> mapContents;
-    for(std::vector<FileStoreComposition::file_store_info_t*>::iterator itr = m_pStore->m_vFileStores.begin(); itr != m_pStore->m_vFileStores.end(); ++itr)
-    {
-      if(!(*itr)->m_bEnabled)
-        continue;
-
-      RainString sFullPath;
-      if(!(*itr)->transformToFullPath(m_sPath, sFullPath))
-      {
-        if(m_sPath.length() < (**itr).m_sMountedIn.length() && memcmp(m_sPath.getCharacters(), (**itr).m_sMountedIn.getCharacters(), m_sPath.length() * sizeof(RainChar)) == 0)
-        {
-          RainString sName = (**itr).m_sMountedIn.mid(m_sPath.length(), (**itr).m_sMountedIn.indexOf('\\', m_sPath.length() + 1) - m_sPath.length());
-          unsigned long iHash = CRCCaselessHashSimple(sName.getCharacters(), sName.length() * sizeof(RainChar));
-          if(mapContents[iHash] == false)
-          {
-            mapContents[iHash] = true;
-            IDirectory *pDirectory = new FileStoreCompositionFakePlaceholderDirectory(m_sPath, m_pStore, sName);
-            m_vDirectories.push_back(pDirectory);
-            m_vItems.push_back(auto_directory_item(pDirectory, 0));
-          }
-          continue;
-        }
-      }
-      if(!(*itr)->m_pStore->doesDirectoryExist(sFullPath))
-        continue;
-      IDirectory *pDirectory = (*itr)->m_pStore->openDirectory(sFullPath);
-      m_vDirectories.push_back(pDirectory);
-      for(IDirectory::iterator itrDir = pDirectory->begin(); itrDir != pDirectory->end(); ++itrDir)
-      {
-        const RainString& sName = itrDir->name();
-        unsigned long iHash = CRCCaselessHashSimple(sName.getCharacters(), sName.length() * sizeof(RainChar));
-        if(mapContents[iHash] == false)
-        {
-          mapContents[iHash] = true;
-          m_vItems.push_back(*itrDir);
-        }
-      }
-    }
-    std::sort(m_vItems.begin(), m_vItems.end(), directories_first_alphabetical_predicate);
+    m_pListing = m_pStore->_getListing(m_sPath);
   }
 
   size_t getItemCount() throw()
   {
-    return m_vItems.size();
+    return m_pListing->m_vItems.size();
   }
 
   void getItemDetails(size_t iIndex, directory_item_t& oDetails) throw(...)
   {
     CHECK_RANGE_LTMAX(0, iIndex, getItemCount());
 
-    auto_directory_item& oItem = m_vItems[iIndex];
+    const FileStoreComposition::listing_item_t& oItem = m_pListing->m_vItems[iIndex];
     if(oDetails.oFields.name)
-      oDetails.sName = oItem.name();
+      oDetails.sName = oItem.m_sName;
     if(oDetails.oFields.dir)
-      oDetails.bIsDirectory = oItem.isDirectory();
+      oDetails.bIsDirectory = oItem.m_bIsDirectory;
     if(oDetails.oFields.size)
-      oDetails.iSize = oItem.size();
+      oDetails.iSize = oItem.m_iSize;
     if(oDetails.oFields.time)
-      oDetails.iTimestamp = oItem.timestamp();
+      oDetails.iTimestamp = oItem.m_iTimestamp;
   }
 
   const RainString& getPath() throw()
@@ -556,16 +1053,19 @@ public:
   }
 
 protected:
-  std::vector<auto_directory_item> m_vItems;
-  std::vector<IDirectory*> m_vDirectories;
   RainString m_sPath;
   FileStoreComposition* m_pStore;
+  FileStoreComposition::listing_t* m_pListing;
 };
 
 IDirectory* FileStoreComposition::openDirectory(const RainString& sPath) throw(...)
 {
   FileStoreCompositionDirectory *pDirectory = CHECK_ALLOCATION(new (std::nothrow) FileStoreCompositionDirectory(sPath, this));
-  pDirectory->init();
+  try
+  {
+    pDirectory->init();
+  }
+  CATCH_THROW_SIMPLE_(delete pDirectory, L"Cannot open directory \'%s\'", sPath.getCharacters());
   return pDirectory;
 }
 
@@ -581,6 +1081,7 @@ IDirectory* FileStoreComposition::openDirectoryNoThrow(const RainString& sPath)
     catch(RainException *pE)
     {
       delete pE;
+      delete pDirectory;
       return 0;
     }
   }
@@ -602,6 +1103,7 @@ void FileStoreComposition::createDirectory(const RainString& sPath) throw(...)
 {
   if(doesDirectoryExist(sPath))
     THROW_SIMPLE_(L"Cannot create directory \'%s\' - it already exists", sPath.getCharacters());
+  _invalidatePath(_getCreatedPath(sPath), false);
   try
   {
     for(std::vector<file_store_info_t*>::iterator itr = m_vFileStores.begin(); itr != m_vFileStores.end(); ++itr)
@@ -651,6 +1153,7 @@ bool FileStoreComposition::createDirectoryNoThrow(const RainString& sPath) throw
 
 void FileStoreComposition::deleteDirectory(const RainString& sPath) throw(...)
 {
+  _invalidatePath(WithoutTrailingBackslash(sPath), false);
   try
   {
     // Optimisations for simple cases
@@ -24,9 +24,31 @@ OTHER DEALINGS IN THE SOFTWARE.
 */
 #pragma once
 #include "file.h"
+#include "containers.h"
+#include "file_watcher.h"
+#include "threading.h"
+#include <map>
 #include <vector>
 
-class RAINMAN2_API FileStoreComposition : public IFileStore
+//! Combines several file stores into one, with higher priority stores hiding files in lower ones
+/*!
+  Which store (if any) provides a file for reading is remembered in an index of resolved paths, so
+  that a path only has to be probed against every store the first time that it is looked up. Paths
+  which no store provides are remembered too, though only the most recent MAX_MISSING_PATHS of
+  them, as any number of different missing paths may be looked up. Likewise, the merged contents of
+  each directory which is opened are remembered, and shared by every IDirectory subsequently opened
+  on it, but only while every store which can be changed is the file system store being watched
+  (see watchFileSystem()); otherwise each directory is listed afresh whenever it is opened, as the
+  composition has no cheap way to find out whether a listing is still current. These caches are
+  discarded whenever the set of enabled stores changes, and the parts of them for a path are
+  discarded whenever the composition writes, creates or deletes it (for files opened for writing,
+  both when they are opened and when they are closed, so such files must be closed before the
+  composition is destroyed). If the stores are changed by other means, then invalidateCaches()
+  should be called (for the resolved paths, which are always remembered), or, for stores on the
+  file system, watchFileSystem() can be used so that only the parts of the caches affected by each
+  change are discarded.
+*/
+class RAINMAN2_API FileStoreComposition : public IFileStore, public IFileChangeListener
 {
 public:
   FileStoreComposition() throw();
@@ -38,6 +60,21 @@ public:
 
   void reenumerateEntryPoints() throw(...);
 
+  //! Forget which stores provide which files and directory listings, for when the contents of the stores have changed
+  void invalidateCaches() throw();
+
+  //! The number of paths which no store provides that are remembered, beyond which the oldest are forgotten
+  static const size_t MAX_MISSING_PATHS = 4096;
+
+  //! Keep the caches up to date with changes made to the file system
+  /*!
+    The directories of every file system store in the composition (and of any added later) are
+    watched, and each change discards just the cached paths and listings which it affects.
+    \param pWatcher A watcher for the file system store used by the composition, which must
+      outlive the composition
+  */
+  void watchFileSystem(RainFileWatcher* pWatcher) throw(...);
+
   // IFileStore interface
   virtual void getCaps(file_store_caps_t& oCaps) const throw();
 
@@ -58,8 +95,12 @@ public:
   virtual void        deleteDirectory       (const RainString& sPath) throw(...);
   virtual bool        deleteDirectoryNoThrow(const RainString& sPath) throw();
 
+  // IFileChangeListener interface
+  virtual void onFileChange(IFileStore* pStore, const RainString& sPath, eFileChange eChange) throw();
+
 protected:
   friend class FileStoreCompositionDirectory;
+  friend class FileStoreCompositionWriteFile;
 
   struct file_store_info_t
   {
@@ -75,9 +116,91 @@ protected:
     bool transformToFullPath(const RainString &sPath, RainString &sFullPath);
   };
 
+  //! A path which has been looked up for reading, along with the store (if any) which provides it
+  struct resolved_path_t
+  {
+    RainString m_sPath;
+    RainString m_sFullPath;
+    file_store_info_t *m_pStore; //!< NULL if no store provides the path
+    bool m_bFree; //!< true if the path has been invalidated, and the slot is waiting to be reused
+  };
+
+  //! Predicate for RainHashIndex::find() which checks that a resolved path matches a path
+  struct resolved_path_matcher_t;
+  friend struct resolved_path_matcher_t;
+
+  //! An item in a merged directory listing
+  struct listing_item_t
+  {
+    RainString m_sName;
+    RainString m_sSortKey; //!< The name in lower case, so that items can be ordered without caseless comparisons
+    filesize_t m_iSize;
+    filetime_t m_iTimestamp;
+    bool m_bIsDirectory;
+    size_t m_iStore;       //!< Rank of the store which provided the item, for preferring higher priority stores
+  };
+
+  //! The merged contents of a directory, shared between the cache and every directory opened on it
+  struct listing_t
+  {
+    std::vector<listing_item_t> m_vItems; //!< Directories first, and then files, each sorted by name
+    volatile long m_iReferenceCount;
+  };
+
+  //! Get the merged contents of a directory, from the cache if possible
+  /*!
+    \param sPath Path of the directory, ending with a backslash
+    \return The listing, with a reference added for the caller, which should call _releaseListing()
+  */
+  listing_t* _getListing(const RainString& sPath) throw(...);
+  static void _releaseListing(listing_t* pListing) throw();
+  //! Determine whether listings can be cached, which is only when no store can change without the composition being told
+  bool _canCacheListings() const throw();
+  //! Build the merged contents of a directory from the contents of each store
+  void _buildListing(const RainString& sPath, listing_t* pListing) throw(...);
+
   static bool _file_store_priority_sort(file_store_info_t* a, file_store_info_t* b);
+  //! Orders listing items by name, and then by the priority of the store which provided them
+  static bool _listing_item_sort(const listing_item_t& a, const listing_item_t& b);
+  static bool _listing_item_is_directory(const listing_item_t& oItem);
+
+  //! Find the highest priority store which provides a file for reading
+  /*!
+    \param sPath The path to look up
+    \param sFullPath Set to the path of the file within the store which provides it
+    \return The store which provides the file, or NULL if no store does
+  */
+  file_store_info_t* _resolveForReading(const RainString& sPath, RainString& sFullPath) throw();
+  //! Discard the cached paths and listings for a path, and everything below it
+  /*!
+    \param sPath The path, without a trailing backslash (an empty path discards everything)
+    \param bListingsOnly If true, then the path index is kept, as whether the path exists is unchanged
+  */
+  void _invalidatePath(const RainString& sPath, bool bListingsOnly) throw();
+  //! Remove a resolved path from the path index and mark its slot as free (but leave it in m_mapResolvedByDirectory)
+  void _freeResolvedPath(size_t iIndex) throw();
+  //! Add a resolved path which no store provides to m_vMissingPaths, freeing the oldest such path if it is full
+  void _rememberMissingPath(size_t iIndex) throw();
+  //! Get the path to discard from the caches when creating a path, as any missing ancestors are created too
+  RainString _getCreatedPath(const RainString& sPath) throw(...);
+  //! Wrap a file opened for writing so that the caches are updated once it has been written
+  /*!
+    \return The wrapped file, or NULL if pFile is NULL or memory is short (in which case pFile is closed)
+  */
+  IFile* _wrapWrittenFile(IFile* pFile, const RainString& sPath) throw();
+  void _enumerateEntryPoints(const std::vector<file_store_info_t*>& vFileStores, std::vector<RainString>& vEntryPoints) throw(...);
 
   std::vector<file_store_info_t*> m_vFileStores;
   std::vector<RainString> m_vEntryPoints;
+  std::vector<resolved_path_t> m_vResolvedPaths;
+  std::vector<size_t> m_vFreeResolvedPaths; //!< Indices of slots of m_vResolvedPaths which can be reused
+  RainHashIndex<size_t> m_oPathIndex; //!< Maps caseless hashes of paths to indices into m_vResolvedPaths
+  std::map<RainString, std::vector<size_t> > m_mapResolvedByDirectory; //!< Indices into m_vResolvedPaths of the paths in each directory, keyed as m_mapListings is
+  std::vector<size_t> m_vMissingPaths; //!< Ring of indices into m_vResolvedPaths of paths which no store provides
+  size_t m_iOldestMissingPath; //!< Position in m_vMissingPaths of the oldest path, once it is full
+  std::map<RainString, listing_t*> m_mapListings; //!< Keyed by path in lower case
+  RainMutex m_oCacheMutex; //!< Guards both the path index and the listings, and changes to the list of stores
+  RainFileWatcher* m_pWatcher;
+  unsigned long m_iCacheGeneration; //!< Incremented whenever anything is removed from the caches
 
 };
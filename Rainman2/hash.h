@@ -24,6 +24,8 @@ OTHER DEALINGS IN THE SOFTWARE.
 */
 #pragma once
 #include "file.h"
+#include <ctype.h>
+#include <wctype.h>
 
 class RAINMAN2_API IHash
 {
@@ -124,4 +126,31 @@ protected:
 };
 
 RAINMAN2_API unsigned long CRCCaselessHashSimple(const void* pData, size_t iDataLength, unsigned long iHashValue = 0);
-RAINMAN2_API unsigned long CRCCaselessHashSimpleAsciiFromUnicode(const wchar_t* pData, size_t iDataLength, unsigned long iHashValue = 0);
\ No newline at end of file
+RAINMAN2_API unsigned long CRCCaselessHashSimpleAsciiFromUnicode(const wchar_t* pData, size_t iDataLength, unsigned long iHashValue = 0);
+//! Lower-case a character of a path, for caseless comparisons
+inline int RainLowerCaseless(wchar_t c) throw()
+{
+  return towlower(c);
+}
+
+//! Lower-case a character of a narrow (archive) string, which must not be passed to tolower() as a negative value
+inline int RainLowerCaseless(char c) throw()
+{
+  return tolower(static_cast<unsigned char>(c));
+}
+
+//! Compare characters in the same way as RainString::compareCaseless()
+/*!
+  Used to confirm candidates found through an index keyed by CRCCaselessHashSimple(), where the
+  characters being compared against are either wide or narrow.
+*/
+template <class T>
+inline bool RainEqualsCaseless(const wchar_t* pA, const T* pB, size_t iLength) throw()
+{
+  for(size_t i = 0; i < iLength; ++i)
+  {
+    if(RainLowerCaseless(pA[i]) != RainLowerCaseless(pB[i]))
+      return false;
+  }
+  return true;
+}
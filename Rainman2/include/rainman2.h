@@ -29,12 +29,16 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "../attributes.h"
 #include "../binaryattrib.h"
 #include "../buffering_streams.h"
+#include "../bulk_extract.h"
+#include "../compress_pipeline.h"
 #include "../exception.h"
 #include "../exception_dialog.h"
 #include "../file.h"
+#include "../file_watcher.h"
 #include "../filestore_adaptors.h"
 #include "../filestore_composition.h"
 #include "../hash.h"
+#include "../inflatefile.h"
 #include "../inifile.h"
 #include "../luattrib.h"
 #include "../mem_fs.h"
@@ -46,8 +50,11 @@ OTHER DEALINGS IN THE SOFTWARE.
 #endif
 // resource.h is for internal use only
 #include "../rgd_dict.h"
+#include "../sga_writer.h"
 #include "../spk_archive.h"
+#include "../spk_writer.h"
 #include "../string.h"
+#include "../threading.h"
 #include "../ucs.h"
 #include "../va_copy.h"
 #include "../win32pe.h"
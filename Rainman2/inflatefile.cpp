@@ -0,0 +1,410 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "inflatefile.h"
+#include "memfile.h"
+#include <algorithm>
+#include <string.h>
+
+static const wchar_t* Z_ERR[] = {
+  L"zLib error from C errno",
+  L"zLib stream error",
+  L"zLib data error",
+  L"zLib memory error",
+  L"zLib buffer error",
+  L"zLib version error"
+};
+
+static const wchar_t* ZErrorMessage(int err) throw()
+{
+  if(err < 0 && -err <= static_cast<int>(sizeof(Z_ERR) / sizeof(*Z_ERR)))
+    return Z_ERR[-err-1];
+  return L"unknown zLib error";
+}
+
+InflateReadFile::InflateReadFile(IFile* pSource, seek_offset_t iSourceOffset, size_t iCompressedLength, size_t iLength, RainMutex* pSourceMutex, bool bOwnSource, memory_buffer_owner_t* pOwner) throw(...)
+  : m_pSource(pSource), m_pSourceMutex(pSourceMutex), m_pCompressed(0), m_pOwner(pOwner), m_iSourceOffset(iSourceOffset)
+  , m_iCompressedLength(iCompressedLength), m_iLength(iLength), m_bOwnSource(bOwnSource)
+{
+  _init();
+}
+
+InflateReadFile::InflateReadFile(const char* pCompressed, size_t iCompressedLength, size_t iLength, memory_buffer_owner_t* pOwner) throw(...)
+  : m_pSource(0), m_pSourceMutex(0), m_pCompressed(pCompressed), m_pOwner(pOwner), m_iSourceOffset(0)
+  , m_iCompressedLength(iCompressedLength), m_iLength(iLength), m_bOwnSource(false)
+{
+  _init();
+}
+
+void InflateReadFile::_init() throw(...)
+{
+  m_iInputPosition = 0;
+  m_iPosition = 0;
+  m_iStreamPosition = 0;
+  m_iCheckpointInterval = DEFAULT_CHECKPOINT_INTERVAL;
+  m_bStreamEnded = false;
+  m_bTolerateBadChecksum = false;
+
+  memset(&m_oStream, 0, sizeof(m_oStream));
+  m_oStream.zalloc = (alloc_func)0;
+  m_oStream.zfree = (free_func)0;
+  int err = inflateInit(&m_oStream);
+  m_bStreamValid = (err == Z_OK);
+  if(!m_bStreamValid)
+  {
+    if(m_bOwnSource)
+      delete m_pSource;
+    if(m_pOwner)
+      m_pOwner->release();
+    THROW_SIMPLE_(L"Cannot initialise zLib stream; %s", ZErrorMessage(err));
+  }
+}
+
+InflateReadFile::~InflateReadFile() throw()
+{
+  _freeCheckpoints();
+  if(m_bStreamValid)
+    inflateEnd(&m_oStream);
+  if(m_bOwnSource)
+    delete m_pSource;
+  if(m_pOwner)
+    m_pOwner->release();
+}
+
+void InflateReadFile::_freeCheckpoints() throw()
+{
+  for(std::vector<z_stream*>::iterator itr = m_vCheckpoints.begin(); itr != m_vCheckpoints.end(); ++itr)
+  {
+    inflateEnd(*itr);
+    delete *itr;
+  }
+  m_vCheckpoints.clear();
+}
+
+void InflateReadFile::setCheckpointInterval(size_t iInterval) throw()
+{
+  // Existing checkpoints are positioned according to the old interval, so they cannot be kept
+  if(iInterval != m_iCheckpointInterval)
+  {
+    _freeCheckpoints();
+    m_iCheckpointInterval = iInterval;
+  }
+}
+
+void InflateReadFile::_saveCheckpoint() throw()
+{
+  z_stream* pCheckpoint = new (std::nothrow) z_stream;
+  if(pCheckpoint == 0)
+    return;
+  if(inflateCopy(pCheckpoint, &m_oStream) != Z_OK)
+  {
+    // A missing checkpoint only makes backward seeks slower, so running out of memory is not fatal
+    delete pCheckpoint;
+    return;
+  }
+  try
+  {
+    m_vCheckpoints.push_back(pCheckpoint);
+  }
+  catch(...)
+  {
+    inflateEnd(pCheckpoint);
+    delete pCheckpoint;
+  }
+}
+
+bool InflateReadFile::_fillInput() throw(...)
+{
+  size_t iRemaining = m_iCompressedLength - m_iInputPosition;
+  if(iRemaining == 0)
+    return false;
+  if(m_pCompressed)
+  {
+    // The entire compressed stream is in memory, so it can be given to zLib in one go
+    m_oStream.next_in = (Bytef*)(m_pCompressed + m_iInputPosition);
+    m_oStream.avail_in = (uInt)iRemaining;
+    m_iInputPosition += iRemaining;
+    return true;
+  }
+
+  size_t iNumBytes = iRemaining < INPUT_BUFFER_SIZE ? iRemaining : INPUT_BUFFER_SIZE;
+  seek_offset_t iPosition = m_iSourceOffset + static_cast<seek_offset_t>(m_iInputPosition);
+  if(m_pSourceMutex)
+  {
+    RainMutexLock oLock(*m_pSourceMutex);
+    iNumBytes = m_pSource->readAtNoThrow(iPosition, m_aInputBuffer, 1, iNumBytes);
+  }
+  else
+    iNumBytes = m_pSource->readAtNoThrow(iPosition, m_aInputBuffer, 1, iNumBytes);
+  if(iNumBytes == 0)
+    THROW_SIMPLE(L"Unexpected end of compressed data");
+  m_oStream.next_in = (Bytef*)m_aInputBuffer;
+  m_oStream.avail_in = (uInt)iNumBytes;
+  m_iInputPosition += iNumBytes;
+  return true;
+}
+
+size_t InflateReadFile::_inflate(unsigned char* pDestination, size_t iLength) throw(...)
+{
+  if(!m_bStreamValid)
+    THROW_SIMPLE(L"zLib stream is not usable after an earlier error");
+
+  size_t iProduced = 0;
+  while(iProduced < iLength && !m_bStreamEnded)
+  {
+    if(m_oStream.avail_in == 0 && !_fillInput())
+      THROW_SIMPLE(L"Unexpected end of compressed data");
+
+    // Output is limited so that checkpoints land on exact multiples of the interval
+    size_t iChunk = iLength - iProduced;
+    size_t iNextCheckpoint = 0;
+    if(m_iCheckpointInterval != 0)
+    {
+      iNextCheckpoint = (m_vCheckpoints.size() + 1) * m_iCheckpointInterval;
+      if(m_iStreamPosition < iNextCheckpoint)
+        iChunk = std::min(iChunk, iNextCheckpoint - m_iStreamPosition);
+    }
+    m_oStream.next_out = (Bytef*)(pDestination + iProduced);
+    m_oStream.avail_out = (uInt)iChunk;
+
+    int err = inflate(&m_oStream, Z_SYNC_FLUSH);
+    size_t iNumBytes = iChunk - m_oStream.avail_out;
+    iProduced += iNumBytes;
+    m_iStreamPosition += iNumBytes;
+
+    switch(err)
+    {
+    case Z_STREAM_END:
+      m_bStreamEnded = true;
+      break;
+
+    case Z_OK:
+      break;
+
+    case Z_BUF_ERROR:
+      // No progress was possible; more input is needed, which the next iteration will supply
+      if(m_oStream.avail_in == 0)
+        break;
+      THROW_SIMPLE_(L"Cannot decompress file; %s", ZErrorMessage(err));
+
+    case Z_NEED_DICT:
+      THROW_SIMPLE(L"Cannot decompress file; zLib requesting dictionary");
+
+    default:
+      if(m_bTolerateBadChecksum && m_iStreamPosition == m_iLength && m_oStream.msg && strcmp(m_oStream.msg, "incorrect data check") == 0)
+      {
+        m_bStreamEnded = true;
+        break;
+      }
+      THROW_SIMPLE_(L"Cannot decompress file; %s (%S)", ZErrorMessage(err), m_oStream.msg ? m_oStream.msg : "?");
+    }
+
+    if(m_iCheckpointInterval != 0 && m_iStreamPosition == iNextCheckpoint && !m_bStreamEnded)
+      _saveCheckpoint();
+  }
+  return iProduced;
+}
+
+void InflateReadFile::_restart(size_t iTarget) throw(...)
+{
+  // Find the last checkpoint at or before the target
+  z_stream* pCheckpoint = 0;
+  if(m_iCheckpointInterval != 0)
+  {
+    size_t iIndex = iTarget / m_iCheckpointInterval;
+    if(iIndex > m_vCheckpoints.size())
+      iIndex = m_vCheckpoints.size();
+    if(iIndex != 0)
+      pCheckpoint = m_vCheckpoints[iIndex - 1];
+  }
+
+  m_bStreamEnded = false;
+  m_oStream.avail_in = 0;
+  if(pCheckpoint)
+  {
+    inflateEnd(&m_oStream);
+    int err = inflateCopy(&m_oStream, pCheckpoint);
+    if(err == Z_OK)
+    {
+      m_iInputPosition = static_cast<size_t>(m_oStream.total_in);
+      m_iStreamPosition = static_cast<size_t>(m_oStream.total_out);
+      m_oStream.avail_in = 0;
+      return;
+    }
+    // Fall back to starting from the beginning
+    memset(&m_oStream, 0, sizeof(m_oStream));
+    err = inflateInit(&m_oStream);
+    m_bStreamValid = (err == Z_OK);
+    if(!m_bStreamValid)
+      THROW_SIMPLE_(L"Cannot initialise zLib stream; %s", ZErrorMessage(err));
+  }
+  else
+  {
+    int err = inflateReset(&m_oStream);
+    if(err != Z_OK)
+    {
+      m_bStreamValid = false;
+      THROW_SIMPLE_(L"Cannot reset zLib stream; %s", ZErrorMessage(err));
+    }
+  }
+  m_iInputPosition = 0;
+  m_iStreamPosition = 0;
+}
+
+void InflateReadFile::_skip(size_t iCount) throw(...)
+{
+  unsigned char aDiscard[4096];
+  while(iCount != 0)
+  {
+    size_t iNumBytes = _inflate(aDiscard, std::min(sizeof(aDiscard), iCount));
+    if(iNumBytes == 0)
+      THROW_SIMPLE(L"Unexpected end of compressed data");
+    iCount -= iNumBytes;
+  }
+}
+
+void InflateReadFile::read(void* pDestination, size_t iItemSize, size_t iItemCount) throw(...)
+{
+  if(readNoThrow(pDestination, iItemSize, iItemCount) != iItemCount)
+  {
+    THROW_SIMPLE_(L"Reading %lu items of size %lu would exceed the file (only %lu bytes remaining)",
+      static_cast<unsigned long>(iItemCount), static_cast<unsigned long>(iItemSize),
+      static_cast<unsigned long>(m_iPosition < m_iLength ? m_iLength - m_iPosition : 0));
+  }
+}
+
+size_t InflateReadFile::readNoThrow(void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+{
+  if(iItemSize == 0 || m_iPosition >= m_iLength)
+    return 0;
+  size_t iAvailable = (m_iLength - m_iPosition) / iItemSize;
+  if(iItemCount > iAvailable)
+    iItemCount = iAvailable;
+  size_t iBytes = iItemSize * iItemCount;
+  size_t iProduced = 0;
+  try
+  {
+    if(m_iPosition < m_iStreamPosition)
+      _restart(m_iPosition);
+    if(m_iPosition > m_iStreamPosition)
+      _skip(m_iPosition - m_iStreamPosition);
+    iProduced = _inflate(reinterpret_cast<unsigned char*>(pDestination), iBytes);
+  }
+  catch(RainException *pE)
+  {
+    delete pE;
+    // The stream may have advanced part of the way; report whole items only
+    iProduced = m_iStreamPosition > m_iPosition ? m_iStreamPosition - m_iPosition : 0;
+    if(iProduced > iBytes)
+      iProduced = iBytes;
+  }
+  iItemCount = iProduced / iItemSize;
+  m_iPosition += iItemCount * iItemSize;
+  return iItemCount;
+}
+
+void InflateReadFile::write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...)
+{
+  THROW_SIMPLE(L"Cannot write to a compressed archive entry");
+}
+
+size_t InflateReadFile::writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw()
+{
+  return 0;
+}
+
+void InflateReadFile::seek(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw(...)
+{
+  if(!seekNoThrow(iOffset, eRelativeTo))
+    THROW_SIMPLE_(L"Cannot seek to position %li of a %lu byte file", static_cast<long>(iOffset), static_cast<unsigned long>(m_iLength));
+}
+
+bool InflateReadFile::seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw()
+{
+  seek_offset_t iPosition;
+  switch(eRelativeTo)
+  {
+  case SR_Start:
+    iPosition = iOffset;
+    break;
+
+  case SR_Current:
+    iPosition = static_cast<seek_offset_t>(m_iPosition) + iOffset;
+    break;
+
+  case SR_End:
+    iPosition = static_cast<seek_offset_t>(m_iLength) + iOffset;
+    break;
+
+  default:
+    return false;
+  };
+  if(iPosition < 0 || static_cast<size_t>(iPosition) > m_iLength)
+    return false;
+  // The stream itself is only moved on the next read, so seeking around (e.g. to find the length) is free
+  m_iPosition = static_cast<size_t>(iPosition);
+  return true;
+}
+
+seek_offset_t InflateReadFile::tell() throw()
+{
+  return static_cast<seek_offset_t>(m_iPosition);
+}
+
+void RainInflateInto(const void* pCompressed, size_t iCompressedLength, void* pDestination, size_t iLength) throw(...)
+{
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  stream.next_in = (Bytef*)pCompressed;
+  stream.avail_in = (uInt)iCompressedLength;
+  stream.next_out = (Bytef*)pDestination;
+  stream.avail_out = (uInt)iLength;
+  stream.zalloc = (alloc_func)0;
+  stream.zfree = (free_func)0;
+
+  int err = inflateInit(&stream);
+  if(err != Z_OK)
+    THROW_SIMPLE_(L"Cannot initialise zLib stream; %s", ZErrorMessage(err));
+
+  // With the whole stream as input and the whole file as output, one call does all of the work
+  err = inflate(&stream, Z_FINISH);
+  size_t iProduced = static_cast<size_t>(stream.total_out);
+  const char* sMessage = stream.msg;
+  if(err != Z_STREAM_END)
+  {
+    inflateEnd(&stream);
+    if(err == Z_OK || err == Z_BUF_ERROR)
+    {
+      if(stream.avail_out == 0)
+        THROW_SIMPLE_(L"Cannot decompress file; data is longer than the expected %lu bytes", static_cast<unsigned long>(iLength));
+      THROW_SIMPLE(L"Cannot decompress file; unexpected end of compressed data");
+    }
+    if(err == Z_NEED_DICT)
+      THROW_SIMPLE(L"Cannot decompress file; zLib requesting dictionary");
+    THROW_SIMPLE_(L"Cannot decompress file; %s (%S)", ZErrorMessage(err), sMessage ? sMessage : "?");
+  }
+  inflateEnd(&stream);
+  if(iProduced != iLength)
+    THROW_SIMPLE_(L"Cannot decompress file; got %lu bytes rather than the expected %lu", static_cast<unsigned long>(iProduced), static_cast<unsigned long>(iLength));
+}
@@ -0,0 +1,146 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#pragma once
+#include "file.h"
+#include "threading.h"
+#include "exception.h"
+#include "zlib.h"
+#include <vector>
+
+struct memory_buffer_owner_t;
+
+//! A read-only file which inflates a zLib stream on demand
+/*!
+  Rather than decompressing an entire archive entry up front, data is inflated as the caller
+  reads it, so reading the header of a large file only costs as much as decompressing that
+  header. Seeking is lazy; nothing is done until the next read. Seeking forwards inflates and
+  discards the intervening data, while seeking backwards restores the nearest checkpoint (a
+  copy of the inflate state taken every getCheckpointInterval() bytes of output) before the
+  target and inflates forwards from there.
+
+  The compressed data is either read from a source file with positional reads, or taken
+  directly from a memory buffer (such as a memory mapped archive). In both cases the source
+  must remain valid for the lifetime of the InflateReadFile, which can be ensured by passing
+  a memory_buffer_owner_t which keeps the source alive.
+*/
+class RAINMAN2_API InflateReadFile : public IFile
+{
+public:
+  //! Inflate data from a region of a source file
+  /*!
+    \param pSource The file containing the compressed data
+    \param iSourceOffset Position within pSource at which the compressed data starts
+    \param iCompressedLength Length, in bytes, of the compressed data
+    \param iLength Length, in bytes, of the uncompressed data
+    \param pSourceMutex If non-zero, this mutex is locked around reads from pSource, which
+           should be done if pSource is shared between threads and is not readAt() thread-safe
+    \param bOwnSource If true, then pSource is deleted when this object is destroyed
+    \param pOwner If non-zero, this object takes over one reference to it (even if an exception
+           is thrown), and releases it when destroyed; it should keep pSource and pSourceMutex alive
+  */
+  InflateReadFile(IFile* pSource, seek_offset_t iSourceOffset, size_t iCompressedLength, size_t iLength, RainMutex* pSourceMutex = 0, bool bOwnSource = false, memory_buffer_owner_t* pOwner = 0) throw(...);
+
+  //! Inflate data from a memory buffer
+  /*!
+    The buffer is not copied, and so must remain valid for the lifetime of this object. If
+    pOwner is non-zero, then this object takes over one reference to it, as above.
+  */
+  InflateReadFile(const char* pCompressed, size_t iCompressedLength, size_t iLength, memory_buffer_owner_t* pOwner = 0) throw(...);
+
+  virtual ~InflateReadFile() throw();
+
+  //! Accept a stream whose trailing checksum is damaged, provided all of the data was inflated
+  /*!
+    Early versions of sga4to5.exe truncated the end of the zLib stream of the last file in an
+    archive; the data itself is intact, but the checksum cannot be verified.
+  */
+  void setTolerateBadChecksum(bool bTolerate) throw() {m_bTolerateBadChecksum = bTolerate;}
+
+  //! Set the number of bytes of output between checkpoints (0 to disable checkpointing)
+  void setCheckpointInterval(size_t iInterval) throw();
+  size_t getCheckpointInterval() const throw() {return m_iCheckpointInterval;}
+
+  inline size_t getSize() const throw() {return m_iLength;}
+
+  virtual void read(void* pDestination, size_t iItemSize, size_t iItemCount) throw(...);
+  virtual size_t readNoThrow(void* pDestination, size_t iItemSize, size_t iItemCount) throw();
+  virtual void write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...);
+  virtual size_t writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw();
+  virtual void seek(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw(...);
+  virtual bool seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw();
+  virtual seek_offset_t tell() throw();
+
+  //! Default number of bytes of output between checkpoints
+  static const size_t DEFAULT_CHECKPOINT_INTERVAL = 1 << 20;
+
+  //! Files smaller than this are cheaper to inflate in one go than to stream
+  static const size_t STREAMING_THRESHOLD = 64 << 10;
+
+protected:
+  void _init() throw(...);
+  void _restart(size_t iTarget) throw(...);
+  void _skip(size_t iCount) throw(...);
+  size_t _inflate(unsigned char* pDestination, size_t iLength) throw(...);
+  bool _fillInput() throw(...);
+  void _saveCheckpoint() throw();
+  void _freeCheckpoints() throw();
+
+  static const size_t INPUT_BUFFER_SIZE = 8192;
+
+  //! Inflate states, in increasing order of total_out
+  /*!
+    Pointers are stored as zLib requires that a z_stream is not moved once initialised.
+  */
+  std::vector<z_stream*> m_vCheckpoints;
+  z_stream m_oStream;
+  IFile* m_pSource;
+  RainMutex* m_pSourceMutex;
+  const char* m_pCompressed;
+  memory_buffer_owner_t* m_pOwner;
+  seek_offset_t m_iSourceOffset;
+  size_t m_iCompressedLength;
+  size_t m_iInputPosition; //!< Number of compressed bytes given to zLib so far
+  size_t m_iLength;
+  size_t m_iPosition; //!< Position requested by the caller
+  size_t m_iStreamPosition; //!< Number of bytes produced by m_oStream
+  size_t m_iCheckpointInterval;
+  bool m_bOwnSource;
+  bool m_bStreamValid;
+  bool m_bStreamEnded;
+  bool m_bTolerateBadChecksum;
+  unsigned char m_aInputBuffer[INPUT_BUFFER_SIZE];
+};
+
+//! Inflate an entire zLib stream in a single call, straight into a caller-supplied buffer
+/*!
+  When the uncompressed length is known up front, this avoids the intermediate buffers of
+  chunked inflation. An exception is thrown if the stream is corrupt, or does not inflate to
+  exactly iLength bytes.
+  \param pCompressed The complete compressed stream
+  \param iCompressedLength Length, in bytes, of the compressed stream
+  \param pDestination Buffer to inflate into
+  \param iLength Length, in bytes, of the uncompressed data
+*/
+RAINMAN2_API void RainInflateInto(const void* pCompressed, size_t iCompressedLength, void* pDestination, size_t iLength) throw(...);
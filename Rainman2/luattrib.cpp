@@ -444,6 +444,8 @@ LuaAttribCache::~LuaAttribCache()
   delete m_pEmptyFile;
   for(std::map<unsigned long, LuaAttrib*>::iterator itr = m_mapFiles.begin(); itr != m_mapFiles.end(); ++itr)
     delete itr->second;
+  for(std::map<const LuaAttrib::_table_t*, MemorySegmentedFile*>::iterator itr = m_mapTables.begin(); itr != m_mapTables.end(); ++itr)
+    delete itr->second;
   if(m_L)
     lua_close(m_L);
 }
@@ -535,19 +537,20 @@ size_t LuaAttribCache::writeTableToBinaryFile(const LuaAttrib::_table_t* pTable,
   {
     if(m_mapTables.count(pTable) != 0)
     {
-      MemoryWriteFile *pCached = m_mapTables[pTable];
-      pFile->write(pCached->getBuffer(), 1, pCached->tell());
-      return pCached->tell();
+      MemorySegmentedFile *pCached = m_mapTables[pTable];
+      pCached->writeTo(pFile);
+      return pCached->getLengthUsed();
     }
     else
     {
       if(bCacheResult)
       {
-        MemoryWriteFile *pCached = new MemoryWriteFile;
+        // Most tables are small, so their chunks are kept small and taken from a shared arena
+        MemorySegmentedFile *pCached = new MemorySegmentedFile(256, &m_oTableArena);
         m_mapTables[pTable] = pCached;
         pTable->writeToBinary(pCached);
-        pFile->write(pCached->getBuffer(), 1, pCached->tell());
-        return pCached->tell();
+        pCached->writeTo(pFile);
+        return pCached->getLengthUsed();
       }
       else
       {
@@ -1302,7 +1305,7 @@ size_t LuaAttrib::_table_t::writeToBinary(IFile* pFile) const
   // Write table header
   pFile->seek(-static_cast<seek_offset_t>(iDataLength + iHeaderLength), SR_Current);
   pFile->writeArray(fTableHeader.getBuffer(), iHeaderLength);
-  pFile->seek(-static_cast<seek_offset_t>(iDataLength), SR_Current);
+  pFile->seek(static_cast<seek_offset_t>(iDataLength), SR_Current);
 
   return iDataLength + iHeaderLength;
 }
@@ -215,7 +215,8 @@ protected:
   LuaAttrib* _performGet(const char* sFilename);
 
   std::map<unsigned long, LuaAttrib*> m_mapFiles;
-  std::map<const LuaAttrib::_table_t*, MemoryWriteFile*> m_mapTables;
+  std::map<const LuaAttrib::_table_t*, MemorySegmentedFile*> m_mapTables;
+  MemoryArena m_oTableArena; //!< Holds the contents of every file in m_mapTables
   lua_State *m_L;
   IDirectory *m_pDirectory;
   LuaAttrib::_value_t m_oEmptyTable;
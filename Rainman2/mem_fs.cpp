@@ -25,56 +25,129 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "mem_fs.h"
 #include "memfile.h"
 #include "exception.h"
+#include "hash.h"
 #include <time.h>
 #include <algorithm>
 
-class MemFileReadAdaptor : public MemoryReadFile
+//! Blocks in which the contents of small files are packed together
+static const size_t ARENA_BLOCK_SIZE = 0x100000;
+
+//! Files larger than this keep their own buffer rather than being packed into a block
+static const size_t ARENA_FILE_LIMIT = 0x10000;
+
+static void DeleteBuffer(const char* pBuffer, size_t iSize)
 {
-public:
-  MemFileReadAdaptor(MemoryFileStore::file_t *pFile) throw()
-    : MemoryReadFile(pFile->m_pData, pFile->m_iLength), m_pFile(pFile)
+  delete[] const_cast<char*>(pBuffer);
+}
+
+// Each block has its own memory_buffer_owner_t, which every file packed into it (and every reader
+// of those files) holds a reference to, so a block is freed as soon as nothing in it is used.
+static memory_buffer_owner_t* NewArenaBlock() throw()
+{
+  char* pBlock = new (std::nothrow) char[ARENA_BLOCK_SIZE];
+  if(pBlock == 0)
+    return 0;
+  memory_buffer_owner_t* pOwner = new (std::nothrow) memory_buffer_owner_t;
+  if(pOwner == 0)
   {
-    pFile->m_iOpenCount++;
+    delete[] pBlock;
+    return 0;
   }
+  pOwner->iReferenceCount = 1;
+  pOwner->pBuffer = pBlock;
+  pOwner->iSize = ARENA_BLOCK_SIZE;
+  pOwner->fnFree = DeleteBuffer;
+  return pOwner;
+}
 
-  virtual ~MemFileReadAdaptor() throw()
+//! Copy the characters of a name, so that the copy does not share a buffer with it
+static RainString CopyName(const RainString& sName)
+{
+  return RainString(sName.getCharacters(), sName.length());
+}
+
+static unsigned long HashFoldedName(const RainString& sFoldedName)
+{
+  return CRCCaselessHashSimpleAsciiFromUnicode(sFoldedName.getCharacters(), sFoldedName.length());
+}
+
+//! Matches children of a directory by their lower-cased name
+struct FoldedNameMatches
+{
+  FoldedNameMatches(const RainString& sFoldedName) : m_sFoldedName(sFoldedName) {}
+
+  template <class T>
+  bool operator() (T* pNode) const
   {
-    m_pFile->m_iOpenCount--;
+    return pNode->m_sFoldedName == m_sFoldedName;
   }
 
-protected:
-  MemoryFileStore::file_t *m_pFile;
+  const RainString& m_sFoldedName;
+};
+
+//! Matches one particular child of a directory
+template <class T>
+struct SameNode
+{
+  SameNode(T* pNode) : m_pNode(pNode) {}
+
+  bool operator() (T* pNode) const
+  {
+    return pNode == m_pNode;
+  }
+
+  T* m_pNode;
+};
+
+class MemFileReadAdaptor : public MemoryReadFile
+{
+public:
+  //! The contents are shared rather than the file, so they stay intact if the file is rewritten or deleted
+  MemFileReadAdaptor(MemoryFileStore::file_t *pFile) throw()
+    : MemoryReadFile(pFile->m_pData, pFile->m_iLength)
+  {
+    m_pOwner = pFile->m_pContentOwner;
+    if(m_pOwner)
+      RainAtomicIncrement(&m_pOwner->iReferenceCount);
+  }
 };
 
 class MemFileWriteAdaptor : public MemoryWriteFile
 {
 public:
-  MemFileWriteAdaptor(MemoryFileStore::file_t *pFile) throw()
-    : MemoryWriteFile(1024), m_pFile(pFile)
+  MemFileWriteAdaptor(MemoryFileStore *pStore, MemoryFileStore::file_t *pFile) throw(...)
+    : MemoryWriteFile(1024), m_pStore(pStore), m_pFile(pFile), m_bRewrite(pFile->m_pData != 0)
   {
-    pFile->m_iOpenCount--;
-    delete[] m_pFile->m_pData;
-    m_pFile->m_pData = 0;
-    m_pFile->m_iLength = 0;
-    time(&m_pFile->m_iTimestamp);
+    // Allocated up front, so that nothing can fail once the contents have been written
+    CHECK_ALLOCATION(m_pContentOwner = new (std::nothrow) memory_buffer_owner_t);
+    MemoryFileStore::_addRef(pFile);
+    pFile->m_bBeingWritten = true;
+    pFile->setContents(0, 0, 0);
+    time(&pFile->m_iTimestamp);
+    ++pStore->m_iWritersOpen;
   }
 
   virtual ~MemFileWriteAdaptor() throw()
   {
     seekNoThrow(0, SR_End);
-    m_pFile->m_pData = m_pBuffer;
-    m_pFile->m_iLength = tell();
-    m_pFile->m_iOpenCount++;
+    m_pStore->_commitContents(m_pFile, m_pBuffer, static_cast<size_t>(tell()), m_pContentOwner, m_bRewrite);
     m_pBuffer = 0;
+    m_pFile->m_bBeingWritten = false;
+    --m_pStore->m_iWritersOpen;
+    MemoryFileStore::_release(m_pFile);
   }
 
 protected:
+  MemoryFileStore *m_pStore;
   MemoryFileStore::file_t *m_pFile;
+  memory_buffer_owner_t *m_pContentOwner;
+  bool m_bRewrite; //!< true if the file had contents before it was opened
 };
 
 class MemDirectoryAdaptor : public IDirectory
 {
 public:
+  //! The directory is shared with the store, so the listing is unaffected by later changes to the store
   MemDirectoryAdaptor(MemoryFileStore::directory_t *pDirectory, MemoryFileStore *pStore, RainString sPath) throw(...)
     : m_pDirectory(pDirectory), m_pStore(pStore)
   {
@@ -82,10 +155,12 @@ public:
       m_sPath = sPath;
     else
       m_sPath = sPath + L"\\";
+    MemoryFileStore::_addRef(pDirectory);
   }
 
   virtual ~MemDirectoryAdaptor() throw()
   {
+    MemoryFileStore::_release(m_pDirectory);
   }
   
   virtual size_t getItemCount() throw()
@@ -100,7 +175,7 @@ public:
     {
       MemoryFileStore::directory_t *pDirectory = m_pDirectory->m_vSubdirectories[iIndex];
       if(oDetails.oFields.name)
-        oDetails.sName = pDirectory->m_sName;
+        oDetails.sName = CopyName(pDirectory->m_sName);
       if(oDetails.oFields.dir)
         oDetails.bIsDirectory = true;
     }
@@ -109,7 +184,7 @@ public:
       iIndex -= m_pDirectory->m_vSubdirectories.size();
       MemoryFileStore::file_t *pFile = m_pDirectory->m_vFiles[iIndex];
       if(oDetails.oFields.name)
-        oDetails.sName = pFile->m_sName;
+        oDetails.sName = CopyName(pFile->m_sName);
       if(oDetails.oFields.dir)
         oDetails.bIsDirectory = false;
       if(oDetails.oFields.size)
@@ -135,147 +210,380 @@ public:
   RainString m_sPath;
 };
 
+MemoryFileStore::MemoryFileStore() throw()
+  : m_pArena(0), m_iArenaUsed(0), m_iWritersOpen(0)
+{
+}
+
+MemoryFileStore::~MemoryFileStore()
+{
+  for(std::vector<directory_t*>::iterator itr = m_vEntryPoints.begin(); itr != m_vEntryPoints.end(); ++itr)
+    _release(*itr);
+  if(m_pArena)
+    m_pArena->release();
+}
+
 void MemoryFileStore::addEntryPoint(const RainString& sName) throw(...)
 {
-  if(std::find(m_vEntryPoints.begin(), m_vEntryPoints.end(), sName) != m_vEntryPoints.end())
-    THROW_SIMPLE_(L"Entry point \'%s\' already exists", sName.getCharacters());
+  directory_t* pEntryPoint = CHECK_ALLOCATION(new (std::nothrow) directory_t(sName));
+  for(std::vector<directory_t*>::iterator itr = m_vEntryPoints.begin(); itr != m_vEntryPoints.end(); ++itr)
+  {
+    if((**itr).m_sFoldedName == pEntryPoint->m_sFoldedName)
+    {
+      _release(pEntryPoint);
+      THROW_SIMPLE_(L"Entry point \'%s\' already exists", sName.getCharacters());
+    }
+  }
+  m_vEntryPoints.push_back(pEntryPoint);
+}
 
-  m_vEntryPoints.push_back(CHECK_ALLOCATION(new (std::nothrow) directory_t(sName)));
+MemoryFileStore* MemoryFileStore::snapshot() throw(...)
+{
+  if(m_iWritersOpen != 0)
+    THROW_SIMPLE_(L"Cannot snapshot memory file store while %lu files are being written", m_iWritersOpen);
+  MemoryFileStore* pSnapshot = CHECK_ALLOCATION(new (std::nothrow) MemoryFileStore);
+  pSnapshot->m_vEntryPoints = m_vEntryPoints;
+  std::for_each(m_vEntryPoints.begin(), m_vEntryPoints.end(), _addRef);
+  return pSnapshot;
 }
 
-template <class T>
-static void delete_fn(T* p)
+void MemoryFileStore::_addRef(node_t* pNode) throw()
 {
-  delete p;
+  RainAtomicIncrement(&pNode->m_iReferenceCount);
 }
 
-MemoryFileStore::~MemoryFileStore()
+void MemoryFileStore::_release(file_t* pFile) throw()
+{
+  if(RainAtomicDecrement(&pFile->m_iReferenceCount) == 0)
+    delete pFile;
+}
+
+void MemoryFileStore::_release(directory_t* pDirectory) throw()
 {
-  std::for_each(m_vEntryPoints.begin(), m_vEntryPoints.end(), delete_fn<directory_t>);
+  if(RainAtomicDecrement(&pDirectory->m_iReferenceCount) == 0)
+    delete pDirectory;
 }
 
-MemoryFileStore::directory_t::directory_t(RainString sName)
-  : m_sName(sName), m_pParent(0)
+MemoryFileStore::node_t::node_t(const RainString& sName) throw(...)
+  : m_sName(CopyName(sName)), m_sFoldedName(CopyName(sName)), m_iReferenceCount(1)
+{
+  m_sFoldedName.toLower();
+  m_iNameHash = HashFoldedName(m_sFoldedName);
+}
+
+MemoryFileStore::node_t::node_t(const node_t& oOther) throw(...)
+  : m_sName(CopyName(oOther.m_sName)), m_sFoldedName(CopyName(oOther.m_sFoldedName)), m_iNameHash(oOther.m_iNameHash)
+  , m_iReferenceCount(1)
+{
+}
+
+MemoryFileStore::directory_t::directory_t(const RainString& sName) throw(...)
+  : node_t(sName)
 {
 }
 
 MemoryFileStore::directory_t::~directory_t()
 {
-  std::for_each(m_vSubdirectories.begin(), m_vSubdirectories.end(), delete_fn<directory_t>);
-  std::for_each(m_vFiles.begin(), m_vFiles.end(), delete_fn<MemoryFileStore::file_t>);
+  for(std::vector<directory_t*>::iterator itr = m_vSubdirectories.begin(); itr != m_vSubdirectories.end(); ++itr)
+    _release(*itr);
+  for(std::vector<file_t*>::iterator itr = m_vFiles.begin(); itr != m_vFiles.end(); ++itr)
+    _release(*itr);
 }
 
-MemoryFileStore::file_t::file_t()
+MemoryFileStore::directory_t* MemoryFileStore::directory_t::copy(const directory_t* pOther) throw(...)
+{
+  directory_t* pCopy = CHECK_ALLOCATION(new (std::nothrow) directory_t(pOther->m_sName));
+  try
+  {
+    pCopy->m_vSubdirectories = pOther->m_vSubdirectories;
+    std::for_each(pCopy->m_vSubdirectories.begin(), pCopy->m_vSubdirectories.end(), _addRef);
+    pCopy->m_vFiles = pOther->m_vFiles;
+    std::for_each(pCopy->m_vFiles.begin(), pCopy->m_vFiles.end(), _addRef);
+    if(!pCopy->m_oSubdirectoryIndex.reserve(pCopy->m_vSubdirectories.size()) || !pCopy->m_oFileIndex.reserve(pCopy->m_vFiles.size()))
+      THROW_SIMPLE(L"Cannot allocate directory index");
+    // Space has been reserved for every child, so none of these can fail
+    for(std::vector<directory_t*>::iterator itr = pCopy->m_vSubdirectories.begin(); itr != pCopy->m_vSubdirectories.end(); ++itr)
+      pCopy->m_oSubdirectoryIndex.insert((**itr).m_iNameHash, *itr);
+    for(std::vector<file_t*>::iterator itr = pCopy->m_vFiles.begin(); itr != pCopy->m_vFiles.end(); ++itr)
+      pCopy->m_oFileIndex.insert((**itr).m_iNameHash, *itr);
+  }
+  CATCH_THROW_SIMPLE_(_release(pCopy), L"Cannot copy directory \'%s\'", pOther->m_sName.getCharacters());
+  return pCopy;
+}
+
+MemoryFileStore::file_t* MemoryFileStore::directory_t::findFile(const RainString& sFoldedName, unsigned long iHash) const throw()
+{
+  file_t* const* ppFile = m_oFileIndex.find(iHash, FoldedNameMatches(sFoldedName));
+  return ppFile ? *ppFile : 0;
+}
+
+MemoryFileStore::directory_t* MemoryFileStore::directory_t::findSubdirectory(const RainString& sFoldedName, unsigned long iHash) const throw()
+{
+  directory_t* const* ppDirectory = m_oSubdirectoryIndex.find(iHash, FoldedNameMatches(sFoldedName));
+  return ppDirectory ? *ppDirectory : 0;
+}
+
+void MemoryFileStore::directory_t::addFile(file_t* pFile) throw(...)
+{
+  if(!m_oFileIndex.insert(pFile->m_iNameHash, pFile))
+  {
+    _release(pFile);
+    THROW_SIMPLE(L"Cannot allocate directory index");
+  }
+  m_vFiles.push_back(pFile);
+}
+
+void MemoryFileStore::directory_t::addSubdirectory(directory_t* pDirectory) throw(...)
+{
+  if(!m_oSubdirectoryIndex.insert(pDirectory->m_iNameHash, pDirectory))
+  {
+    _release(pDirectory);
+    THROW_SIMPLE(L"Cannot allocate directory index");
+  }
+  m_vSubdirectories.push_back(pDirectory);
+}
+
+void MemoryFileStore::directory_t::removeFile(file_t* pFile) throw()
+{
+  m_oFileIndex.erase(pFile->m_iNameHash, SameNode<file_t>(pFile));
+  m_vFiles.erase(std::find(m_vFiles.begin(), m_vFiles.end(), pFile));
+  _release(pFile);
+}
+
+void MemoryFileStore::directory_t::removeSubdirectory(directory_t* pDirectory) throw()
+{
+  m_oSubdirectoryIndex.erase(pDirectory->m_iNameHash, SameNode<directory_t>(pDirectory));
+  m_vSubdirectories.erase(std::find(m_vSubdirectories.begin(), m_vSubdirectories.end(), pDirectory));
+  _release(pDirectory);
+}
+
+void MemoryFileStore::directory_t::replaceFile(file_t* pOld, file_t* pNew) throw()
+{
+  // Removing the old entry leaves room in the index, so adding the new one cannot fail
+  m_oFileIndex.erase(pOld->m_iNameHash, SameNode<file_t>(pOld));
+  m_oFileIndex.insert(pNew->m_iNameHash, pNew);
+  *std::find(m_vFiles.begin(), m_vFiles.end(), pOld) = pNew;
+  _release(pOld);
+}
+
+void MemoryFileStore::directory_t::replaceSubdirectory(directory_t* pOld, directory_t* pNew) throw()
+{
+  m_oSubdirectoryIndex.erase(pOld->m_iNameHash, SameNode<directory_t>(pOld));
+  m_oSubdirectoryIndex.insert(pNew->m_iNameHash, pNew);
+  *std::find(m_vSubdirectories.begin(), m_vSubdirectories.end(), pOld) = pNew;
+  _release(pOld);
+}
+
+MemoryFileStore::file_t::file_t(const RainString& sName) throw(...)
+  : node_t(sName), m_pData(0), m_iLength(0), m_pContentOwner(0), m_bBeingWritten(false)
 {
-  m_pData = 0;
-  m_iLength = 0;
-  m_iOpenCount = 1;
   time(&m_iTimestamp);
 }
 
+MemoryFileStore::file_t::file_t(const file_t& oOther) throw(...)
+  : node_t(oOther), m_pData(oOther.m_pData), m_iLength(oOther.m_iLength), m_pContentOwner(oOther.m_pContentOwner)
+  , m_bBeingWritten(false), m_iTimestamp(oOther.m_iTimestamp)
+{
+  if(m_pContentOwner)
+    RainAtomicIncrement(&m_pContentOwner->iReferenceCount);
+}
+
 MemoryFileStore::file_t::~file_t()
 {
-  delete[] m_pData;
+  if(m_pContentOwner)
+    m_pContentOwner->release();
 }
 
-bool MemoryFileStore::_find(const RainString& sWhat, MemoryFileStore::directory_t** ppResultDirectory, MemoryFileStore::file_t** ppResultFile, bool bCreateFile, bool bCreateDir, bool bThrow)
+void MemoryFileStore::file_t::setContents(const char* pData, size_t iLength, memory_buffer_owner_t* pOwner) throw()
 {
-  if(ppResultDirectory)
-    *ppResultDirectory = 0;
-  if(ppResultFile)
-    *ppResultFile = 0;
+  if(m_pContentOwner)
+    m_pContentOwner->release();
+  m_pData = pData;
+  m_iLength = iLength;
+  m_pContentOwner = pOwner;
+}
 
-  RainString sEntryPoint = sWhat.beforeFirst('\\');
-  RainString sRemainder = sWhat.afterFirst('\\');
+MemoryFileStore::file_t* MemoryFileStore::_unshareFile(directory_t* pDirectory, file_t* pFile) throw(...)
+{
+  if(RainAtomicRead(&pFile->m_iReferenceCount) == 1)
+    return pFile;
+  file_t* pCopy = CHECK_ALLOCATION(new (std::nothrow) file_t(*pFile));
+  pDirectory->replaceFile(pFile, pCopy);
+  return pCopy;
+}
 
-  directory_t* pCurrentDirectory = 0;
-  std::vector<directory_t*>::iterator itrDirectory = std::find(m_vEntryPoints.begin(), m_vEntryPoints.end(), sEntryPoint);
-  if(itrDirectory == m_vEntryPoints.end())
+void MemoryFileStore::_commitContents(file_t* pFile, char* pData, size_t iLength, memory_buffer_owner_t* pOwner, bool bRewrite) throw()
+{
+  if(iLength == 0)
   {
-    if(!bCreateDir)
-    {
-      if(bThrow)
-        THROW_SIMPLE_(L"Cannot find entry point \'%s\' for \'%s\'", sEntryPoint.getCharacters(), sWhat.getCharacters());
-      else
-        return false;
-    }
-    pCurrentDirectory = new (std::nothrow) directory_t(sEntryPoint);
-    if(bThrow)
-      CHECK_ALLOCATION(pCurrentDirectory);
-    else if(pCurrentDirectory == 0)
-      return false;
-    m_vEntryPoints.push_back(pCurrentDirectory);
+    delete[] pData;
+    delete pOwner;
+    return;
   }
-  else
+
+  // Small files are packed into blocks, so that the store is not left with a great many small
+  // allocations. Space in a block is never reused, so a file which is being rewritten (and which
+  // may well be rewritten again) gets a buffer of exactly the right size instead, and only new
+  // files are packed.
+  if(iLength <= ARENA_FILE_LIMIT && bRewrite)
   {
-    pCurrentDirectory = *itrDirectory;
+    char* pCopy = new (std::nothrow) char[iLength];
+    if(pCopy)
+    {
+      memcpy(pCopy, pData, iLength);
+      delete[] pData;
+      pData = pCopy;
+    }
   }
-
-  while(!sRemainder.isEmpty())
+  else if(iLength <= ARENA_FILE_LIMIT)
   {
-    RainString sPart = sRemainder.beforeFirst('\\');
-    sRemainder = sRemainder.afterFirst('\\');
-
-    if(sRemainder.isEmpty())
+    // Contents are kept pointer aligned within the block, as with MemoryArena
+    size_t iSize = (iLength + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if(m_pArena == 0 || ARENA_BLOCK_SIZE - m_iArenaUsed < iSize)
     {
-      file_t* pFile = 0;
-      std::vector<file_t*>::iterator itrFile = std::find(pCurrentDirectory->m_vFiles.begin(), pCurrentDirectory->m_vFiles.end(), sPart);
-      if(itrFile == pCurrentDirectory->m_vFiles.end())
+      memory_buffer_owner_t* pBlock = NewArenaBlock();
+      if(pBlock)
       {
-        if(bCreateFile)
-        {
-          pFile = new (std::nothrow) file_t;
-          if(bThrow)
-            CHECK_ALLOCATION(pFile);
-          else if(pFile == 0)
-            return false;
-          pFile->m_sName = sPart;
-          pCurrentDirectory->m_vFiles.push_back(pFile);
-        }
-      }
-      else
-      {
-        pFile = *itrFile;
-      }
-      if(pFile)
-      {
-        if(ppResultDirectory)
-          *ppResultDirectory = pCurrentDirectory;
-        if(ppResultFile)
-          *ppResultFile = pFile;
-        return true;
+        if(m_pArena)
+          m_pArena->release();
+        m_pArena = pBlock;
+        m_iArenaUsed = 0;
       }
     }
+    if(m_pArena && ARENA_BLOCK_SIZE - m_iArenaUsed >= iSize)
+    {
+      char* pCopy = const_cast<char*>(m_pArena->pBuffer) + m_iArenaUsed;
+      m_iArenaUsed += iSize;
+      memcpy(pCopy, pData, iLength);
+      delete[] pData;
+      delete pOwner;
+      RainAtomicIncrement(&m_pArena->iReferenceCount);
+      pFile->setContents(pCopy, iLength, m_pArena);
+      return;
+    }
+  }
+
+  // Otherwise the file keeps a buffer of its own
+  pOwner->iReferenceCount = 1;
+  pOwner->pBuffer = pData;
+  pOwner->iSize = iLength;
+  pOwner->fnFree = DeleteBuffer;
+  pFile->setContents(pData, iLength, pOwner);
+}
 
-    directory_t* pNextDirectory = 0;
-    itrDirectory = std::find(pCurrentDirectory->m_vSubdirectories.begin(), pCurrentDirectory->m_vSubdirectories.end(), sPart);
-    if(itrDirectory == pCurrentDirectory->m_vSubdirectories.end())
+bool MemoryFileStore::_find(const RainString& sWhat, MemoryFileStore::directory_t** ppResultDirectory, MemoryFileStore::file_t** ppResultFile, bool bCreateFile, bool bCreateDir, bool bThrow, bool bUnshare, MemoryFileStore::directory_t** ppParentDirectory)
+{
+  if(ppResultDirectory)
+    *ppResultDirectory = 0;
+  if(ppResultFile)
+    *ppResultFile = 0;
+  if(ppParentDirectory)
+    *ppParentDirectory = 0;
+  // Directories which items are created in must belong to this store alone
+  if(bCreateFile || bCreateDir)
+    bUnshare = true;
+
+  try
+  {
+    RainString sFolded(sWhat);
+    sFolded.toLower();
+    const RainChar* pPath = sWhat.getCharacters();
+    size_t iLength = sWhat.length();
+    size_t iPartEnd = std::find(pPath, pPath + iLength, '\\') - pPath;
+
+    RainString sEntryPoint = sFolded.mid(0, iPartEnd);
+    size_t iEntryPoint = 0;
+    while(iEntryPoint < m_vEntryPoints.size() && !(m_vEntryPoints[iEntryPoint]->m_sFoldedName == sEntryPoint))
+      ++iEntryPoint;
+    directory_t* pCurrentDirectory = 0;
+    directory_t* pParentDirectory = 0;
+    if(iEntryPoint == m_vEntryPoints.size())
     {
       if(!bCreateDir)
       {
         if(bThrow)
-          THROW_SIMPLE_(L"Cannot find %s \'%s\' for \'%s\'", sRemainder.isEmpty() ? L"item" : L"directory", sPart.getCharacters(), sWhat.getCharacters());
+          THROW_SIMPLE_(L"Cannot find entry point \'%s\' for \'%s\'", sEntryPoint.getCharacters(), sWhat.getCharacters());
         else
           return false;
       }
-      pNextDirectory = new (std::nothrow) directory_t(sPart);
-      if(bThrow)
-        CHECK_ALLOCATION(pNextDirectory);
-      else if(pNextDirectory == 0)
-        return false;
-      pNextDirectory->m_pParent = pCurrentDirectory;
-      pCurrentDirectory->m_vSubdirectories.push_back(pNextDirectory);
+      pCurrentDirectory = CHECK_ALLOCATION(new (std::nothrow) directory_t(sWhat.mid(0, iPartEnd)));
+      m_vEntryPoints.push_back(pCurrentDirectory);
     }
     else
     {
-      pNextDirectory = *itrDirectory;
+      pCurrentDirectory = m_vEntryPoints[iEntryPoint];
+      if(bUnshare && RainAtomicRead(&pCurrentDirectory->m_iReferenceCount) != 1)
+      {
+        pCurrentDirectory = directory_t::copy(pCurrentDirectory);
+        _release(m_vEntryPoints[iEntryPoint]);
+        m_vEntryPoints[iEntryPoint] = pCurrentDirectory;
+      }
+    }
+
+    for(size_t iPartStart = iPartEnd + 1; iPartStart < iLength; iPartStart = iPartEnd + 1)
+    {
+      iPartEnd = std::find(pPath + iPartStart, pPath + iLength, '\\') - pPath;
+      bool bLastPart = iPartEnd + 1 >= iLength;
+      RainString sFoldedPart = sFolded.mid(iPartStart, iPartEnd - iPartStart);
+      unsigned long iHash = HashFoldedName(sFoldedPart);
+
+      if(bLastPart)
+      {
+        file_t* pFile = pCurrentDirectory->findFile(sFoldedPart, iHash);
+        if(pFile == 0 && bCreateFile)
+        {
+          pFile = CHECK_ALLOCATION(new (std::nothrow) file_t(sWhat.mid(iPartStart, iPartEnd - iPartStart)));
+          pCurrentDirectory->addFile(pFile);
+        }
+        if(pFile)
+        {
+          // A file is only a valid result if the caller is looking for one
+          if(ppResultFile)
+          {
+            *ppResultFile = pFile;
+            if(ppResultDirectory)
+              *ppResultDirectory = pCurrentDirectory;
+          }
+          return true;
+        }
+      }
+
+      directory_t* pNextDirectory = pCurrentDirectory->findSubdirectory(sFoldedPart, iHash);
+      if(pNextDirectory == 0)
+      {
+        if(!bCreateDir)
+        {
+          if(bThrow)
+            THROW_SIMPLE_(L"Cannot find %s \'%s\' for \'%s\'", bLastPart ? L"item" : L"directory", sWhat.mid(iPartStart, iPartEnd - iPartStart).getCharacters(), sWhat.getCharacters());
+          else
+            return false;
+        }
+        pNextDirectory = CHECK_ALLOCATION(new (std::nothrow) directory_t(sWhat.mid(iPartStart, iPartEnd - iPartStart)));
+        pCurrentDirectory->addSubdirectory(pNextDirectory);
+      }
+      else if(bUnshare && RainAtomicRead(&pNextDirectory->m_iReferenceCount) != 1)
+      {
+        directory_t* pCopy = directory_t::copy(pNextDirectory);
+        pCurrentDirectory->replaceSubdirectory(pNextDirectory, pCopy);
+        pNextDirectory = pCopy;
+      }
+      pParentDirectory = pCurrentDirectory;
+      pCurrentDirectory = pNextDirectory;
     }
-    pCurrentDirectory = pNextDirectory;
-  }
 
-  if(ppResultDirectory)
-    *ppResultDirectory = pCurrentDirectory;
-  return true;
+    if(ppResultDirectory)
+      *ppResultDirectory = pCurrentDirectory;
+    if(ppParentDirectory)
+      *ppParentDirectory = pParentDirectory;
+    return true;
+  }
+  catch(RainException *pE)
+  {
+    if(bThrow)
+      throw;
+    delete pE;
+    return false;
+  }
 }
 
 void MemoryFileStore::getCaps(file_store_caps_t& oCaps) const throw()
@@ -291,38 +599,52 @@ void MemoryFileStore::getCaps(file_store_caps_t& oCaps) const throw()
 
 IFile* MemoryFileStore::openFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
 {
+  if(eMode == FM_Update)
+    THROW_SIMPLE_(L"Cannot open file \'%s\' for updating - memory files can only be read or rewritten", sPath.getCharacters());
+  // Readers are locked out until a write completes, so atomic writes need nothing extra
+  bool bWrite = eMode == FM_Write || eMode == FM_WriteAtomic;
+  directory_t* pDirectory = 0;
   file_t* pFile = 0;
-  if(!_find(sPath, 0, &pFile, eMode == FM_Write, eMode == FM_Write, true) || pFile == 0)
+  if(!_find(sPath, &pDirectory, &pFile, bWrite, bWrite, true) || pFile == 0)
     THROW_SIMPLE_(L"Cannot open file \'%s\' - it is a directory", sPath.getCharacters());
-  if(eMode == FM_Write)
+  if(pFile->m_bBeingWritten)
+    THROW_SIMPLE_(L"Cannot open file \'%s\' - it is being written to", sPath.getCharacters());
+  if(bWrite)
   {
-    if(pFile->m_iOpenCount != 1)
-      THROW_SIMPLE_(L"Cannot open file \'%s\' for writing - it is already in use", sPath.getCharacters());
-    return CHECK_ALLOCATION(new (std::nothrow) MemFileWriteAdaptor(pFile));
+    // Files already open for reading keep the old contents
+    pFile = _unshareFile(pDirectory, pFile);
+    return CHECK_ALLOCATION(new (std::nothrow) MemFileWriteAdaptor(this, pFile));
   }
   else
   {
-    if(pFile->m_iOpenCount == 0)
-      THROW_SIMPLE_(L"Cannot open file \'%s\' for reading - it is being written to", sPath.getCharacters());
     return CHECK_ALLOCATION(new (std::nothrow) MemFileReadAdaptor(pFile));
   }
 }
 
 IFile* MemoryFileStore::openFileNoThrow(const RainString& sPath, eFileOpenMode eMode) throw()
 {
+  if(eMode == FM_Update)
+    return 0;
+  bool bWrite = eMode == FM_Write || eMode == FM_WriteAtomic;
+  directory_t* pDirectory = 0;
   file_t* pFile = 0;
-  if(!_find(sPath, 0, &pFile, eMode == FM_Write, eMode == FM_Write, false) || pFile == 0)
+  if(!_find(sPath, &pDirectory, &pFile, bWrite, bWrite, false) || pFile == 0 || pFile->m_bBeingWritten)
     return 0;
-  if(eMode == FM_Write)
+  if(bWrite)
   {
-    if(pFile->m_iOpenCount != 1)
+    try
+    {
+      pFile = _unshareFile(pDirectory, pFile);
+      return new (std::nothrow) MemFileWriteAdaptor(this, pFile);
+    }
+    catch(RainException *pE)
+    {
+      delete pE;
       return 0;
-    return new (std::nothrow) MemFileWriteAdaptor(pFile);
+    }
   }
   else
   {
-    if(pFile->m_iOpenCount == 0)
-      return 0;
     return new (std::nothrow) MemFileReadAdaptor(pFile);
   }
 }
@@ -337,28 +659,18 @@ void MemoryFileStore::deleteFile(const RainString& sPath) throw(...)
 {
   directory_t* pDirectory = 0;
   file_t* pFile = 0;
-  if(!_find(sPath, &pDirectory, &pFile, false, false, true) || pFile == 0)
+  if(!_find(sPath, &pDirectory, &pFile, false, false, true, true) || pFile == 0)
     THROW_SIMPLE_(L"Cannot delete file \'%s\' - it is a directory", sPath.getCharacters());
-
-  std::vector<file_t*>::iterator itrFile = std::find(pDirectory->m_vFiles.begin(), pDirectory->m_vFiles.end(), pFile->m_sName);
-  CHECK_ASSERT(itrFile != pDirectory->m_vFiles.end());
-  pDirectory->m_vFiles.erase(itrFile);
-  delete pFile;
+  pDirectory->removeFile(pFile);
 }
 
 bool MemoryFileStore::deleteFileNoThrow(const RainString& sPath) throw()
 {
   directory_t* pDirectory = 0;
   file_t* pFile = 0;
-  if(!_find(sPath, &pDirectory, &pFile, false, false, false) || pFile == 0)
+  if(!_find(sPath, &pDirectory, &pFile, false, false, false, true) || pFile == 0)
     return false;
-
-  std::vector<file_t*>::iterator itrFile = std::find(pDirectory->m_vFiles.begin(), pDirectory->m_vFiles.end(), pFile->m_sName);
-  if(itrFile == pDirectory->m_vFiles.end())
-    return false;
-
-  pDirectory->m_vFiles.erase(itrFile);
-  delete pFile;
+  pDirectory->removeFile(pFile);
   return true;
 }
 
@@ -386,7 +698,15 @@ IDirectory* MemoryFileStore::openDirectoryNoThrow(const RainString& sPath) throw
   directory_t* pDirectory = 0;
   if(!_find(sPath, &pDirectory, 0, false, false, false) || pDirectory == 0)
     return 0;
-  return new (std::nothrow) MemDirectoryAdaptor(pDirectory, this, sPath);
+  try
+  {
+    return new (std::nothrow) MemDirectoryAdaptor(pDirectory, this, sPath);
+  }
+  catch(RainException *pE)
+  {
+    delete pE;
+    return 0;
+  }
 }
 
 bool MemoryFileStore::doesDirectoryExist(const RainString& sPath) throw()
@@ -413,19 +733,20 @@ bool MemoryFileStore::createDirectoryNoThrow(const RainString& sPath) throw()
 void MemoryFileStore::deleteDirectory(const RainString& sPath) throw(...)
 {
   directory_t* pDirectory = 0;
-  _find(sPath, &pDirectory, 0, false, false, true);
-  if(pDirectory->m_pParent == 0)
+  directory_t* pParent = 0;
+  if(!_find(sPath, &pDirectory, 0, false, false, true, true, &pParent) || pDirectory == 0)
+    THROW_SIMPLE_(L"Cannot delete directory \'%s\' - it is a file", sPath.getCharacters());
+  if(pParent == 0)
     THROW_SIMPLE_(L"Cannot delete root directory \'%s\'", sPath.getCharacters());
-  pDirectory->m_pParent->m_vSubdirectories.erase(std::find(pDirectory->m_pParent->m_vSubdirectories.begin(), pDirectory->m_pParent->m_vSubdirectories.end(), pDirectory));
-  delete pDirectory;
+  pParent->removeSubdirectory(pDirectory);
 }
 
 bool MemoryFileStore::deleteDirectoryNoThrow(const RainString& sPath) throw()
 {
   directory_t* pDirectory = 0;
-  if(!_find(sPath, &pDirectory, 0, false, false, false) || !pDirectory || pDirectory->m_pParent == 0)
+  directory_t* pParent = 0;
+  if(!_find(sPath, &pDirectory, 0, false, false, false, true, &pParent) || pDirectory == 0 || pParent == 0)
     return false;
-  pDirectory->m_pParent->m_vSubdirectories.erase(std::find(pDirectory->m_pParent->m_vSubdirectories.begin(), pDirectory->m_pParent->m_vSubdirectories.end(), pDirectory));
-  delete pDirectory;
+  pParent->removeSubdirectory(pDirectory);
   return true;
 }
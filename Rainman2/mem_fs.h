@@ -24,14 +24,42 @@ OTHER DEALINGS IN THE SOFTWARE.
 */
 #pragma once
 #include "file.h"
-
+#include "containers.h"
+
+struct memory_buffer_owner_t;
+
+//! A file store which exists entirely in memory
+/*!
+  Each directory indexes its children by a hash of their lower-cased names, so looking up a
+  path costs one hash probe per component, regardless of how many items each directory holds.
+  New small files have their contents packed into shared blocks rather than each having their own
+  allocation, and each block is freed once none of the files packed into it remain. Larger files,
+  and small files which are rewritten, keep a buffer of their own.
+
+  snapshot() creates a second store which initially shares every directory and file with the
+  first, without copying anything. Directories and files are reference counted, and when either
+  store changes something shared, it copies just the directories along the path to the change
+  (and not any file contents), so neither store sees the other's changes. Reference counts
+  (including those of RainString buffers) are updated atomically, and nodes never share the
+  buffers of their names with one another, so a store and its snapshots may be used from
+  different threads at the same time, though each individual store is no more thread safe
+  than before.
+*/
 class RAINMAN2_API MemoryFileStore : public IFileStore
 {
 public:
+  MemoryFileStore() throw();
   virtual ~MemoryFileStore() throw();
 
   void addEntryPoint(const RainString& sName) throw(...);
 
+  //! Create a copy-on-write snapshot of the store, which the caller must delete
+  /*!
+    A snapshot cannot be taken while any file in the store is open for writing, as such a file
+    is not yet in a consistent state.
+  */
+  MemoryFileStore* snapshot() throw(...);
+
   // IFileStore interface
   virtual void getCaps(file_store_caps_t& oCaps) const throw();
 
@@ -57,39 +85,90 @@ protected:
   friend class MemFileReadAdaptor;
   friend class MemDirectoryAdaptor;
 
-  struct file_t
+  //! Members common to files and directories
+  struct node_t
   {
-    file_t();
-    ~file_t();
-
-    inline bool operator == (const RainString& s) {return s.compareCaseless(m_sName) == 0;}
+    //! Names are copied rather than sharing their buffers, see MemoryFileStore
+    node_t(const RainString& sName) throw(...);
+    node_t(const node_t& oOther) throw(...);
 
     RainString m_sName;
-    char* m_pData;
+    RainString m_sFoldedName; //!< Lower-cased name, which children are indexed by
+    unsigned long m_iNameHash; //!< Hash of m_sFoldedName
+    volatile long m_iReferenceCount; //!< References from directories, stores and open adaptors
+  };
+
+  struct file_t : node_t
+  {
+    file_t(const RainString& sName) throw(...);
+    file_t(const file_t& oOther) throw(...); //!< Shares the contents of oOther
+    ~file_t() throw();
+
+    //! Replace the contents, taking over the caller's reference to pOwner
+    void setContents(const char* pData, size_t iLength, memory_buffer_owner_t* pOwner) throw();
+
+    const char* m_pData;
     size_t m_iLength;
-    unsigned long m_iOpenCount;
+    memory_buffer_owner_t* m_pContentOwner; //!< Keeps m_pData alive; null if the file is empty
+    bool m_bBeingWritten;
     filetime_t m_iTimestamp;
   };
-  friend bool operator == (file_t* p, const RainString& s);
 
-  struct directory_t
+  struct directory_t : node_t
   {
-    directory_t(RainString sName);
-    ~directory_t();
+    directory_t(const RainString& sName) throw(...);
+    ~directory_t() throw();
 
-    inline bool operator == (const RainString& s) {return s.compareCaseless(m_sName) == 0;}
+    //! Make a directory with the same name and children as another
+    static directory_t* copy(const directory_t* pOther) throw(...);
 
-    RainString m_sName;
-    std::vector<directory_t*> m_vSubdirectories;
-    std::vector<file_t*> m_vFiles;
-    directory_t* m_pParent;
+    file_t* findFile(const RainString& sFoldedName, unsigned long iHash) const throw();
+    directory_t* findSubdirectory(const RainString& sFoldedName, unsigned long iHash) const throw();
+
+    //! Add a child, taking over the caller's reference to it
+    void addFile(file_t* pFile) throw(...);
+    void addSubdirectory(directory_t* pDirectory) throw(...);
+
+    //! Remove a child, releasing the directory's reference to it
+    void removeFile(file_t* pFile) throw();
+    void removeSubdirectory(directory_t* pDirectory) throw();
+
+    //! Put pNew in the place of pOld, taking over the caller's reference to pNew
+    void replaceFile(file_t* pOld, file_t* pNew) throw();
+    void replaceSubdirectory(directory_t* pOld, directory_t* pNew) throw();
+
+    std::vector<directory_t*> m_vSubdirectories; //!< In order of creation, for listings
+    std::vector<file_t*> m_vFiles; //!< In order of creation, for listings
+    RainHashIndex<directory_t*> m_oSubdirectoryIndex;
+    RainHashIndex<file_t*> m_oFileIndex;
   };
-  friend bool operator == (directory_t* p, const RainString& s);
 
-  bool _find(const RainString& sWhat, directory_t** ppResultDirectory, file_t** ppResultFile, bool bCreateFile, bool bCreateDir, bool bThrow);
+  static void _addRef(node_t* pNode) throw();
+  static void _release(file_t* pFile) throw();
+  static void _release(directory_t* pDirectory) throw();
+
+  //! Resolve a path to a directory or file
+  /*!
+    \param bUnshare If true, any shared directories along the path are copied, so that the
+           resulting directory can be modified without affecting snapshots (files are left
+           for the caller to copy, as only it knows whether the contents will be kept)
+    \param ppParentDirectory If non-null, receives the parent of a resulting directory, or null
+           for an entry point
+  */
+  bool _find(const RainString& sWhat, directory_t** ppResultDirectory, file_t** ppResultFile, bool bCreateFile, bool bCreateDir, bool bThrow, bool bUnshare = false, directory_t** ppParentDirectory = 0);
+
+  //! Get a file which only this store refers to, copying it out of pDirectory if it is shared
+  file_t* _unshareFile(directory_t* pDirectory, file_t* pFile) throw(...);
+
+  //! Store the contents of a file which has just been written, taking ownership of pData and pOwner
+  /*!
+    pOwner is a spare owner, used if the contents are not packed into a block.
+    \param bRewrite true if the file had contents before it was written
+  */
+  void _commitContents(file_t* pFile, char* pData, size_t iLength, memory_buffer_owner_t* pOwner, bool bRewrite) throw();
 
   std::vector<directory_t*> m_vEntryPoints;
+  memory_buffer_owner_t* m_pArena; //!< The block which the contents of new small files are being packed into, shared with the files
+  size_t m_iArenaUsed; //!< Number of bytes of m_pArena which have been used
+  unsigned long m_iWritersOpen;
 };
-
-inline bool operator == (MemoryFileStore::directory_t* p, const RainString& s) {return *p == s;}
-inline bool operator == (MemoryFileStore::file_t* p, const RainString& s) {return *p == s;}
@@ -23,19 +23,108 @@ FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
 OTHER DEALINGS IN THE SOFTWARE.
 */
 #include "memfile.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+void memory_buffer_owner_t::release() throw()
+{
+  if(RainAtomicDecrement(&iReferenceCount) == 0)
+  {
+    fnFree(pBuffer, iSize);
+    delete this;
+  }
+}
+
+MemoryFileView::MemoryFileView(const char* pData, size_t iLength, memory_buffer_owner_t* pOwner) throw()
+  : m_pData(pData), m_iLength(iLength), m_pOwner(pOwner)
+{
+}
+
+MemoryFileView::~MemoryFileView() throw()
+{
+  if(m_pOwner)
+    m_pOwner->release();
+}
+
+const char* MemoryFileView::getData() const throw()
+{
+  return m_pData;
+}
+
+size_t MemoryFileView::getLength() const throw()
+{
+  return m_iLength;
+}
+
+bool MemoryFileView::isDirect() const throw()
+{
+  return true;
+}
 
 MemoryReadFile::MemoryReadFile(const char *pBuffer, size_t iSize, bool bTakeOwnership) throw()
 {
   m_pBuffer = m_pPointer = pBuffer;
   m_iSize = iSize;
   m_pEnd = m_pBuffer + iSize;
-  m_bOwnsBuffer = bTakeOwnership;
+  m_fnFreeBuffer = bTakeOwnership ? _deleteBuffer : 0;
+  m_pOwner = 0;
+}
+
+MemoryReadFile::MemoryReadFile(const char *pBuffer, size_t iSize, memory_buffer_owner_t* pOwner) throw()
+{
+  m_pBuffer = m_pPointer = pBuffer;
+  m_iSize = iSize;
+  m_pEnd = m_pBuffer + iSize;
+  m_fnFreeBuffer = 0;
+  m_pOwner = pOwner;
 }
 
 MemoryReadFile::~MemoryReadFile()
 {
-  if(m_bOwnsBuffer)
-    delete[] const_cast<char*>(m_pBuffer);
+  _releaseBuffer();
+}
+
+void MemoryReadFile::_deleteBuffer(const char* pBuffer, size_t iSize)
+{
+  delete[] const_cast<char*>(pBuffer);
+}
+
+void MemoryReadFile::_releaseBuffer() throw()
+{
+  if(m_pOwner)
+  {
+    m_pOwner->release();
+    m_pOwner = 0;
+  }
+  else if(m_fnFreeBuffer)
+    m_fnFreeBuffer(m_pBuffer, m_iSize);
+  m_fnFreeBuffer = 0;
+}
+
+IFileView* MemoryReadFile::mapView(seek_offset_t iPosition, size_t iLength) throw(...)
+{
+  _checkViewRange(iPosition, iLength);
+  if(m_fnFreeBuffer && m_pOwner == 0)
+  {
+    CHECK_ALLOCATION(m_pOwner = new (std::nothrow) memory_buffer_owner_t);
+    m_pOwner->iReferenceCount = 1; // The reference held by the file itself
+    m_pOwner->pBuffer = m_pBuffer;
+    m_pOwner->iSize = m_iSize;
+    m_pOwner->fnFree = m_fnFreeBuffer;
+  }
+  if(m_pOwner)
+    RainAtomicIncrement(&m_pOwner->iReferenceCount);
+  MemoryFileView* pView = new (std::nothrow) MemoryFileView(m_pBuffer + iPosition, iLength, m_pOwner);
+  if(pView == 0 && m_pOwner)
+    m_pOwner->release();
+  return CHECK_ALLOCATION(pView);
 }
 
 void MemoryReadFile::write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...)
@@ -48,6 +137,121 @@ size_t MemoryReadFile::writeNoThrow(const void* pSource, size_t iItemSize, size_
   return 0;
 }
 
+MemoryMappedFile::MemoryMappedFile() throw()
+  : MemoryReadFile(0, 0, false)
+{
+}
+
+MemoryMappedFile::~MemoryMappedFile() throw()
+{
+  unmap();
+}
+
+void MemoryMappedFile::map(const RainString& sPath) throw(...)
+{
+  if(!mapNoThrow(sPath))
+    THROW_SIMPLE_(L"Unable to map \'%s\' into memory", sPath.getCharacters());
+}
+
+#ifdef _WIN32
+bool MemoryMappedFile::mapNoThrow(const RainString& sPath) throw()
+{
+  unmap();
+
+  HANDLE hFile = CreateFileW(sPath.getCharacters(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(hFile == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER iFileSize;
+  if(GetFileSizeEx(hFile, &iFileSize) == FALSE || iFileSize.HighPart != 0)
+  {
+    CloseHandle(hFile);
+    return false;
+  }
+  if(iFileSize.LowPart == 0)
+  {
+    // Empty files cannot be mapped, but are trivially represented without a mapping
+    CloseHandle(hFile);
+    return true;
+  }
+
+  // The view keeps the mapping (and hence the file) alive, so both handles can be closed straight away
+  HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(hFile);
+  if(hMapping == NULL)
+    return false;
+  const char* pView = reinterpret_cast<const char*>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+  CloseHandle(hMapping);
+  if(pView == 0)
+    return false;
+
+  m_pBuffer = m_pPointer = pView;
+  m_iSize = static_cast<size_t>(iFileSize.LowPart);
+  m_pEnd = m_pBuffer + m_iSize;
+  m_fnFreeBuffer = _unmapBuffer;
+  return true;
+}
+
+void MemoryMappedFile::_unmapBuffer(const char* pBuffer, size_t iSize)
+{
+  UnmapViewOfFile(pBuffer);
+}
+#else
+bool MemoryMappedFile::mapNoThrow(const RainString& sPath) throw()
+{
+  unmap();
+
+  std::vector<char> vNative;
+  if(!RainNativePath(sPath, vNative))
+    return false;
+  int iDescriptor = open(&vNative[0], O_RDONLY | O_CLOEXEC);
+  if(iDescriptor == -1)
+    return false;
+  bool bMapped = mapDescriptorNoThrow(iDescriptor);
+  close(iDescriptor);
+  return bMapped;
+}
+
+bool MemoryMappedFile::mapDescriptorNoThrow(int iDescriptor) throw()
+{
+  unmap();
+
+  struct stat oStat;
+  if(fstat(iDescriptor, &oStat) != 0 || !S_ISREG(oStat.st_mode))
+    return false;
+  if(static_cast<unsigned long long>(oStat.st_size) > static_cast<unsigned long long>(static_cast<size_t>(-1)))
+    return false;
+  if(oStat.st_size == 0)
+  {
+    // Empty files cannot be mapped, but are trivially represented without a mapping
+    return true;
+  }
+
+  size_t iSize = static_cast<size_t>(oStat.st_size);
+  void* pView = mmap(0, iSize, PROT_READ, MAP_PRIVATE, iDescriptor, 0);
+  if(pView == MAP_FAILED)
+    return false;
+
+  m_pBuffer = m_pPointer = reinterpret_cast<const char*>(pView);
+  m_iSize = iSize;
+  m_pEnd = m_pBuffer + m_iSize;
+  m_fnFreeBuffer = _unmapBuffer;
+  return true;
+}
+
+void MemoryMappedFile::_unmapBuffer(const char* pBuffer, size_t iSize)
+{
+  munmap(const_cast<char*>(pBuffer), iSize);
+}
+#endif
+
+void MemoryMappedFile::unmap() throw()
+{
+  // Views taken of the file keep the mapping alive until they are deleted
+  _releaseBuffer();
+  m_pBuffer = m_pPointer = m_pEnd = 0;
+  m_iSize = 0;
+}
+
 MemoryWriteFile::MemoryWriteFile(size_t iInitialSize) throw(...)
 {
   CHECK_ALLOCATION(m_pBuffer = m_pPointer = m_pEnd = new (std::nothrow) char[iInitialSize]);
@@ -68,8 +272,8 @@ void MemoryWriteFile::write(const void* pSource, size_t iItemSize, size_t iItemC
     m_iSize = m_iSize * 2 + iBytes;
     char *pNewBuffer = CHECK_ALLOCATION(new (std::nothrow) char[m_iSize]);
     m_pBufferEnd = pNewBuffer + m_iSize;
+    std::copy(m_pBuffer, m_pEnd, pNewBuffer);
     m_pEnd = m_pEnd - m_pBuffer + pNewBuffer;
-    std::copy(m_pBuffer, m_pPointer, pNewBuffer);
     m_pPointer = m_pPointer - m_pBuffer + pNewBuffer; 
     delete[] m_pBuffer;
     m_pBuffer = pNewBuffer;
@@ -85,13 +289,13 @@ size_t MemoryWriteFile::writeNoThrow(const void* pSource, size_t iItemSize, size
   size_t iBytes = iItemSize * iItemCount;
   if(m_pPointer + iBytes >= m_pBufferEnd)
   {
-    char *pNewBuffer = new (std::nothrow) char[m_iSize << 1];
+    char *pNewBuffer = new (std::nothrow) char[m_iSize * 2 + iBytes];
     if(pNewBuffer)
     {
-      m_iSize <<= 1;
+      m_iSize = m_iSize * 2 + iBytes;
       m_pBufferEnd = pNewBuffer + m_iSize;
+      std::copy(m_pBuffer, m_pEnd, pNewBuffer);
       m_pEnd = m_pEnd - m_pBuffer + pNewBuffer;
-      std::copy(m_pBuffer, m_pPointer, pNewBuffer);
       m_pPointer = m_pPointer - m_pBuffer + pNewBuffer;
       delete[] m_pBuffer;
       m_pBuffer = pNewBuffer;
@@ -108,3 +312,285 @@ size_t MemoryWriteFile::writeNoThrow(const void* pSource, size_t iItemSize, size
     m_pEnd = m_pPointer;
   return iItemCount;
 }
+
+MemoryArena::MemoryArena(size_t iBlockSize) throw()
+  : m_pBlocks(0), m_pNext(0), m_pEnd(0), m_iBlockSize(iBlockSize), m_iMemoryUsage(0)
+{
+}
+
+MemoryArena::~MemoryArena() throw()
+{
+  reset();
+}
+
+char* MemoryArena::allocate(size_t iBytes) throw(...)
+{
+  char* pMemory = allocateNoThrow(iBytes);
+  if(pMemory == 0)
+    THROW_SIMPLE_(L"Cannot allocate %lu bytes from memory arena", static_cast<unsigned long>(iBytes));
+  return pMemory;
+}
+
+char* MemoryArena::allocateNoThrow(size_t iBytes) throw()
+{
+  // Allocations are kept pointer aligned, so that they can hold more than just characters
+  iBytes = (iBytes + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  if(iBytes <= static_cast<size_t>(m_pEnd - m_pNext))
+  {
+    char* pMemory = m_pNext;
+    m_pNext += iBytes;
+    return pMemory;
+  }
+
+  // Large requests get a block to themselves, rather than wasting the remainder of a block
+  bool bOwnBlock = iBytes > m_iBlockSize / 4;
+  size_t iSize = bOwnBlock ? iBytes : m_iBlockSize;
+  char* pMemory = new (std::nothrow) char[sizeof(block_t) + iSize];
+  if(pMemory == 0)
+    return 0;
+  block_t* pBlock = reinterpret_cast<block_t*>(pMemory);
+  pBlock->iSize = iSize;
+  m_iMemoryUsage += sizeof(block_t) + iSize;
+  pMemory += sizeof(block_t);
+  if(bOwnBlock && m_pBlocks)
+  {
+    // The current block probably still has room for smaller allocations, so stays current
+    pBlock->pNext = m_pBlocks->pNext;
+    m_pBlocks->pNext = pBlock;
+    return pMemory;
+  }
+  pBlock->pNext = m_pBlocks;
+  m_pBlocks = pBlock;
+  m_pNext = pMemory + iBytes;
+  m_pEnd = pMemory + iSize;
+  return pMemory;
+}
+
+void MemoryArena::reset() throw()
+{
+  while(m_pBlocks)
+  {
+    block_t* pNext = m_pBlocks->pNext;
+    delete[] reinterpret_cast<char*>(m_pBlocks);
+    m_pBlocks = pNext;
+  }
+  m_pNext = m_pEnd = 0;
+  m_iMemoryUsage = 0;
+}
+
+size_t MemoryArena::getMemoryUsage() const throw()
+{
+  return m_iMemoryUsage;
+}
+
+MemorySegmentedFile::MemorySegmentedFile(size_t iChunkSize, MemoryArena* pArena) throw()
+  : m_pArena(pArena), m_iChunkSize(iChunkSize ? iChunkSize : 1), m_iLength(0), m_iPosition(0)
+{
+}
+
+MemorySegmentedFile::~MemorySegmentedFile() throw()
+{
+  if(m_pArena == 0)
+  {
+    for(std::vector<char*>::iterator itr = m_vChunks.begin(); itr != m_vChunks.end(); ++itr)
+      delete[] *itr;
+  }
+}
+
+void MemorySegmentedFile::writeTo(IFile* pDestination) const throw(...)
+{
+  writeTo(pDestination, 0, m_iLength);
+}
+
+void MemorySegmentedFile::writeTo(IFile* pDestination, seek_offset_t iPosition, size_t iLength) const throw(...)
+{
+  if(iPosition < 0 || static_cast<size_t>(iPosition) > m_iLength || iLength > m_iLength - static_cast<size_t>(iPosition))
+  {
+    THROW_SIMPLE_(L"Cannot write %lu bytes from position %li of a %lu byte memory file",
+      static_cast<unsigned long>(iLength), static_cast<long>(iPosition), static_cast<unsigned long>(m_iLength));
+  }
+  std::vector<file_buffer_t> vBuffers;
+  _gather(static_cast<size_t>(iPosition), iLength, vBuffers);
+  if(!vBuffers.empty())
+    pDestination->writeGather(&vBuffers[0], vBuffers.size());
+}
+
+void MemorySegmentedFile::_gather(size_t iPosition, size_t iLength, std::vector<file_buffer_t>& vBuffers) const throw(...)
+{
+  vBuffers.reserve(vBuffers.size() + iLength / m_iChunkSize + 2);
+  while(iLength != 0)
+  {
+    size_t iOffset = iPosition % m_iChunkSize;
+    file_buffer_t oBuffer;
+    oBuffer.pData = m_vChunks[iPosition / m_iChunkSize] + iOffset;
+    oBuffer.iLength = std::min(m_iChunkSize - iOffset, iLength);
+    vBuffers.push_back(oBuffer);
+    iPosition += oBuffer.iLength;
+    iLength -= oBuffer.iLength;
+  }
+}
+
+bool MemorySegmentedFile::_reserve(size_t iLength) throw()
+{
+  while(m_vChunks.size() * m_iChunkSize < iLength)
+  {
+    char* pChunk = m_pArena ? m_pArena->allocateNoThrow(m_iChunkSize) : new (std::nothrow) char[m_iChunkSize];
+    if(pChunk == 0)
+      return false;
+    try
+    {
+      m_vChunks.push_back(pChunk);
+    }
+    catch(...)
+    {
+      if(m_pArena == 0)
+        delete[] pChunk;
+      return false;
+    }
+  }
+  return true;
+}
+
+void MemorySegmentedFile::_copyIn(const char* pSource, size_t iBytes) throw()
+{
+  while(iBytes != 0)
+  {
+    size_t iOffset = m_iPosition % m_iChunkSize;
+    size_t iCount = std::min(m_iChunkSize - iOffset, iBytes);
+    memcpy(m_vChunks[m_iPosition / m_iChunkSize] + iOffset, pSource, iCount);
+    pSource += iCount;
+    iBytes -= iCount;
+    m_iPosition += iCount;
+  }
+  if(m_iPosition > m_iLength)
+    m_iLength = m_iPosition;
+}
+
+size_t MemorySegmentedFile::_copyOut(size_t iPosition, char* pDestination, size_t iBytes) const throw()
+{
+  if(iPosition >= m_iLength)
+    return 0;
+  if(iBytes > m_iLength - iPosition)
+    iBytes = m_iLength - iPosition;
+  for(size_t iRemaining = iBytes; iRemaining != 0;)
+  {
+    size_t iOffset = iPosition % m_iChunkSize;
+    size_t iCount = std::min(m_iChunkSize - iOffset, iRemaining);
+    memcpy(pDestination, m_vChunks[iPosition / m_iChunkSize] + iOffset, iCount);
+    pDestination += iCount;
+    iPosition += iCount;
+    iRemaining -= iCount;
+  }
+  return iBytes;
+}
+
+void MemorySegmentedFile::read(void* pDestination, size_t iItemSize, size_t iItemCount) throw(...)
+{
+  size_t iBytes = iItemSize * iItemCount;
+  if(iBytes > m_iLength - m_iPosition)
+  {
+    THROW_SIMPLE_(L"Reading %lu items of size %lu would exceed the memory file (only %lu bytes remaining)",
+      static_cast<unsigned long>(iItemCount), static_cast<unsigned long>(iItemSize), static_cast<unsigned long>(m_iLength - m_iPosition));
+  }
+  m_iPosition += _copyOut(m_iPosition, reinterpret_cast<char*>(pDestination), iBytes);
+}
+
+size_t MemorySegmentedFile::readNoThrow(void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+{
+  if(iItemSize == 0)
+    return 0;
+  size_t iAvailable = (m_iLength - m_iPosition) / iItemSize;
+  if(iItemCount > iAvailable)
+    iItemCount = iAvailable;
+  m_iPosition += _copyOut(m_iPosition, reinterpret_cast<char*>(pDestination), iItemSize * iItemCount);
+  return iItemCount;
+}
+
+size_t MemorySegmentedFile::readAtNoThrow(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+{
+  if(iPosition < 0 || static_cast<size_t>(iPosition) > m_iLength || iItemSize == 0)
+    return 0;
+  size_t iAvailable = (m_iLength - static_cast<size_t>(iPosition)) / iItemSize;
+  if(iItemCount > iAvailable)
+    iItemCount = iAvailable;
+  _copyOut(static_cast<size_t>(iPosition), reinterpret_cast<char*>(pDestination), iItemSize * iItemCount);
+  return iItemCount;
+}
+
+bool MemorySegmentedFile::isReadAtThreadSafe() const throw()
+{
+  return true;
+}
+
+IFileView* MemorySegmentedFile::mapView(seek_offset_t iPosition, size_t iLength) throw(...)
+{
+  if(iPosition < 0 || static_cast<size_t>(iPosition) > m_iLength || iLength > m_iLength - static_cast<size_t>(iPosition))
+  {
+    THROW_SIMPLE_(L"Cannot view %lu bytes at position %li of a %lu byte memory file",
+      static_cast<unsigned long>(iLength), static_cast<long>(iPosition), static_cast<unsigned long>(m_iLength));
+  }
+  size_t iOffset = static_cast<size_t>(iPosition) % m_iChunkSize;
+  if(iLength != 0 && iLength <= m_iChunkSize - iOffset)
+  {
+    const char* pData = m_vChunks[static_cast<size_t>(iPosition) / m_iChunkSize] + iOffset;
+    return CHECK_ALLOCATION(new (std::nothrow) MemoryFileView(pData, iLength));
+  }
+  // Views spanning several chunks have to be made contiguous by copying
+  return IFile::mapView(iPosition, iLength);
+}
+
+void MemorySegmentedFile::write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...)
+{
+  size_t iBytes = iItemSize * iItemCount;
+  if(!_reserve(m_iPosition + iBytes))
+    THROW_SIMPLE_(L"Cannot allocate memory to write %lu bytes to memory file", static_cast<unsigned long>(iBytes));
+  _copyIn(reinterpret_cast<const char*>(pSource), iBytes);
+}
+
+size_t MemorySegmentedFile::writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw()
+{
+  if(iItemSize == 0)
+    return 0;
+  if(!_reserve(m_iPosition + iItemSize * iItemCount))
+  {
+    size_t iAvailable = (m_vChunks.size() * m_iChunkSize - m_iPosition) / iItemSize;
+    if(iItemCount > iAvailable)
+      iItemCount = iAvailable;
+  }
+  _copyIn(reinterpret_cast<const char*>(pSource), iItemSize * iItemCount);
+  return iItemCount;
+}
+
+void MemorySegmentedFile::seek(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw(...)
+{
+  if(!seekNoThrow(iOffset, eRelativeTo))
+    THROW_SIMPLE_(L"Cannot seek to %li in a %lu byte memory file", static_cast<long>(iOffset), static_cast<unsigned long>(m_iLength));
+}
+
+bool MemorySegmentedFile::seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw()
+{
+  seek_offset_t iBase;
+  switch(eRelativeTo)
+  {
+  case SR_Start:
+    iBase = 0;
+    break;
+  case SR_Current:
+    iBase = static_cast<seek_offset_t>(m_iPosition);
+    break;
+  case SR_End:
+    iBase = static_cast<seek_offset_t>(m_iLength);
+    break;
+  default:
+    return false;
+  }
+  if(iBase + iOffset < 0 || static_cast<size_t>(iBase + iOffset) > m_iLength)
+    return false;
+  m_iPosition = static_cast<size_t>(iBase + iOffset);
+  return true;
+}
+
+seek_offset_t MemorySegmentedFile::tell() throw()
+{
+  return static_cast<seek_offset_t>(m_iPosition);
+}
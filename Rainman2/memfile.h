@@ -26,6 +26,35 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "file.h"
 #include "exception.h"
 
+//! Shared ownership of the memory behind a MemoryReadFile, so that views of it can outlive the file
+struct RAINMAN2_API memory_buffer_owner_t
+{
+  volatile long iReferenceCount;
+  const char* pBuffer;
+  size_t iSize;
+  void (*fnFree)(const char* pBuffer, size_t iSize); //!< Called once the last reference is released
+
+  void release() throw();
+};
+
+//! View returned by the mapView() of memory files, pointing directly at the memory of the file
+class RAINMAN2_API MemoryFileView : public IFileView
+{
+public:
+  //! If pOwner is non-null, then the view takes over one reference to it
+  MemoryFileView(const char* pData, size_t iLength, memory_buffer_owner_t* pOwner = 0) throw();
+  virtual ~MemoryFileView() throw();
+
+  virtual const char* getData() const throw();
+  virtual size_t getLength() const throw();
+  virtual bool isDirect() const throw();
+
+protected:
+  const char* m_pData;
+  size_t m_iLength;
+  memory_buffer_owner_t* m_pOwner;
+};
+
 //! Common code in both MemoryReadFile and MemoryReadFile
 /*!
   TCharPtr should be either `char*` or `const char*` depending on whether or not
@@ -91,7 +120,42 @@ public:
     return static_cast<seek_offset_t>(m_pPointer - m_pBuffer);
   }
 
+  virtual size_t readAtNoThrow(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw()
+  {
+    size_t iLength = static_cast<size_t>(m_pEnd - m_pBuffer);
+    if(iPosition < 0 || static_cast<size_t>(iPosition) > iLength || iItemSize == 0)
+      return 0;
+    size_t iAvailable = (iLength - static_cast<size_t>(iPosition)) / iItemSize;
+    if(iItemCount > iAvailable)
+      iItemCount = iAvailable;
+    memcpy(pDestination, m_pBuffer + iPosition, iItemSize * iItemCount);
+    return iItemCount;
+  }
+
+  //! Positional reads only read the buffer, and so can be performed concurrently
+  virtual bool isReadAtThreadSafe() const throw()
+  {
+    return true;
+  }
+
+  //! Views point straight into the buffer, so only remain valid until the buffer is next changed
+  virtual IFileView* mapView(seek_offset_t iPosition, size_t iLength) throw(...)
+  {
+    _checkViewRange(iPosition, iLength);
+    return CHECK_ALLOCATION(new (std::nothrow) MemoryFileView(m_pBuffer + iPosition, iLength));
+  }
+
 protected:
+  void _checkViewRange(seek_offset_t iPosition, size_t iLength) throw(...)
+  {
+    size_t iFileLength = static_cast<size_t>(m_pEnd - m_pBuffer);
+    if(iPosition < 0 || static_cast<size_t>(iPosition) > iFileLength || iLength > iFileLength - static_cast<size_t>(iPosition))
+    {
+      THROW_SIMPLE_(L"Cannot view %lu bytes at position %li of a %lu byte memory file",
+        static_cast<unsigned long>(iLength), static_cast<long>(iPosition), static_cast<unsigned long>(iFileLength));
+    }
+  }
+
   TCharPtr m_pBuffer, m_pPointer, m_pEnd;
   size_t m_iSize;
 };
@@ -100,13 +164,59 @@ class RAINMAN2_API MemoryReadFile : public MemoryFileBase<const char*>
 {
 public:
   MemoryReadFile(const char *pBuffer, size_t iSize, bool bTakeOwnership = false) throw();
+  //! Read from a buffer which is kept alive by pOwner, taking over one reference to it
+  /*!
+    The buffer can be any part of the memory which pOwner keeps alive, and views of the file
+    share the reference, so can outlive the file.
+  */
+  MemoryReadFile(const char *pBuffer, size_t iSize, memory_buffer_owner_t* pOwner) throw();
   virtual ~MemoryReadFile() throw();
 
+  inline const char* getBuffer() const throw() {return m_pBuffer;}
+  inline size_t getSize() const throw() {return m_iSize;}
+
   virtual void write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...);
   virtual size_t writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw();
 
+  //! When the file owns its buffer, views share that ownership, and so can outlive the file
+  /*!
+    When the file does not own its buffer, views remain valid for as long as the buffer does.
+  */
+  virtual IFileView* mapView(seek_offset_t iPosition, size_t iLength) throw(...);
+
+protected:
+  //! Give up the file's claim on its buffer, freeing it unless views still refer to it
+  void _releaseBuffer() throw();
+
+  static void _deleteBuffer(const char* pBuffer, size_t iSize);
+
+  void (*m_fnFreeBuffer)(const char* pBuffer, size_t iSize); //!< Frees the buffer, or null if it is not owned
+  memory_buffer_owner_t* m_pOwner; //!< Created when the first view is taken of an owned buffer
+};
+
+//! A read-only file whose entire contents are mapped into memory by the operating system
+/*!
+  Rather than reading the file into a buffer, the file is mapped into the address space of
+  the process, and pages are only read from disk as they are accessed. The buffer returned
+  by getBuffer() remains valid until the file is unmapped or the object is destroyed, so
+  pointers into it can be handed out as zero-copy views (see SgaArchive::initMapped()).
+*/
+class RAINMAN2_API MemoryMappedFile : public MemoryReadFile
+{
+public:
+  MemoryMappedFile() throw();
+  virtual ~MemoryMappedFile() throw();
+
+  void map(const RainString& sPath) throw(...);
+  bool mapNoThrow(const RainString& sPath) throw();
+#ifndef _WIN32
+  //! Map the whole of an already open file; the descriptor can be closed once this returns
+  bool mapDescriptorNoThrow(int iDescriptor) throw();
+#endif
+  void unmap() throw();
+
 protected:
-  bool m_bOwnsBuffer;
+  static void _unmapBuffer(const char* pBuffer, size_t iSize);
 };
 
 class RAINMAN2_API MemoryWriteFile : public MemoryFileBase<char*>
@@ -124,3 +234,101 @@ public:
 protected:
   char *m_pBufferEnd;
 };
+
+//! Hands out memory from large blocks, which are all freed together when the arena is destroyed
+/*!
+  Intended for many short-lived buffers (such as the chunks of MemorySegmentedFile objects)
+  which share a common lifetime, as each allocation is little more than a pointer increment
+  and nothing is freed individually. An arena is not thread safe.
+*/
+class RAINMAN2_API MemoryArena
+{
+public:
+  MemoryArena(size_t iBlockSize = 0x10000) throw();
+  ~MemoryArena() throw();
+
+  //! Allocate iBytes bytes, which remain valid until the arena is reset or destroyed
+  char* allocate(size_t iBytes) throw(...);
+  char* allocateNoThrow(size_t iBytes) throw();
+
+  //! Free everything which has been allocated from the arena
+  void reset() throw();
+
+  size_t getMemoryUsage() const throw();
+
+protected:
+  struct block_t
+  {
+    block_t* pNext;
+    size_t iSize; //!< Bytes of data which follow the header
+  };
+
+  block_t* m_pBlocks;
+  char* m_pNext;
+  char* m_pEnd;
+  size_t m_iBlockSize;
+  size_t m_iMemoryUsage;
+};
+
+//! A growable memory file, stored as a series of fixed size chunks
+/*!
+  Unlike MemoryWriteFile, growing the file never moves the data already written, as more
+  chunks are simply added to the end. Any position within the file can still be seeked to
+  and overwritten, such as for filling in a header once the data following it is known.
+  As the contents are not contiguous, they are read back with read() or readAt(), or sent
+  to another file with writeTo(), which passes every chunk to that file in one writeGather().
+  Chunks can optionally be allocated from a MemoryArena, in which case they are only freed
+  when the arena is.
+*/
+class RAINMAN2_API MemorySegmentedFile : public IFile
+{
+public:
+  MemorySegmentedFile(size_t iChunkSize = 0x1000, MemoryArena* pArena = 0) throw();
+  virtual ~MemorySegmentedFile() throw();
+
+  inline size_t getLengthUsed() const throw() {return m_iLength;}
+
+  //! Write the entire file to another file, leaving the position of this file unchanged
+  void writeTo(IFile* pDestination) const throw(...);
+
+  //! Write part of the file to another file, leaving the position of this file unchanged
+  void writeTo(IFile* pDestination, seek_offset_t iPosition, size_t iLength) const throw(...);
+
+  virtual void read(void* pDestination, size_t iItemSize, size_t iItemCount) throw(...);
+  virtual size_t readNoThrow(void* pDestination, size_t iItemSize, size_t iItemCount) throw();
+  virtual size_t readAtNoThrow(seek_offset_t iPosition, void* pDestination, size_t iItemSize, size_t iItemCount) throw();
+  virtual bool isReadAtThreadSafe() const throw();
+
+  //! Views lying within a single chunk point directly at it, while others are copies
+  /*!
+    Direct views remain valid for as long as the file does, as chunks never move.
+  */
+  virtual IFileView* mapView(seek_offset_t iPosition, size_t iLength) throw(...);
+
+  virtual void write(const void* pSource, size_t iItemSize, size_t iItemCount) throw(...);
+  virtual size_t writeNoThrow(const void* pSource, size_t iItemSize, size_t iItemCount) throw();
+
+  //! Positions beyond the end of the file cannot be seeked to
+  virtual void seek(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw(...);
+  virtual bool seekNoThrow(seek_offset_t iOffset, seek_relative_t eRelativeTo) throw();
+  virtual seek_offset_t tell() throw();
+
+protected:
+  //! Add chunks until the file can hold iLength bytes, returning false if memory runs out first
+  bool _reserve(size_t iLength) throw();
+
+  //! Copy bytes to the current position, which must already have room for them
+  void _copyIn(const char* pSource, size_t iBytes) throw();
+
+  //! Copy up to iBytes from iPosition, returning the number of bytes copied
+  size_t _copyOut(size_t iPosition, char* pDestination, size_t iBytes) const throw();
+
+  //! Append the buffers which cover a range of the file to vBuffers
+  void _gather(size_t iPosition, size_t iLength, std::vector<file_buffer_t>& vBuffers) const throw(...);
+
+  std::vector<char*> m_vChunks;
+  MemoryArena* m_pArena;
+  size_t m_iChunkSize;
+  size_t m_iLength;
+  size_t m_iPosition;
+};
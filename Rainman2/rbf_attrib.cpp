@@ -40,6 +40,16 @@ RbfAttributeFile::~RbfAttributeFile() throw()
   _cleanSelf();
 }
 
+//! View an array of items in a file, which remains valid for as long as the view
+template <class T>
+static const T* ViewArray(IFile* pFile, unsigned long iOffset, unsigned long iCount, IFileView*& pView) throw(...)
+{
+  if(iCount > static_cast<size_t>(-1) / sizeof(T))
+    THROW_SIMPLE_(L"Array of %lu items is too large", iCount);
+  pView = pFile->mapView(iOffset, sizeof(T) * iCount);
+  return pView->getArray<T>();
+}
+
 void RbfAttributeFile::load(IFile *pFile) throw(...)
 {
   _cleanSelf();
@@ -53,25 +63,13 @@ void RbfAttributeFile::load(IFile *pFile) throw(...)
 
   try
   {
-    pFile->seek(m_oHeader.iTablesOffset, SR_Start);
-    CHECK_ALLOCATION(m_pTables = new (std::nothrow) _table_raw_t[m_oHeader.iTablesCount]);
-    pFile->readArray(m_pTables, m_oHeader.iTablesCount);
-
-    pFile->seek(m_oHeader.iKeysOffset, SR_Start);
-    CHECK_ALLOCATION(m_pKeys = new (std::nothrow) _key_raw_t[m_oHeader.iKeysCount]);
-    pFile->readArray(m_pKeys, m_oHeader.iKeysCount);
-
-    pFile->seek(m_oHeader.iDataIndexOffset, SR_Start);
-    CHECK_ALLOCATION(m_pDataIndex = new (std::nothrow) unsigned long[m_oHeader.iDataIndexCount]);
-    pFile->readArray(m_pDataIndex, m_oHeader.iDataIndexCount);
-
-    pFile->seek(m_oHeader.iDataOffset, SR_Start);
-    CHECK_ALLOCATION(m_pData = new (std::nothrow) _data_raw_t[m_oHeader.iDataCount]);
-    pFile->readArray(m_pData, m_oHeader.iDataCount);
-
-    pFile->seek(m_oHeader.iStringsOffset, SR_Start);
-    CHECK_ALLOCATION(m_sStringBlock = new char[m_oHeader.iStringsLength]);
-    pFile->readArray(m_sStringBlock, m_oHeader.iStringsLength);
+    // When the file is already in memory (e.g. freshly inflated from an archive), the arrays
+    // are used where they lie rather than being copied
+    m_pTables = ViewArray<_table_raw_t>(pFile, m_oHeader.iTablesOffset, m_oHeader.iTablesCount, m_aViews[0]);
+    m_pKeys = ViewArray<_key_raw_t>(pFile, m_oHeader.iKeysOffset, m_oHeader.iKeysCount, m_aViews[1]);
+    m_pDataIndex = ViewArray<unsigned long>(pFile, m_oHeader.iDataIndexOffset, m_oHeader.iDataIndexCount, m_aViews[2]);
+    m_pData = ViewArray<_data_raw_t>(pFile, m_oHeader.iDataOffset, m_oHeader.iDataCount, m_aViews[3]);
+    m_sStringBlock = ViewArray<char>(pFile, m_oHeader.iStringsOffset, m_oHeader.iStringsLength, m_aViews[4]);
 
     if(m_oHeader.iTablesCount < 1)
       THROW_SIMPLE(L"RBF files must contain at least the top-level container table");
@@ -168,15 +166,14 @@ void RbfAttributeFile::_zeroSelf() throw()
   m_sStringBlock = 0;
   m_pKeys = 0;
   m_pKeyOrdering = 0;
+  for(size_t i = 0; i < sizeof(m_aViews) / sizeof(*m_aViews); ++i)
+    m_aViews[i] = 0;
 }
 
 void RbfAttributeFile::_cleanSelf() throw()
 {
-  delete[] m_pTables;
-  delete[] m_pData;
-  delete[] m_pDataIndex;
-  delete[] m_sStringBlock;
-  delete[] m_pKeys;
+  for(size_t i = 0; i < sizeof(m_aViews) / sizeof(*m_aViews); ++i)
+    delete m_aViews[i];
   delete[] m_pKeyOrdering;
   _zeroSelf();
 }
@@ -395,7 +392,7 @@ unsigned long RbfAttrTableAdapter::findChildIndex(unsigned long iName) throw()
   {
     // Linearlly searching an alphabetically sorted array is no faster than searching a pseudo-randomly
     // sorted array, so go for the pseudo-random array as the alphabetically sorted array may not exist
-    unsigned long *pIndex = m_pFile->m_pDataIndex + m_oTable.iChildIndex;
+    const unsigned long *pIndex = m_pFile->m_pDataIndex + m_oTable.iChildIndex;
     for(unsigned long iIndex = 0; iIndex < m_oTable.iChildCount; ++iIndex, ++pIndex)
     {
       if(iName == pDict->asciiToHash(m_pFile->m_pKeys[m_pFile->m_pData[*pIndex].iKeyIndex]))
@@ -473,8 +470,9 @@ void RbfWriter::rewriteInRelicStyle(RbfWriter *pDestination) const throw(...)
       case RbfAttributeFile::_data_raw_t::T_String:
         {
           unsigned long iNewIndex = pDestination->m_pStringBlock->getLengthUsed();
-          const char* sRaw = m_pStringBlock->getBuffer() + pData->uValue;
-          pDestination->m_pStringBlock->writeArray(sRaw, 4 + *reinterpret_cast<const unsigned long*>(sRaw));
+          unsigned long iStringLength;
+          m_pStringBlock->readAt(pData->uValue, &iStringLength, sizeof(unsigned long), 1);
+          m_pStringBlock->writeTo(pDestination->m_pStringBlock, pData->uValue, 4 + iStringLength);
           pData->uValue = iNewIndex;
           break;
         }
@@ -504,7 +502,7 @@ void RbfWriter::initialise()
 
   // heap allocations
   if(m_pStringBlock == 0)
-    m_pStringBlock = new MemoryWriteFile;
+    m_pStringBlock = new MemorySegmentedFile(0x4000);
 }
 
 #define CACHED_SET(hash, map, field, code, always, saved) \
@@ -655,7 +653,7 @@ void RbfWriter::writeToFile(IFile *pFile, bool bRelicStyle) const throw(...)
     pFile->writeArray(&*m_vTables, m_vTables.size());
     pFile->writeArray(&*m_vDataIndex, m_vDataIndex.size());
   }
-  pFile->writeArray(m_pStringBlock->getBuffer(), m_pStringBlock->getLengthUsed());
+  m_pStringBlock->writeTo(pFile);
 }
 
 #endif
@@ -181,13 +181,14 @@ protected:
   void _cleanSelf() throw();
   void _buildKeyOrdering() throw(...);
 
-  // Contents of a .rbf file on disk
-  _header_raw_t  m_oHeader;
-  _table_raw_t  *m_pTables;
-  _data_raw_t   *m_pData;
-  _key_raw_t    *m_pKeys;
-  unsigned long *m_pDataIndex;
-  char          *m_sStringBlock;
+  // Contents of a .rbf file on disk; the arrays point into views of the file
+  _header_raw_t        m_oHeader;
+  const _table_raw_t  *m_pTables;
+  const _data_raw_t   *m_pData;
+  const _key_raw_t    *m_pKeys;
+  const unsigned long *m_pDataIndex;
+  const char          *m_sStringBlock;
+  IFileView           *m_aViews[5];
 
   // Fields not on disk
   RainString     m_sFilename;
@@ -399,7 +400,7 @@ protected:
   _cache_map_t m_mapData;
   _cache_map_t m_mapStrings;
   RbfAttributeFile::_data_raw_t m_oDataValue;
-  MemoryWriteFile* m_pStringBlock;
+  MemorySegmentedFile* m_pStringBlock; //!< Segmented, so that growing it never copies the strings already in it
   size_t m_iAmountSavedByCaching;
   bool m_bEnableCaching;
 };
@@ -0,0 +1,835 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "sga_writer.h"
+#include "archive.h"
+#include "exception.h"
+#include "hash.h"
+#include "inflatefile.h"
+#include "memfile.h"
+#include "zlib.h"
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <string.h>
+
+bool SgaArchiveWriter::_content_key_t::operator < (const _content_key_t& oOther) const throw()
+{
+  if(iLength != oOther.iLength)
+    return iLength < oOther.iLength;
+  return memcmp(aMD5, oOther.aMD5, 16) < 0;
+}
+
+SgaArchiveWriter::SgaArchiveWriter() throw()
+  : m_iBytesIn(0), m_iBytesOut(0), m_iDataStart(0), m_iDataLength(0), m_iDuplicateCount(0), m_iReusedCount(0)
+  , m_iThreadCount(0), m_iCompressionLevel(Z_BEST_COMPRESSION), m_iVersionMajor(2)
+{
+}
+
+SgaArchiveWriter::~SgaArchiveWriter() throw()
+{
+}
+
+void SgaArchiveWriter::setVersion(unsigned short iVersionMajor) throw(...)
+{
+  if(iVersionMajor != 2 && iVersionMajor != 4 && iVersionMajor != 5)
+    THROW_SIMPLE_(L"Only version 2.0, 4.0 or 5.0 SGA archives can be written, not version %u.0", static_cast<unsigned int>(iVersionMajor));
+  m_iVersionMajor = iVersionMajor;
+}
+
+void SgaArchiveWriter::setArchiveName(const RainString& sName) throw()
+{
+  m_sArchiveName = sName;
+}
+
+void SgaArchiveWriter::setCompressionLevel(int iLevel) throw()
+{
+  if(iLevel < Z_BEST_SPEED)
+    iLevel = Z_BEST_SPEED;
+  if(iLevel > Z_BEST_COMPRESSION)
+    iLevel = Z_BEST_COMPRESSION;
+  m_iCompressionLevel = iLevel;
+}
+
+void SgaArchiveWriter::setThreadCount(unsigned long iThreadCount) throw()
+{
+  m_iThreadCount = iThreadCount;
+}
+
+//! A directory item, along with its name for sorting by
+struct SgaWriterItem
+{
+  RainString sName;
+  auto_directory_item oItem;
+};
+
+static bool SgaWriterItemOrder(const SgaWriterItem& a, const SgaWriterItem& b)
+{
+  // SgaArchive looks up names with a caseless binary search
+  return a.sName.compareCaseless(b.sName) < 0;
+}
+
+void SgaArchiveWriter::addEntryPoint(const RainString& sName, const RainString& sAlias, IFileStore* pSource, const RainString& sSourcePath) throw(...)
+{
+  _addEntryPoint(sName, sAlias, pSource, 0, sSourcePath);
+}
+
+void SgaArchiveWriter::addEntryPoint(const RainString& sName, const RainString& sAlias, IArchiveFileStore* pSource, const RainString& sSourcePath) throw(...)
+{
+  _addEntryPoint(sName, sAlias, pSource, pSource, sSourcePath);
+}
+
+void SgaArchiveWriter::_addEntryPoint(const RainString& sName, const RainString& sAlias, IFileStore* pSource, IArchiveFileStore* pRawSource, const RainString& sSourcePath) throw(...)
+{
+  if(m_vEntryPoints.size() >= 0xFFFF)
+    THROW_SIMPLE(L"Too many entry points");
+  file_store_caps_t oCaps;
+  pSource->getCaps(oCaps);
+
+  _directory_t oEntryPoint;
+  oEntryPoint.sName = sName;
+  oEntryPoint.sAlias = sAlias;
+  size_t iFirstDirectory = m_vDirectories.size();
+  size_t iFirstFile = m_vFiles.size();
+
+  // Directories are numbered in the order in which they are visited by a breadth first search, so
+  // that the children of each directory form a contiguous range, as the archive format requires.
+  std::queue<std::pair<IDirectory*, size_t> > qTodo;
+  try
+  {
+    _directory_t oRoot;
+    m_vDirectories.push_back(oRoot);
+    qTodo.push(std::make_pair(pSource->openDirectory(sSourcePath), iFirstDirectory));
+    size_t iSkipLength = qTodo.front().first->getPath().length();
+    std::vector<SgaWriterItem> vDirectories, vFiles;
+    while(!qTodo.empty())
+    {
+      IDirectory *pDirectory = qTodo.front().first;
+      size_t iDirectory = qTodo.front().second;
+      const RainString& sDirectoryPath = pDirectory->getPath();
+      RainString sRelativePath = sDirectoryPath.mid(iSkipLength, sDirectoryPath.length() - iSkipLength);
+
+      vDirectories.clear();
+      vFiles.clear();
+      for(IDirectory::iterator itr = pDirectory->begin(), itrEnd = pDirectory->end(); itr != itrEnd; ++itr)
+      {
+        SgaWriterItem oItem;
+        oItem.sName = itr->name();
+        oItem.oItem = *itr;
+        (itr->isDirectory() ? vDirectories : vFiles).push_back(oItem);
+      }
+      std::sort(vDirectories.begin(), vDirectories.end(), SgaWriterItemOrder);
+      std::sort(vFiles.begin(), vFiles.end(), SgaWriterItemOrder);
+
+      m_vDirectories[iDirectory].iFirstDirectory = static_cast<unsigned short>(m_vDirectories.size());
+      for(std::vector<SgaWriterItem>::iterator itr = vDirectories.begin(); itr != vDirectories.end(); ++itr)
+      {
+        _directory_t oChild;
+        oChild.sName = sRelativePath + itr->sName;
+        m_vDirectories.push_back(oChild);
+        qTodo.push(std::make_pair(static_cast<IDirectory*>(0), m_vDirectories.size() - 1));
+        qTodo.back().first = itr->oItem.open();
+      }
+      m_vDirectories[iDirectory].iLastDirectory = static_cast<unsigned short>(m_vDirectories.size());
+
+      m_vDirectories[iDirectory].iFirstFile = static_cast<unsigned short>(m_vFiles.size());
+      for(std::vector<SgaWriterItem>::iterator itr = vFiles.begin(); itr != vFiles.end(); ++itr)
+      {
+        _file_t oFile;
+        oFile.sName = itr->sName;
+        oFile.sSource = sDirectoryPath + itr->sName;
+        oFile.pSource = pSource;
+        oFile.pRawSource = pRawSource;
+        oFile.bSerialRead = !oCaps.bCanReadConcurrently;
+        oFile.iModificationTime = static_cast<unsigned long>(itr->oItem.timestamp());
+        oFile.iDataOffset = 0;
+        oFile.iDataLengthCompressed = 0;
+        oFile.iDataLength = itr->oItem.size().iLower;
+        m_vFiles.push_back(oFile);
+      }
+      m_vDirectories[iDirectory].iLastFile = static_cast<unsigned short>(m_vFiles.size());
+
+      if(m_vDirectories.size() > 0xFFFF || m_vFiles.size() > 0xFFFF)
+        THROW_SIMPLE(L"SGA archives cannot contain more than 65535 directories or 65535 files");
+
+      delete pDirectory;
+      qTodo.pop();
+    }
+  }
+  catch(RainException *pE)
+  {
+    while(!qTodo.empty())
+    {
+      delete qTodo.front().first;
+      qTodo.pop();
+    }
+    m_vDirectories.resize(iFirstDirectory);
+    m_vFiles.resize(iFirstFile);
+    RETHROW_SIMPLE_(pE, L"Cannot add \'%s\' as entry point \'%s\'", sSourcePath.getCharacters(), sName.getCharacters());
+  }
+
+  oEntryPoint.iFirstDirectory = static_cast<unsigned short>(iFirstDirectory);
+  oEntryPoint.iLastDirectory = static_cast<unsigned short>(m_vDirectories.size());
+  oEntryPoint.iFirstFile = static_cast<unsigned short>(iFirstFile);
+  oEntryPoint.iLastFile = static_cast<unsigned short>(m_vFiles.size());
+  m_vEntryPoints.push_back(oEntryPoint);
+}
+
+//! Convert a character to the (narrow) form stored in SGA archives, throwing if it has no such form
+static char NarrowCharacter(const RainString& sString, RainChar c) throw(...)
+{
+  if(c & ~0xFF)
+    THROW_SIMPLE_(L"\'%s\' cannot be stored in an SGA archive, as it has characters outside of Latin-1", sString.getCharacters());
+  return static_cast<char>(c);
+}
+
+//! Write a string as a fixed length field of (narrow) characters, padded with zeros
+static void WriteFixedString(IFile* pFile, const RainString& sString, size_t iFieldLength) throw(...)
+{
+  char sBuffer[64] = {0};
+  if(iFieldLength > sizeof(sBuffer))
+    THROW_SIMPLE_(L"Fixed length fields of %lu characters are not supported", static_cast<unsigned long>(iFieldLength));
+  // The field always ends with at least one zero
+  if(sString.length() >= iFieldLength)
+    THROW_SIMPLE_(L"\'%s\' is longer than the %lu characters which SGA archives can store", sString.getCharacters(), static_cast<unsigned long>(iFieldLength - 1));
+  for(size_t i = 0; i < sString.length(); ++i)
+    sBuffer[i] = NarrowCharacter(sString, sString.getCharacters()[i]);
+  pFile->writeArray(sBuffer, iFieldLength);
+}
+
+//! Append a string to a string blob as (narrow) characters, and return its offset
+static unsigned long AppendString(std::vector<char>& vBlob, const RainString& sString) throw(...)
+{
+  unsigned long iOffset = static_cast<unsigned long>(vBlob.size());
+  for(size_t i = 0; i < sString.length(); ++i)
+    vBlob.push_back(NarrowCharacter(sString, sString.getCharacters()[i]));
+  vBlob.push_back(0);
+  return iOffset;
+}
+
+void SgaArchiveWriter::_writeTableOfContents(IFile* pToc) throw(...)
+{
+  const unsigned long iDataHeaderOverviewSize = 24;
+  unsigned long iEntryPointSize = m_iVersionMajor == 5 ? 138 : 140;
+  unsigned long iFileSize = m_iVersionMajor == 2 ? 20 : 22;
+
+  unsigned long iEntryPointOffset = iDataHeaderOverviewSize;
+  unsigned long iDirectoryOffset = iEntryPointOffset + iEntryPointSize * static_cast<unsigned long>(m_vEntryPoints.size());
+  unsigned long iFileOffset = iDirectoryOffset + 12 * static_cast<unsigned long>(m_vDirectories.size());
+  unsigned long iStringOffset = iFileOffset + iFileSize * static_cast<unsigned long>(m_vFiles.size());
+
+  pToc->writeOne(iEntryPointOffset);
+  pToc->writeOne(static_cast<unsigned short>(m_vEntryPoints.size()));
+  pToc->writeOne(iDirectoryOffset);
+  pToc->writeOne(static_cast<unsigned short>(m_vDirectories.size()));
+  pToc->writeOne(iFileOffset);
+  pToc->writeOne(static_cast<unsigned short>(m_vFiles.size()));
+  pToc->writeOne(iStringOffset);
+  pToc->writeOne(static_cast<unsigned short>(m_vDirectories.size() + m_vFiles.size()));
+
+  for(std::vector<_directory_t>::const_iterator itr = m_vEntryPoints.begin(); itr != m_vEntryPoints.end(); ++itr)
+  {
+    WriteFixedString(pToc, itr->sName, 64);
+    WriteFixedString(pToc, itr->sAlias, 64);
+    pToc->writeOne(itr->iFirstDirectory);
+    pToc->writeOne(itr->iLastDirectory);
+    pToc->writeOne(itr->iFirstFile);
+    pToc->writeOne(itr->iLastFile);
+    if(m_iVersionMajor == 5)
+      pToc->writeOne(itr->iFirstDirectory);
+    else
+      pToc->writeOne(static_cast<unsigned long>(itr->iFirstDirectory));
+  }
+
+  std::vector<char> vStrings;
+  for(std::vector<_directory_t>::const_iterator itr = m_vDirectories.begin(); itr != m_vDirectories.end(); ++itr)
+  {
+    pToc->writeOne(AppendString(vStrings, itr->sName));
+    pToc->writeOne(itr->iFirstDirectory);
+    pToc->writeOne(itr->iLastDirectory);
+    pToc->writeOne(itr->iFirstFile);
+    pToc->writeOne(itr->iLastFile);
+  }
+
+  for(std::vector<_file_t>::const_iterator itr = m_vFiles.begin(); itr != m_vFiles.end(); ++itr)
+  {
+    // Compression flags as used by the games: 0x00 = stored, 0x10 = zlib (small file), 0x20 = zlib (large file)
+    unsigned long iFlags = 0;
+    if(itr->iDataLengthCompressed != itr->iDataLength)
+      iFlags = itr->iDataLength < 4096 ? 0x10 : 0x20;
+
+    pToc->writeOne(AppendString(vStrings, itr->sName));
+    if(m_iVersionMajor == 2)
+      pToc->writeOne(iFlags);
+    pToc->writeOne(itr->iDataOffset);
+    pToc->writeOne(itr->iDataLengthCompressed);
+    pToc->writeOne(itr->iDataLength);
+    if(m_iVersionMajor != 2)
+    {
+      pToc->writeOne(itr->iModificationTime);
+      pToc->writeOne(static_cast<unsigned short>(iFlags));
+    }
+  }
+
+  if(!vStrings.empty())
+    pToc->writeArray(&vStrings[0], vStrings.size());
+}
+
+void SgaArchiveWriter::compressFile(size_t iIndex, RainCompressedFile& oResult) throw(...)
+{
+  const _file_t& oFile = m_vFiles[m_vToWrite[iIndex]];
+  oResult.pData = 0;
+  if(oFile.pRawSource && _copyRaw(oFile, oResult))
+    return;
+
+  MemoryWriteFile oRaw(oFile.iDataLength ? oFile.iDataLength : 1);
+  try
+  {
+    if(oFile.bSerialRead)
+    {
+      RainMutexLock oLock(m_oSerialReadMutex);
+      oFile.pSource->pumpFile(oFile.sSource, &oRaw);
+    }
+    else
+      oFile.pSource->pumpFile(oFile.sSource, &oRaw);
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot read \'%s\'", oFile.sSource.getCharacters());
+  if(oRaw.getLengthUsed() > 0xFFFFFFFFUL)
+    THROW_SIMPLE_(L"\'%s\' is too large to be stored in an SGA archive", oFile.sSource.getCharacters());
+  oResult.iLength = static_cast<unsigned long>(oRaw.getLengthUsed());
+
+  MD5Hash oHash;
+  oHash.update(oRaw.getBuffer(), oRaw.getLengthUsed());
+  oHash.finalise(oResult.aMD5);
+
+  if(oResult.iLength == 0)
+  {
+    oResult.iDataLength = 0;
+    return;
+  }
+
+  uLongf iCompressedLength = compressBound(oResult.iLength);
+  CHECK_ALLOCATION(oResult.pData = new (std::nothrow) char[iCompressedLength]);
+  if(compress2(reinterpret_cast<Bytef*>(oResult.pData), &iCompressedLength, reinterpret_cast<const Bytef*>(oRaw.getBuffer()), oResult.iLength, m_iCompressionLevel) == Z_OK
+    && iCompressedLength < oResult.iLength)
+  {
+    oResult.iDataLength = static_cast<unsigned long>(iCompressedLength);
+  }
+  else
+  {
+    // Store the file as-is, which SgaArchive recognises by the compressed and uncompressed lengths being equal
+    memcpy(oResult.pData, oRaw.getBuffer(), oResult.iLength);
+    oResult.iDataLength = oResult.iLength;
+  }
+}
+
+bool SgaArchiveWriter::_copyRaw(const _file_t& oFile, RainCompressedFile& oResult) throw(...)
+{
+  archive_raw_details_t oDetails;
+  MemoryWriteFile oRaw(oFile.iDataLength ? oFile.iDataLength : 1);
+  try
+  {
+    if(oFile.bSerialRead)
+    {
+      RainMutexLock oLock(m_oSerialReadMutex);
+      oFile.pRawSource->pumpRaw(oFile.sSource, &oRaw, oDetails);
+    }
+    else
+      oFile.pRawSource->pumpRaw(oFile.sSource, &oRaw, oDetails);
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot read '%s'", oFile.sSource.getCharacters());
+
+  // SGA archives treat a file as stored as-is precisely when its raw and uncompressed lengths are
+  // equal, so a zLib stream which is no smaller than the file has to be decompressed after all
+  if(oDetails.bCompressed && oDetails.iLengthCompressed >= oDetails.iLength)
+    return false;
+  if(oRaw.getLengthUsed() != oDetails.iLengthCompressed)
+    THROW_SIMPLE_(L"Raw data of '%s' is the wrong length", oFile.sSource.getCharacters());
+
+  oResult.iLength = oDetails.iLength;
+  oResult.iDataLength = oDetails.iLengthCompressed;
+
+  // Duplicates are detected by the hash of the uncompressed contents, as for files which compressFile()
+  // handles, so a zLib stream has to be inflated to be hashed (which also checks that it is valid)
+  MD5Hash oHash;
+  if(oDetails.bCompressed)
+  {
+    char* pContents = 0;
+    try
+    {
+      CHECK_ALLOCATION(pContents = new (std::nothrow) char[oDetails.iLength ? oDetails.iLength : 1]);
+      RainInflateInto(oRaw.getBuffer(), oRaw.getLengthUsed(), pContents, oDetails.iLength);
+    }
+    CATCH_THROW_SIMPLE_(delete[] pContents, L"Cannot decompress raw data of '%s'", oFile.sSource.getCharacters());
+    oHash.update(pContents, oDetails.iLength);
+    delete[] pContents;
+  }
+  else
+    oHash.update(oRaw.getBuffer(), oRaw.getLengthUsed());
+  oHash.finalise(oResult.aMD5);
+  if(oResult.iDataLength != 0)
+  {
+    CHECK_ALLOCATION(oResult.pData = new (std::nothrow) char[oResult.iDataLength]);
+    memcpy(oResult.pData, oRaw.getBuffer(), oResult.iDataLength);
+  }
+  return true;
+}
+
+void SgaArchiveWriter::writeFile(IFile* pOutput, RainCompressedFile& oItem) throw(...)
+{
+  _file_t& oFile = m_vFiles[m_vToWrite[oItem.iIndex]];
+  oFile.iDataLength = oItem.iLength;
+  m_iBytesIn += oItem.iLength;
+
+  _content_key_t oKey;
+  memcpy(oKey.aMD5, oItem.aMD5, 16);
+  oKey.iLength = oItem.iLength;
+  std::map<_content_key_t, size_t>::iterator itrOriginal = m_mapContents.find(oKey);
+  if(itrOriginal != m_mapContents.end())
+  {
+    const _file_t& oOriginal = m_vFiles[itrOriginal->second];
+    oFile.iDataOffset = oOriginal.iDataOffset;
+    oFile.iDataLengthCompressed = oOriginal.iDataLengthCompressed;
+    ++m_iDuplicateCount;
+    return;
+  }
+
+  if(oItem.iDataLength > 0xFFFFFFFFUL - m_iDataStart - m_iDataLength)
+    THROW_SIMPLE(L"SGA archives cannot be larger than 4GB");
+  try
+  {
+    pOutput->write(oItem.pData, 1, oItem.iDataLength);
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot write data of \'%s\'", oFile.sSource.getCharacters());
+  oFile.iDataOffset = m_iDataLength;
+  oFile.iDataLengthCompressed = oItem.iDataLength;
+  m_iDataLength += oItem.iDataLength;
+  m_iBytesOut += oItem.iDataLength;
+  m_mapContents[oKey] = m_vToWrite[oItem.iIndex];
+}
+
+unsigned long SgaArchiveWriter::_getFileHeaderSize() const throw()
+{
+  unsigned long iFileHeaderSize = 180;
+  if(m_iVersionMajor >= 4)
+    iFileHeaderSize += 4;
+  if(m_iVersionMajor == 5)
+    iFileHeaderSize += 4;
+  return iFileHeaderSize;
+}
+
+unsigned long SgaArchiveWriter::_getTableOfContentsSize() throw(...)
+{
+  // The size of the table of contents does not depend upon the data offsets within it
+  MemoryWriteFile oDataHeader;
+  _writeTableOfContents(&oDataHeader);
+  return static_cast<unsigned long>(oDataHeader.getLengthUsed());
+}
+
+void SgaArchiveWriter::_writeHeaders(IFile* pOutput, unsigned long iDataHeaderOffset) throw(...)
+{
+  unsigned long iFileHeaderSize = _getFileHeaderSize();
+  MemoryWriteFile oDataHeader;
+  _writeTableOfContents(&oDataHeader);
+  unsigned long iDataHeaderSize = static_cast<unsigned long>(oDataHeader.getLengthUsed());
+  if(iDataHeaderSize > 0xFFFFFFFFUL - iDataHeaderOffset)
+    THROW_SIMPLE(L"SGA archives cannot be larger than 4GB");
+  pOutput->seek(iDataHeaderOffset, SR_Start);
+  pOutput->write(oDataHeader.getBuffer(), 1, iDataHeaderSize);
+
+  unsigned char aHeaderMD5[16];
+  MD5Hash oHeaderHash;
+  oHeaderHash.updateFromString("DFC9AF62-FC1B-4180-BC27-11CCE87D3EFF");
+  oHeaderHash.update(oDataHeader.getBuffer(), iDataHeaderSize);
+  oHeaderHash.finalise(aHeaderMD5);
+
+  // The contents hash covers everything after the file header, which ends with either the file
+  // data or the table of contents
+  unsigned char aContentsMD5[16];
+  {
+    MD5Hash oContentsHash;
+    oContentsHash.updateFromString("E01519D6-2DB7-4640-AF54-0A23319C56C3");
+    pOutput->seek(iFileHeaderSize, SR_Start);
+    unsigned long iEnd = m_iDataStart + m_iDataLength;
+    if(iDataHeaderOffset + iDataHeaderSize > iEnd)
+      iEnd = iDataHeaderOffset + iDataHeaderSize;
+    unsigned long iRemaining = iEnd - iFileHeaderSize;
+    const unsigned long iBufferSize = 0x10000;
+    std::vector<char> vBuffer(iBufferSize);
+    while(iRemaining != 0)
+    {
+      unsigned long iAmount = iRemaining < iBufferSize ? iRemaining : iBufferSize;
+      pOutput->read(&vBuffer[0], 1, iAmount);
+      oContentsHash.update(&vBuffer[0], iAmount);
+      iRemaining -= iAmount;
+    }
+    oContentsHash.finalise(aContentsMD5);
+  }
+
+  pOutput->seek(0, SR_Start);
+  pOutput->writeArray("_ARCHIVE", 8);
+  pOutput->writeOne(m_iVersionMajor);
+  pOutput->writeOne(static_cast<unsigned short>(0));
+  pOutput->writeArray(aContentsMD5, 16);
+  unsigned short sArchiveName[64] = {0};
+  for(size_t i = 0; i < m_sArchiveName.length() && i < 63; ++i)
+    sArchiveName[i] = static_cast<unsigned short>(m_sArchiveName.getCharacters()[i]);
+  pOutput->writeArray(sArchiveName, 64);
+  pOutput->writeArray(aHeaderMD5, 16);
+  pOutput->writeOne(iDataHeaderSize);
+  pOutput->writeOne(m_iDataStart);
+  if(m_iVersionMajor == 5)
+    pOutput->writeOne(iDataHeaderOffset);
+  if(m_iVersionMajor >= 4)
+    pOutput->writeOne(static_cast<unsigned long>(1)); // Platform #1 (win32/x86)
+  pOutput->seek(0, SR_End);
+}
+
+void SgaArchiveWriter::writeToFile(IFile* pOutput) throw(...)
+{
+  if(m_vEntryPoints.empty())
+    THROW_SIMPLE(L"Cannot write an SGA archive without any entry points");
+
+  m_mapContents.clear();
+  m_iBytesIn = 0;
+  m_iBytesOut = 0;
+  m_iDataLength = 0;
+  m_iDuplicateCount = 0;
+  m_iReusedCount = 0;
+  m_vToWrite.resize(m_vFiles.size());
+  for(size_t i = 0; i < m_vFiles.size(); ++i)
+    m_vToWrite[i] = i;
+
+  try
+  {
+    // Version 2.0 and 4.0 archives are laid out as [file header][data header][file data], and version
+    // 5.0 archives as [file header][file data][data header]. The data header is not known until every
+    // file has been compressed, so a placeholder is written in its place, and then overwritten later.
+    unsigned long iFileHeaderSize = _getFileHeaderSize();
+    m_iDataStart = iFileHeaderSize;
+    if(m_iVersionMajor != 5)
+      m_iDataStart += _getTableOfContentsSize();
+    {
+      std::vector<char> vZeros(m_iDataStart, 0);
+      pOutput->writeArray(&vZeros[0], m_iDataStart);
+    }
+
+    RainCompressAndWrite(this, pOutput, m_vToWrite.size(), m_iThreadCount ? m_iThreadCount : RainGetProcessorCount());
+
+    _writeHeaders(pOutput, m_iVersionMajor == 5 ? m_iDataStart + m_iDataLength : iFileHeaderSize);
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot write version %u.0 SGA archive", static_cast<unsigned int>(m_iVersionMajor));
+}
+
+//! Copy a range of bytes from one position in a file to a position in another (or the same) file
+static void CopyRawData(IFile* pSource, seek_offset_t iSourcePosition, IFile* pDestination, seek_offset_t iDestinationPosition, unsigned long iLength, std::vector<char>& vBuffer) throw(...)
+{
+  while(iLength != 0)
+  {
+    unsigned long iAmount = iLength < vBuffer.size() ? iLength : static_cast<unsigned long>(vBuffer.size());
+    pSource->seek(iSourcePosition, SR_Start);
+    pSource->read(&vBuffer[0], 1, iAmount);
+    pDestination->seek(iDestinationPosition, SR_Start);
+    pDestination->write(&vBuffer[0], 1, iAmount);
+    iSourcePosition += iAmount;
+    iDestinationPosition += iAmount;
+    iLength -= iAmount;
+  }
+}
+
+void SgaArchiveWriter::_adoptHeader(SgaArchive& oArchive) throw(...)
+{
+  const SgaArchive::_file_header_raw_t& oHeader = oArchive.m_oFileHeader;
+  if(oHeader.iVersionMajor == 4 && oHeader.iVersionMinor != 0)
+    THROW_SIMPLE_(L"Version %u.%u SGA archives cannot be rewritten", static_cast<unsigned int>(oHeader.iVersionMajor), static_cast<unsigned int>(oHeader.iVersionMinor));
+  m_iVersionMajor = oHeader.iVersionMajor;
+  if(m_sArchiveName.isEmpty())
+  {
+    size_t iLength = 0;
+    while(iLength < 64 && oHeader.sArchiveName[iLength] != 0)
+      ++iLength;
+    m_sArchiveName = RainString(oHeader.sArchiveName, iLength);
+  }
+}
+
+void SgaArchiveWriter::_loadTableOfContents(SgaArchive& oArchive) throw(...)
+{
+  const SgaArchive::_file_header_raw_t& oHeader = oArchive.m_oFileHeader;
+  m_vEntryPoints.clear();
+  m_vDirectories.clear();
+  m_vFiles.clear();
+  oArchive._loadEverything();
+
+  // The alias of each entry point is not kept by SgaArchive, so is taken from the raw records
+  size_t iEntryPointSize = m_iVersionMajor == 5 ? 138 : 140;
+  std::vector<unsigned char> vBuffer;
+  const unsigned char* pRaw = oHeader.iEntryPointCount == 0 ? 0 : oArchive._readTableOfContents(oHeader.iEntryPointOffset, 0, oHeader.iEntryPointCount, iEntryPointSize, vBuffer);
+  for(unsigned short i = 0; i < oHeader.iEntryPointCount; ++i, pRaw += iEntryPointSize)
+  {
+    const SgaArchive::_entry_point_info_t& oInfo = oArchive.m_pEntryPoints[i];
+    const char* sAlias = reinterpret_cast<const char*>(pRaw + 64);
+    const char* sAliasEnd = reinterpret_cast<const char*>(memchr(sAlias, 0, 64));
+    _directory_t oEntryPoint;
+    oEntryPoint.sName = oInfo.sName;
+    oEntryPoint.sAlias = RainString(sAlias, sAliasEnd ? sAliasEnd - sAlias : 64);
+    oEntryPoint.iFirstDirectory = oInfo.iFirstDirectory;
+    oEntryPoint.iLastDirectory = oInfo.iLastDirectory;
+    oEntryPoint.iFirstFile = oInfo.iFirstFile;
+    oEntryPoint.iLastFile = oInfo.iLastFile;
+    m_vEntryPoints.push_back(oEntryPoint);
+  }
+
+  m_vFiles.resize(oHeader.iFileCount);
+  for(unsigned short i = 0; i < oHeader.iDirectoryCount; ++i)
+  {
+    const SgaArchive::_directory_info_t& oInfo = oArchive.m_pDirectories[i];
+    _directory_t oDirectory;
+    oDirectory.sName = RainString(oArchive.m_sStringBlob + oInfo.iPath);
+    oDirectory.iFirstDirectory = oInfo.iFirstDirectory;
+    oDirectory.iLastDirectory = oInfo.iLastDirectory;
+    oDirectory.iFirstFile = oInfo.iFirstFile;
+    oDirectory.iLastFile = oInfo.iLastFile;
+    m_vDirectories.push_back(oDirectory);
+
+    RainString sPath = oArchive._getDirectoryPath(&oInfo);
+    for(unsigned short iFile = oInfo.iFirstFile; iFile < oInfo.iLastFile && iFile < oHeader.iFileCount; ++iFile)
+    {
+      const SgaArchive::_file_info_t& oFileInfo = oArchive.m_pFiles[iFile];
+      _file_t& oFile = m_vFiles[iFile];
+      oFile.sName = RainString(oArchive.m_sStringBlob + oFileInfo.iName);
+      oFile.sSource = sPath + oFile.sName;
+      oFile.pSource = 0;
+      oFile.pRawSource = 0;
+      oFile.bSerialRead = false;
+      oFile.iModificationTime = oFileInfo.iModificationTime;
+      oFile.iDataOffset = oFileInfo.iDataOffset;
+      oFile.iDataLengthCompressed = oFileInfo.iDataLengthCompressed;
+      oFile.iDataLength = oFileInfo.iDataLength;
+    }
+  }
+}
+
+void SgaArchiveWriter::_reuseUnchangedFiles(SgaArchive& oArchive) throw(...)
+{
+  for(std::vector<_directory_t>::const_iterator itrEntryPoint = m_vEntryPoints.begin(); itrEntryPoint != m_vEntryPoints.end(); ++itrEntryPoint)
+  {
+    for(size_t iDirectory = itrEntryPoint->iFirstDirectory; iDirectory < itrEntryPoint->iLastDirectory; ++iDirectory)
+    {
+      const _directory_t& oDirectory = m_vDirectories[iDirectory];
+      RainString sPath = itrEntryPoint->sName + L"\\";
+      if(!oDirectory.sName.isEmpty())
+        sPath += oDirectory.sName + L"\\";
+      for(size_t iFile = oDirectory.iFirstFile; iFile < oDirectory.iLastFile; ++iFile)
+      {
+        _file_t& oFile = m_vFiles[iFile];
+        SgaArchive::_directory_info_t *pExistingDirectory;
+        SgaArchive::_file_info_t *pExisting;
+        if(!oArchive._resolvePath(sPath + oFile.sName, &pExistingDirectory, &pExisting, false) || pExisting == 0
+          || pExisting->iDataLength != oFile.iDataLength)
+        {
+          m_vToWrite.push_back(iFile);
+          continue;
+        }
+
+        // The sizes match, so the contents have to be compared. This is far quicker than compressing
+        // the file again, and it means that timestamps can be ignored, as they are not always reliable.
+        MemoryWriteFile oRaw(oFile.iDataLength ? oFile.iDataLength : 1);
+        try
+        {
+          oFile.pSource->pumpFile(oFile.sSource, &oRaw);
+        }
+        CATCH_THROW_SIMPLE_({}, L"Cannot read \'%s\'", oFile.sSource.getCharacters());
+        if(oRaw.getLengthUsed() != pExisting->iDataLength)
+        {
+          m_vToWrite.push_back(iFile);
+          continue;
+        }
+        if(pExisting->iDataLength != 0)
+        {
+          std::vector<char> vExisting(pExisting->iDataLength);
+          oArchive._readFileInto(pExisting, &vExisting[0]);
+          if(memcmp(&vExisting[0], oRaw.getBuffer(), pExisting->iDataLength) != 0)
+          {
+            m_vToWrite.push_back(iFile);
+            continue;
+          }
+        }
+
+        oFile.iDataOffset = pExisting->iDataOffset;
+        oFile.iDataLengthCompressed = pExisting->iDataLengthCompressed;
+        m_iBytesIn += pExisting->iDataLength;
+        ++m_iReusedCount;
+
+        // New files whose contents are identical can then share the existing data
+        _content_key_t oKey;
+        MD5Hash oHash;
+        oHash.update(oRaw.getBuffer(), oRaw.getLengthUsed());
+        oHash.finalise(oKey.aMD5);
+        oKey.iLength = pExisting->iDataLength;
+        m_mapContents[oKey] = iFile;
+      }
+    }
+  }
+}
+
+void SgaArchiveWriter::_relocateData(IFile* pArchive, unsigned long iEnd) throw(...)
+{
+  // Files which share data are moved together, so that they continue to share it
+  std::map<std::pair<unsigned long, unsigned long>, unsigned long> mapMoved;
+  std::vector<char> vBuffer(0x10000);
+  for(size_t i = 0; i < m_vFiles.size(); ++i)
+  {
+    _file_t& oFile = m_vFiles[i];
+    if(oFile.iDataLengthCompressed == 0 || oFile.iDataOffset >= iEnd)
+      continue;
+    std::pair<unsigned long, unsigned long> oKey(oFile.iDataOffset, oFile.iDataLengthCompressed);
+    std::map<std::pair<unsigned long, unsigned long>, unsigned long>::iterator itrMoved = mapMoved.find(oKey);
+    if(itrMoved != mapMoved.end())
+    {
+      oFile.iDataOffset = itrMoved->second;
+      continue;
+    }
+    if(oFile.iDataLengthCompressed > 0xFFFFFFFFUL - m_iDataStart - m_iDataLength)
+      THROW_SIMPLE(L"SGA archives cannot be larger than 4GB");
+    try
+    {
+      CopyRawData(pArchive, m_iDataStart + oFile.iDataOffset, pArchive, m_iDataStart + m_iDataLength, oFile.iDataLengthCompressed, vBuffer);
+    }
+    CATCH_THROW_SIMPLE_({}, L"Cannot move data of \'%s\'", oFile.sSource.getCharacters());
+    mapMoved[oKey] = m_iDataLength;
+    oFile.iDataOffset = m_iDataLength;
+    m_iDataLength += oFile.iDataLengthCompressed;
+    m_iBytesOut += oFile.iDataLengthCompressed;
+  }
+}
+
+void SgaArchiveWriter::updateFile(IFile* pArchive) throw(...)
+{
+  if(m_vEntryPoints.empty())
+    THROW_SIMPLE(L"Cannot update an SGA archive without any entry points");
+
+  m_mapContents.clear();
+  m_vToWrite.clear();
+  m_iBytesIn = 0;
+  m_iBytesOut = 0;
+  m_iDuplicateCount = 0;
+  m_iReusedCount = 0;
+
+  try
+  {
+    // The existing archive is only read from whilst it is loaded, and must be unloaded before
+    // anything is written, as it does not expect the file to change beneath it
+    {
+      SgaArchive oArchive;
+      oArchive.init(pArchive, false);
+      _adoptHeader(oArchive);
+      m_iDataStart = oArchive.m_oFileHeader.iDataOffset;
+      _reuseUnchangedFiles(oArchive);
+    }
+
+    unsigned long iFileHeaderSize = _getFileHeaderSize();
+    unsigned long iDataHeaderSize = _getTableOfContentsSize();
+    pArchive->seek(0, SR_End);
+    seek_offset_t iEndOfFile = pArchive->tell();
+    if(m_iVersionMajor != 5 && iFileHeaderSize + iDataHeaderSize > static_cast<unsigned long>(iEndOfFile))
+      iEndOfFile = iFileHeaderSize + iDataHeaderSize;
+    if(static_cast<unsigned long>(iEndOfFile) < m_iDataStart)
+      THROW_SIMPLE(L"Archive is shorter than its header claims");
+    m_iDataLength = static_cast<unsigned long>(iEndOfFile) - m_iDataStart;
+
+    // Version 2.0 and 4.0 archives have the table of contents immediately after the file header,
+    // and if it has grown, then it may now overlap the start of the file data
+    if(m_iVersionMajor != 5 && iFileHeaderSize + iDataHeaderSize > m_iDataStart)
+      _relocateData(pArchive, iFileHeaderSize + iDataHeaderSize - m_iDataStart);
+
+    pArchive->seek(m_iDataStart + m_iDataLength, SR_Start);
+    RainCompressAndWrite(this, pArchive, m_vToWrite.size(), m_iThreadCount ? m_iThreadCount : RainGetProcessorCount());
+
+    // Nothing which the existing table of contents refers to has been overwritten yet, so until this
+    // point the archive remains valid. Version 5.0 archives stay valid until the header is rewritten,
+    // but for other versions, the table of contents itself has to be overwritten in place.
+    _writeHeaders(pArchive, m_iVersionMajor == 5 ? m_iDataStart + m_iDataLength : iFileHeaderSize);
+  }
+  CATCH_THROW_SIMPLE(m_vToWrite.clear(), L"Cannot update SGA archive");
+}
+
+void SgaArchiveWriter::compact(IFile* pArchive, IFile* pOutput) throw(...)
+{
+  m_mapContents.clear();
+  m_vToWrite.clear();
+  m_iBytesIn = 0;
+  m_iBytesOut = 0;
+  m_iDataLength = 0;
+  m_iDuplicateCount = 0;
+  m_iReusedCount = 0;
+
+  try
+  {
+    SgaArchive oArchive;
+    oArchive.init(pArchive, false);
+    _adoptHeader(oArchive);
+    _loadTableOfContents(oArchive);
+    unsigned long iOldDataStart = oArchive.m_oFileHeader.iDataOffset;
+
+    unsigned long iFileHeaderSize = _getFileHeaderSize();
+    m_iDataStart = iFileHeaderSize;
+    if(m_iVersionMajor != 5)
+      m_iDataStart += _getTableOfContentsSize();
+    {
+      std::vector<char> vZeros(m_iDataStart, 0);
+      pOutput->writeArray(&vZeros[0], m_iDataStart);
+    }
+
+    // Data is keyed by both offset and length, in case some other tool has made files share only
+    // part of their data
+    std::map<std::pair<unsigned long, unsigned long>, unsigned long> mapCopied;
+    std::vector<char> vBuffer(0x10000);
+    for(std::vector<_file_t>::iterator itr = m_vFiles.begin(); itr != m_vFiles.end(); ++itr)
+    {
+      m_iBytesIn += itr->iDataLength;
+      std::pair<unsigned long, unsigned long> oKey(itr->iDataOffset, itr->iDataLengthCompressed);
+      std::map<std::pair<unsigned long, unsigned long>, unsigned long>::iterator itrCopied = mapCopied.find(oKey);
+      if(itrCopied != mapCopied.end())
+      {
+        itr->iDataOffset = itrCopied->second;
+        ++m_iDuplicateCount;
+        continue;
+      }
+      if(itr->iDataLengthCompressed > 0xFFFFFFFFUL - m_iDataStart - m_iDataLength)
+        THROW_SIMPLE(L"SGA archives cannot be larger than 4GB");
+      try
+      {
+        CopyRawData(pArchive, iOldDataStart + itr->iDataOffset, pOutput, m_iDataStart + m_iDataLength, itr->iDataLengthCompressed, vBuffer);
+      }
+      CATCH_THROW_SIMPLE_({}, L"Cannot copy data of \'%s\'", itr->sSource.getCharacters());
+      itr->iDataOffset = m_iDataLength;
+      mapCopied[oKey] = m_iDataLength;
+      m_iDataLength += itr->iDataLengthCompressed;
+      m_iBytesOut += itr->iDataLengthCompressed;
+    }
+
+    _writeHeaders(pOutput, m_iVersionMajor == 5 ? m_iDataStart + m_iDataLength : iFileHeaderSize);
+  }
+  CATCH_THROW_SIMPLE({}, L"Cannot compact SGA archive");
+}
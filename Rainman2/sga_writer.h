@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#pragma once
+#include "file.h"
+#include "compress_pipeline.h"
+#include "exception.h"
+#include "threading.h"
+#include <map>
+#include <vector>
+
+class IArchiveFileStore;
+class SgaArchive;
+
+//! Creates SGA archives from the contents of other file stores
+/*!
+  Version 2.0, 4.0 and 5.0 archives can be created, and are laid out such that SgaArchive (and
+  the games) can read them. Each entry point of the archive is filled with the contents of a
+  directory from any IFileStore, which could be the file system, or another archive.
+
+  Files are compressed by a pool of worker threads, and then written to the archive in table of
+  contents order by the calling thread. Files whose contents are identical are only stored once,
+  with each of their table of contents entries pointing at the same data. Files which do not get
+  any smaller when compressed are stored uncompressed. When the contents of an entry point come from
+  another archive, files which are already compressed there are copied without being decompressed.
+
+  Example usage:
+    SgaArchiveWriter oWriter;
+    oWriter.setVersion(4);
+    oWriter.setArchiveName(L"My Mod");
+    oWriter.addEntryPoint(L"data", L"data", RainGetFileSystemStore(), L"C:\\MyMod\\data");
+    std::auto_ptr<IFile> pFile(RainOpenFile(L"C:\\MyMod\\MyMod.sga", FM_Write));
+    oWriter.writeToFile(pFile.get());
+
+  An existing archive can instead be brought up to date with updateFile(), which only compresses
+  and appends the files that have changed, and leaves everything else where it is. The dead space
+  which this leaves behind can later be reclaimed with compact().
+*/
+class RAINMAN2_API SgaArchiveWriter : protected ICompressedFileSink
+{
+public:
+  SgaArchiveWriter() throw();
+  ~SgaArchiveWriter() throw();
+
+  //! Set the major version of archive to create (2, 4 or 5; the default is 2)
+  void setVersion(unsigned short iVersionMajor) throw(...);
+
+  //! Set the name stored in the archive header (at most 63 characters are stored)
+  void setArchiveName(const RainString& sName) throw();
+
+  //! Set the zlib compression level, from 1 (fastest) to 9 (smallest); the default is 9
+  void setCompressionLevel(int iLevel) throw();
+
+  //! Set the number of threads used to compress files
+  /*!
+    \param iThreadCount Number of threads, or 0 for one thread per processor (the default)
+  */
+  void setThreadCount(unsigned long iThreadCount) throw();
+
+  //! Add an entry point to the archive, filled with the contents of a directory
+  /*!
+    The directory tree is enumerated immediately, but files are not read until writeToFile().
+    \param sName The name of the entry point, as used in paths (for example "data")
+    \param sAlias The alias of the entry point (games typically use the same value as sName)
+    \param pSource The file store to take files from; must remain valid until writeToFile() returns
+    \param sSourcePath The directory whose contents become the contents of the entry point
+  */
+  void addEntryPoint(const RainString& sName, const RainString& sAlias, IFileStore* pSource, const RainString& sSourcePath) throw(...);
+
+  //! Add an entry point to the archive, filled with the contents of a directory within another archive
+  /*!
+    As for the other overload, except that files which are compressed within pSource have their
+    compressed data copied as-is (see IArchiveFileStore::pumpRaw()), rather than being decompressed
+    and compressed again. This makes repacking an archive about as quick as copying it. Copied files
+    keep the compression level that they were compressed with, and are only detected as duplicates
+    of other files copied in the same way.
+  */
+  void addEntryPoint(const RainString& sName, const RainString& sAlias, IArchiveFileStore* pSource, const RainString& sSourcePath) throw(...);
+
+  //! Write the archive
+  /*!
+    \param pOutput The file to write the archive to. It must be empty, and must support reading
+      back what was written (as files opened with FM_Write do), so that the contents hash can be
+      computed.
+  */
+  void writeToFile(IFile* pOutput) throw(...);
+
+  //! Update an existing archive in place, so that it holds the entry points which have been added
+  /*!
+    Files whose contents are the same as those of the file at the same path in the existing archive
+    keep their existing data. Only the data of new and changed files is compressed, and it is
+    appended to the end of the archive. A fresh table of contents is then written, and the header
+    is rewritten to refer to it. The data of files which have changed or been removed is left in
+    the archive as dead space, until compact() is used.
+
+    The version of the existing archive is kept, regardless of setVersion(). In version 5.0
+    archives, the new table of contents is appended after the new data, and the old one is left as
+    dead space. In version 2.0 and 4.0 archives, the table of contents must immediately follow the
+    file header, so it is rewritten in place, and if it has grown, the data of any files which it
+    would overwrite is first moved to the end of the archive.
+
+    An update is not crash-safe. New data is appended first and the header is rewritten last, so
+    in version 5.0 archives, an interrupted update leaves the existing table of contents and header
+    intact (though IFile cannot flush to disk, so the operating system may reorder the writes). In
+    version 2.0 and 4.0 archives, an update interrupted whilst the table of contents is being
+    rewritten leaves the archive corrupt. Where that matters, use writeToFile() with a file opened
+    with FM_WriteAtomic rather than updating in place, and use compact() in the same way to remove
+    dead space.
+    \param pArchive The archive to update, opened for both reading and writing without being
+      truncated (as files opened with FM_Update are).
+  */
+  void updateFile(IFile* pArchive) throw(...);
+
+  //! Write a copy of an existing archive, without any dead space
+  /*!
+    The table of contents of the existing archive replaces any entry points which have been added,
+    and then the (still compressed) data of every file is copied in table of contents order. Data
+    which no file refers to, such as that left behind by updateFile(), is not copied.
+    \param pArchive The archive to copy
+    \param pOutput The file to write the copy to, with the same requirements as for writeToFile()
+  */
+  void compact(IFile* pArchive, IFile* pOutput) throw(...);
+
+  size_t getFileCount() const throw() {return m_vFiles.size();}
+  size_t getDirectoryCount() const throw() {return m_vDirectories.size();}
+
+  //! Get the total (uncompressed) size of every file written, including duplicates
+  unsigned long long getBytesIn() const throw() {return m_iBytesIn;}
+  //! Get the size of the file data written to the archive, excluding the headers
+  unsigned long long getBytesOut() const throw() {return m_iBytesOut;}
+  //! Get the number of files whose contents were a duplicate of an earlier file
+  size_t getDuplicateCount() const throw() {return m_iDuplicateCount;}
+  //! Get the number of files whose existing data was kept by updateFile()
+  size_t getReusedCount() const throw() {return m_iReusedCount;}
+
+  //! A directory or entry point in the table of contents; for internal use only
+  struct _directory_t
+  {
+    RainString sName;
+    RainString sAlias;
+    unsigned short iFirstDirectory;
+    unsigned short iLastDirectory;
+    unsigned short iFirstFile;
+    unsigned short iLastFile;
+  };
+
+  //! A file in the table of contents; for internal use only
+  struct _file_t
+  {
+    RainString sName;
+    RainString sSource;
+    IFileStore* pSource;
+    IArchiveFileStore* pRawSource; //!< Set if the raw data of the file can be copied from pSource
+    bool bSerialRead;  //!< true if pSource cannot be read from by multiple threads at once
+    unsigned long iModificationTime;
+    unsigned long iDataOffset;
+    unsigned long iDataLengthCompressed;
+    unsigned long iDataLength;
+  };
+
+  //! Identifies the contents of a file, for detecting duplicates; for internal use only
+  struct _content_key_t
+  {
+    unsigned char aMD5[16];
+    unsigned long iLength;
+
+    bool operator < (const _content_key_t& oOther) const throw();
+  };
+
+protected:
+  void _addEntryPoint(const RainString& sName, const RainString& sAlias, IFileStore* pSource, IArchiveFileStore* pRawSource, const RainString& sSourcePath) throw(...);
+  // ICompressedFileSink interface, used by writeToFile() and updateFile()
+  virtual void compressFile(size_t iIndex, RainCompressedFile& oResult) throw(...);
+  virtual void writeFile(IFile* pOutput, RainCompressedFile& oItem) throw(...);
+  //! Copy the raw data of a file from another archive, returning false if it has to be compressed instead
+  bool _copyRaw(const _file_t& oFile, RainCompressedFile& oResult) throw(...);
+  void _writeTableOfContents(IFile* pToc) throw(...);
+  //! Write the table of contents at iDataHeaderOffset, and then the file header, including both hashes
+  void _writeHeaders(IFile* pOutput, unsigned long iDataHeaderOffset) throw(...);
+  unsigned long _getFileHeaderSize() const throw();
+  unsigned long _getTableOfContentsSize() throw(...);
+  //! Take the version and (unless one has been set) the name of an existing archive
+  void _adoptHeader(SgaArchive& oArchive) throw(...);
+  //! Replace the entry points, directories and files with those of an existing archive
+  void _loadTableOfContents(SgaArchive& oArchive) throw(...);
+  //! Keep the existing data of files which are unchanged, and queue every other file to be written
+  void _reuseUnchangedFiles(SgaArchive& oArchive) throw(...);
+  //! Move the data of files which lies before iEnd (relative to the start of the data) to the end of the archive
+  void _relocateData(IFile* pArchive, unsigned long iEnd) throw(...);
+
+  std::vector<_directory_t> m_vEntryPoints;
+  std::vector<_directory_t> m_vDirectories;
+  std::vector<_file_t> m_vFiles;
+  std::vector<size_t> m_vToWrite; //!< Indices of the files whose data is to be compressed and written, in order
+  std::map<_content_key_t, size_t> m_mapContents;
+  RainMutex m_oSerialReadMutex;
+  RainString m_sArchiveName;
+  unsigned long long m_iBytesIn;
+  unsigned long long m_iBytesOut;
+  unsigned long m_iDataStart;
+  unsigned long m_iDataLength;
+  size_t m_iDuplicateCount;
+  size_t m_iReusedCount;
+  unsigned long m_iThreadCount;
+  int m_iCompressionLevel;
+  unsigned short m_iVersionMajor;
+};
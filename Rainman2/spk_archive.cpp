@@ -25,9 +25,12 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "spk_archive.h"
 #include "zlib.h"
 #include "memfile.h"
+#include "inflatefile.h"
+#include "hash.h"
 #include <memory.h>
 #include <string.h>
-#include <stack>
+#include <algorithm>
+#include <map>
 
 SpkArchive::SpkArchive()
 {
@@ -39,7 +42,7 @@ SpkArchive::~SpkArchive()
   _cleanSelf();
 }
 
-static char* strenchr(char* str, char* en, char chr)
+static const char* strenchr(const char* str, const char* en, char chr)
 {
   for(; str != en; ++str)
   {
@@ -51,7 +54,7 @@ static char* strenchr(char* str, char* en, char chr)
   return str;
 }
 
-static unsigned long strenulong(char* str, char* en)
+static unsigned long strenulong(const char* str, const char* en)
 {
   unsigned long value = 0;
   for(; str != en; ++str)
@@ -69,7 +72,7 @@ static unsigned long strenulong(char* str, char* en)
   return value;
 }
 
-static void strreadchexcksum(char *str, int iNumBytes, unsigned long* pResult)
+static void strreadchexcksum(const char *str, int iNumBytes, unsigned long* pResult)
 {
   --pResult;
   for(int i = 0; i < iNumBytes; ++i, str += 2)
@@ -108,8 +111,10 @@ bool SpkArchive::doesFileResemble(IFile* pFile) throw()
 void SpkArchive::init(IFile* pSpkFile, bool bTakePointerOwnership) throw(...)
 {
   _cleanSelf();
+  m_pRawSource = archive_raw_source_t::create(pSpkFile, bTakePointerOwnership);
+  m_pRawFileMutex = &archive_raw_source_t::get(m_pRawSource)->oMutex;
   m_pRawFile = pSpkFile;
-  m_bDeleteRawFileLater = bTakePointerOwnership;
+  m_bRawReadAtThreadSafe = pSpkFile->isReadAtThreadSafe();
 
   try
   {
@@ -120,16 +125,15 @@ void SpkArchive::init(IFile* pSpkFile, bool bTakePointerOwnership) throw(...)
     pSpkFile->readOne(m_oFileHeader.iHeaderOffset);
     pSpkFile->readOne(m_oFileHeader.iZero);
     pSpkFile->readOne(m_oFileHeader.iHeaderLength);
-    pSpkFile->seek(m_oFileHeader.iHeaderOffset, SR_Start);
-    CHECK_ALLOCATION(m_sRawInfoHeader = new (std::nothrow) char[m_oFileHeader.iHeaderLength + 1]);
-    pSpkFile->readArray(m_sRawInfoHeader, m_oFileHeader.iHeaderLength);
+    // File names are left pointing into the header, which is not copied if the archive is in memory
+    m_pRawInfoHeader = pSpkFile->mapView(m_oFileHeader.iHeaderOffset, m_oFileHeader.iHeaderLength);
   }
   CATCH_THROW_SIMPLE(_cleanSelf(), L"Could not load valid file header");
 
   // Handle header line by line
-  char *sHeader = m_sRawInfoHeader,
-       *sHeaderEnd = sHeader + m_oFileHeader.iHeaderLength,
-       *sLineTerminator = strenchr(sHeader, sHeaderEnd, '\n');
+  const char *sHeader = m_pRawInfoHeader->getData(),
+             *sHeaderEnd = sHeader + m_pRawInfoHeader->getLength(),
+             *sLineTerminator = strenchr(sHeader, sHeaderEnd, '\n');
 
   // Check first line
   if((sLineTerminator - sHeader) < 5 || memcmp(sHeader, "SPK: ", 5) != 0)
@@ -137,22 +141,13 @@ void SpkArchive::init(IFile* pSpkFile, bool bTakePointerOwnership) throw(...)
     THROW_SIMPLE(L"Data header does not indicate an SPK archive");
   }
   sHeader = sLineTerminator + 1;
-  m_iNumDirs = 1;
-  CHECK_ALLOCATION(m_pRootDir = new (std::nothrow) _dir_t);
-  m_pRootDir->sName = L"SPK";
-  m_pRootDir->sPath = L"SPK\\";
-  m_pRootDir->pDirs = NULL;
-  m_pRootDir->pFiles = NULL;
-  m_pRootDir->iCountDirs = 0;
-  m_pRootDir->iCountFiles = 0;
-  m_pRootDir->iAllocdDirs = 0;
-  m_pRootDir->iAllocdFiles = 0;
-
-  // Handle file files
+
+  // Handle file lines; the name of each file is left as its full path until the tree is built
+  std::vector<_file_t> vFiles;
   for(; sHeader < sHeaderEnd; sHeader = sLineTerminator + 1)
   {
     sLineTerminator = strenchr(sHeader, sHeaderEnd, '\n');
-    char *sDelim = strenchr(sHeader, sLineTerminator, '\t');
+    const char *sDelim = strenchr(sHeader, sLineTerminator, '\t');
     _file_t oFile;
     oFile.iDataOffset = strenulong(sHeader, sDelim) * 0x200;
 
@@ -177,140 +172,158 @@ void SpkArchive::init(IFile* pSpkFile, bool bTakePointerOwnership) throw(...)
       oFile.eCompression = _file_t::CT_ZLib;
     NEXT_TAB();
     oFile.sName = sHeader;
-    *sDelim = 0;
+    oFile.iNameLength = sDelim - sHeader;
+    vFiles.push_back(oFile);
 
-    char *sDirDelim = strrchr(oFile.sName, '\\');
-    _dir_t *pDirForThis = _findDir(oFile.sName, sDirDelim ? (sDirDelim - oFile.sName) : 0, true, true);
-    if(pDirForThis == NULL)
-      THROW_SIMPLE_(L"Cannot allocate directory for \'%S\'", oFile.sName);
-    if(sDirDelim)
-      oFile.sName = sDirDelim + 1;
-    *_allocFile(pDirForThis) = oFile;
+#undef NEXT_TAB
   }
-}
 
-SpkArchive::_file_t* SpkArchive::_allocFile(_dir_t* pParent) throw(...)
-{
-  if(pParent->iCountFiles >= pParent->iAllocdFiles)
+  try
   {
-    size_t iNextAllocd = (pParent->iAllocdFiles + 1) * 2;
-    _file_t *pNewFiles = new _file_t[iNextAllocd];
-    if(pParent->pFiles)
-    {
-      memcpy(pNewFiles, pParent->pFiles, sizeof(_file_t) * pParent->iAllocdFiles);
-      delete[] pParent->pFiles;
-    }
-    pParent->pFiles = pNewFiles;
-    pParent->iAllocdFiles = iNextAllocd;
+    _buildTree(vFiles);
   }
-  ++m_iNumFiles;
-  return pParent->pFiles + (pParent->iCountFiles++);
+  CATCH_THROW_SIMPLE(_cleanSelf(), L"Cannot build directory tree");
 }
 
-SpkArchive::_dir_t* SpkArchive::_allocDir(_dir_t *pParent) throw(...)
+//! Compare two names caselessly, in the same way as RainString::compareCaseless()
+static int CompareCaseless(const char* sA, size_t iLengthA, const char* sB, size_t iLengthB) throw()
 {
-  if(pParent->iCountDirs >= pParent->iAllocdDirs)
+  for(size_t i = 0; i < iLengthA && i < iLengthB; ++i)
   {
-    size_t iNextAllocd = (pParent->iAllocdDirs + 1) * 2;
-    _dir_t *pNewDirs = new _dir_t[iNextAllocd];
-    if(pParent->pDirs)
-    {
-      for(size_t i = 0; i < pParent->iAllocdDirs; ++i)
-      {
-        pNewDirs[i].sName.swap(pParent->pDirs[i].sName);
-        pNewDirs[i].sPath.swap(pParent->pDirs[i].sPath);
-        pNewDirs[i].pDirs = pParent->pDirs[i].pDirs;
-        pNewDirs[i].pFiles = pParent->pDirs[i].pFiles;
-        pNewDirs[i].iCountDirs = pParent->pDirs[i].iCountDirs;
-        pNewDirs[i].iCountFiles = pParent->pDirs[i].iCountFiles;
-        pNewDirs[i].iAllocdDirs = pParent->pDirs[i].iAllocdDirs;
-        pNewDirs[i].iAllocdFiles = pParent->pDirs[i].iAllocdFiles;
-      }
-      delete[] pParent->pDirs;
-    }
-    pParent->pDirs = pNewDirs;
-    pParent->iAllocdDirs = iNextAllocd;
+    int iA = RainLowerCaseless(sA[i]);
+    int iB = RainLowerCaseless(sB[i]);
+    if(iA != iB)
+      return iA < iB ? -1 : 1;
   }
-  _dir_t *pDir = pParent->pDirs + pParent->iCountDirs;
-  ++pParent->iCountDirs;
-  ++m_iNumDirs;
-  pDir->pDirs = NULL;
-  pDir->pFiles = NULL;
-  pDir->iCountDirs = 0;
-  pDir->iCountFiles = 0;
-  pDir->iAllocdDirs = 0;
-  pDir->iAllocdFiles = 0;
-  return pDir;
+  if(iLengthA == iLengthB)
+    return 0;
+  return iLengthA < iLengthB ? -1 : 1;
 }
 
-SpkArchive::_dir_t* SpkArchive::_findDir(const char* sName, size_t iNameLength, bool bAssumeInRoot, bool bCreate) throw()
+//! Orders strings caselessly, for use as the ordering of a std::map
+struct SpkCaselessLess
 {
-  _dir_t *pCurrentDir = m_pRootDir;
-  if(!bAssumeInRoot)
+  bool operator() (const RainString& a, const RainString& b) const throw()
   {
-    size_t iRootLength = m_pRootDir->sName.length();
-    if(iNameLength < iRootLength || m_pRootDir->sName.compareCaseless(sName, iRootLength) != 0)
-      return NULL;
-    sName += iRootLength;
-    iNameLength -= iRootLength;
-    if(iNameLength != 0 && *sName == '\\')
-      ++sName, --iNameLength;
+    return a.compareCaseless(b) < 0;
   }
+};
+
+//! A file name which is not zero terminated, along with the index of the file
+struct spk_name_ref_t
+{
+  const char* sName;
+  size_t iLength;
+  size_t iIndex;
+};
 
-  for(; iNameLength != 0;)
+//! Orders name references caselessly by name
+static bool SpkNameOrder(const spk_name_ref_t& a, const spk_name_ref_t& b)
+{
+  return CompareCaseless(a.sName, a.iLength, b.sName, b.iLength) < 0;
+}
+
+void SpkArchive::_buildTree(std::vector<_file_t>& vFiles) throw(...)
+{
+  // Directories are identified by their path relative to the root (which is the empty string). For
+  // each one, note which files it contains and what its subdirectories are.
+  typedef std::map<RainString, std::vector<spk_name_ref_t>, SpkCaselessLess> files_map_t;
+  typedef std::map<RainString, std::vector<RainString>, SpkCaselessLess> children_map_t;
+  files_map_t mapFiles;
+  children_map_t mapChildren;
+  mapChildren[RainString()];
+  std::vector<RainString> vNewDirs;
+  for(size_t i = 0; i < vFiles.size(); ++i)
   {
-    size_t iPartLength = iNameLength;
-    for(size_t i = 0; i < iNameLength; ++i)
+    size_t iSlash = vFiles[i].iNameLength;
+    while(iSlash != 0 && vFiles[i].sName[iSlash - 1] != '\\')
+      --iSlash;
+    RainString sDir;
+    if(iSlash != 0)
     {
-      if(sName[i] == '\\')
-      {
-        iPartLength = i;
-        break;
-      }
+      sDir = RainString(vFiles[i].sName, iSlash - 1);
+      vFiles[i].sName += iSlash;
+      vFiles[i].iNameLength -= iSlash;
     }
-    if(iPartLength == 0)
+    spk_name_ref_t oRef = {vFiles[i].sName, vFiles[i].iNameLength, i};
+    mapFiles[sDir].push_back(oRef);
+
+    // Parents are registered before their children, so that the loop stops at the first known parent
+    vNewDirs.clear();
+    for(RainString sNew = sDir; mapChildren.find(sNew) == mapChildren.end(); sNew = sNew.beforeLast('\\'))
+      vNewDirs.push_back(sNew);
+    for(std::vector<RainString>::reverse_iterator itr = vNewDirs.rbegin(); itr != vNewDirs.rend(); ++itr)
     {
-      ++sName;
-      --iNameLength;
-      continue;
+      mapChildren[*itr];
+      mapChildren[itr->beforeLast('\\')].push_back(*itr);
     }
-    size_t iLower = 0, iUpper = pCurrentDir->iCountDirs;
-    _dir_t *pSub = 0;
-    while(iLower < iUpper)
+  }
+
+  m_iNumDirs = mapChildren.size();
+  m_iNumFiles = vFiles.size();
+  CHECK_ALLOCATION(m_pDirs = new (std::nothrow) _dir_t[m_iNumDirs]);
+  CHECK_ALLOCATION(m_pFiles = new (std::nothrow) _file_t[m_iNumFiles ? m_iNumFiles : 1]);
+
+  // Directories are numbered in the order in which they are visited by a breadth first search, so
+  // that the subdirectories of each directory form a contiguous range
+  std::vector<RainString> vOrder;
+  vOrder.push_back(RainString());
+  m_pDirs[0].sName = L"SPK";
+  m_pDirs[0].sPath = L"SPK\\";
+  size_t iNextDir = 1, iNextFile = 0;
+  for(size_t iDir = 0; iDir < vOrder.size(); ++iDir)
+  {
+    _dir_t& oDir = m_pDirs[iDir];
+    // Subdirectories share a common prefix, so sorting their paths sorts them by name
+    std::vector<RainString>& vChildren = mapChildren[vOrder[iDir]];
+    std::sort(vChildren.begin(), vChildren.end(), SpkCaselessLess());
+    oDir.pDirs = m_pDirs + iNextDir;
+    oDir.iCountDirs = vChildren.size();
+    for(std::vector<RainString>::const_iterator itr = vChildren.begin(); itr != vChildren.end(); ++itr)
     {
-      size_t iMid = (iLower + iUpper) / 2;
-      pSub = pCurrentDir->pDirs + iMid;
-      int iStatus = pSub->sName.compareCaseless(sName, iPartLength);
-      if(iStatus == 0)
-        break;
-      else
-      {
-        pSub = 0;
-        if(iStatus < 0)
-          iLower = iMid + 1;
-        else
-          iUpper = iMid;
-      }
+      _dir_t& oChild = m_pDirs[iNextDir++];
+      oChild.sName = itr->afterLast('\\');
+      oChild.sPath = oDir.sPath + oChild.sName + L"\\";
+      vOrder.push_back(*itr);
     }
-    if(pSub == 0 && bCreate)
+
+    oDir.pFiles = m_pFiles + iNextFile;
+    oDir.iCountFiles = 0;
+    files_map_t::iterator itrFiles = mapFiles.find(vOrder[iDir]);
+    if(itrFiles != mapFiles.end())
     {
-      if(pCurrentDir->iCountDirs == 0 || pCurrentDir->pDirs[pCurrentDir->iCountDirs - 1].sName.compareCaseless(sName, iPartLength) < 0)
-      {
-        pSub = _allocDir(pCurrentDir);
-        pSub->sName = RainString(sName, iPartLength);
-        pSub->sPath = pCurrentDir->sPath + pSub->sName + L"\\";
-      }
+      std::vector<spk_name_ref_t>& vDirFiles = itrFiles->second;
+      std::stable_sort(vDirFiles.begin(), vDirFiles.end(), SpkNameOrder);
+      for(size_t i = 0; i < vDirFiles.size(); ++i)
+        m_pFiles[iNextFile++] = vFiles[vDirFiles[i].iIndex];
+      oDir.iCountFiles = vDirFiles.size();
     }
-    if(pSub == 0)
-      return NULL;
-    pCurrentDir = pSub;
-    sName += iPartLength;
-    iNameLength -= iPartLength;
-    if(iNameLength != 0 && *sName == '\\')
-      ++sName, --iNameLength;
   }
 
-  return pCurrentDir;
+  // Files are inserted before directories, so that a file is found in preference to a directory
+  // with the same name
+  if(!m_oPathIndex.reserve(m_iNumDirs + m_iNumFiles))
+    THROW_SIMPLE(L"Cannot allocate path index");
+  _path_index_entry_t oEntry;
+  oEntry.bIsFile = true;
+  for(oEntry.iDirectory = 0; oEntry.iDirectory < m_iNumDirs; ++oEntry.iDirectory)
+  {
+    const _dir_t& oDir = m_pDirs[oEntry.iDirectory];
+    unsigned long iDirHash = CRCCaselessHashSimpleAsciiFromUnicode(oDir.sPath.getCharacters(), oDir.sPath.length());
+    for(size_t i = 0; i < oDir.iCountFiles; ++i)
+    {
+      oEntry.iIndex = (oDir.pFiles + i) - m_pFiles;
+      m_oPathIndex.insert(CRCCaselessHashSimple(oDir.pFiles[i].sName, oDir.pFiles[i].iNameLength, iDirHash), oEntry);
+    }
+  }
+  oEntry.bIsFile = false;
+  for(oEntry.iIndex = 0; oEntry.iIndex < m_iNumDirs; ++oEntry.iIndex)
+  {
+    // Directory paths end with a backslash, which is not part of the key
+    const RainString& sPath = m_pDirs[oEntry.iIndex].sPath;
+    oEntry.iDirectory = oEntry.iIndex;
+    m_oPathIndex.insert(CRCCaselessHashSimpleAsciiFromUnicode(sPath.getCharacters(), sPath.length() - 1), oEntry);
+  }
 }
 
 void SpkArchive::_zeroSelf() throw()
@@ -321,52 +334,37 @@ void SpkArchive::_zeroSelf() throw()
   m_oFileHeader.iZero = 0;
   m_oFileHeader.iHeaderLength = 0;
   m_oFileHeader.sVersion = 0;
-  m_sRawInfoHeader = 0;
-  m_pRootDir = 0;
+  m_pRawInfoHeader = 0;
+  m_pDirs = 0;
+  m_pFiles = 0;
   m_pRawFile = 0;
+  m_pRawSource = 0;
+  m_pRawFileMutex = 0;
   m_iNumFiles = 0;
   m_iNumDirs = 0;
-  m_bDeleteRawFileLater = false;
+  m_bRawReadAtThreadSafe = false;
 }
 
 void SpkArchive::_cleanSelf() throw()
 {
   delete[] m_oFileHeader.sVersion;
-  delete[] m_sRawInfoHeader;
-  if(m_pRootDir)
-  {
-    std::stack<_dir_t*> stkDirs;
-    stkDirs.push(m_pRootDir);
-    while(!stkDirs.empty())
-    {
-      _dir_t *pDir = stkDirs.top();
-      stkDirs.pop();
-      if(pDir->pDirs)
-      {
-        if(pDir->iCountDirs != 0)
-        {
-          stkDirs.push(pDir);
-          for(size_t i = 0; i < pDir->iCountDirs; ++i)
-          {
-            if(pDir->pDirs[i].pDirs)
-              stkDirs.push(pDir->pDirs + i);
-          }
-          pDir->iCountDirs = 0;
-        }
-        else
-        {
-          delete[] pDir->pDirs;
-          delete[] pDir->pFiles;
-        }
-      }
-    }
-    delete m_pRootDir;
-  }
-  if(m_bDeleteRawFileLater)
-    delete m_pRawFile;
+  delete m_pRawInfoHeader;
+  delete[] m_pDirs;
+  delete[] m_pFiles;
+  m_oPathIndex.clear();
+  // Files opened from the archive may still hold references to the raw file
+  if(m_pRawSource)
+    m_pRawSource->release();
   _zeroSelf();
 }
 
+void SpkArchive::getCaps(file_store_caps_t& oCaps) const throw()
+{
+  IArchiveFileStore::getCaps(oCaps);
+  // The directory tree is fully built by init() and never modified afterwards
+  oCaps.bCanReadConcurrently = true;
+}
+
 IFile* SpkArchive::openFile(const RainString& sPath, eFileOpenMode eMode) throw(...)
 {
   if(eMode != FM_Read)
@@ -374,14 +372,11 @@ IFile* SpkArchive::openFile(const RainString& sPath, eFileOpenMode eMode) throw(
   _file_t *pFileInfo = _findFile(sPath);
   if(pFileInfo == 0)
     THROW_SIMPLE_(L"Cannot open non-existant file \'%s\'", sPath.getCharacters());
-  IFile* pFile = CHECK_ALLOCATION(new (std::nothrow) MemoryWriteFile(pFileInfo->iDataLength));
   try
   {
-    _pumpFile(pFileInfo, pFile);
-    pFile->seek(0, SR_Start);
+    return _openFile(pFileInfo);
   }
-  CATCH_THROW_SIMPLE_(delete pFile, L"Error opening \'%s\' for reading", sPath.getCharacters());
-  return pFile;
+  CATCH_THROW_SIMPLE_({}, L"Error opening \'%s\' for reading", sPath.getCharacters());
 }
 
 void SpkArchive::pumpFile(const RainString& sPath, IFile* pSink) throw(...)
@@ -392,6 +387,129 @@ void SpkArchive::pumpFile(const RainString& sPath, IFile* pSink) throw(...)
   _pumpFile(pFileInfo, pSink);
 }
 
+void SpkArchive::verify(archive_verify_report_t& oReport, unsigned long iThreadCount) throw(...)
+{
+  unsigned long iStartTime = RainGetTickCount();
+  oReport.clear();
+
+  // SPK archives have no archive-wide hashes, but every file has a checksum of its own
+  std::vector<_verify_item_t> vItems;
+  for(size_t iDir = 0; iDir < m_iNumDirs; ++iDir)
+  {
+    const _dir_t& oDir = m_pDirs[iDir];
+    for(size_t i = 0; i < oDir.iCountFiles; ++i)
+    {
+      _verify_item_t oItem;
+      oItem.pFile = oDir.pFiles + i;
+      oItem.sPath = oDir.sPath + RainString(oDir.pFiles[i].sName, oDir.pFiles[i].iNameLength);
+      oItem.iOrder = oDir.pFiles[i].iDataOffset;
+      vItems.push_back(oItem);
+      oReport.iBytesRead += oDir.pFiles[i].iDataLengthCompressed;
+    }
+  }
+  _verifyFiles(vItems, oReport, iThreadCount);
+
+  oReport.iMillisecondsElapsed = RainGetTickCount() - iStartTime;
+}
+
+bool SpkArchive::_verifyFile(void* pFile, RainString& sReason) throw()
+{
+  _file_t* pInfo = reinterpret_cast<_file_t*>(pFile);
+  size_t iLengthCompressed = static_cast<size_t>(pInfo->iDataLengthCompressed);
+  char* pCompressed = 0;
+  char* pData = 0;
+  try
+  {
+    if(pInfo->eCompression != _file_t::CT_ZLib)
+      THROW_SIMPLE(L"Unknown file compression method");
+    CHECK_ALLOCATION(pCompressed = new (std::nothrow) char[iLengthCompressed ? iLengthCompressed : 1]);
+    if(_readRawNoThrow(static_cast<seek_offset_t>(pInfo->iDataOffset), pCompressed, iLengthCompressed) != iLengthCompressed)
+      THROW_SIMPLE(L"Unexpected end of archive");
+    CHECK_ALLOCATION(pData = new (std::nothrow) char[pInfo->iDataLength ? pInfo->iDataLength : 1]);
+    RainInflateInto(pCompressed, iLengthCompressed, pData, pInfo->iDataLength);
+
+    // The checksum is stored as 32 hex digits, which strreadchexcksum() packs into longs in little endian order
+    unsigned char aExpected[16];
+    bool bHaveChecksum = false;
+    for(int i = 0; i < 16; ++i)
+    {
+      aExpected[i] = static_cast<unsigned char>((pInfo->iChecksum[i / 4] >> ((i % 4) * 8)) & 0xFF);
+      if(aExpected[i] != 0)
+        bHaveChecksum = true;
+    }
+    if(bHaveChecksum)
+    {
+      // The checksum is of the uncompressed contents (as SpkArchiveWriter writes it), which also
+      // means that a stream which inflates correctly but to the wrong contents is caught
+      unsigned char aActual[16];
+      MD5Hash oHash;
+      oHash.update(pData, pInfo->iDataLength);
+      oHash.finalise(aActual);
+      if(memcmp(aActual, aExpected, 16) != 0)
+        THROW_SIMPLE(L"MD5 checksum does not match the file contents");
+    }
+  }
+  catch(RainException *pE)
+  {
+    delete[] pCompressed;
+    delete[] pData;
+    sReason = _describeVerifyException(pE);
+    return false;
+  }
+  delete[] pCompressed;
+  delete[] pData;
+  return true;
+}
+
+void SpkArchive::_getBatchItem(const RainString& sPath, _batch_item_t& oItem) throw(...)
+{
+  _file_t *pFileInfo = _findFile(sPath);
+  if(pFileInfo == 0)
+    THROW_SIMPLE(L"File does not exist");
+  oItem.iPosition = static_cast<seek_offset_t>(pFileInfo->iDataOffset);
+  oItem.iLength = static_cast<size_t>(pFileInfo->iDataLengthCompressed);
+  oItem.pFile = pFileInfo;
+  oItem.bNeedsRead = true;
+}
+
+void SpkArchive::_pumpBatchItem(const _batch_item_t& oItem, IFile* pSink, const char* pRawData) throw(...)
+{
+  _pumpFile(reinterpret_cast<_file_t*>(oItem.pFile), pSink, pRawData);
+}
+
+size_t SpkArchive::_readBatchData(seek_offset_t iPosition, void* pDestination, size_t iLength) throw()
+{
+  return _readRawNoThrow(iPosition, pDestination, iLength);
+}
+
+void SpkArchive::_getRawDetails(const _batch_item_t& oItem, archive_raw_details_t& oDetails) throw()
+{
+  const _file_t* pFileInfo = reinterpret_cast<const _file_t*>(oItem.pFile);
+  oDetails.iLength = pFileInfo->iDataLength;
+  oDetails.iLengthCompressed = pFileInfo->iDataLengthCompressed;
+  oDetails.iModificationTime = pFileInfo->iModificationTime;
+  // Every file in an SPK archive is a zLib stream, even if it is no smaller than the original
+  oDetails.bCompressed = true;
+}
+
+size_t SpkArchive::readFileInto(const RainString& sPath, void* pBuffer, size_t iBufferSize) throw(...)
+{
+  _file_t *pFileInfo = _findFile(sPath);
+  if(pFileInfo == 0)
+    THROW_SIMPLE_(L"Cannot read non-existant file \'%s\'", sPath.getCharacters());
+  if(pFileInfo->iDataLength > iBufferSize)
+  {
+    THROW_SIMPLE_(L"Cannot read \'%s\'; it is %lu bytes, but the buffer is only %lu bytes", sPath.getCharacters(),
+      pFileInfo->iDataLength, static_cast<unsigned long>(iBufferSize));
+  }
+  try
+  {
+    _readFileInto(pFileInfo, pBuffer);
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot read file \'%s\'", sPath.getCharacters());
+  return pFileInfo->iDataLength;
+}
+
 IFile* SpkArchive::openFileNoThrow(const RainString& sPath, eFileOpenMode eMode) throw()
 {
   if(eMode != FM_Read)
@@ -399,21 +517,15 @@ IFile* SpkArchive::openFileNoThrow(const RainString& sPath, eFileOpenMode eMode)
   _file_t *pFileInfo = _findFile(sPath);
   if(pFileInfo == 0)
     return 0;
-  IFile* pFile = new (std::nothrow) MemoryWriteFile(pFileInfo->iDataLength);
-  if(!pFile)
-    return 0;
   try
   {
-    _pumpFile(pFileInfo, pFile);
-    pFile->seek(0, SR_Start);
+    return _openFile(pFileInfo);
   }
   catch(RainException *pE)
   {
     delete pE;
-    delete pFile;
     return 0;
   }
-  return pFile;
 }
 
 bool SpkArchive::doesFileExist(const RainString& sPath) throw()
@@ -421,6 +533,28 @@ bool SpkArchive::doesFileExist(const RainString& sPath) throw()
   return _findFile(sPath) != 0;
 }
 
+bool SpkArchive::getFileStorageOrder(const RainString& sPath, unsigned long& iOrder) throw()
+{
+  _file_t* pFile = _findFile(sPath);
+  if(pFile == 0)
+    return false;
+  iOrder = pFile->iDataOffset;
+  return true;
+}
+
+size_t SpkArchive::getMemoryUsage() const throw()
+{
+  size_t iUsage = sizeof(SpkArchive);
+  if(m_pRawInfoHeader && !m_pRawInfoHeader->isDirect())
+    iUsage += m_pRawInfoHeader->getLength();
+  // File names point into the raw info header, so only the directories have strings of their own
+  iUsage += sizeof(_dir_t) * m_iNumDirs + sizeof(_file_t) * m_iNumFiles;
+  for(size_t i = 0; i < m_iNumDirs; ++i)
+    iUsage += m_pDirs[i].sName.getMemoryUsage() + m_pDirs[i].sPath.getMemoryUsage();
+  iUsage += m_oPathIndex.getMemoryUsage();
+  return iUsage;
+}
+
 size_t SpkArchive::getEntryPointCount() throw()
 {
   if(m_iNumDirs == 0)
@@ -432,7 +566,7 @@ size_t SpkArchive::getEntryPointCount() throw()
 const RainString& SpkArchive::getEntryPointName(size_t iIndex) throw(...)
 {
   CHECK_RANGE_LTMAX(0, iIndex, getEntryPointCount());
-  return m_pRootDir->sName;
+  return m_pDirs[0].sName;
 }
 
 class SpkArchiveDirectoryAdapter : public IDirectory
@@ -478,7 +612,7 @@ public:
       iItemIndex -= m_pDirectory->iCountDirs;
       SpkArchive::_file_t* pInfo = m_pDirectory->pFiles + iItemIndex;
       if(oDetails.oFields.name)
-        oDetails.sName = RainString(pInfo->sName);
+        oDetails.sName = RainString(pInfo->sName, pInfo->iNameLength);
       if(oDetails.oFields.dir)
         oDetails.bIsDirectory = false;
       if(oDetails.oFields.size)
@@ -496,7 +630,7 @@ public:
     {
       m_pArchive->_pumpFile(m_pDirectory->pFiles + iIndex, pSink);
     }
-    CATCH_THROW_SIMPLE_({}, L"Cannot pump file \'%s\\%S\'", m_pDirectory->sPath.getCharacters(), m_pDirectory->pFiles[iIndex].sName);
+    CATCH_THROW_SIMPLE_({}, L"Cannot pump file \'%s%s\'", m_pDirectory->sPath.getCharacters(), RainString(m_pDirectory->pFiles[iIndex].sName, m_pDirectory->pFiles[iIndex].iNameLength).getCharacters());
   }
 
   virtual IDirectory* openDirectory(size_t iIndex) throw(...)
@@ -538,65 +672,114 @@ bool SpkArchive::doesDirectoryExist(const RainString& sPath) throw()
   return _findDir(sPath) != 0;
 }
 
-SpkArchive::_dir_t* SpkArchive::_findDir(RainString sName) throw()
+struct SpkArchive::_path_index_matcher_t
 {
-  if(m_pRootDir == 0)
-    return 0;
-  if(m_pRootDir->sName.compareCaseless(sName.beforeFirst('\\')) != 0)
-    return 0;
-  sName = sName.afterFirst('\\');
-  _dir_t *pDir = m_pRootDir;
-  for(; !sName.isEmpty();)
+  _path_index_matcher_t(SpkArchive* pArchive, const RainChar* pPath, size_t iLength, bool bIsFile) throw()
+    : m_pArchive(pArchive), m_pPath(pPath), m_iLength(iLength), m_bIsFile(bIsFile)
   {
-    RainString sPart = sName.beforeFirst('\\');
-    sName = sName.afterFirst('\\');
+  }
 
-    size_t iLower = 0, iUpper = pDir->iCountDirs;
-    while(iLower < iUpper)
-    {
-      size_t iMid = (iLower + iUpper) / 2;
-      _dir_t *pChild = pDir->pDirs + iMid;
-      int iStatus = sPart.compareCaseless(pChild->sName);
-      if(iStatus == 0)
-      {
-        pDir = pChild;
-        goto next_for;
-      }
-      else if(iStatus < 0)
-        iUpper = iMid;
-      else
-        iLower = iMid + 1;
-    }
-    return 0;
-next_for: ;
+  bool operator() (const _path_index_entry_t& oEntry) const throw()
+  {
+    // The path of a directory is its stored path without the trailing backslash, and the path of a
+    // file is the stored path of its directory followed by the file name
+    if(oEntry.bIsFile != m_bIsFile)
+      return false;
+    const RainString& sDirPath = m_pArchive->m_pDirs[oEntry.iDirectory].sPath;
+    if(!oEntry.bIsFile)
+      return m_iLength == sDirPath.length() - 1 && RainEqualsCaseless(m_pPath, sDirPath.getCharacters(), m_iLength);
+    const char* sName = m_pArchive->m_pFiles[oEntry.iIndex].sName;
+    size_t iNameLength = m_pArchive->m_pFiles[oEntry.iIndex].iNameLength;
+    return m_iLength == sDirPath.length() + iNameLength && RainEqualsCaseless(m_pPath, sDirPath.getCharacters(), sDirPath.length())
+      && RainEqualsCaseless(m_pPath + sDirPath.length(), sName, iNameLength);
   }
-  return pDir;
+
+  SpkArchive* m_pArchive;
+  const RainChar* m_pPath;
+  size_t m_iLength;
+  bool m_bIsFile;
+};
+
+void* SpkArchive::_findInIndex(const RainString& sPath, bool bIsFile) throw()
+{
+  // A trailing backslash makes no difference to what a path refers to
+  size_t iLength = sPath.length();
+  if(iLength != 0 && sPath.getCharacters()[iLength - 1] == '\\')
+    --iLength;
+
+  const _path_index_entry_t* pEntry = m_oPathIndex.find(CRCCaselessHashSimpleAsciiFromUnicode(sPath.getCharacters(), iLength),
+    _path_index_matcher_t(this, sPath.getCharacters(), iLength, bIsFile));
+  if(pEntry == 0)
+    return 0;
+  if(bIsFile)
+    return m_pFiles + pEntry->iIndex;
+  else
+    return m_pDirs + pEntry->iIndex;
+}
+
+SpkArchive::_dir_t* SpkArchive::_findDir(const RainString& sName) throw()
+{
+  return reinterpret_cast<_dir_t*>(_findInIndex(sName, false));
 }
 
 SpkArchive::_file_t* SpkArchive::_findFile(const RainString& sName) throw()
 {
-  _dir_t *pTheDir = _findDir(sName.beforeLast('\\'));
-  if(pTheDir == 0)
-    return 0;
-  RainString sFile = sName.afterLast('\\');
-
-  size_t iLower = 0, iUpper = pTheDir->iCountFiles;
-  while(iLower < iUpper)
-  {
-    size_t iMid = (iLower + iUpper) / 2;
-    _file_t *pFile = pTheDir->pFiles + iMid;
-    int iStatus = sFile.compareCaseless(pFile->sName);
-    if(iStatus == 0)
-      return pFile;
-    else if(iStatus < 0)
-      iUpper = iMid;
-    else
-      iLower = iMid + 1;
+  return reinterpret_cast<_file_t*>(_findInIndex(sName, true));
+}
+
+size_t SpkArchive::_readRawNoThrow(seek_offset_t iPosition, void* pDestination, size_t iLength) throw()
+{
+  if(m_bRawReadAtThreadSafe)
+    return m_pRawFile->readAtNoThrow(iPosition, pDestination, 1, iLength);
+  RainMutexLock oLock(*m_pRawFileMutex);
+  return m_pRawFile->readAtNoThrow(iPosition, pDestination, 1, iLength);
+}
+
+IFile* SpkArchive::_openFile(SpkArchive::_file_t* pInfo) throw(...)
+{
+  if(pInfo->eCompression == _file_t::CT_ZLib && pInfo->iDataLength >= InflateReadFile::STREAMING_THRESHOLD)
+  {
+    // Large files are inflated as they are read, rather than all at once, holding a reference to the raw file
+    memory_buffer_owner_t* pRawSource = archive_raw_source_t::addReference(m_pRawSource);
+    InflateReadFile* pFile = new (std::nothrow) InflateReadFile(m_pRawFile, static_cast<seek_offset_t>(pInfo->iDataOffset),
+      pInfo->iDataLengthCompressed, pInfo->iDataLength, m_bRawReadAtThreadSafe ? 0 : m_pRawFileMutex, false, pRawSource);
+    if(pFile == 0)
+      pRawSource->release();
+    return CHECK_ALLOCATION(pFile);
+  }
+  IFile* pFile = CHECK_ALLOCATION(new (std::nothrow) MemoryWriteFile(pInfo->iDataLength));
+  try
+  {
+    _pumpFile(pInfo, pFile);
+    pFile->seek(0, SR_Start);
+  }
+  CATCH_THROW_SIMPLE(delete pFile, L"Cannot decompress file data");
+  return pFile;
+}
+
+void SpkArchive::_readFileInto(SpkArchive::_file_t* pInfo, void* pBuffer) throw(...)
+{
+  if(pInfo->eCompression != _file_t::CT_ZLib)
+    THROW_SIMPLE(L"Unknown file compression method");
+
+  size_t iLengthCompressed = static_cast<size_t>(pInfo->iDataLengthCompressed);
+  char* pCompressed = CHECK_ALLOCATION(new (std::nothrow) char[iLengthCompressed ? iLengthCompressed : 1]);
+  try
+  {
+    if(_readRawNoThrow(static_cast<seek_offset_t>(pInfo->iDataOffset), pCompressed, iLengthCompressed) != iLengthCompressed)
+      THROW_SIMPLE(L"Unexpected end of archive");
+    RainInflateInto(pCompressed, iLengthCompressed, pBuffer, static_cast<size_t>(pInfo->iDataLength));
   }
-  return 0;
+  CATCH_THROW_SIMPLE(delete[] pCompressed, L"Cannot decompress file data");
+  delete[] pCompressed;
 }
 
 void SpkArchive::_pumpFile(SpkArchive::_file_t* pInfo, IFile* pSink) throw(...)
+{
+  _pumpFile(pInfo, pSink, 0);
+}
+
+void SpkArchive::_pumpFile(SpkArchive::_file_t* pInfo, IFile* pSink, const char* pRawData) throw(...)
 {
   switch(pInfo->eCompression)
   {
@@ -608,7 +791,8 @@ void SpkArchive::_pumpFile(SpkArchive::_file_t* pInfo, IFile* pSink) throw(...)
     THROW_SIMPLE(L"Unknown file compression method");
   };
 
-  m_pRawFile->seek(pInfo->iDataOffset, SR_Start);
+  // Positional reads are used rather than seek() + read() so that multiple threads can pump at once
+  seek_offset_t iPosition = static_cast<seek_offset_t>(pInfo->iDataOffset);
 
   static const size_t BUFFER_SIZE = 4096;
   static const wchar_t* Z_ERR[] = {
@@ -627,11 +811,21 @@ void SpkArchive::_pumpFile(SpkArchive::_file_t* pInfo, IFile* pSink) throw(...)
   z_stream stream;
   int err;
 
-  iNumBytes = m_pRawFile->readArrayNoThrow(aBufferComp, std::min(BUFFER_SIZE, iRemaining));
-  iRemaining -= iNumBytes;
-
-  stream.next_in = (Bytef*)aBufferComp;
-  stream.avail_in = (uInt)iNumBytes;
+  if(pRawData)
+  {
+    // The entire compressed stream is already in memory, so it can be given to zLib in one go
+    stream.next_in = (Bytef*)pRawData;
+    stream.avail_in = (uInt)iRemaining;
+    iRemaining = 0;
+  }
+  else
+  {
+    iNumBytes = _readRawNoThrow(iPosition, aBufferComp, std::min(BUFFER_SIZE, iRemaining));
+    iPosition += static_cast<seek_offset_t>(iNumBytes);
+    iRemaining -= iNumBytes;
+    stream.next_in = (Bytef*)aBufferComp;
+    stream.avail_in = (uInt)iNumBytes;
+  }
   stream.next_out = (Bytef*)aBufferInft;
   stream.avail_out = (uInt)BUFFER_SIZE;
   stream.zalloc = (alloc_func)0;
@@ -659,7 +853,8 @@ void SpkArchive::_pumpFile(SpkArchive::_file_t* pInfo, IFile* pSink) throw(...)
         case Z_OK:
           if(stream.avail_in == 0)
           {
-            iNumBytes = m_pRawFile->readArrayNoThrow(aBufferComp, std::min(BUFFER_SIZE, iRemaining));
+            iNumBytes = _readRawNoThrow(iPosition, aBufferComp, std::min(BUFFER_SIZE, iRemaining));
+            iPosition += static_cast<seek_offset_t>(iNumBytes);
             iRemaining -= iNumBytes;
             stream.next_in = (Bytef*)aBufferComp;
             stream.avail_in = (uInt)iNumBytes;
@@ -25,6 +25,13 @@ OTHER DEALINGS IN THE SOFTWARE.
 #pragma once
 #include "archive.h"
 
+//! Reads SPK archives, as used by Company of Heroes Online
+/*!
+  When an archive is loaded, its directories and files are laid out in two flat arrays, with the
+  subdirectories and files of each directory forming contiguous ranges sorted by name, and an index
+  of the full path of every file and directory is built, so that resolving a path is a single hash
+  table lookup, regardless of the order in which the archive lists its files.
+*/
 class RAINMAN2_API SpkArchive : public IArchiveFileStore
 {
 public:
@@ -37,11 +44,19 @@ public:
 
   virtual size_t getFileCount() const throw() {return m_iNumFiles;}
   virtual size_t getDirectoryCount() const throw() {return m_iNumDirs;}
+  virtual size_t getMemoryUsage() const throw();
+
+  //! Check the MD5 checksum of every file, on a pool of threads
+  virtual void verify(archive_verify_report_t& oReport, unsigned long iThreadCount = 0) throw(...);
+
+  virtual void getCaps(file_store_caps_t& oCaps) const throw();
 
   virtual IFile* openFile         (const RainString& sPath, eFileOpenMode eMode) throw(...);
   virtual void   pumpFile         (const RainString& sPath, IFile* pSink) throw(...);
+  virtual size_t readFileInto     (const RainString& sPath, void* pBuffer, size_t iBufferSize) throw(...);
   virtual IFile* openFileNoThrow  (const RainString& sPath, eFileOpenMode eMode) throw();
   virtual bool   doesFileExist    (const RainString& sPath) throw();
+  virtual bool   getFileStorageOrder(const RainString& sPath, unsigned long& iOrder) throw();
 
   virtual size_t            getEntryPointCount() throw();
   virtual const RainString& getEntryPointName(size_t iIndex) throw(...);
@@ -70,7 +85,8 @@ protected:
 		unsigned long iDataLength;
 		unsigned long iModificationTime;
     unsigned long iChecksum[4];
-    char         *sName;
+    const char   *sName; //!< Points into the raw info header, and so is not zero terminated
+    size_t        iNameLength;
     enum eCompressionType
     {
       CT_Unknown = 0,
@@ -82,28 +98,53 @@ protected:
   {
     RainString sName,
                sPath;
+    // The subdirectories and files of the directory are contiguous ranges of the archive's arrays
     _dir_t    *pDirs;
     _file_t   *pFiles;
     size_t     iCountDirs,
-               iCountFiles,
-               iAllocdDirs,
-               iAllocdFiles;
+               iCountFiles;
+  };
+
+  //! An entry in the path index, which maps full paths to files and directories
+  struct _path_index_entry_t
+  {
+    size_t iIndex;     //!< Index of the file or directory
+    size_t iDirectory; //!< For files, the index of the directory containing the file
+    bool bIsFile;
   };
 
+  //! Predicate for RainHashIndex::find() which checks that a path index entry matches a path
+  struct _path_index_matcher_t;
+  friend struct _path_index_matcher_t;
+
+  virtual bool   _verifyFile(void* pFile, RainString& sReason) throw();
+  virtual void   _getBatchItem(const RainString& sPath, _batch_item_t& oItem) throw(...);
+  virtual void   _pumpBatchItem(const _batch_item_t& oItem, IFile* pSink, const char* pRawData) throw(...);
+  virtual size_t _readBatchData(seek_offset_t iPosition, void* pDestination, size_t iLength) throw();
+  virtual void _getRawDetails(const _batch_item_t& oItem, archive_raw_details_t& oDetails) throw();
+
   void     _zeroSelf () throw();
   void     _cleanSelf() throw();
-  _file_t* _allocFile(_dir_t* pParent) throw(...);
-  _dir_t*  _allocDir (_dir_t* pParent) throw(...);
-  _dir_t*  _findDir  (const char* sName, size_t iNameLength, bool bAssumeInRoot, bool bCreate) throw();
-  _dir_t*  _findDir  (RainString sName) throw();
+  //! Lay out the files listed by the header (whose names are still full paths) and their directories, and index them
+  void     _buildTree(std::vector<_file_t>& vFiles) throw(...);
+  void*    _findInIndex(const RainString& sPath, bool bIsFile) throw();
+  _dir_t*  _findDir  (const RainString& sName) throw();
   _file_t* _findFile (const RainString& sName) throw();
   void     _pumpFile (_file_t* pFile, IFile* pSink) throw(...);
+  void     _pumpFile (_file_t* pFile, IFile* pSink, const char* pRawData) throw(...);
+  void     _readFileInto(_file_t* pFile, void* pBuffer) throw(...);
+  IFile*   _openFile (_file_t* pFile) throw(...);
+  size_t   _readRawNoThrow(seek_offset_t iPosition, void* pDestination, size_t iLength) throw();
 
   _file_header_t m_oFileHeader;
-  char          *m_sRawInfoHeader;
-  _dir_t        *m_pRootDir;
+  IFileView     *m_pRawInfoHeader;
+  _dir_t        *m_pDirs; //!< Every directory, starting with the root
+  _file_t       *m_pFiles;
   IFile         *m_pRawFile;
+  memory_buffer_owner_t *m_pRawSource; //!< Shares m_pRawFile with the files opened from the archive
   size_t         m_iNumFiles;
   size_t         m_iNumDirs;
-  bool           m_bDeleteRawFileLater;
+  RainMutex     *m_pRawFileMutex; //!< Guards m_pRawFile; belongs to m_pRawSource
+  RainHashIndex<_path_index_entry_t> m_oPathIndex;
+  bool           m_bRawReadAtThreadSafe;
 };
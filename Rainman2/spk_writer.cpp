@@ -0,0 +1,263 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "spk_writer.h"
+#include "exception.h"
+#include "hash.h"
+#include "memfile.h"
+#include "zlib.h"
+#include <algorithm>
+#include <map>
+#include <stack>
+#include <stdio.h>
+#include <string.h>
+
+//! SPK archives address file data in units of this many bytes
+static const unsigned long SPK_SECTOR_SIZE = 0x200;
+
+SpkArchiveWriter::SpkArchiveWriter() throw()
+  : m_iBytesIn(0), m_iBytesOut(0), m_iDataEnd(0), m_iThreadCount(0), m_iCompressionLevel(Z_BEST_COMPRESSION)
+{
+}
+
+SpkArchiveWriter::~SpkArchiveWriter() throw()
+{
+}
+
+void SpkArchiveWriter::setCompressionLevel(int iLevel) throw()
+{
+  if(iLevel < Z_BEST_SPEED)
+    iLevel = Z_BEST_SPEED;
+  if(iLevel > Z_BEST_COMPRESSION)
+    iLevel = Z_BEST_COMPRESSION;
+  m_iCompressionLevel = iLevel;
+}
+
+void SpkArchiveWriter::setThreadCount(unsigned long iThreadCount) throw()
+{
+  m_iThreadCount = iThreadCount;
+}
+
+//! A directory item, along with its name for sorting by
+struct SpkWriterItem
+{
+  RainString sName;
+  auto_directory_item oItem;
+};
+
+static bool SpkWriterItemOrder(const SpkWriterItem& a, const SpkWriterItem& b)
+{
+  return a.sName.compareCaseless(b.sName) < 0;
+}
+
+void SpkArchiveWriter::addDirectory(IFileStore* pSource, const RainString& sSourcePath) throw(...)
+{
+  file_store_caps_t oCaps;
+  pSource->getCaps(oCaps);
+  size_t iFirstFile = m_vFiles.size();
+
+  std::stack<IDirectory*> stkTodo;
+  try
+  {
+    stkTodo.push(pSource->openDirectory(sSourcePath));
+    size_t iSkipLength = stkTodo.top()->getPath().length();
+    std::vector<SpkWriterItem> vItems;
+    while(!stkTodo.empty())
+    {
+      IDirectory *pDirectory = stkTodo.top();
+      stkTodo.pop();
+      const RainString& sDirectoryPath = pDirectory->getPath();
+      RainString sRelativePath = sDirectoryPath.mid(iSkipLength, sDirectoryPath.length() - iSkipLength);
+
+      vItems.clear();
+      try
+      {
+        for(IDirectory::iterator itr = pDirectory->begin(), itrEnd = pDirectory->end(); itr != itrEnd; ++itr)
+        {
+          SpkWriterItem oItem;
+          oItem.sName = itr->name();
+          oItem.oItem = *itr;
+          vItems.push_back(oItem);
+        }
+        std::sort(vItems.begin(), vItems.end(), SpkWriterItemOrder);
+        for(std::vector<SpkWriterItem>::iterator itr = vItems.begin(); itr != vItems.end(); ++itr)
+        {
+          if(itr->oItem.isDirectory())
+          {
+            stkTodo.push(0);
+            stkTodo.top() = itr->oItem.open();
+            continue;
+          }
+          _file_t oFile;
+          oFile.sName = sRelativePath + itr->sName;
+          oFile.sSource = sDirectoryPath + itr->sName;
+          oFile.pSource = pSource;
+          oFile.bSerialRead = !oCaps.bCanReadConcurrently;
+          oFile.iModificationTime = static_cast<unsigned long>(itr->oItem.timestamp());
+          oFile.iDataSector = 0;
+          oFile.iDataLengthCompressed = 0;
+          oFile.iDataLength = itr->oItem.size().iLower;
+          memset(oFile.aMD5, 0, 16);
+          m_vFiles.push_back(oFile);
+        }
+      }
+      CATCH_THROW_SIMPLE(delete pDirectory, L"Cannot list directory");
+      delete pDirectory;
+    }
+  }
+  catch(RainException *pE)
+  {
+    for(; !stkTodo.empty(); stkTodo.pop())
+      delete stkTodo.top();
+    m_vFiles.resize(iFirstFile);
+    RETHROW_SIMPLE_(pE, L"Cannot add \'%s\' to SPK archive", sSourcePath.getCharacters());
+  }
+}
+
+void SpkArchiveWriter::compressFile(size_t iIndex, RainCompressedFile& oResult) throw(...)
+{
+  const _file_t& oFile = m_vFiles[iIndex];
+  oResult.pData = 0;
+
+  MemoryWriteFile oRaw(oFile.iDataLength ? oFile.iDataLength : 1);
+  try
+  {
+    if(oFile.bSerialRead)
+    {
+      RainMutexLock oLock(m_oSerialReadMutex);
+      oFile.pSource->pumpFile(oFile.sSource, &oRaw);
+    }
+    else
+      oFile.pSource->pumpFile(oFile.sSource, &oRaw);
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot read \'%s\'", oFile.sSource.getCharacters());
+  if(oRaw.getLengthUsed() > 0xFFFFFFFFUL)
+    THROW_SIMPLE_(L"\'%s\' is too large to be stored in an SPK archive", oFile.sSource.getCharacters());
+  oResult.iLength = static_cast<unsigned long>(oRaw.getLengthUsed());
+
+  MD5Hash oHash;
+  oHash.update(oRaw.getBuffer(), oRaw.getLengthUsed());
+  oHash.finalise(oResult.aMD5);
+
+  // SpkArchive only understands zLib streams, so every file is compressed, even if that makes it larger
+  uLongf iCompressedLength = compressBound(oResult.iLength);
+  CHECK_ALLOCATION(oResult.pData = new (std::nothrow) char[iCompressedLength]);
+  if(compress2(reinterpret_cast<Bytef*>(oResult.pData), &iCompressedLength, reinterpret_cast<const Bytef*>(oRaw.getBuffer()), oResult.iLength, m_iCompressionLevel) != Z_OK)
+  {
+    delete[] oResult.pData;
+    oResult.pData = 0;
+    THROW_SIMPLE_(L"Cannot compress \'%s\'", oFile.sSource.getCharacters());
+  }
+  oResult.iDataLength = static_cast<unsigned long>(iCompressedLength);
+}
+
+void SpkArchiveWriter::writeFile(IFile* pOutput, RainCompressedFile& oItem) throw(...)
+{
+  _file_t& oFile = m_vFiles[oItem.iIndex];
+  unsigned long iPadding = (SPK_SECTOR_SIZE - (oItem.iDataLength % SPK_SECTOR_SIZE)) % SPK_SECTOR_SIZE;
+  if(oItem.iDataLength > 0xFFFFFFFFUL - iPadding || oItem.iDataLength + iPadding > 0xFFFFFFFFUL - m_iDataEnd)
+    THROW_SIMPLE(L"SPK archives cannot be larger than 4GB");
+  try
+  {
+    static const char aZeros[SPK_SECTOR_SIZE] = {0};
+    pOutput->write(oItem.pData, 1, oItem.iDataLength);
+    if(iPadding != 0)
+      pOutput->write(aZeros, 1, iPadding);
+  }
+  CATCH_THROW_SIMPLE_({}, L"Cannot write data of \'%s\'", oFile.sSource.getCharacters());
+  oFile.iDataSector = m_iDataEnd / SPK_SECTOR_SIZE;
+  oFile.iDataLength = oItem.iLength;
+  oFile.iDataLengthCompressed = oItem.iDataLength;
+  memcpy(oFile.aMD5, oItem.aMD5, 16);
+  m_iDataEnd += oItem.iDataLength + iPadding;
+  m_iBytesIn += oItem.iLength;
+  m_iBytesOut += oItem.iDataLength;
+}
+
+void SpkArchiveWriter::_writeInfoHeader(IFile* pOutput) throw(...)
+{
+  // Each line is [data offset / 512] [compressed length] [length] [modification time] [MD5] [compression] [name],
+  // separated by tabs, with the MD5 as 32 hex digits, and the name using backslashes as separators
+  static const char sHexDigits[] = "0123456789abcdef";
+  std::vector<char> vHeader;
+  const char sFirstLine[] = "SPK: Rainman2\n";
+  vHeader.insert(vHeader.end(), sFirstLine, sFirstLine + sizeof(sFirstLine) - 1);
+  for(std::vector<_file_t>::const_iterator itr = m_vFiles.begin(); itr != m_vFiles.end(); ++itr)
+  {
+    char sNumbers[64];
+    int iLength = sprintf(sNumbers, "%lu\t%lu\t%lu\t%lu\t", itr->iDataSector, itr->iDataLengthCompressed, itr->iDataLength, itr->iModificationTime);
+    vHeader.insert(vHeader.end(), sNumbers, sNumbers + iLength);
+    for(int i = 0; i < 16; ++i)
+    {
+      vHeader.push_back(sHexDigits[itr->aMD5[i] >> 4]);
+      vHeader.push_back(sHexDigits[itr->aMD5[i] & 0xF]);
+    }
+    vHeader.push_back('\t');
+    vHeader.push_back('Z');
+    vHeader.push_back('\t');
+    for(size_t i = 0; i < itr->sName.length(); ++i)
+    {
+      RainChar c = itr->sName.getCharacters()[i];
+      // Tabs and newlines would split the line, and other characters would have to be replaced,
+      // which could give two files the same name
+      if(c == '\t' || c == '\n' || (c & ~0xFF))
+        THROW_SIMPLE_(L"\'%s\' cannot be named in an SPK archive", itr->sSource.getCharacters());
+      vHeader.push_back(static_cast<char>(c));
+    }
+    vHeader.push_back('\n');
+  }
+  if(vHeader.size() > 0xFFFFFFFFUL - m_iDataEnd)
+    THROW_SIMPLE(L"SPK archives cannot be larger than 4GB");
+
+  pOutput->writeArray(&vHeader[0], vHeader.size());
+  pOutput->seek(0, SR_Start);
+  pOutput->writeArray("\xFFSPK", 4);
+  pOutput->writeOne(static_cast<unsigned long>(1)); // Version
+  pOutput->writeOne(m_iDataEnd); // Offset of the text header
+  pOutput->writeOne(static_cast<unsigned long>(0));
+  pOutput->writeOne(static_cast<unsigned long>(vHeader.size()));
+  pOutput->seek(0, SR_End);
+}
+
+void SpkArchiveWriter::writeToFile(IFile* pOutput) throw(...)
+{
+  m_iBytesIn = 0;
+  m_iBytesOut = 0;
+  try
+  {
+    // The archive is laid out as [file header][file data][text header], with the file header padded
+    // to a whole sector. The file header is not known until every file has been written, so a
+    // placeholder is written in its place, and then overwritten later.
+    m_iDataEnd = SPK_SECTOR_SIZE;
+    {
+      std::vector<char> vZeros(SPK_SECTOR_SIZE, 0);
+      pOutput->writeArray(&vZeros[0], SPK_SECTOR_SIZE);
+    }
+
+    RainCompressAndWrite(this, pOutput, m_vFiles.size(), m_iThreadCount ? m_iThreadCount : RainGetProcessorCount());
+
+    _writeInfoHeader(pOutput);
+  }
+  CATCH_THROW_SIMPLE({}, L"Cannot write SPK archive");
+}
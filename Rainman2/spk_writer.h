@@ -0,0 +1,110 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#pragma once
+#include "file.h"
+#include "compress_pipeline.h"
+#include "exception.h"
+#include "threading.h"
+#include <vector>
+
+//! Creates SPK archives (as used by Company of Heroes Online) from the contents of other file stores
+/*!
+  The archive is filled with the contents of a directory from any IFileStore, which could be the file
+  system, or another archive, and is laid out such that SpkArchive (and the game) can read it. Every
+  file is stored as a zLib stream, starting on a 512 byte boundary, and the text header which lists
+  the files (along with the MD5 checksum of each one) follows the data.
+
+  Files are read, compressed and hashed by a pool of worker threads, and then written to the archive
+  in order by the calling thread, in a single sequential pass.
+
+  Example usage:
+    SpkArchiveWriter oWriter;
+    oWriter.addDirectory(RainGetFileSystemStore(), L"C:\\MyMod\\data");
+    std::auto_ptr<IFile> pFile(RainOpenFile(L"C:\\MyMod\\MyMod.spk", FM_Write));
+    oWriter.writeToFile(pFile.get());
+*/
+class RAINMAN2_API SpkArchiveWriter : protected ICompressedFileSink
+{
+public:
+  SpkArchiveWriter() throw();
+  ~SpkArchiveWriter() throw();
+
+  //! Set the zLib compression level, from 1 (fastest) to 9 (smallest, and the default)
+  void setCompressionLevel(int iLevel) throw();
+
+  //! Set the number of threads used to compress files
+  /*!
+    \param iThreadCount Number of worker threads, or 0 (the default) to use one per processor
+  */
+  void setThreadCount(unsigned long iThreadCount) throw();
+
+  //! Add every file within a directory (and its subdirectories) to the archive
+  /*!
+    The files are named relative to sSourcePath, so adding several directories merges their contents
+    into the root of the archive.
+    \param pSource The file store to read from
+    \param sSourcePath Path of the directory within pSource
+  */
+  void addDirectory(IFileStore* pSource, const RainString& sSourcePath) throw(...);
+
+  //! Compress every file and write the archive
+  void writeToFile(IFile* pOutput) throw(...);
+
+  size_t getFileCount() const throw() {return m_vFiles.size();}
+
+  //! Get the total size of the files written, before compression
+  unsigned long long getBytesIn() const throw() {return m_iBytesIn;}
+  //! Get the total size of the file data written, after compression
+  unsigned long long getBytesOut() const throw() {return m_iBytesOut;}
+
+  //! A file in the archive; for internal use only
+  struct _file_t
+  {
+    RainString sName;   //!< Path of the file relative to the root of the archive
+    RainString sSource;
+    IFileStore* pSource;
+    bool bSerialRead;  //!< true if pSource cannot be read from by multiple threads at once
+    unsigned long iModificationTime;
+    unsigned long iDataSector;  //!< Offset of the data, in units of 512 bytes
+    unsigned long iDataLengthCompressed;
+    unsigned long iDataLength;
+    unsigned char aMD5[16];
+  };
+
+protected:
+  // ICompressedFileSink interface, used by writeToFile()
+  virtual void compressFile(size_t iIndex, RainCompressedFile& oResult) throw(...);
+  virtual void writeFile(IFile* pOutput, RainCompressedFile& oItem) throw(...);
+  //! Write the text header which lists every file
+  void _writeInfoHeader(IFile* pOutput) throw(...);
+
+  std::vector<_file_t> m_vFiles;
+  RainMutex m_oSerialReadMutex;
+  unsigned long long m_iBytesIn;
+  unsigned long long m_iBytesOut;
+  unsigned long m_iDataEnd;  //!< Offset of the end of the data written so far, which is always a multiple of 512
+  unsigned long m_iThreadCount;
+  int m_iCompressionLevel;
+};
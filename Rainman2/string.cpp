@@ -24,6 +24,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 */
 #include "string.h"
 #include "exception.h"
+#include "threading.h"
 #include "va_copy.h"
 #include <memory.h>
 #include <new>
@@ -93,7 +94,7 @@ struct rain_string_buffer_t
   */
   void free() throw()
   {
-    if(--iReferenceCount == 0)
+    if(RainAtomicDecrement(&iReferenceCount) == 0)
     {
       if(!isUsingMiniBuffer())
         delete[] pBuffer;
@@ -149,13 +150,14 @@ struct rain_string_buffer_t
     };
   };
   size_t iBufferLength;
-  size_t iReferenceCount;
+  //! Updated atomically, as strings on different threads can share a buffer
+  volatile long iReferenceCount;
 };
 
 RainString::RainString() throw(...)
 {
   m_pBuffer = RainEmptyString.m_pBuffer;
-  ++m_pBuffer->iReferenceCount;
+  RainAtomicIncrement(&m_pBuffer->iReferenceCount);
 }
 
 #ifdef RAINMAN2_USE_WX
@@ -168,7 +170,7 @@ RainString::RainString(wxString s) throw(...)
 RainString::RainString(const RainString& oCopyFrom) throw()
 {
   m_pBuffer = oCopyFrom.m_pBuffer;
-  ++m_pBuffer->iReferenceCount;
+  RainAtomicIncrement(&m_pBuffer->iReferenceCount);
 }
 
 #ifdef RAINMAN2_USE_LUA
@@ -183,7 +185,7 @@ RainString::RainString(lua_State *L, int idx) throw(...)
 RainString& RainString::operator= (const RainChar* sZeroTermString) throw(...)
 {
   size_t iLength = sZeroTermString ? wcslen(sZeroTermString) : 0;
-  if(m_pBuffer->iReferenceCount == 1 && iLength < m_pBuffer->iBufferLength)
+  if(RainAtomicRead(&m_pBuffer->iReferenceCount) == 1 && iLength < m_pBuffer->iBufferLength)
   {
     std::copy(sZeroTermString, sZeroTermString + iLength + 1, m_pBuffer->getBuffer());
     if(m_pBuffer->isUsingMiniBuffer())
@@ -203,7 +205,7 @@ RainString& RainString::operator= (const RainChar* sZeroTermString) throw(...)
 RainString& RainString::operator= (const char* sZeroTermString) throw(...)
 {
   size_t iLength = sZeroTermString ? strlen(sZeroTermString) : 0;
-  if(m_pBuffer->iReferenceCount == 1 && iLength < m_pBuffer->iBufferLength)
+  if(RainAtomicRead(&m_pBuffer->iReferenceCount) == 1 && iLength < m_pBuffer->iBufferLength)
   {
     std::copy(sZeroTermString, sZeroTermString + iLength + 1, m_pBuffer->getBuffer());
     if(m_pBuffer->isUsingMiniBuffer())
@@ -223,7 +225,7 @@ RainString& RainString::operator= (const char* sZeroTermString) throw(...)
 RainString& RainString::operator= (const RainString& oCopyFrom) throw()
 {
   // If doing S = S, with refCount == 1, we want to increment refcount before freeing
-  ++oCopyFrom.m_pBuffer->iReferenceCount;
+  RainAtomicIncrement(&oCopyFrom.m_pBuffer->iReferenceCount);
   m_pBuffer->free();
   m_pBuffer = oCopyFrom.m_pBuffer;
   return *this;
@@ -498,7 +500,7 @@ RainChar* RainString::_commonInit(size_t iLength)
 
 void RainString::_ensureExclusiveBufferAccess() throw(...)
 {
-  if(m_pBuffer->iReferenceCount > 1)
+  if(RainAtomicRead(&m_pBuffer->iReferenceCount) > 1)
   {
     rain_string_buffer_t* pNewBuffer;
     CHECK_ALLOCATION(pNewBuffer = new NOTHROW rain_string_buffer_t(m_pBuffer->iBufferLength));
@@ -515,7 +517,7 @@ void RainString::_ensureExclusiveBufferAccess() throw(...)
 
 void RainString::_ensureExclusiveBufferAccess(RainString::iterator& a, RainString::iterator& b) throw(...)
 {
-  if(m_pBuffer->iReferenceCount > 1)
+  if(RainAtomicRead(&m_pBuffer->iReferenceCount) > 1)
   {
     difference_type da = a - const_begin();
     difference_type db = b - const_begin();
@@ -530,6 +532,13 @@ size_t RainString::length() const throw()
   return m_pBuffer->getLengthUsed();
 }
 
+size_t RainString::getMemoryUsage() const throw()
+{
+  if(m_pBuffer->isUsingMiniBuffer())
+    return sizeof(rain_string_buffer_t);
+  return sizeof(rain_string_buffer_t) + m_pBuffer->iBufferLength * sizeof(RainChar);
+}
+
 bool RainString::operator== (const wchar_t* sString) const throw()
 {
   return std::equal(begin(), end(), sString);
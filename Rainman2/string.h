@@ -270,6 +270,12 @@ public:
   //! Gets the length of the string
   size_t length() const throw();
 
+  //! Gets the number of bytes of heap memory used by the string
+  /*!
+    Strings which share a buffer (due to copying) each report the full size of the buffer.
+  */
+  size_t getMemoryUsage() const throw();
+
   //! Gets a pointer to the characters of the string
   const RainChar* getCharacters() const throw();
 
@@ -0,0 +1,295 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include "threading.h"
+#include "exception.h"
+#include "new_trace.h"
+#include <limits.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+
+// Ensure that the inline storage is large enough for the operating system object
+typedef char RainMutex_storage_check[sizeof(CRITICAL_SECTION) <= sizeof(void*[8]) ? 1 : -1];
+
+RainMutex::RainMutex() throw()
+{
+  InitializeCriticalSection(reinterpret_cast<CRITICAL_SECTION*>(m_aStorage));
+}
+
+RainMutex::~RainMutex() throw()
+{
+  DeleteCriticalSection(reinterpret_cast<CRITICAL_SECTION*>(m_aStorage));
+}
+
+void RainMutex::lock() throw()
+{
+  EnterCriticalSection(reinterpret_cast<CRITICAL_SECTION*>(m_aStorage));
+}
+
+void RainMutex::unlock() throw()
+{
+  LeaveCriticalSection(reinterpret_cast<CRITICAL_SECTION*>(m_aStorage));
+}
+
+RainSemaphore::RainSemaphore(long iInitialCount) throw(...)
+{
+  m_hSemaphore = reinterpret_cast<void*>(CreateSemaphoreW(NULL, iInitialCount, LONG_MAX, NULL));
+  if(m_hSemaphore == NULL)
+    THROW_SIMPLE(L"Cannot create semaphore");
+}
+
+RainSemaphore::~RainSemaphore() throw()
+{
+  CloseHandle(reinterpret_cast<HANDLE>(m_hSemaphore));
+}
+
+void RainSemaphore::wait() throw()
+{
+  WaitForSingleObject(reinterpret_cast<HANDLE>(m_hSemaphore), INFINITE);
+}
+
+void RainSemaphore::post() throw()
+{
+  ReleaseSemaphore(reinterpret_cast<HANDLE>(m_hSemaphore), 1, NULL);
+}
+
+static unsigned __stdcall RainThreadEntry(void* pThread)
+{
+  reinterpret_cast<RainThread*>(pThread)->run();
+  return 0;
+}
+
+RainThread::RainThread() throw()
+  : m_hThread(0)
+{
+}
+
+RainThread::~RainThread() throw()
+{
+  join();
+}
+
+void RainThread::start() throw(...)
+{
+  if(m_hThread)
+    THROW_SIMPLE(L"Thread has already been started");
+  // _beginthreadex rather than CreateThread, so that the C runtime is initialised for the new thread
+  m_hThread = reinterpret_cast<void*>(_beginthreadex(NULL, 0, RainThreadEntry, reinterpret_cast<void*>(this), 0, NULL));
+  if(m_hThread == 0)
+    THROW_SIMPLE(L"Cannot create thread");
+}
+
+void RainThread::join() throw()
+{
+  if(m_hThread)
+  {
+    WaitForSingleObject(reinterpret_cast<HANDLE>(m_hThread), INFINITE);
+    CloseHandle(reinterpret_cast<HANDLE>(m_hThread));
+    m_hThread = 0;
+  }
+}
+
+long RainAtomicIncrement(volatile long* pValue) throw()
+{
+  return InterlockedIncrement(pValue);
+}
+
+long RainAtomicDecrement(volatile long* pValue) throw()
+{
+  return InterlockedDecrement(pValue);
+}
+
+long RainAtomicRead(volatile long* pValue) throw()
+{
+  return InterlockedCompareExchange(pValue, 0, 0);
+}
+
+unsigned long RainGetProcessorCount() throw()
+{
+  SYSTEM_INFO oInfo;
+  GetSystemInfo(&oInfo);
+  return oInfo.dwNumberOfProcessors ? oInfo.dwNumberOfProcessors : 1;
+}
+
+unsigned long RainGetTickCount() throw()
+{
+  return GetTickCount();
+}
+
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Ensure that the inline storage is large enough for the operating system object
+typedef char RainMutex_storage_check[sizeof(pthread_mutex_t) <= sizeof(void*[8]) ? 1 : -1];
+
+RainMutex::RainMutex() throw()
+{
+  pthread_mutexattr_t oAttributes;
+  pthread_mutexattr_init(&oAttributes);
+  pthread_mutexattr_settype(&oAttributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(reinterpret_cast<pthread_mutex_t*>(m_aStorage), &oAttributes);
+  pthread_mutexattr_destroy(&oAttributes);
+}
+
+RainMutex::~RainMutex() throw()
+{
+  pthread_mutex_destroy(reinterpret_cast<pthread_mutex_t*>(m_aStorage));
+}
+
+void RainMutex::lock() throw()
+{
+  pthread_mutex_lock(reinterpret_cast<pthread_mutex_t*>(m_aStorage));
+}
+
+void RainMutex::unlock() throw()
+{
+  pthread_mutex_unlock(reinterpret_cast<pthread_mutex_t*>(m_aStorage));
+}
+
+// Unnamed POSIX semaphores are not available everywhere (e.g. Mac OS X), so a semaphore is
+// built from a mutex and a condition variable instead
+struct posix_semaphore_t
+{
+  pthread_mutex_t oMutex;
+  pthread_cond_t oCondition;
+  long iCount;
+};
+
+RainSemaphore::RainSemaphore(long iInitialCount) throw(...)
+{
+  posix_semaphore_t* pSemaphore = CHECK_ALLOCATION(new NOTHROW posix_semaphore_t);
+  if(pthread_mutex_init(&pSemaphore->oMutex, NULL) != 0)
+  {
+    delete pSemaphore;
+    THROW_SIMPLE(L"Cannot create semaphore");
+  }
+  if(pthread_cond_init(&pSemaphore->oCondition, NULL) != 0)
+  {
+    pthread_mutex_destroy(&pSemaphore->oMutex);
+    delete pSemaphore;
+    THROW_SIMPLE(L"Cannot create semaphore");
+  }
+  pSemaphore->iCount = iInitialCount;
+  m_hSemaphore = reinterpret_cast<void*>(pSemaphore);
+}
+
+RainSemaphore::~RainSemaphore() throw()
+{
+  posix_semaphore_t* pSemaphore = reinterpret_cast<posix_semaphore_t*>(m_hSemaphore);
+  pthread_cond_destroy(&pSemaphore->oCondition);
+  pthread_mutex_destroy(&pSemaphore->oMutex);
+  delete pSemaphore;
+}
+
+void RainSemaphore::wait() throw()
+{
+  posix_semaphore_t* pSemaphore = reinterpret_cast<posix_semaphore_t*>(m_hSemaphore);
+  pthread_mutex_lock(&pSemaphore->oMutex);
+  while(pSemaphore->iCount <= 0)
+    pthread_cond_wait(&pSemaphore->oCondition, &pSemaphore->oMutex);
+  --pSemaphore->iCount;
+  pthread_mutex_unlock(&pSemaphore->oMutex);
+}
+
+void RainSemaphore::post() throw()
+{
+  posix_semaphore_t* pSemaphore = reinterpret_cast<posix_semaphore_t*>(m_hSemaphore);
+  pthread_mutex_lock(&pSemaphore->oMutex);
+  ++pSemaphore->iCount;
+  pthread_cond_signal(&pSemaphore->oCondition);
+  pthread_mutex_unlock(&pSemaphore->oMutex);
+}
+
+static void* RainThreadEntry(void* pThread)
+{
+  reinterpret_cast<RainThread*>(pThread)->run();
+  return 0;
+}
+
+RainThread::RainThread() throw()
+  : m_hThread(0)
+{
+}
+
+RainThread::~RainThread() throw()
+{
+  join();
+}
+
+void RainThread::start() throw(...)
+{
+  if(m_hThread)
+    THROW_SIMPLE(L"Thread has already been started");
+  // pthread_t is an opaque type of unspecified size, so it cannot be stored in m_hThread directly
+  pthread_t* pThread = CHECK_ALLOCATION(new NOTHROW pthread_t);
+  if(pthread_create(pThread, NULL, RainThreadEntry, reinterpret_cast<void*>(this)) != 0)
+  {
+    delete pThread;
+    THROW_SIMPLE(L"Cannot create thread");
+  }
+  m_hThread = reinterpret_cast<void*>(pThread);
+}
+
+void RainThread::join() throw()
+{
+  if(m_hThread)
+  {
+    pthread_t* pThread = reinterpret_cast<pthread_t*>(m_hThread);
+    pthread_join(*pThread, NULL);
+    delete pThread;
+    m_hThread = 0;
+  }
+}
+
+long RainAtomicIncrement(volatile long* pValue) throw()
+{
+  return __sync_add_and_fetch(pValue, 1);
+}
+
+long RainAtomicDecrement(volatile long* pValue) throw()
+{
+  return __sync_sub_and_fetch(pValue, 1);
+}
+
+long RainAtomicRead(volatile long* pValue) throw()
+{
+  return __sync_fetch_and_add(pValue, 0);
+}
+
+unsigned long RainGetProcessorCount() throw()
+{
+  long iCount = sysconf(_SC_NPROCESSORS_ONLN);
+  return iCount > 0 ? static_cast<unsigned long>(iCount) : 1;
+}
+
+unsigned long RainGetTickCount() throw()
+{
+  timespec oNow;
+  clock_gettime(CLOCK_MONOTONIC, &oNow);
+  return static_cast<unsigned long>(oNow.tv_sec) * 1000 + static_cast<unsigned long>(oNow.tv_nsec / 1000000);
+}
+#endif
@@ -0,0 +1,205 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#pragma once
+#include "api.h"
+#include <deque>
+
+//! A mutual exclusion lock
+/*!
+  Only one thread can hold the lock at any one time, and the lock is recursive, so
+  the thread holding the lock can acquire it again (provided that it releases it a
+  matching number of times). Use RainMutexLock to acquire and release the lock in a
+  scoped (and hence exception-safe) manner.
+*/
+class RAINMAN2_API RainMutex
+{
+public:
+  RainMutex() throw();
+  ~RainMutex() throw();
+
+  void lock() throw();
+  void unlock() throw();
+
+protected:
+  //! Storage for the underlying operating system object
+  /*!
+    The operating system object is stored inline rather than being allocated, so that
+    constructing a mutex can never fail, and so that the operating system headers are
+    not required by users of this header.
+  */
+  void* m_aStorage[8];
+
+private:
+  RainMutex(const RainMutex&);
+  RainMutex& operator= (const RainMutex&);
+};
+
+//! Holds a RainMutex locked for the lifetime of the object
+class RAINMAN2_API RainMutexLock
+{
+public:
+  RainMutexLock(RainMutex& oMutex) throw()
+    : m_oMutex(oMutex)
+  {
+    m_oMutex.lock();
+  }
+
+  ~RainMutexLock() throw()
+  {
+    m_oMutex.unlock();
+  }
+
+protected:
+  RainMutex& m_oMutex;
+
+private:
+  RainMutexLock(const RainMutexLock&);
+  RainMutexLock& operator= (const RainMutexLock&);
+};
+
+//! A counting semaphore
+/*!
+  wait() blocks until the count is above zero, and then decrements it. post() increments
+  the count, thus releasing one waiting thread (if there are any).
+*/
+class RAINMAN2_API RainSemaphore
+{
+public:
+  RainSemaphore(long iInitialCount = 0) throw(...);
+  ~RainSemaphore() throw();
+
+  void wait() throw();
+  void post() throw();
+
+protected:
+  void* m_hSemaphore;
+
+private:
+  RainSemaphore(const RainSemaphore&);
+  RainSemaphore& operator= (const RainSemaphore&);
+};
+
+//! A thread of execution
+/*!
+  Derive from this class and implement run(), then call start() to begin executing run()
+  on a new thread. Exceptions must not escape from run(); derived classes should catch and
+  store them for the thread which calls join() to deal with.
+*/
+class RAINMAN2_API RainThread
+{
+public:
+  RainThread() throw();
+  //! Destructor; waits for the thread to finish if it is still running
+  virtual ~RainThread() throw();
+
+  //! Start executing run() on a new thread
+  void start() throw(...);
+
+  //! Wait for run() to return (does nothing if the thread was never started)
+  void join() throw();
+
+  //! The code to execute on the new thread
+  virtual void run() throw() = 0;
+
+protected:
+  void* m_hThread;
+
+private:
+  RainThread(const RainThread&);
+  RainThread& operator= (const RainThread&);
+};
+
+//! A first-in first-out queue which can be shared between threads, with a maximum length
+/*!
+  push() blocks while the queue is full, and pop() blocks while the queue is empty, making
+  this suitable for passing work between producer and consumer threads.
+*/
+template <class T>
+class RainBoundedQueue
+{
+public:
+  RainBoundedQueue(long iMaximumLength) throw(...)
+    : m_oFreeSlots(iMaximumLength), m_oUsedSlots(0)
+  {
+  }
+
+  void push(const T& oValue) throw()
+  {
+    m_oFreeSlots.wait();
+    {
+      RainMutexLock oLock(m_oMutex);
+      m_qItems.push_back(oValue);
+    }
+    m_oUsedSlots.post();
+  }
+
+  T pop() throw()
+  {
+    m_oUsedSlots.wait();
+    T oValue;
+    {
+      RainMutexLock oLock(m_oMutex);
+      oValue = m_qItems.front();
+      m_qItems.pop_front();
+    }
+    m_oFreeSlots.post();
+    return oValue;
+  }
+
+protected:
+  RainMutex m_oMutex;
+  RainSemaphore m_oFreeSlots;
+  RainSemaphore m_oUsedSlots;
+  std::deque<T> m_qItems;
+};
+
+//! Atomically increment a value which is shared between threads
+/*!
+  \return The incremented value
+*/
+RAINMAN2_API long RainAtomicIncrement(volatile long* pValue) throw();
+
+//! Atomically decrement a value which is shared between threads
+/*!
+  \return The decremented value
+*/
+RAINMAN2_API long RainAtomicDecrement(volatile long* pValue) throw();
+
+//! Read a value which is shared between threads
+/*!
+  Changes which other threads made before they last updated the value (with RainAtomicIncrement()
+  or RainAtomicDecrement()) are visible once the value has been read. This makes it safe to check
+  that a reference count is 1 before modifying the object which it counts.
+*/
+RAINMAN2_API long RainAtomicRead(volatile long* pValue) throw();
+
+//! Get the number of processors available to the process (always at least 1)
+RAINMAN2_API unsigned long RainGetProcessorCount() throw();
+
+//! Get the number of milliseconds elapsed since an arbitrary point in time
+/*!
+  Suitable for measuring durations of (at most) several weeks.
+*/
+RAINMAN2_API unsigned long RainGetTickCount() throw();
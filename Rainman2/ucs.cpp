@@ -24,7 +24,8 @@ OTHER DEALINGS IN THE SOFTWARE.
 */
 #include "ucs.h"
 #include "exception.h"
-#include "buffering_streams.h"
+#include <algorithm>
+#include <memory>
 
 UcsFile::UcsFile()
 {
@@ -55,24 +56,35 @@ void UcsFile::load(IFile *pFile) throw(...)
   if(iByteOrder != 0xFEFF)
     THROW_SIMPLE(L"File is not a UCS file, or is in big-endian format");
 
-  BufferingInputTextStream<RainChar, 4096> oReader(pFile);
-  while(!oReader.isEOF())
+  // The text is parsed where it lies, which for files held in memory avoids copying it into a
+  // stream buffer before copying each string out again
+  seek_offset_t iStart = pFile->tell();
+  pFile->seek(0, SR_End);
+  size_t iLength = static_cast<size_t>(pFile->tell() - iStart) / sizeof(unsigned short);
+  std::auto_ptr<IFileView> pView(pFile->mapView(iStart, iLength * sizeof(unsigned short)));
+  const unsigned short *pText = pView->getArray<unsigned short>(),
+                       *pTextEnd = pText + iLength;
+
+  for(const unsigned short *pLine = pText;; )
   {
-    const RainString sLine(oReader.readLine());
-    const RainChar *pChars = sLine.getCharacters();
+    const unsigned short *pLineEnd = std::find(pLine, pTextEnd, '\n');
+    const unsigned short *pChars = pLine;
     unsigned long iKey = 0;
-    while('0' <= *pChars && *pChars <= '9')
+    while(pChars != pLineEnd && '0' <= *pChars && *pChars <= '9')
     {
       iKey = iKey * 10 + (*pChars - '0');
       ++pChars;
     }
-    if(*pChars == '\t')
+    if(pChars != pLineEnd && *pChars == '\t')
       ++pChars;
-    const RainChar *pEnd = pChars;
-    while(*pEnd != '\n' && *pEnd != '\r' && *pEnd != '\0')
+    const unsigned short *pEnd = pChars;
+    while(pEnd != pLineEnd && *pEnd != '\r' && *pEnd != '\0')
       ++pEnd;
 
     m_mapStrings.insert(std::make_pair(iKey, RainString(pChars, pEnd - pChars)));
+    if(pLineEnd == pTextEnd)
+      break;
+    pLine = pLineEnd + 1;
   }
   m_mapStrings.rehash(m_mapStrings.size() / 4);
 }
@@ -0,0 +1,312 @@
+/*
+Copyright (c) 2008 Peter "Corsix" Cawley
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+#include <Rainman2.h>
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+#include <vector>
+
+// Behaviour tests for parts of Rainman2 whose correctness is easy to get subtly wrong. Each test
+// reports the checks which fail, and the process exits with a non-zero status if any did.
+
+static int g_iChecksFailed = 0;
+
+#define CHECK(expression) \
+  if(!(expression)) { \
+    printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #expression); \
+    ++g_iChecksFailed; \
+  }
+
+//! Predicate for RainHashIndex which matches one value
+struct IntegerMatches
+{
+  IntegerMatches(int iValue) : m_iValue(iValue) {}
+  bool operator() (int iValue) const {return iValue == m_iValue;}
+  int m_iValue;
+};
+
+static bool HashIndexHas(const RainHashIndex<int>& oIndex, unsigned long iHash, int iValue)
+{
+  const int* pValue = oIndex.find(iHash, IntegerMatches(iValue));
+  return pValue != 0 && *pValue == iValue;
+}
+
+//! Erasing from the middle of a probe sequence must leave every later value findable
+static void TestHashIndexErase()
+{
+  // A table of 16 slots holds up to 8 values, so hashes which are equal modulo 16 collide
+  RainHashIndex<int> oIndex;
+  CHECK(oIndex.insert(1, 1));
+  CHECK(oIndex.insert(17, 17));
+  CHECK(oIndex.insert(33, 33));
+  CHECK(oIndex.insert(2, 2)); // Displaced past the run of collisions from slot 1
+  CHECK(oIndex.erase(17, IntegerMatches(17)));
+  CHECK(!HashIndexHas(oIndex, 17, 17));
+  CHECK(HashIndexHas(oIndex, 1, 1));
+  CHECK(HashIndexHas(oIndex, 33, 33));
+  CHECK(HashIndexHas(oIndex, 2, 2));
+  CHECK(oIndex.size() == 3);
+  CHECK(!oIndex.erase(17, IntegerMatches(17)));
+
+  // Probe sequences which wrap around the end of the table
+  RainHashIndex<int> oWrapped;
+  CHECK(oWrapped.insert(15, 15));
+  CHECK(oWrapped.insert(31, 31));
+  CHECK(oWrapped.insert(0, 0));
+  CHECK(oWrapped.erase(15, IntegerMatches(15)));
+  CHECK(HashIndexHas(oWrapped, 31, 31));
+  CHECK(HashIndexHas(oWrapped, 0, 0));
+  CHECK(oWrapped.erase(31, IntegerMatches(31)));
+  CHECK(HashIndexHas(oWrapped, 0, 0));
+
+  // Values with the same hash are told apart by the predicate
+  RainHashIndex<int> oSameHash;
+  CHECK(oSameHash.insert(5, 100));
+  CHECK(oSameHash.insert(5, 101));
+  CHECK(oSameHash.insert(5, 102));
+  CHECK(oSameHash.erase(5, IntegerMatches(101)));
+  CHECK(HashIndexHas(oSameHash, 5, 100));
+  CHECK(!HashIndexHas(oSameHash, 5, 101));
+  CHECK(HashIndexHas(oSameHash, 5, 102));
+
+  // Many values, erased in a different order to that in which they were inserted
+  RainHashIndex<int> oMany;
+  for(int i = 0; i < 1000; ++i)
+    CHECK(oMany.insert(static_cast<unsigned long>(i % 37), i));
+  for(int i = 0; i < 1000; i += 2)
+    CHECK(oMany.erase(static_cast<unsigned long>(i % 37), IntegerMatches(i)));
+  for(int i = 0; i < 1000; ++i)
+    CHECK(HashIndexHas(oMany, static_cast<unsigned long>(i % 37), i) == (i % 2 == 1));
+  CHECK(oMany.size() == 500);
+}
+
+//! Exposes the number of checkpoints which an InflateReadFile has saved
+class CheckpointedInflateReadFile : public InflateReadFile
+{
+public:
+  CheckpointedInflateReadFile(const char* pCompressed, size_t iCompressedLength, size_t iLength)
+    : InflateReadFile(pCompressed, iCompressedLength, iLength)
+  {
+  }
+
+  size_t getCheckpointCount() const {return m_vCheckpoints.size();}
+};
+
+//! Seeking must give the same data as reading sequentially, whether it restarts from a checkpoint or not
+static void TestInflateSeek()
+{
+  // Varied enough to not compress down to almost nothing, and large enough to be streamed
+  std::vector<char> vData(300000);
+  unsigned long iState = 12345;
+  for(size_t i = 0; i < vData.size(); ++i)
+  {
+    iState = iState * 1103515245 + 12345;
+    vData[i] = "abcdefghij \n"[(iState >> 16) % 12];
+  }
+  uLongf iCompressedLength = compressBound(static_cast<uLong>(vData.size()));
+  std::vector<char> vCompressed(iCompressedLength);
+  CHECK(compress2(reinterpret_cast<Bytef*>(&vCompressed[0]), &iCompressedLength, reinterpret_cast<const Bytef*>(&vData[0]), static_cast<uLong>(vData.size()), 9) == Z_OK);
+
+  CheckpointedInflateReadFile oFile(&vCompressed[0], iCompressedLength, vData.size());
+  oFile.setCheckpointInterval(16384);
+  std::vector<char> vRead(vData.size());
+  oFile.read(&vRead[0], 1, vRead.size());
+  CHECK(memcmp(&vRead[0], &vData[0], vData.size()) == 0);
+  CHECK(oFile.getCheckpointCount() != 0);
+
+  // Backwards seeks restart from the nearest earlier checkpoint, and forward seeks skip ahead
+  const size_t aOffsets[] = {0, 299990, 16384, 16383, 150000, 100, 250000, 32767, 299000, 1};
+  for(size_t i = 0; i < sizeof(aOffsets) / sizeof(*aOffsets); ++i)
+  {
+    char aBuffer[64];
+    oFile.seek(static_cast<seek_offset_t>(aOffsets[i]), SR_Start);
+    CHECK(oFile.tell() == static_cast<seek_offset_t>(aOffsets[i]));
+    size_t iCount = oFile.readNoThrow(aBuffer, 1, sizeof(aBuffer));
+    size_t iExpected = vData.size() - aOffsets[i] < sizeof(aBuffer) ? vData.size() - aOffsets[i] : sizeof(aBuffer);
+    CHECK(iCount == iExpected);
+    CHECK(memcmp(aBuffer, &vData[aOffsets[i]], iExpected) == 0);
+  }
+
+  // Relative seeks in both directions
+  oFile.seek(1000, SR_Start);
+  oFile.seek(-500, SR_Current);
+  CHECK(oFile.tell() == 500);
+  oFile.seek(-10, SR_End);
+  char aTail[10];
+  CHECK(oFile.readNoThrow(aTail, 1, sizeof(aTail)) == sizeof(aTail));
+  CHECK(memcmp(aTail, &vData[vData.size() - 10], 10) == 0);
+
+  // Without checkpoints, every backwards seek restarts from the beginning, but gives the same data
+  CheckpointedInflateReadFile oUncheckpointed(&vCompressed[0], iCompressedLength, vData.size());
+  oUncheckpointed.setCheckpointInterval(0);
+  oUncheckpointed.seek(200000, SR_Start);
+  char aBuffer[64];
+  oUncheckpointed.read(aBuffer, 1, sizeof(aBuffer));
+  oUncheckpointed.seek(70000, SR_Start);
+  oUncheckpointed.read(aBuffer, 1, sizeof(aBuffer));
+  CHECK(memcmp(aBuffer, &vData[70000], sizeof(aBuffer)) == 0);
+  CHECK(oUncheckpointed.getCheckpointCount() == 0);
+}
+
+static RainString ReadWholeFile(const RainString& sPath)
+{
+  std::auto_ptr<IFile> pFile(RainOpenFile(sPath, FM_Read));
+  char aBuffer[256];
+  size_t iLength = pFile->readNoThrow(aBuffer, 1, sizeof(aBuffer));
+  return RainString(aBuffer, iLength);
+}
+
+static void WriteWholeFile(IFile* pFile, const char* sContents)
+{
+  pFile->write(sContents, 1, strlen(sContents));
+}
+
+//! An atomic write must leave the old file in place until the new one is closed
+static void TestWriteAtomic()
+{
+  const RainString sPath(L"RainmanTest.tmp");
+  RainDeleteFileNoThrow(sPath);
+
+  // A new file only appears once closed
+  {
+    std::auto_ptr<IFile> pFile(RainOpenFile(sPath, FM_WriteAtomic));
+    WriteWholeFile(pFile.get(), "first");
+    CHECK(!RainDoesFileExist(sPath));
+  }
+  CHECK(RainDoesFileExist(sPath));
+  CHECK(ReadWholeFile(sPath) == L"first");
+
+  // An existing file keeps its old contents until the new ones are complete
+  {
+    std::auto_ptr<IFile> pFile(RainOpenFile(sPath, FM_WriteAtomic));
+    WriteWholeFile(pFile.get(), "second, which is longer");
+    CHECK(ReadWholeFile(sPath) == L"first");
+  }
+  CHECK(ReadWholeFile(sPath) == L"second, which is longer");
+
+  // Through the file system store, as used by compositions and the archive writers
+  {
+    std::auto_ptr<IFile> pFile(RainGetFileSystemStore()->openFile(sPath, FM_WriteAtomic));
+    WriteWholeFile(pFile.get(), "third");
+    CHECK(ReadWholeFile(sPath) == L"second, which is longer");
+  }
+  CHECK(ReadWholeFile(sPath) == L"third");
+
+  RainDeleteFile(sPath);
+}
+
+static RainString ReadWholeFile(IFileStore* pStore, const RainString& sPath)
+{
+  std::auto_ptr<IFile> pFile(pStore->openFile(sPath, FM_Read));
+  char aBuffer[256];
+  size_t iLength = pFile->readNoThrow(aBuffer, 1, sizeof(aBuffer));
+  return RainString(aBuffer, iLength);
+}
+
+static void WriteWholeFile(IFileStore* pStore, const RainString& sPath, const char* sContents)
+{
+  std::auto_ptr<IFile> pFile(pStore->openFile(sPath, FM_Write));
+  WriteWholeFile(pFile.get(), sContents);
+}
+
+//! A snapshot must not see changes made to the store after it was taken, nor the store see changes to the snapshot
+static void TestMemoryStoreCopyOnWrite()
+{
+  MemoryFileStore oStore;
+  oStore.createDirectory(L"data");
+  oStore.createDirectory(L"data\\sub");
+  WriteWholeFile(&oStore, L"data\\a.txt", "a");
+  WriteWholeFile(&oStore, L"data\\sub\\b.txt", "b");
+
+  std::auto_ptr<MemoryFileStore> pSnapshot(oStore.snapshot());
+  CHECK(ReadWholeFile(pSnapshot.get(), L"data\\a.txt") == L"a");
+  CHECK(ReadWholeFile(pSnapshot.get(), L"data\\sub\\b.txt") == L"b");
+
+  // Changes to the store, deep within shared directories
+  WriteWholeFile(&oStore, L"data\\sub\\b.txt", "b2");
+  WriteWholeFile(&oStore, L"data\\sub\\c.txt", "c");
+  oStore.deleteFile(L"data\\a.txt");
+  CHECK(ReadWholeFile(&oStore, L"data\\sub\\b.txt") == L"b2");
+  CHECK(ReadWholeFile(pSnapshot.get(), L"data\\sub\\b.txt") == L"b");
+  CHECK(!pSnapshot->doesFileExist(L"data\\sub\\c.txt"));
+  CHECK(pSnapshot->doesFileExist(L"data\\a.txt"));
+  CHECK(ReadWholeFile(pSnapshot.get(), L"data\\a.txt") == L"a");
+
+  // Changes to the snapshot
+  WriteWholeFile(pSnapshot.get(), L"data\\a.txt", "a3");
+  pSnapshot->createDirectory(L"data\\other");
+  CHECK(!oStore.doesFileExist(L"data\\a.txt"));
+  CHECK(!oStore.doesDirectoryExist(L"data\\other"));
+  CHECK(ReadWholeFile(pSnapshot.get(), L"data\\a.txt") == L"a3");
+
+  // A listing opened before a change keeps showing the directory as it was
+  std::auto_ptr<IDirectory> pDirectory(oStore.openDirectory(L"data\\sub"));
+  size_t iItemCount = pDirectory->getItemCount();
+  WriteWholeFile(&oStore, L"data\\sub\\d.txt", "d");
+  CHECK(pDirectory->getItemCount() == iItemCount);
+
+  // A file opened for reading keeps its contents when the file is rewritten or deleted
+  std::auto_ptr<IFile> pReader(oStore.openFile(L"data\\sub\\b.txt", FM_Read));
+  WriteWholeFile(&oStore, L"data\\sub\\b.txt", "rewritten");
+  oStore.deleteFile(L"data\\sub\\b.txt");
+  char aBuffer[8];
+  CHECK(pReader->readNoThrow(aBuffer, 1, sizeof(aBuffer)) == 2);
+  CHECK(memcmp(aBuffer, "b2", 2) == 0);
+}
+
+typedef void (*test_function_t)();
+
+int main()
+{
+  struct
+  {
+    const char* sName;
+    test_function_t fnTest;
+  } aTests[] = {
+    {"RainHashIndex erase", TestHashIndexErase},
+    {"InflateReadFile seek", TestInflateSeek},
+    {"FM_WriteAtomic", TestWriteAtomic},
+    {"MemoryFileStore copy-on-write", TestMemoryStoreCopyOnWrite},
+  };
+
+  for(size_t i = 0; i < sizeof(aTests) / sizeof(*aTests); ++i)
+  {
+    int iFailedBefore = g_iChecksFailed;
+    try
+    {
+      aTests[i].fnTest();
+    }
+    catch(RainException *pE)
+    {
+      printf("%s: exception thrown\n", aTests[i].sName);
+      for(RainException *p = pE; p; p = p->getPrevious())
+        printf("  %ls:%lu - %ls\n", p->getFile().getCharacters(), p->getLine(), p->getMessage().getCharacters());
+      delete pE;
+      ++g_iChecksFailed;
+    }
+    printf("%s: %s\n", aTests[i].sName, g_iChecksFailed == iFailedBefore ? "passed" : "FAILED");
+  }
+  return g_iChecksFailed == 0 ? 0 : 1;
+}
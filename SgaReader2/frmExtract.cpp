@@ -29,7 +29,37 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include <wx/menu.h>
 #include <wx/msgdlg.h>
 #include <stack>
-#include <queue>
+
+//! Reflects the progress of a BulkExtractor in a gauge and label
+class frmExtractProgress : public IBulkExtractCallback
+{
+public:
+  frmExtractProgress(wxWindow *pWindow, wxGauge *pProgressBar, wxStaticText *pCurrentItem)
+    : m_pWindow(pWindow), m_pProgressBar(pProgressBar), m_pCurrentItem(pCurrentItem), m_iLastUpdate(0)
+  {
+  }
+
+  virtual bool onBulkExtractProgress(const bulk_extract_progress_t& oProgress) throw()
+  {
+    // Updating the window for every file would take longer than extracting small files
+    if(oProgress.iFilesDone != oProgress.iFilesTotal && oProgress.iMillisecondsElapsed - m_iLastUpdate < 100)
+      return true;
+    m_iLastUpdate = oProgress.iMillisecondsElapsed;
+
+    m_pProgressBar->SetRange(static_cast<int>(oProgress.iFilesTotal));
+    m_pProgressBar->SetValue(static_cast<int>(oProgress.iFilesDone));
+    m_pCurrentItem->SetLabel(wxString::Format(L"%s (%.1f MB/s)", oProgress.pCurrentFile->getCharacters(),
+      oProgress.getBytesPerSecond() / 1048576.0));
+    ::wxSafeYield(m_pWindow);
+    return true;
+  }
+
+protected:
+  wxWindow *m_pWindow;
+  wxGauge *m_pProgressBar;
+  wxStaticText *m_pCurrentItem;
+  unsigned long m_iLastUpdate;
+};
 
 BEGIN_EVENT_TABLE(frmExtract, wxDialog)
   EVT_BUTTON(BTN_BROWSE, frmExtract::onBrowse)
@@ -170,56 +200,17 @@ void frmExtract::onExtract(wxCommandEvent &e)
     Layout();
     ::wxSafeYield(this);
 
-    int iTotalCount = 1, iDoneCount = 0;
-    std::queue<IDirectory*> qTodo;
+    frmExtractProgress oProgress(this, pProgressBar, pCurrentItem);
+    BulkExtractor oExtractor;
+    oExtractor.setCallback(&oProgress);
     try
     {
-      qTodo.push(m_pArchive->openDirectory(m_sPathToExtract));
-      iTotalCount += static_cast<int>(qTodo.front()->getItemCount());
-      size_t iSkipLength = qTodo.front()->getPath().length();
-      pProgressBar->SetRange(iTotalCount);
-      while(!qTodo.empty())
-      {
-        IDirectory *pDirectory = qTodo.front();
-        pCurrentItem->SetLabel(pDirectory->getPath());
-        pProgressBar->SetValue(++iDoneCount);
-        ::wxSafeYield(this);
-
-        RainString sDirectoryBase = pDirectory->getPath();
-        sDirectoryBase = sFolder + sDirectoryBase.mid(iSkipLength, sDirectoryBase.length() - iSkipLength);
-        if(!RainDoesDirectoryExist(sDirectoryBase))
-          RainCreateDirectory(sDirectoryBase);
-        for(IDirectory::iterator itr = pDirectory->begin(), itrEnd = pDirectory->end(); itr != itrEnd; ++itr)
-        {
-          if(itr->isDirectory())
-          {
-            IDirectory *pChild = itr->open();
-            iTotalCount += 1 + static_cast<int>(pChild->getItemCount());
-            qTodo.push(pChild);
-            pProgressBar->SetRange(iTotalCount);
-          }
-          else
-          {
-            std::auto_ptr<IFile> pFile;
-            pCurrentItem->SetLabel(pDirectory->getPath() + itr->name());
-            pProgressBar->SetValue(++iDoneCount);
-            ::wxSafeYield(this);
-            pFile.reset(RainOpenFile(sDirectoryBase + itr->name(), FM_Write));
-            itr->pump(&*pFile);
-          }
-        }
-
-        delete pDirectory;
-        qTodo.pop();
-      }
+      pCurrentItem->SetLabel(L"Finding files to extract...");
+      ::wxSafeYield(this);
+      oExtractor.extract(m_pArchive, m_sPathToExtract, RainGetFileSystemStore(), sFolder);
     }
     catch(RainException *pE)
     {
-      while(!qTodo.empty())
-      {
-        delete qTodo.front();
-        qTodo.pop();
-      }
       EXCEPTION_MESSAGE_BOX_1(L"Error extracting directory \'%s\'", m_sPathToExtract.getCharacters(), pE);
       SetReturnCode(GetEscapeId());
       return;
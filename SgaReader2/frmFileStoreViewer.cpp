@@ -395,6 +395,9 @@ void frmFileStoreViewer::_doLoadArchive(wxString sPath, eArchiveTypes eArchiveTy
     };
     m_pArchive = pArchive;
     pArchive->init(RainOpenFile(sPath, FM_Read));
+    // Allow frmExtract to decompress files on multiple threads
+    if(eArchiveType == AT_SGA)
+      static_cast<SgaArchive*>(pArchive)->enableConcurrentReads();
   }
   CATCH_MESSAGE_BOX_1(L"Unable to open archive file \'%s\'", sPath.c_str(), {
     _closeCurrentArchive();